@@ -0,0 +1,232 @@
+//! Measures the hot paths of `FileManager` against a `SyntheticDrive`, without any network.
+//!
+//! Run with `cargo bench`. The sizes of the file trees can be scaled with the
+//! `GCSF_BENCH_SCALE` environment variable, e.g. `GCSF_BENCH_SCALE=0.1 cargo bench` for a quick
+//! run on trees ten times smaller.
+extern crate gcsf;
+
+use gcsf::{FileId, FileManager, SyntheticDrive, WriteBuffer};
+use std::env;
+use std::time::{Duration, Instant};
+
+/// Scales a size by `GCSF_BENCH_SCALE`.
+fn scaled(count: usize) -> usize {
+    let scale = env::var("GCSF_BENCH_SCALE")
+        .ok()
+        .and_then(|scale| scale.parse::<f64>().ok())
+        .unwrap_or(1.0);
+    ((count as f64 * scale) as usize).max(1)
+}
+
+fn manager(drive: SyntheticDrive) -> FileManager<SyntheticDrive> {
+    manager_with(drive, false)
+}
+
+fn manager_with(drive: SyntheticDrive, lazy_loading: bool) -> FileManager<SyntheticDrive> {
+    FileManager::with_drive_facade(
+        false,
+        false,
+        false,
+        lazy_loading,
+        Duration::from_secs(0),
+        None,
+        Duration::from_secs(86400),
+        drive,
+    )
+    .unwrap()
+}
+
+fn nanos(duration: Duration) -> f64 {
+    duration.as_secs() as f64 * 1e9 + f64::from(duration.subsec_nanos())
+}
+
+/// Prints the total time taken by `count` operations and the time per operation.
+fn report(name: &str, count: usize, elapsed: Duration) {
+    println!(
+        "{:<40} {:>10} ops {:>12.3} ms {:>12.1} ns/op",
+        name,
+        count,
+        nanos(elapsed) / 1e6,
+        nanos(elapsed) / count as f64
+    );
+}
+
+/// Prints the median and the 99th percentile of some latencies.
+fn report_latencies(name: &str, mut samples: Vec<Duration>) {
+    samples.sort();
+    let percentile = |p: f64| nanos(samples[((samples.len() - 1) as f64 * p) as usize]);
+    println!(
+        "{:<40} {:>10} ops {:>9.1} ns p50 {:>9.1} ns p99",
+        name,
+        samples.len(),
+        percentile(0.5),
+        percentile(0.99)
+    );
+}
+
+/// A drive with `folders` folders in its root, each holding `files_per_folder` files.
+fn drive_with_folders(folders: usize, files_per_folder: usize) -> (SyntheticDrive, Vec<String>) {
+    let mut drive = SyntheticDrive::new();
+    let root = drive.root().to_string();
+    let mut ids = Vec::with_capacity(folders);
+    for f in 0..folders {
+        let folder = drive.add_folder(&format!("folder-{}", f), &root);
+        for i in 0..files_per_folder {
+            drive.add_file(&format!("file-{}", i), &folder, Vec::new());
+        }
+        ids.push(folder);
+    }
+    (drive, ids)
+}
+
+fn bench_populate() {
+    let (folders, files_per_folder) = (scaled(1000), 1000);
+    let (drive, _) = drive_with_folders(folders, files_per_folder);
+
+    let start = Instant::now();
+    let manager = manager(drive);
+    report(
+        "populate",
+        folders * (files_per_folder + 1),
+        start.elapsed(),
+    );
+    assert!(manager.files.len() > folders * files_per_folder);
+}
+
+fn bench_lazy_loading() {
+    let (folders, files_per_folder) = (scaled(1000), 1000);
+    let (drive, ids) = drive_with_folders(folders, files_per_folder);
+
+    let start = Instant::now();
+    let mut manager = manager_with(drive, true);
+    report("populate (lazy)", 1, start.elapsed());
+
+    let start = Instant::now();
+    manager.load_children(1).unwrap();
+    report("first listing of the root", folders, start.elapsed());
+
+    let folder = manager.get_inode(&FileId::DriveId(ids[0].clone())).unwrap();
+    let start = Instant::now();
+    manager.load_children(folder).unwrap();
+    report(
+        "first listing of a folder",
+        files_per_folder,
+        start.elapsed(),
+    );
+}
+
+fn bench_large_directory() {
+    let entries = scaled(100_000);
+    let (drive, folders) = drive_with_folders(1, entries);
+    let manager = manager(drive);
+    let parent = manager
+        .get_inode(&FileId::DriveId(folders[0].clone()))
+        .unwrap();
+
+    // Names are visited in a scattered order, so that lookups do not benefit from locality.
+    let names: Vec<String> = (0..entries)
+        .map(|i| format!("file-{}", (i * 7919) % entries))
+        .collect();
+    let samples: Vec<Duration> = names
+        .into_iter()
+        .map(|name| {
+            let id = FileId::ParentAndName { parent, name };
+            let start = Instant::now();
+            assert!(manager.get_inode(&id).is_some());
+            start.elapsed()
+        })
+        .collect();
+    report_latencies("lookup in a large directory", samples);
+
+    let listings = 10;
+    let start = Instant::now();
+    for _ in 0..listings {
+        let count = manager
+            .get_children(&FileId::Inode(parent))
+            .unwrap()
+            .count();
+        assert_eq!(count, entries);
+    }
+    report(
+        "readdir of a large directory",
+        listings * entries,
+        start.elapsed(),
+    );
+}
+
+fn bench_changes() {
+    let (folders, files_per_folder) = (scaled(100), 1000);
+    let (drive, folder_ids) = drive_with_folders(folders, files_per_folder);
+    let root = drive.root().to_string();
+    let mut manager = manager(drive);
+
+    // Half of the changed files are renamed and the other half are moved to the first folder.
+    let ids: Vec<(String, usize)> = manager
+        .drive_ids
+        .keys()
+        .map(|id| id.to_string())
+        .filter(|id| *id != root && !folder_ids.contains(id))
+        .take(files_per_folder * 2)
+        .enumerate()
+        .map(|(i, id)| (id, i))
+        .collect();
+    let target = folder_ids[0].clone();
+    for &(ref id, i) in &ids {
+        manager
+            .df
+            .change_file(id, |file| {
+                if i % 2 == 0 {
+                    file.name = Some(format!("renamed-{}", i));
+                } else {
+                    file.parents = Some(vec![target.clone()]);
+                }
+            })
+            .unwrap();
+    }
+
+    let start = Instant::now();
+    manager.sync().unwrap();
+    report("change application", ids.len(), start.elapsed());
+}
+
+fn bench_write_buffer() {
+    let block = vec![7u8; 4096];
+    let total = scaled(64 * 1024 * 1024) / block.len() * block.len();
+    let mut buffer = WriteBuffer::new(u64::max_value(), env::temp_dir(), Some(0));
+
+    let start = Instant::now();
+    for offset in (0..total).step_by(block.len()) {
+        buffer.write(offset as u64, &block).unwrap();
+    }
+    let elapsed = start.elapsed();
+    report("sequential 4 KiB writes", total / block.len(), elapsed);
+    println!(
+        "{:<40} {:>10.1} MiB/s",
+        "",
+        total as f64 / (1024.0 * 1024.0) / (nanos(elapsed) / 1e9)
+    );
+
+    // Every other block first, then the blocks in between, which merge all extents.
+    let mut buffer = WriteBuffer::new(u64::max_value(), env::temp_dir(), Some(0));
+    let blocks = total / block.len();
+    let start = Instant::now();
+    for i in (0..blocks).step_by(2).chain((1..blocks).step_by(2)) {
+        buffer.write((i * block.len()) as u64, &block).unwrap();
+    }
+    report("interleaved 4 KiB writes", blocks, start.elapsed());
+    assert_eq!(buffer.dirty_bytes(), total as u64);
+
+    let start = Instant::now();
+    let mut data = Vec::new();
+    buffer.apply(&mut data).unwrap();
+    report("apply of the merged buffer", 1, start.elapsed());
+    assert_eq!(data.len(), total);
+}
+
+fn main() {
+    bench_populate();
+    bench_lazy_loading();
+    bench_large_directory();
+    bench_changes();
+    bench_write_buffer();
+}
@@ -0,0 +1,1064 @@
+//! A local stand-in for the Drive API. It serves an account held in memory, answering every
+//! request after a configurable round trip time and at a configurable bandwidth, so that a
+//! mounted `Gcsf` can be measured as if it talked to Drive, without an account or any quota.
+//!
+//! Only the parts of the API which GCSF uses are served: listing, metadata and content of files,
+//! changes, uploads (simple, multipart and resumable), batches and the storage quota.
+
+use hyper::server::{Handler, Listening, Request, Response, Server};
+use hyper::status::StatusCode;
+use hyper::uri::RequestUri;
+use serde_json;
+use serde_json::Value;
+use std::collections::{BTreeMap, HashMap, HashSet};
+use std::error::Error;
+use std::fs;
+use std::io::Read;
+use std::path::Path;
+use std::str;
+use std::sync::{Arc, Mutex};
+use std::thread;
+use std::time::{Duration, SystemTime, UNIX_EPOCH};
+
+const FOLDER_MIME_TYPE: &str = "application/vnd.google-apps.folder";
+
+/// How many requests are answered at the same time. Every kept-alive connection holds a thread,
+/// so this must exceed the number of connections GCSF opens.
+const THREADS: usize = 128;
+
+/// The page size of listings which do not ask for one, as on Drive.
+const DEFAULT_PAGE_SIZE: usize = 100;
+
+/// The network between the file system and the server.
+#[derive(Debug, Clone, Copy)]
+pub struct Link {
+    /// How long every request waits before it is answered, i.e. one round trip.
+    pub latency: Duration,
+
+    /// How many bytes per second the body of a request or response is sent at, if limited.
+    pub bandwidth: Option<u64>,
+}
+
+impl Link {
+    /// Waits for as long as sending `bytes` takes.
+    fn transfer(&self, bytes: usize) {
+        if let Some(bandwidth) = self.bandwidth.filter(|&bandwidth| bandwidth > 0) {
+            let seconds = bytes as f64 / bandwidth as f64;
+            thread::sleep(Duration::from_micros((seconds * 1e6) as u64));
+        }
+    }
+}
+
+/// The content of a file.
+#[derive(Debug, Clone)]
+pub enum Content {
+    /// Content which has been uploaded.
+    Bytes(Vec<u8>),
+
+    /// Made-up content of the given length, generated whenever it is read, so that large files
+    /// do not take up memory.
+    Pattern(u64),
+}
+
+impl Content {
+    fn len(&self) -> u64 {
+        match *self {
+            Content::Bytes(ref bytes) => bytes.len() as u64,
+            Content::Pattern(len) => len,
+        }
+    }
+
+    /// The bytes `start..end`, clamped to the end of the content.
+    fn range(&self, start: u64, end: u64) -> Vec<u8> {
+        let end = end.min(self.len());
+        if start >= end {
+            return Vec::new();
+        }
+        match *self {
+            Content::Bytes(ref bytes) => bytes[start as usize..end as usize].to_vec(),
+            Content::Pattern(_) => (start..end).map(|i| (i % 251) as u8).collect(),
+        }
+    }
+}
+
+struct Entry {
+    name: String,
+    mime_type: String,
+    parents: Vec<String>,
+    trashed: bool,
+    modified_time: String,
+    version: u64,
+    content: Content,
+}
+
+impl Entry {
+    fn is_folder(&self) -> bool {
+        self.mime_type == FOLDER_MIME_TYPE
+    }
+
+    fn to_json(&self, id: &str) -> Value {
+        let mut file = json!({
+            "kind": "drive#file",
+            "id": id,
+            "name": self.name,
+            "mimeType": self.mime_type,
+            "parents": self.parents,
+            "trashed": self.trashed,
+            "modifiedTime": self.modified_time,
+            "createdTime": self.modified_time,
+            "viewedByMeTime": self.modified_time,
+            "version": self.version.to_string(),
+        });
+        if !self.is_folder() {
+            file["size"] = Value::String(self.content.len().to_string());
+        }
+        file
+    }
+
+    /// Applies the writable fields of a file resource.
+    fn update(&mut self, metadata: &Value) {
+        if let Some(name) = metadata["name"].as_str() {
+            self.name = name.to_string();
+        }
+        if let Some(mime_type) = metadata["mimeType"].as_str() {
+            self.mime_type = mime_type.to_string();
+        }
+        if let Some(trashed) = metadata["trashed"].as_bool() {
+            self.trashed = trashed;
+        }
+        self.touch();
+    }
+
+    fn touch(&mut self) {
+        self.version += 1;
+        self.modified_time = now();
+    }
+}
+
+/// An upload for which a resumable session has been opened.
+struct Session {
+    /// The file being updated, or none if the upload creates a file.
+    id: Option<String>,
+    metadata: Value,
+    len: u64,
+    data: Vec<u8>,
+
+    /// The file resource, once the upload has finished.
+    result: Option<Value>,
+}
+
+/// The files of the account served by a `DriveServer`.
+pub struct Account {
+    root: String,
+    files: HashMap<String, Entry>,
+
+    /// The IDs of all files ever created, in order, so that listings are stable. Deleted files
+    /// are skipped.
+    order: Vec<String>,
+
+    /// The ID of every file changed so far, in order. A changes token is an index in this list.
+    changes: Vec<String>,
+
+    sessions: HashMap<u64, Session>,
+    last_id: u64,
+}
+
+impl Account {
+    /// Creates an account without any files.
+    pub fn new() -> Self {
+        Account {
+            root: String::from("replay-root"),
+            files: HashMap::new(),
+            order: Vec::new(),
+            changes: Vec::new(),
+            sessions: HashMap::new(),
+            last_id: 0,
+        }
+    }
+
+    /// The Drive ID of the root "My Drive" directory.
+    pub fn root(&self) -> &str {
+        &self.root
+    }
+
+    /// Adds a directory named `name` to the directory with the ID `parent`. Returns its ID.
+    pub fn add_folder(&mut self, name: &str, parent: &str) -> String {
+        self.insert(name, FOLDER_MIME_TYPE, parent, Content::Bytes(Vec::new()))
+    }
+
+    /// Adds a regular file named `name`, holding `content`, to the directory with the ID
+    /// `parent`. Returns its ID.
+    pub fn add_file(&mut self, name: &str, parent: &str, content: Content) -> String {
+        self.insert(name, "application/octet-stream", parent, content)
+    }
+
+    /// Adds the files of a recorded listing: a JSON object whose `files` hold file resources, as
+    /// returned by `files.list`. Files keep their IDs and get made-up content of their size. The
+    /// parent which is not itself listed is taken for the root of the recorded account and
+    /// replaced with the root of this one.
+    pub fn load_recording(&mut self, path: &Path) -> Result<usize, Box<dyn Error>> {
+        let recording: Value = serde_json::from_slice(&fs::read(path)?)?;
+        let files = recording["files"]
+            .as_array()
+            .ok_or("The recording holds no files")?;
+
+        let ids: HashSet<&str> = files.iter().filter_map(|f| f["id"].as_str()).collect();
+        let mut parents: HashMap<&str, usize> = HashMap::new();
+        for parent in files.iter().filter_map(|f| f["parents"].as_array()) {
+            for parent in parent.iter().filter_map(Value::as_str) {
+                if !ids.contains(parent) {
+                    *parents.entry(parent).or_insert(0) += 1;
+                }
+            }
+        }
+        let recorded_root = parents
+            .into_iter()
+            .max_by_key(|&(_, count)| count)
+            .map(|(id, _)| id.to_string());
+
+        for file in files {
+            let id = match file["id"].as_str() {
+                Some(id) => id.to_string(),
+                None => continue,
+            };
+            let parents = file["parents"]
+                .as_array()
+                .map(|parents| {
+                    parents
+                        .iter()
+                        .filter_map(Value::as_str)
+                        .map(|parent| match recorded_root {
+                            Some(ref root) if root == parent => self.root.clone(),
+                            _ => parent.to_string(),
+                        })
+                        .collect()
+                })
+                .unwrap_or_else(|| vec![self.root.clone()]);
+            let size = file["size"]
+                .as_str()
+                .and_then(|size| size.parse().ok())
+                .unwrap_or(0);
+
+            self.order.push(id.clone());
+            self.files.insert(
+                id,
+                Entry {
+                    name: file["name"].as_str().unwrap_or("unnamed").to_string(),
+                    mime_type: file["mimeType"]
+                        .as_str()
+                        .unwrap_or("application/octet-stream")
+                        .to_string(),
+                    parents,
+                    trashed: file["trashed"].as_bool().unwrap_or(false),
+                    modified_time: file["modifiedTime"]
+                        .as_str()
+                        .map(String::from)
+                        .unwrap_or_else(now),
+                    version: 1,
+                    content: Content::Pattern(size),
+                },
+            );
+        }
+        Ok(files.len())
+    }
+
+    fn insert(&mut self, name: &str, mime_type: &str, parent: &str, content: Content) -> String {
+        self.last_id += 1;
+        let id = format!("replay-{}", self.last_id);
+        self.order.push(id.clone());
+        self.files.insert(
+            id.clone(),
+            Entry {
+                name: name.to_string(),
+                mime_type: mime_type.to_string(),
+                parents: vec![parent.to_string()],
+                trashed: false,
+                modified_time: now(),
+                version: 1,
+                content,
+            },
+        );
+        id
+    }
+
+    /// Creates a file from the metadata sent by the client.
+    fn create(&mut self, metadata: &Value, content: Content) -> String {
+        let parent = metadata["parents"][0]
+            .as_str()
+            .map(|parent| self.resolve(parent))
+            .unwrap_or_else(|| self.root.clone());
+        let id = self.insert(
+            metadata["name"].as_str().unwrap_or("Untitled"),
+            metadata["mimeType"]
+                .as_str()
+                .unwrap_or("application/octet-stream"),
+            &parent,
+            content,
+        );
+        self.changes.push(id.clone());
+        id
+    }
+
+    /// Replaces the content (and some metadata) of a file. Returns its resource.
+    fn replace_content(&mut self, id: &str, metadata: &Value, content: Content) -> Option<Value> {
+        let entry = self.files.get_mut(id)?;
+        entry.update(metadata);
+        entry.content = content;
+        let file = entry.to_json(id);
+        self.changes.push(id.to_string());
+        Some(file)
+    }
+
+    fn resolve(&self, id: &str) -> String {
+        if id == "root" {
+            self.root.clone()
+        } else {
+            id.to_string()
+        }
+    }
+
+    fn resource(&self, id: &str) -> Option<Value> {
+        if id == "root" || id == self.root {
+            return Some(json!({
+                "kind": "drive#file",
+                "id": self.root,
+                "name": "My Drive",
+                "mimeType": FOLDER_MIME_TYPE,
+            }));
+        }
+        self.files.get(id).map(|entry| entry.to_json(id))
+    }
+}
+
+/// What a `files.list` query asks for.
+#[derive(Default)]
+struct Query {
+    parents: Option<Vec<String>>,
+    trashed: Option<bool>,
+    shared_with_me: Option<bool>,
+    modified_after: Option<String>,
+    modified_before: Option<String>,
+}
+
+impl Query {
+    /// Parses the conditions GCSF puts in its queries: parents, trashed and shared status and
+    /// ranges of modification times, joined with "and".
+    fn parse(q: &str) -> Self {
+        let quoted = |condition: &str| condition.split('\'').nth(1).map(String::from);
+        let mut query = Query::default();
+        for condition in q.split(" and ") {
+            let condition = condition.trim().trim_matches(|c| c == '(' || c == ')');
+            if condition.contains(" in parents") {
+                query.parents = Some(condition.split(" or ").filter_map(quoted).collect());
+            } else if condition.starts_with("trashed") {
+                query.trashed = Some(condition.ends_with("true"));
+            } else if condition.starts_with("sharedWithMe") {
+                query.shared_with_me = Some(condition.ends_with("true"));
+            } else if condition.starts_with("modifiedTime >=") {
+                query.modified_after = quoted(condition);
+            } else if condition.starts_with("modifiedTime <") {
+                query.modified_before = quoted(condition);
+            }
+        }
+        query
+    }
+
+    fn matches(&self, account: &Account, entry: &Entry) -> bool {
+        // Nothing is shared with the account, every file is its own.
+        if self.shared_with_me == Some(true) {
+            return false;
+        }
+
+        // Queries give times to the second, without the milliseconds and the zone.
+        let time = &entry.modified_time[..cmp_len(&entry.modified_time)];
+        self.parents.as_ref().map_or(true, |parents| {
+            parents
+                .iter()
+                .any(|parent| entry.parents.contains(&account.resolve(parent)))
+        }) && self
+            .trashed
+            .map_or(true, |trashed| entry.trashed == trashed)
+            && self
+                .modified_after
+                .as_ref()
+                .map_or(true, |after| time >= after.as_str())
+            && self
+                .modified_before
+                .as_ref()
+                .map_or(true, |before| time < before.as_str())
+    }
+}
+
+/// The length of the part of a timestamp which queries compare, e.g. `2020-01-01T00:00:00`.
+fn cmp_len(time: &str) -> usize {
+    time.len().min(19)
+}
+
+/// A request, or one of the calls of a batch.
+struct Call<'a> {
+    method: &'a str,
+    path: &'a str,
+    query: HashMap<String, String>,
+    headers: HashMap<&'static str, String>,
+    body: &'a [u8],
+}
+
+impl<'a> Call<'a> {
+    fn param(&self, name: &str) -> Option<&str> {
+        self.query.get(name).map(String::as_str)
+    }
+
+    fn header(&self, name: &str) -> Option<&str> {
+        self.headers.get(name).map(String::as_str)
+    }
+
+    fn json_body(&self) -> Value {
+        serde_json::from_slice(self.body).unwrap_or_else(|_| json!({}))
+    }
+}
+
+/// The headers which calls are answered by.
+const HEADERS: &[&str] = &[
+    "content-type",
+    "content-range",
+    "range",
+    "x-upload-content-length",
+];
+
+struct Reply {
+    status: u16,
+    headers: Vec<(&'static str, String)>,
+    body: Vec<u8>,
+}
+
+impl Reply {
+    fn json(status: u16, body: &Value) -> Self {
+        Reply {
+            status,
+            headers: vec![("Content-Type", String::from("application/json"))],
+            body: body.to_string().into_bytes(),
+        }
+    }
+
+    fn error(status: u16, message: &str) -> Self {
+        Reply::json(
+            status,
+            &json!({ "error": { "code": status, "message": message, "errors": [] } }),
+        )
+    }
+
+    fn empty(status: u16) -> Self {
+        Reply {
+            status,
+            headers: Vec::new(),
+            body: Vec::new(),
+        }
+    }
+}
+
+/// Everything the request handlers share.
+struct State {
+    account: Mutex<Account>,
+    link: Link,
+
+    /// The address of the server, including the trailing slash.
+    url: Mutex<String>,
+
+    /// Maps every kind of call to the number of calls of that kind.
+    calls: Mutex<BTreeMap<&'static str, usize>>,
+}
+
+impl State {
+    fn count(&self, kind: &'static str) {
+        *self.calls.lock().unwrap().entry(kind).or_insert(0) += 1;
+    }
+
+    fn respond(&self, call: &Call) -> Reply {
+        let segments: Vec<&str> = call.path.trim_matches('/').split('/').collect();
+        match (call.method, &segments[..]) {
+            ("GET", ["drive", "v3", "files"]) => self.list(call),
+            ("POST", ["drive", "v3", "files"]) => {
+                self.count("files.create");
+                let mut account = self.account.lock().unwrap();
+                let id = account.create(&call.json_body(), Content::Bytes(Vec::new()));
+                Reply::json(200, &account.resource(&id).unwrap())
+            }
+            ("GET", ["drive", "v3", "files", id]) if call.param("alt") == Some("media") => {
+                self.download(call, id)
+            }
+            ("GET", ["drive", "v3", "files", id]) => {
+                self.count("files.get");
+                match self.account.lock().unwrap().resource(id) {
+                    Some(file) => Reply::json(200, &file),
+                    None => Reply::error(404, &format!("File not found: {}", id)),
+                }
+            }
+            ("PATCH", ["drive", "v3", "files", id]) => self.update(call, id),
+            ("DELETE", ["drive", "v3", "files", id]) => {
+                self.count("files.delete");
+                let mut account = self.account.lock().unwrap();
+                match account.files.remove(*id) {
+                    Some(_) => Reply::empty(204),
+                    None => Reply::error(404, &format!("File not found: {}", id)),
+                }
+            }
+            ("GET", ["drive", "v3", "about"]) => {
+                self.count("about.get");
+                let account = self.account.lock().unwrap();
+                let usage: u64 = account.files.values().map(|e| e.content.len()).sum();
+                Reply::json(
+                    200,
+                    &json!({ "storageQuota": {
+                        "usage": usage.to_string(),
+                        "limit": (16u64 << 30).to_string(),
+                    }}),
+                )
+            }
+            ("GET", ["drive", "v3", "changes", "startPageToken"]) => {
+                self.count("changes.getStartPageToken");
+                let token = self.account.lock().unwrap().changes.len();
+                Reply::json(200, &json!({ "startPageToken": token.to_string() }))
+            }
+            ("GET", ["drive", "v3", "changes"]) => self.changes(call),
+            (_, ["upload", "drive", "v3", "files"]) => self.upload(call, None),
+            (_, ["upload", "drive", "v3", "files", id]) => self.upload(call, Some(id)),
+            (_, ["upload", "session", number]) => self.upload_chunk(call, number),
+            ("POST", ["batch", "drive", "v3"]) => self.batch(call),
+            ("POST", ["token"]) => {
+                self.count("token");
+                Reply::json(
+                    200,
+                    &json!({ "access_token": "replayed", "token_type": "Bearer", "expires_in": 3600 }),
+                )
+            }
+            _ => Reply::error(404, &format!("{} {} is not served", call.method, call.path)),
+        }
+    }
+
+    fn list(&self, call: &Call) -> Reply {
+        self.count("files.list");
+        let query = Query::parse(call.param("q").unwrap_or(""));
+        let page_size = call
+            .param("pageSize")
+            .and_then(|size| size.parse().ok())
+            .unwrap_or(DEFAULT_PAGE_SIZE)
+            .max(1);
+        let start: usize = call
+            .param("pageToken")
+            .and_then(|token| token.parse().ok())
+            .unwrap_or(0);
+
+        let account = self.account.lock().unwrap();
+        let matching: Vec<&String> = account
+            .order
+            .iter()
+            .filter(|id| {
+                account
+                    .files
+                    .get(*id)
+                    .map_or(false, |entry| query.matches(&account, entry))
+            })
+            .collect();
+
+        let files: Vec<Value> = matching
+            .iter()
+            .skip(start)
+            .take(page_size)
+            .map(|id| account.files[*id].to_json(id))
+            .collect();
+        let mut list = json!({ "kind": "drive#fileList", "files": files });
+        if start + page_size < matching.len() {
+            list["nextPageToken"] = Value::String((start + page_size).to_string());
+        }
+        Reply::json(200, &list)
+    }
+
+    fn download(&self, call: &Call, id: &str) -> Reply {
+        self.count("files.get (content)");
+        let account = self.account.lock().unwrap();
+        let content = match account.files.get(id) {
+            Some(entry) => &entry.content,
+            None => return Reply::error(404, &format!("File not found: {}", id)),
+        };
+
+        // Only single ranges are asked for, e.g. `bytes=0-1048575`.
+        let range = call
+            .header("range")
+            .and_then(|range| range.trim().trim_start_matches("bytes=").split_once("-"))
+            .map(|(start, end)| (start.parse::<u64>(), end.parse::<u64>()));
+        match range {
+            Some((Ok(start), Ok(end))) if start < content.len() => Reply {
+                status: 206,
+                headers: vec![(
+                    "Content-Range",
+                    format!(
+                        "bytes {}-{}/{}",
+                        start,
+                        end.min(content.len() - 1),
+                        content.len()
+                    ),
+                )],
+                body: content.range(start, end + 1),
+            },
+            Some(_) => Reply::empty(416),
+            None => Reply {
+                status: 200,
+                headers: Vec::new(),
+                body: content.range(0, content.len()),
+            },
+        }
+    }
+
+    fn update(&self, call: &Call, id: &str) -> Reply {
+        self.count("files.update");
+        let mut account = self.account.lock().unwrap();
+        let (add, remove) = (call.param("addParents"), call.param("removeParents"));
+        let add = add.map(|parent| account.resolve(parent));
+        let entry = match account.files.get_mut(id) {
+            Some(entry) => entry,
+            None => return Reply::error(404, &format!("File not found: {}", id)),
+        };
+
+        if let Some(remove) = remove {
+            let removed: Vec<&str> = remove.split(',').collect();
+            entry
+                .parents
+                .retain(|parent| !removed.contains(&parent.as_str()));
+        }
+        if let Some(add) = add {
+            entry.parents.push(add);
+        }
+        entry.update(&call.json_body());
+
+        let file = entry.to_json(id);
+        account.changes.push(id.to_string());
+        Reply::json(200, &file)
+    }
+
+    fn changes(&self, call: &Call) -> Reply {
+        self.count("changes.list");
+        let account = self.account.lock().unwrap();
+        let start: usize = call
+            .param("pageToken")
+            .and_then(|token| token.parse().ok())
+            .unwrap_or(0);
+        let page_size = call
+            .param("pageSize")
+            .and_then(|size| size.parse().ok())
+            .unwrap_or(DEFAULT_PAGE_SIZE)
+            .max(1);
+        let end = (start + page_size).min(account.changes.len());
+
+        // GCSF does not ask for removals, and deleted files are gone from the account.
+        let changes: Vec<Value> = account.changes[start.min(end)..end]
+            .iter()
+            .filter_map(|id| {
+                account.files.get(id).map(|entry| {
+                    json!({
+                        "kind": "drive#change",
+                        "type": "file",
+                        "fileId": id,
+                        "removed": false,
+                        "time": entry.modified_time,
+                        "file": entry.to_json(id),
+                    })
+                })
+            })
+            .collect();
+
+        let mut list = json!({ "kind": "drive#changeList", "changes": changes });
+        if end < account.changes.len() {
+            list["nextPageToken"] = Value::String(end.to_string());
+        } else {
+            list["newStartPageToken"] = Value::String(end.to_string());
+        }
+        Reply::json(200, &list)
+    }
+
+    /// Starts an upload which creates a file (without `id`) or replaces the content of one.
+    fn upload(&self, call: &Call, id: Option<&str>) -> Reply {
+        let (metadata, content) = match call.param("uploadType") {
+            Some("resumable") => return self.open_session(call, id),
+            Some("multipart") => {
+                self.count("upload (multipart)");
+                match multipart(call.header("content-type").unwrap_or(""), call.body) {
+                    Some(parts) => (
+                        serde_json::from_slice(parts[0]).unwrap_or_else(|_| json!({})),
+                        parts.get(1).map(|part| part.to_vec()).unwrap_or_default(),
+                    ),
+                    None => return Reply::error(400, "Malformed multipart body"),
+                }
+            }
+            _ => {
+                self.count("upload (media)");
+                (json!({}), call.body.to_vec())
+            }
+        };
+
+        let mut account = self.account.lock().unwrap();
+        let id = match id {
+            Some(id) => id.to_string(),
+            None => account.create(&metadata, Content::Bytes(Vec::new())),
+        };
+        match account.replace_content(&id, &metadata, Content::Bytes(content)) {
+            Some(file) => Reply::json(200, &file),
+            None => Reply::error(404, &format!("File not found: {}", id)),
+        }
+    }
+
+    fn open_session(&self, call: &Call, id: Option<&str>) -> Reply {
+        self.count("upload (session)");
+        let len = call
+            .header("x-upload-content-length")
+            .and_then(|len| len.parse().ok())
+            .unwrap_or(0);
+
+        let mut account = self.account.lock().unwrap();
+        if let Some(id) = id {
+            if !account.files.contains_key(id) {
+                return Reply::error(404, &format!("File not found: {}", id));
+            }
+        }
+        account.last_id += 1;
+        let number = account.last_id;
+        account.sessions.insert(
+            number,
+            Session {
+                id: id.map(String::from),
+                metadata: call.json_body(),
+                len,
+                data: Vec::new(),
+                result: None,
+            },
+        );
+
+        Reply {
+            status: 200,
+            headers: vec![(
+                "Location",
+                format!("{}upload/session/{}", self.url.lock().unwrap(), number),
+            )],
+            body: Vec::new(),
+        }
+    }
+
+    /// Receives a chunk of a resumable upload, or tells how much of it has been received.
+    fn upload_chunk(&self, call: &Call, number: &str) -> Reply {
+        self.count("upload (chunk)");
+        let mut account = self.account.lock().unwrap();
+        let number: u64 = number.parse().unwrap_or(0);
+
+        // Either `bytes <first>-<last>/<total>` or `bytes */<total>` for a status query.
+        let range = call
+            .header("content-range")
+            .map(|range| range.trim().trim_start_matches("bytes").trim().to_string())
+            .unwrap_or_default();
+        let (chunk, total) = range.split_once("/").unwrap_or((range.as_str(), ""));
+        let first = chunk
+            .split_once("-")
+            .and_then(|(first, _)| first.parse::<usize>().ok());
+
+        let (id, metadata, data) = {
+            let session = match account.sessions.get_mut(&number) {
+                Some(session) => session,
+                None => return Reply::error(404, "No such upload session"),
+            };
+            if let Some(ref file) = session.result {
+                return Reply::json(200, file);
+            }
+            if let Some(first) = first {
+                session.data.truncate(first);
+                session.data.extend_from_slice(call.body);
+            }
+            if let Ok(total) = total.parse() {
+                session.len = total;
+            }
+            if (session.data.len() as u64) < session.len {
+                let mut reply = Reply::empty(308);
+                if !session.data.is_empty() {
+                    reply
+                        .headers
+                        .push(("Range", format!("bytes=0-{}", session.data.len() - 1)));
+                }
+                return reply;
+            }
+            (
+                session.id.clone(),
+                session.metadata.clone(),
+                session.data.split_off(0),
+            )
+        };
+
+        let id = match id {
+            Some(id) => id,
+            None => account.create(&metadata, Content::Bytes(Vec::new())),
+        };
+        match account.replace_content(&id, &metadata, Content::Bytes(data)) {
+            Some(file) => {
+                account.sessions.get_mut(&number).unwrap().result = Some(file.clone());
+                Reply::json(200, &file)
+            }
+            None => Reply::error(404, &format!("File not found: {}", id)),
+        }
+    }
+
+    /// Answers every call of a batch, in a single `multipart/mixed` response.
+    fn batch(&self, call: &Call) -> Reply {
+        self.count("batch");
+        let boundary = match boundary(call.header("content-type").unwrap_or("")) {
+            Some(boundary) => boundary.to_string(),
+            None => return Reply::error(400, "A batch needs a boundary"),
+        };
+        let body = String::from_utf8_lossy(call.body).into_owned();
+        let delimiter = format!("--{}", boundary);
+
+        let mut response = String::new();
+        for part in body.split(delimiter.as_str()).skip(1) {
+            if part.starts_with("--") {
+                break;
+            }
+            // The headers of the part, the request line, the headers of the call and its body.
+            let mut sections = part.trim_start().splitn(2, "\r\n\r\n");
+            let (headers, request) = (sections.next().unwrap_or(""), sections.next());
+            let content_id = headers
+                .lines()
+                .find(|line| line.to_lowercase().starts_with("content-id:"))
+                .map(|line| {
+                    line["content-id:".len()..]
+                        .trim()
+                        .trim_matches(|c| c == '<' || c == '>')
+                })
+                .unwrap_or("");
+            let mut sections = request.unwrap_or("").splitn(2, "\r\n\r\n");
+            let head = sections.next().unwrap_or("");
+            let call_body = sections.next().unwrap_or("").trim();
+            let mut request_line = head.lines().next().unwrap_or("").split_whitespace();
+            let (method, target) = (request_line.next(), request_line.next());
+
+            let reply = match (method, target) {
+                (Some(method), Some(target)) => {
+                    let (path, query) = split_target(target);
+                    self.respond(&Call {
+                        method,
+                        path,
+                        query,
+                        headers: HashMap::new(),
+                        body: call_body.as_bytes(),
+                    })
+                }
+                _ => Reply::error(400, "Malformed call in batch"),
+            };
+            response.push_str(&format!(
+                "--batch_response\r\nContent-Type: application/http\r\nContent-ID: <response-{}>\r\n\r\nHTTP/1.1 {} {}\r\nContent-Type: application/json; charset=UTF-8\r\n\r\n{}\r\n",
+                content_id,
+                reply.status,
+                reason(reply.status),
+                String::from_utf8_lossy(&reply.body)
+            ));
+        }
+        response.push_str("--batch_response--\r\n");
+
+        Reply {
+            status: 200,
+            headers: vec![(
+                "Content-Type",
+                String::from("multipart/mixed; boundary=batch_response"),
+            )],
+            body: response.into_bytes(),
+        }
+    }
+}
+
+struct Service(Arc<State>);
+
+impl Handler for Service {
+    fn handle(&self, mut request: Request, mut response: Response) {
+        let target = match request.uri {
+            RequestUri::AbsolutePath(ref target) => target.clone(),
+            _ => String::new(),
+        };
+        let mut body = Vec::new();
+        if let Err(e) = request.read_to_end(&mut body) {
+            eprintln!("Could not read a request to {}: {}", target, e);
+            return;
+        }
+        let headers = HEADERS
+            .iter()
+            .filter_map(|&name| {
+                request
+                    .headers
+                    .get_raw(name)
+                    .and_then(|values| values.first())
+                    .map(|value| (name, String::from_utf8_lossy(value).into_owned()))
+            })
+            .collect();
+
+        let state = &self.0;
+        state.link.transfer(body.len());
+        thread::sleep(state.link.latency);
+
+        let method = request.method.to_string();
+        let (path, query) = split_target(&target);
+        let reply = state.respond(&Call {
+            method: &method,
+            path,
+            query,
+            headers,
+            body: &body,
+        });
+
+        state.link.transfer(reply.body.len());
+        *response.status_mut() = StatusCode::from_u16(reply.status);
+        for (name, value) in reply.headers {
+            response
+                .headers_mut()
+                .set_raw(name, vec![value.into_bytes()]);
+        }
+        if let Err(e) = response.send(&reply.body) {
+            eprintln!("Could not answer a request to {}: {}", target, e);
+        }
+    }
+}
+
+/// Serves an `Account` over HTTP on a local port, until dropped.
+pub struct DriveServer {
+    state: Arc<State>,
+    listening: Listening,
+}
+
+impl DriveServer {
+    /// Starts serving `account` on a free local port, through `link`.
+    pub fn start(account: Account, link: Link) -> Result<Self, Box<dyn Error>> {
+        let state = Arc::new(State {
+            account: Mutex::new(account),
+            link,
+            url: Mutex::new(String::new()),
+            calls: Mutex::new(BTreeMap::new()),
+        });
+        let listening =
+            Server::http("127.0.0.1:0")?.handle_threads(Service(Arc::clone(&state)), THREADS)?;
+        *state.url.lock().unwrap() = format!("http://{}/", listening.socket);
+
+        Ok(DriveServer { state, listening })
+    }
+
+    /// The address of the server, to be used as `Config::api_root_url`.
+    pub fn url(&self) -> String {
+        self.state.url.lock().unwrap().clone()
+    }
+
+    /// How many calls of every kind the server has answered so far. Calls sent in batches are
+    /// counted along with the batches.
+    pub fn calls(&self) -> BTreeMap<&'static str, usize> {
+        self.state.calls.lock().unwrap().clone()
+    }
+}
+
+impl Drop for DriveServer {
+    fn drop(&mut self) {
+        let _ = self.listening.close();
+    }
+}
+
+/// Splits a request target into its path and its decoded query parameters.
+fn split_target(target: &str) -> (&str, HashMap<String, String>) {
+    let (path, query) = target.split_once("?").unwrap_or((target, ""));
+    let params = query
+        .split('&')
+        .filter(|param| !param.is_empty())
+        .map(|param| {
+            let (name, value) = param.split_once("=").unwrap_or((param, ""));
+            (decode(name), decode(value))
+        })
+        .collect();
+    (path, params)
+}
+
+/// Decodes a percent-encoded query component.
+fn decode(component: &str) -> String {
+    let bytes = component.as_bytes();
+    let mut decoded = Vec::with_capacity(bytes.len());
+    let mut i = 0;
+    while i < bytes.len() {
+        match bytes[i] {
+            b'+' => decoded.push(b' '),
+            b'%' if i + 2 < bytes.len() => {
+                let hex = str::from_utf8(&bytes[i + 1..i + 3]).ok();
+                match hex.and_then(|hex| u8::from_str_radix(hex, 16).ok()) {
+                    Some(byte) => {
+                        decoded.push(byte);
+                        i += 2;
+                    }
+                    None => decoded.push(b'%'),
+                }
+            }
+            byte => decoded.push(byte),
+        }
+        i += 1;
+    }
+    String::from_utf8_lossy(&decoded).into_owned()
+}
+
+/// Extracts the boundary parameter of a multipart Content-Type.
+fn boundary(content_type: &str) -> Option<&str> {
+    content_type
+        .split(';')
+        .map(str::trim)
+        .find(|param| param.starts_with("boundary="))
+        .map(|param| param["boundary=".len()..].trim_matches('"'))
+}
+
+/// Splits a `multipart/related` body into the bodies of its parts.
+fn multipart<'a>(content_type: &str, body: &'a [u8]) -> Option<Vec<&'a [u8]>> {
+    let delimiter = format!("--{}", boundary(content_type)?).into_bytes();
+    let mut parts = Vec::new();
+    let mut rest = body;
+    while let Some(start) = find(rest, &delimiter) {
+        rest = &rest[start + delimiter.len()..];
+        if rest.starts_with(b"--") {
+            break;
+        }
+        let end = find(rest, &delimiter).unwrap_or(rest.len());
+        let part = &rest[..end];
+        // The headers of a part end with an empty line. Its body ends with a line break.
+        let content = find(part, b"\r\n\r\n").map_or(part, |headers| &part[headers + 4..]);
+        let content = if content.ends_with(b"\r\n") {
+            &content[..content.len() - 2]
+        } else {
+            content
+        };
+        parts.push(content);
+    }
+    if parts.is_empty() {
+        None
+    } else {
+        Some(parts)
+    }
+}
+
+fn find(haystack: &[u8], needle: &[u8]) -> Option<usize> {
+    haystack
+        .windows(needle.len())
+        .position(|window| window == needle)
+}
+
+fn reason(status: u16) -> &'static str {
+    match status {
+        200 => "OK",
+        204 => "No Content",
+        400 => "Bad Request",
+        404 => "Not Found",
+        _ => "Unknown",
+    }
+}
+
+/// The current time, formatted like the timestamps of Drive.
+fn now() -> String {
+    let seconds = SystemTime::now()
+        .duration_since(UNIX_EPOCH)
+        .map(|d| d.as_secs() as i64)
+        .unwrap_or(0);
+    ::chrono::NaiveDateTime::from_timestamp(seconds, 0)
+        .format("%Y-%m-%dT%H:%M:%S.000Z")
+        .to_string()
+}
@@ -0,0 +1,383 @@
+//! Measures the mounted file system end to end. `Gcsf` is mounted against a local stand-in for
+//! Drive (see `drive_server.rs`), which answers after a given round trip time and at a given
+//! bandwidth, and fio-style workloads are run on the mount point: a sequential read, random 4 KiB
+//! reads, a storm of small file creations, `ls -R` and `rm -rf`. Every workload is reported in
+//! operations per second, along with the median and 99th percentile latency of its operations.
+//!
+//! Run with `cargo bench --bench mount`. Mounting requires FUSE; the benchmark is skipped where
+//! it is not available. It is set up through environment variables:
+//!
+//! - `GCSF_E2E_LATENCY_MS`: the round trip time to the server, in milliseconds (default 50).
+//! - `GCSF_E2E_BANDWIDTH_MIBPS`: the bandwidth of every transfer, in MiB/s (default 20, 0 for
+//!   unlimited).
+//! - `GCSF_E2E_CONFIG`: a configuration file like `sample_config.toml` to mount with, so that
+//!   settings such as `read_ahead_chunks`, `io_workers` or `write_back` can be compared.
+//! - `GCSF_E2E_RECORDING`: a recorded listing of an account (`{"files": [...]}`, with the file
+//!   resources returned by `files.list`), which is served along with the benchmark files, with
+//!   made-up content.
+//! - `GCSF_BENCH_SCALE`: scales the sizes of the workloads, as for the other benchmarks.
+extern crate chrono;
+extern crate config;
+extern crate fuse;
+extern crate gcsf;
+extern crate hyper;
+#[macro_use]
+extern crate serde_json;
+
+mod drive_server;
+
+use drive_server::{Account, Content, DriveServer, Link};
+use gcsf::{Config, Gcsf};
+use std::collections::hash_map::DefaultHasher;
+use std::env;
+use std::ffi::OsStr;
+use std::fs;
+use std::hash::{Hash, Hasher};
+use std::io;
+use std::io::{Read, Write};
+use std::os::unix::fs::FileExt;
+use std::path::{Path, PathBuf};
+use std::process;
+use std::time::{Duration, Instant};
+
+/// The scope GCSF asks for, which the stored token is issued for.
+const SCOPE: &str = "https://www.googleapis.com/auth/drive";
+
+const SESSION_NAME: &str = "e2e";
+
+/// The size of the reads of the sequential workload, which is what FUSE sends at most.
+const SEQUENTIAL_READ_SIZE: usize = 128 * 1024;
+
+const BLOCK_SIZE: usize = 4096;
+
+/// Scales a size by `GCSF_BENCH_SCALE`.
+fn scaled(count: usize) -> usize {
+    let scale = env::var("GCSF_BENCH_SCALE")
+        .ok()
+        .and_then(|scale| scale.parse::<f64>().ok())
+        .unwrap_or(1.0);
+    ((count as f64 * scale) as usize).max(1)
+}
+
+fn env_number(name: &str, default: f64) -> f64 {
+    env::var(name)
+        .ok()
+        .and_then(|value| value.parse().ok())
+        .unwrap_or(default)
+}
+
+fn seconds(duration: Duration) -> f64 {
+    duration.as_secs() as f64 + f64::from(duration.subsec_nanos()) / 1e9
+}
+
+/// Prints the throughput of a workload and the median and 99th percentile of the latencies of
+/// its operations.
+fn report(name: &str, mut samples: Vec<Duration>, elapsed: Duration) {
+    if samples.is_empty() {
+        return println!("{:<32} no operations", name);
+    }
+    samples.sort();
+    let percentile = |p: f64| seconds(samples[((samples.len() - 1) as f64 * p) as usize]) * 1e3;
+    println!(
+        "{:<32} {:>8} ops {:>10.1} ops/s {:>9.2} ms p50 {:>9.2} ms p99",
+        name,
+        samples.len(),
+        samples.len() as f64 / seconds(elapsed),
+        percentile(0.5),
+        percentile(0.99)
+    );
+}
+
+/// Runs `operation`, adding how long it took to `samples`.
+fn timed<T, F>(samples: &mut Vec<Duration>, operation: F) -> io::Result<T>
+where
+    F: FnOnce() -> io::Result<T>,
+{
+    let start = Instant::now();
+    let result = operation();
+    samples.push(start.elapsed());
+    result
+}
+
+/// A reproducible sequence of pseudo-random numbers (xorshift), so that every run reads the same
+/// offsets.
+struct Offsets(u64);
+
+impl Iterator for Offsets {
+    type Item = u64;
+
+    fn next(&mut self) -> Option<u64> {
+        self.0 ^= self.0 << 13;
+        self.0 ^= self.0 >> 7;
+        self.0 ^= self.0 << 17;
+        Some(self.0)
+    }
+}
+
+/// The two large files read by the benchmark, and the directory tree it lists.
+struct Layout {
+    file_len: u64,
+    folders: usize,
+    files_per_folder: usize,
+}
+
+impl Layout {
+    fn new() -> Self {
+        Layout {
+            file_len: scaled(64 * 1024 * 1024) as u64,
+            folders: scaled(20),
+            files_per_folder: 50,
+        }
+    }
+
+    /// Creates the account served to the file system.
+    fn account(&self) -> Result<Account, Box<dyn std::error::Error>> {
+        let mut account = Account::new();
+        let root = account.root().to_string();
+        let bench = account.add_folder("bench", &root);
+        account.add_file("sequential.bin", &bench, Content::Pattern(self.file_len));
+        account.add_file("random.bin", &bench, Content::Pattern(self.file_len));
+
+        let tree = account.add_folder("tree", &bench);
+        for d in 0..self.folders {
+            let folder = account.add_folder(&format!("folder-{}", d), &tree);
+            for f in 0..self.files_per_folder {
+                account.add_file(
+                    &format!("file-{}", f),
+                    &folder,
+                    Content::Pattern(BLOCK_SIZE as u64),
+                );
+            }
+        }
+
+        if let Ok(path) = env::var("GCSF_E2E_RECORDING") {
+            let count = account.load_recording(Path::new(&path))?;
+            println!("Serving {} recorded files from {}", count, path);
+        }
+        Ok(account)
+    }
+}
+
+/// Stores a token which never expires, so that GCSF never has to log in. It is keyed the way
+/// yup-oauth2 looks tokens up: by the hash of the sorted scopes, with the default hasher.
+fn write_token(path: &Path) -> io::Result<()> {
+    let mut hasher = DefaultHasher::new();
+    vec![SCOPE].hash(&mut hasher);
+    let tokens = json!({ "tokens": [{
+        "hash": hasher.finish(),
+        "token": {
+            "access_token": "replayed",
+            "refresh_token": "replayed",
+            "token_type": "Bearer",
+            "expires_in": 3600,
+            "expires_in_timestamp": 32_503_680_000i64,
+        },
+    }]});
+    fs::write(path, tokens.to_string())
+}
+
+/// The configuration to mount with: `GCSF_E2E_CONFIG` if set, pointed at the server.
+fn config(server: &DriveServer, config_dir: &Path) -> Config {
+    let mut config = match env::var("GCSF_E2E_CONFIG") {
+        Ok(path) => {
+            let mut settings = config::Config::default();
+            settings
+                .merge(config::File::with_name(&path))
+                .expect("Invalid configuration file");
+            settings
+                .try_into::<Config>()
+                .expect("Invalid configuration file")
+        }
+        Err(_) => Config::default(),
+    };
+
+    let secret = json!({ "installed": {
+        "client_id": "gcsf-e2e",
+        "client_secret": "gcsf-e2e",
+        "auth_uri": format!("{}auth", server.url()),
+        "token_uri": format!("{}token", server.url()),
+        "redirect_uris": ["urn:ietf:wg:oauth:2.0:oob"],
+    }});
+    config.api_root_url = Some(server.url());
+    config.client_secret = Some(secret.to_string());
+    config.config_dir = Some(config_dir.to_path_buf());
+    config.session_name = Some(SESSION_NAME.to_string());
+    config.mount_check = Some(false);
+    // Every run starts from a listing of the account, as served by this server.
+    config.metadata_snapshot = Some(false);
+    config
+}
+
+fn sequential_read(path: &Path) -> io::Result<()> {
+    let mut file = fs::File::open(path)?;
+    let mut buffer = vec![0; SEQUENTIAL_READ_SIZE];
+    let mut samples = Vec::new();
+    let mut total = 0;
+
+    let start = Instant::now();
+    loop {
+        let read = timed(&mut samples, || file.read(&mut buffer))?;
+        if read == 0 {
+            break;
+        }
+        total += read;
+    }
+    let elapsed = start.elapsed();
+    report("sequential 128 KiB reads", samples, elapsed);
+    println!(
+        "{:<32} {:>8.1} MiB/s",
+        "",
+        total as f64 / (1024.0 * 1024.0) / seconds(elapsed)
+    );
+    Ok(())
+}
+
+fn random_reads(path: &Path, len: u64) -> io::Result<()> {
+    let file = fs::File::open(path)?;
+    let mut buffer = vec![0; BLOCK_SIZE];
+    let blocks = len / BLOCK_SIZE as u64;
+    let mut samples = Vec::new();
+
+    let start = Instant::now();
+    for offset in Offsets(0x9E37_79B9_7F4A_7C15).take(scaled(2000)) {
+        let offset = offset % blocks * BLOCK_SIZE as u64;
+        timed(&mut samples, || file.read_exact_at(&mut buffer, offset))?;
+    }
+    report("random 4 KiB reads", samples, start.elapsed());
+    Ok(())
+}
+
+fn list_recursively(dir: &Path, samples: &mut Vec<Duration>) -> io::Result<()> {
+    let entries = timed(samples, || {
+        fs::read_dir(dir)?.collect::<io::Result<Vec<_>>>()
+    })?;
+    for entry in entries {
+        let path = entry.path();
+        let metadata = timed(samples, || fs::symlink_metadata(&path))?;
+        if metadata.is_dir() {
+            list_recursively(&path, samples)?;
+        }
+    }
+    Ok(())
+}
+
+fn ls_recursive(root: &Path) -> io::Result<()> {
+    let mut samples = Vec::new();
+    let start = Instant::now();
+    list_recursively(root, &mut samples)?;
+    report("ls -R (readdir and stat)", samples, start.elapsed());
+    Ok(())
+}
+
+/// Creates `count` files of 4 KiB each in `dir`. Every file is written and closed before the
+/// next one is created.
+fn create_storm(dir: &Path, count: usize) -> io::Result<()> {
+    let block = vec![7u8; BLOCK_SIZE];
+    let mut samples = Vec::new();
+
+    fs::create_dir(dir)?;
+    let start = Instant::now();
+    for i in 0..count {
+        timed(&mut samples, || {
+            let mut file = fs::File::create(dir.join(format!("file-{}", i)))?;
+            file.write_all(&block)
+        })?;
+    }
+    report("create, write 4 KiB, close", samples, start.elapsed());
+    Ok(())
+}
+
+fn rm_recursive(dir: &Path) -> io::Result<()> {
+    let mut samples = Vec::new();
+    let start = Instant::now();
+    let entries = fs::read_dir(dir)?.collect::<io::Result<Vec<_>>>()?;
+    for entry in entries {
+        timed(&mut samples, || fs::remove_file(entry.path()))?;
+    }
+    timed(&mut samples, || fs::remove_dir(dir))?;
+    report("rm -rf (unlink and rmdir)", samples, start.elapsed());
+    Ok(())
+}
+
+fn run_workloads(mountpoint: &Path, layout: &Layout) -> io::Result<()> {
+    let bench = mountpoint.join("bench");
+    ls_recursive(mountpoint)?;
+    sequential_read(&bench.join("sequential.bin"))?;
+    random_reads(&bench.join("random.bin"), layout.file_len)?;
+    let storm = bench.join("storm");
+    create_storm(&storm, scaled(500))?;
+    rm_recursive(&storm)
+}
+
+fn main() {
+    if !Path::new("/dev/fuse").exists() {
+        println!("Skipping the end-to-end benchmark: FUSE is not available.");
+        return;
+    }
+
+    let link = Link {
+        latency: Duration::from_micros((env_number("GCSF_E2E_LATENCY_MS", 50.0) * 1e3) as u64),
+        bandwidth: match env_number("GCSF_E2E_BANDWIDTH_MIBPS", 20.0) {
+            mibps if mibps > 0.0 => Some((mibps * 1024.0 * 1024.0) as u64),
+            _ => None,
+        },
+    };
+    let layout = Layout::new();
+    let server = DriveServer::start(layout.account().unwrap(), link).unwrap();
+    println!(
+        "Serving Drive at {} with a round trip time of {:?} and a bandwidth of {}",
+        server.url(),
+        link.latency,
+        link.bandwidth
+            .map_or(String::from("unlimited"), |b| format!("{} bytes/s", b))
+    );
+
+    let dir: PathBuf = env::temp_dir().join(format!("gcsf-e2e-{}", process::id()));
+    let (config_dir, mountpoint) = (dir.join("config"), dir.join("mount"));
+    fs::create_dir_all(&config_dir).unwrap();
+    fs::create_dir_all(&mountpoint).unwrap();
+    write_token(&config_dir.join(SESSION_NAME)).unwrap();
+    let config = config(&server, &config_dir);
+
+    let vals = config.mount_options();
+    let options: Vec<&OsStr> = vals
+        .iter()
+        .flat_map(|val| vec![OsStr::new("-o"), OsStr::new(val)])
+        .collect();
+
+    let start = Instant::now();
+    let fs = Gcsf::with_config(config).unwrap();
+    report(
+        "mount (list all files)",
+        vec![start.elapsed()],
+        start.elapsed(),
+    );
+
+    let session = match unsafe { fuse::spawn_mount(fs, &mountpoint, &options) } {
+        Ok(session) => session,
+        Err(e) => {
+            println!("Skipping the end-to-end benchmark: could not mount: {}", e);
+            let _ = fs::remove_dir_all(&dir);
+            return;
+        }
+    };
+
+    if let Err(e) = run_workloads(&mountpoint, &layout) {
+        println!("A workload failed: {}", e);
+    }
+
+    // The file system uploads whatever is still queued before it is dropped.
+    let start = Instant::now();
+    drop(session);
+    report(
+        "unmount (drain uploads)",
+        vec![start.elapsed()],
+        start.elapsed(),
+    );
+
+    println!("Calls answered by the server:");
+    for (kind, count) in server.calls() {
+        println!("    {:<28} {:>8}", kind, count);
+    }
+    let _ = fs::remove_dir_all(&dir);
+}
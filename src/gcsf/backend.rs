@@ -0,0 +1,135 @@
+use drive3;
+use failure::Error;
+use std::sync::mpsc::Receiver;
+use std::time::Duration;
+
+type DriveId = String;
+type DriveIdRef<'a> = &'a str;
+
+/// A part of the files on Drive, as listed by `DriveBackend::list_files()`.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Listing<'a> {
+    /// The untrashed files in the directory with the given Drive ID.
+    Children(DriveIdRef<'a>),
+
+    /// The untrashed files shared with the user.
+    Shared,
+
+    /// The trashed files, wherever they are.
+    Trashed,
+}
+
+/// The operations a `FileManager` needs from Drive: listing files and changes, creating files,
+/// buffering and flushing their content and mutating their metadata.
+///
+/// `DriveFacade` implements them on top of the Drive API. `SyntheticDrive` implements them in
+/// memory, so that the file tree can be exercised (e.g. benchmarked) without an account.
+pub trait DriveBackend {
+    /// Returns the Drive ID of the root "My Drive" directory.
+    fn root_id(&mut self) -> Result<&String, Error>;
+
+    /// Returns the current token for the `changes.list` API endpoint, or the start page token if
+    /// absent.
+    fn changes_token(&mut self) -> Result<&String, Error>;
+
+    /// Makes the next call to `get_all_changes()` return the changes which happened since
+    /// `token` was issued. Without a token, a fresh one is requested when needed.
+    fn set_changes_token(&mut self, token: Option<String>);
+
+    /// Returns a list of all changes which are more recent than the changes token indicates.
+    fn get_all_changes(&mut self) -> Result<Vec<drive3::Change>, Error>;
+
+    /// Starts polling for changes in the background, every `interval`, if the backend supports
+    /// it. From then on, changes are retrieved by `take_polled_changes()` instead of
+    /// `get_all_changes()`.
+    fn start_polling_changes(&mut self, interval: Duration) -> Result<(), Error>;
+
+    /// Whether changes are being polled for in the background.
+    fn is_polling_changes(&self) -> bool;
+
+    /// Returns the changes which the background poller has found since the last call, without
+    /// blocking. The changes token moves past them, so they must be applied. Returns none if the
+    /// poller has not finished a poll since the last call; once the returned changes are
+    /// applied, the file tree is as recent as the last poll.
+    fn take_polled_changes(&mut self) -> Option<Vec<drive3::Change>>;
+
+    /// Lists all files, optionally only the trashed (or untrashed) ones, and returns a receiver
+    /// which yields the files one page at a time, as soon as each page is available.
+    fn list_all_files(
+        &self,
+        trashed: Option<bool>,
+    ) -> Result<Receiver<Result<Vec<drive3::File>, Error>>, Error>;
+
+    /// Lists a part of the files, all at once. Used for loading the file tree one directory at a
+    /// time, instead of listing every file with `list_all_files()`.
+    fn list_files(&mut self, listing: Listing) -> Result<Vec<drive3::File>, Error>;
+
+    /// The length of the content of a file which must be exported (e.g. a Google document), if
+    /// it has been exported in its current `version` (see `File::content_version()`). Drive does
+    /// not report the length of such files.
+    fn exported_len(
+        &self,
+        drive_id: DriveIdRef,
+        mime_type: &Option<String>,
+        version: Option<&str>,
+    ) -> Option<u64>;
+
+    /// Creates a new, empty file. If successful, returns the file id.
+    fn create(&mut self, drive_file: &drive3::File) -> Result<DriveId, Error>;
+
+    /// Writes some data to a file starting at a certain offset.
+    /// This is a lazy operation. The data is buffered and only gets uploaded when flush() is
+    /// called. `remote_len` is the length of the content of the file on Drive, if known; it
+    /// allows flush() to skip downloading content which has been overwritten entirely.
+    fn write(
+        &mut self,
+        id: DriveId,
+        offset: usize,
+        data: &[u8],
+        remote_len: Option<u64>,
+    ) -> Result<(), Error>;
+
+    /// Truncates a file to a certain size. Like `write()`, this only takes effect on Drive when
+    /// flush() is called.
+    fn truncate(&mut self, id: DriveId, size: u64, remote_len: Option<u64>) -> Result<(), Error>;
+
+    /// Applies pending write operations, possibly in the background. Similar to flushing a
+    /// stream. `done` is called with the result, right away if there is nothing to flush.
+    fn flush<F>(&mut self, id: DriveIdRef, done: F)
+    where
+        F: FnOnce(Result<(), Error>) + Send + 'static;
+
+    /// Like `flush()`, except that `done` is only called once the uploads of the file which were
+    /// queued before have finished as well.
+    fn sync<F>(&mut self, id: DriveIdRef, done: F)
+    where
+        F: FnOnce(Result<(), Error>) + Send + 'static;
+
+    /// Deletes a file permanently. `done` is called with the result, possibly on another thread.
+    fn delete_permanently<F>(&mut self, id: DriveIdRef, done: F)
+    where
+        F: FnOnce(Result<(), Error>) + Send + 'static;
+
+    /// `mv` operation. Can potentially move a file to a new directory and/or rename it.
+    /// `current_parents` are the parents the file has on Drive. If they are not known, they are
+    /// requested from Drive first. `done` is called with the result, like for
+    /// `delete_permanently()`.
+    fn move_to<F>(
+        &mut self,
+        id: DriveIdRef,
+        parent: DriveIdRef,
+        new_name: &str,
+        current_parents: Option<Vec<DriveId>>,
+        done: F,
+    ) where
+        F: FnOnce(Result<(), Error>) + Send + 'static;
+
+    /// Marks a file as trashed. `done` is called with the result, like for
+    /// `delete_permanently()`.
+    fn move_to_trash<F>(&mut self, id: DriveId, done: F)
+    where
+        F: FnOnce(Result<(), Error>) + Send + 'static;
+
+    /// Drops all cached content of a file.
+    fn invalidate(&mut self, id: DriveIdRef);
+}
@@ -0,0 +1,289 @@
+use super::drive_facade::{GcAuthenticator, GcClient};
+use super::metrics;
+use super::scheduler;
+use super::scheduler::MAX_RETRIES;
+use drive3;
+use failure::{err_msg, Error};
+use hyper::header::{Authorization, Bearer, ContentType};
+use hyper::method::Method;
+use hyper::status::StatusCode;
+use oauth2::GetToken;
+use rand;
+use std::collections::HashMap;
+use std::io::Read;
+use std::sync::mpsc::{channel, Receiver, Sender};
+use std::thread;
+
+/// Drive accepts at most this many calls in a single batch request.
+pub const MAX_BATCH_SIZE: usize = 100;
+
+/// A single Drive API call, as sent within a batch request.
+#[derive(Debug, Clone)]
+pub struct BatchCall {
+    /// The HTTP method of the call.
+    pub method: Method,
+
+    /// The path and query of the call, e.g. `/drive/v3/files/<id>`.
+    pub path: String,
+
+    /// The JSON body of the call, if any.
+    pub body: Option<String>,
+}
+
+/// Several Drive API calls which are sent together, in a single `multipart/mixed` request. Drive
+/// answers with one part per call, each holding the response to that call.
+pub struct Batch {
+    calls: Vec<BatchCall>,
+    boundary: String,
+}
+
+impl Batch {
+    /// Creates a batch of at most `MAX_BATCH_SIZE` calls.
+    pub fn new(calls: Vec<BatchCall>) -> Self {
+        Batch {
+            calls,
+            boundary: format!("batch_{:016x}", rand::random::<u64>()),
+        }
+    }
+
+    /// The value of the Content-Type header of the batch request.
+    pub fn content_type(&self) -> String {
+        format!("multipart/mixed; boundary={}", self.boundary)
+    }
+
+    /// The body of the batch request. Every call is identified by its index in the batch.
+    pub fn encode(&self) -> String {
+        let mut body = String::new();
+        for (i, call) in self.calls.iter().enumerate() {
+            body.push_str(&format!(
+                "--{}\r\nContent-Type: application/http\r\nContent-ID: <item{}>\r\n\r\n{} {} HTTP/1.1\r\n",
+                self.boundary, i, call.method, call.path
+            ));
+            match call.body {
+                Some(ref json) => body.push_str(&format!(
+                    "Content-Type: application/json; charset=UTF-8\r\nContent-Length: {}\r\n\r\n{}\r\n",
+                    json.len(),
+                    json
+                )),
+                None => body.push_str("\r\n"),
+            }
+        }
+        body.push_str(&format!("--{}--\r\n", self.boundary));
+        body
+    }
+
+    /// Maps the response to the batch request back to the calls. Returns the result of every
+    /// call, in the order of the calls. `content_type` is the Content-Type of the response, which
+    /// holds the boundary between its parts. Calls which the response does not mention have
+    /// failed.
+    pub fn decode(&self, content_type: &str, body: &str) -> Vec<Result<(), Error>> {
+        let mut statuses: HashMap<usize, (u16, String)> = HashMap::new();
+        if let Some(boundary) = Self::boundary(content_type) {
+            let delimiter = format!("--{}", boundary);
+            for part in body.split(delimiter.as_str()).skip(1) {
+                if let Some((index, status, message)) = Self::decode_part(part) {
+                    statuses.insert(index, (status, message));
+                }
+            }
+        }
+
+        (0..self.calls.len())
+            .map(|i| match statuses.remove(&i) {
+                Some((status, _)) if status >= 200 && status < 300 => Ok(()),
+                Some((status, message)) => Err(err_msg(format!(
+                    "{} {} failed with status {}: {}",
+                    self.calls[i].method,
+                    self.calls[i].path,
+                    status,
+                    message.trim()
+                ))),
+                None => Err(err_msg(format!(
+                    "{} {}: no response in batch",
+                    self.calls[i].method, self.calls[i].path
+                ))),
+            })
+            .collect()
+    }
+
+    /// Extracts the boundary parameter of a `multipart/mixed` Content-Type.
+    fn boundary(content_type: &str) -> Option<&str> {
+        content_type
+            .split(';')
+            .map(str::trim)
+            .find(|param| param.starts_with("boundary="))
+            .map(|param| param["boundary=".len()..].trim_matches('"'))
+    }
+
+    /// Parses one part of a batch response into the index of its call, the HTTP status of the
+    /// call and the body of its response.
+    fn decode_part(part: &str) -> Option<(usize, u16, String)> {
+        let mut index = None;
+        let mut lines = part.lines();
+        for line in lines.by_ref() {
+            let line = line.trim();
+            if line.to_lowercase().starts_with("content-id:") {
+                index = line["content-id:".len()..]
+                    .trim()
+                    .trim_matches(|c| c == '<' || c == '>')
+                    .trim_start_matches("response-")
+                    .trim_start_matches("item")
+                    .parse()
+                    .ok();
+            }
+            if line.starts_with("HTTP/") {
+                let status = line.split_whitespace().nth(1)?.parse().ok()?;
+                // The headers of the response are followed by an empty line and its body.
+                let message: Vec<&str> = lines.skip_while(|l| !l.trim().is_empty()).collect();
+                return Some((index?, status, message.join("\n")));
+            }
+        }
+        None
+    }
+}
+
+type Callback = Box<dyn FnOnce(Result<(), Error>) + Send>;
+
+/// A call waiting to be sent, along with what to do with its result.
+struct Job {
+    call: BatchCall,
+    done: Callback,
+}
+
+/// Sends metadata mutations (deletions, moves, trashing) to Drive from a background thread,
+/// coalescing the calls which are submitted while a batch is in flight into the next batch.
+///
+/// A lone call is sent right away, so it never waits for others. When many calls come in at
+/// once, e.g. from several processes removing files at the same time, they share a single round
+/// trip for up to `MAX_BATCH_SIZE` calls instead of taking one each.
+pub struct Batcher {
+    sender: Sender<Job>,
+}
+
+impl Batcher {
+    /// Starts the batching thread, which sends batches to the Drive API served under
+    /// `api_root_url` (see `Config::api_root_url()`). The client and authenticator it uses are
+    /// created by `create` on that thread.
+    pub fn start<F>(api_root_url: &str, create: F) -> Self
+    where
+        F: FnOnce() -> Result<(GcClient, GcAuthenticator), Error> + Send + 'static,
+    {
+        let url = format!("{}batch/drive/v3", api_root_url);
+        let (sender, receiver) = channel::<Job>();
+        let spawned =
+            thread::Builder::new()
+                .name("batcher".to_string())
+                .spawn(move || match create() {
+                    Ok((client, auth)) => Self::run(&url, &client, auth, &receiver),
+                    Err(e) => {
+                        error!("Could not start sending batches: {}", e);
+                        // Fail every call instead of leaving its caller waiting.
+                        for job in receiver {
+                            (job.done)(Err(err_msg("Batches can not be sent")));
+                        }
+                    }
+                });
+        if let Err(e) = spawned {
+            error!("Could not start batching thread: {}", e);
+        }
+
+        Batcher { sender }
+    }
+
+    /// Queues a call. `done` is called with its result, on the batching thread.
+    pub fn submit<F>(&self, call: BatchCall, done: F)
+    where
+        F: FnOnce(Result<(), Error>) + Send + 'static,
+    {
+        let job = Job {
+            call,
+            done: Box::new(done),
+        };
+        // The receiver only goes away if the batching thread could not be started.
+        if let Err(e) = self.sender.send(job) {
+            (e.0.done)(Err(err_msg("The batching thread is not running")));
+        }
+    }
+
+    fn run(url: &str, client: &GcClient, mut auth: GcAuthenticator, receiver: &Receiver<Job>) {
+        // The channel is closed when the Batcher is dropped.
+        while let Ok(first) = receiver.recv() {
+            let mut jobs = vec![first];
+            while jobs.len() < MAX_BATCH_SIZE {
+                match receiver.try_recv() {
+                    Ok(job) => jobs.push(job),
+                    Err(_) => break,
+                }
+            }
+
+            let (calls, callbacks): (Vec<_>, Vec<_>) =
+                jobs.into_iter().map(|job| (job.call, job.done)).unzip();
+            let batch = Batch::new(calls);
+            debug!("Sending a batch of {} calls", callbacks.len());
+
+            match Self::send(url, client, &mut auth, &batch) {
+                Ok(results) => {
+                    for (done, result) in callbacks.into_iter().zip(results) {
+                        done(result);
+                    }
+                }
+                Err(e) => {
+                    warn!("Could not send batch: {}", e);
+                    for done in callbacks {
+                        done(Err(err_msg(format!("Batch request failed: {}", e))));
+                    }
+                }
+            }
+        }
+    }
+
+    fn send(
+        url: &str,
+        client: &GcClient,
+        auth: &mut GcAuthenticator,
+        batch: &Batch,
+    ) -> Result<Vec<Result<(), Error>>, Error> {
+        let token = auth
+            .token(&[drive3::Scope::Full])
+            .map_err(|e| err_msg(format!("{:#?}", e)))?;
+
+        let body = batch.encode();
+        let mut attempts = 0;
+        let mut response = loop {
+            let response = client
+                .post(url)
+                .header(Authorization(Bearer {
+                    token: token.access_token.clone(),
+                }))
+                .header(ContentType(batch.content_type().parse().unwrap()))
+                .body(&body)
+                .send()
+                .map_err(|e| err_msg(format!("{:#?}", e)))?;
+
+            // The scheduler pauses before sending the retried request.
+            if scheduler::is_throttling(response.status.to_u16(), false) && attempts < MAX_RETRIES {
+                attempts += 1;
+                debug!("Retrying a batch, attempt {}", attempts);
+                metrics::mark_retry();
+                continue;
+            }
+            break response;
+        };
+
+        let mut content = String::new();
+        response.read_to_string(&mut content)?;
+        if response.status != StatusCode::Ok {
+            return Err(err_msg(format!(
+                "unexpected status {:?}: {}",
+                response.status, content
+            )));
+        }
+
+        let content_type = response
+            .headers
+            .get_raw("Content-Type")
+            .and_then(|values| values.first())
+            .map(|value| String::from_utf8_lossy(value).into_owned())
+            .ok_or_else(|| err_msg("Batch response has no Content-Type"))?;
+        Ok(batch.decode(&content_type, &content))
+    }
+}
@@ -0,0 +1,245 @@
+use std::cmp;
+use std::collections::{BTreeMap, HashMap, VecDeque};
+use std::fmt;
+use std::ops::Deref;
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+type DriveId = String;
+type DriveIdRef<'a> = &'a str;
+
+/// An immutable, reference-counted piece of file content. Chunks are shared between the cache
+/// and its readers, so serving a read or slicing a chunk never copies the content.
+#[derive(Clone)]
+pub struct Chunk {
+    data: Arc<Vec<u8>>,
+    start: usize,
+    end: usize,
+}
+
+impl Chunk {
+    /// Returns the part of the chunk between `from` and `to`, relative to the start of the chunk.
+    /// Both bounds are clamped to the length of the chunk.
+    pub fn slice(&self, from: usize, to: usize) -> Chunk {
+        let to = self.start + cmp::min(to, self.len());
+        Chunk {
+            data: Arc::clone(&self.data),
+            start: cmp::min(self.start + from, to),
+            end: to,
+        }
+    }
+}
+
+impl From<Vec<u8>> for Chunk {
+    fn from(data: Vec<u8>) -> Self {
+        let end = data.len();
+        Chunk {
+            data: Arc::new(data),
+            start: 0,
+            end,
+        }
+    }
+}
+
+impl Deref for Chunk {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        &self.data[self.start..self.end]
+    }
+}
+
+impl fmt::Debug for Chunk {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        write!(f, "Chunk({} bytes)", self.len())
+    }
+}
+
+/// A cache for blocks of file content, identified by a Drive ID and a block index. The cache is
+/// limited by the total size of the blocks it holds rather than by their count, so that a few
+/// large files can not take up all the memory while many small ones keep evicting each other.
+/// Files can be partially resident: only the blocks which were actually read are stored.
+///
+/// Eviction follows the CLOCK algorithm: blocks are kept in a circular queue in insertion order
+/// and a block which was accessed since the last time the clock hand passed over it gets a
+/// second chance.
+pub struct BlockCache {
+    /// Maps Drive IDs to the resident blocks of the corresponding file.
+    files: HashMap<DriveId, BTreeMap<u64, Block>>,
+
+    /// The circular queue used for eviction. Entries whose generation does not match the one of
+    /// the resident block are stale and are skipped.
+    clock: VecDeque<(DriveId, u64, u64)>,
+
+    /// The total size and the number of all resident blocks.
+    size: u64,
+    count: usize,
+
+    /// The size which the cache tries not to exceed.
+    max_size: u64,
+
+    /// How long a block can be served after it has been inserted.
+    ttl: Duration,
+
+    /// Incremented for every insertion and used for telling apart old clock entries.
+    generation: u64,
+}
+
+struct Block {
+    data: Chunk,
+    inserted: Instant,
+    referenced: bool,
+    generation: u64,
+}
+
+impl BlockCache {
+    /// Creates an empty cache which holds at most `max_size` bytes, each block being valid for
+    /// `ttl` after it is inserted.
+    pub fn new(max_size: u64, ttl: Duration) -> Self {
+        BlockCache {
+            files: HashMap::new(),
+            clock: VecDeque::new(),
+            size: 0,
+            count: 0,
+            max_size,
+            ttl,
+            generation: 0,
+        }
+    }
+
+    /// Whether a block is resident and has not expired.
+    pub fn contains(&self, id: DriveIdRef, index: u64) -> bool {
+        self.files
+            .get(id)
+            .and_then(|blocks| blocks.get(&index))
+            .map_or(false, |block| block.inserted.elapsed() < self.ttl)
+    }
+
+    /// Returns a block if it is resident and has not expired. Expired blocks are dropped. The
+    /// returned chunk shares its content with the cache.
+    pub fn get(&mut self, id: DriveIdRef, index: u64) -> Option<Chunk> {
+        if !self.contains(id, index) {
+            self.remove(id, index);
+            return None;
+        }
+
+        let block = self.files.get_mut(id)?.get_mut(&index)?;
+        block.referenced = true;
+        Some(block.data.clone())
+    }
+
+    /// Inserts a block, replacing the previous version of it if one exists. Other blocks are
+    /// evicted until the total size fits the limit again; the inserted block itself is always
+    /// kept, even if it alone exceeds the limit.
+    pub fn insert<C: Into<Chunk>>(&mut self, id: DriveId, index: u64, data: C) {
+        let data = data.into();
+        self.remove(&id, index);
+        self.generation += 1;
+
+        let len = data.len() as u64;
+        while self.size + len > self.max_size && self.evict_one() {}
+
+        self.clock.push_back((id.clone(), index, self.generation));
+        self.files.entry(id).or_insert_with(BTreeMap::new).insert(
+            index,
+            Block {
+                data,
+                inserted: Instant::now(),
+                referenced: false,
+                generation: self.generation,
+            },
+        );
+        self.size += len;
+        self.count += 1;
+
+        // Stale entries accumulate in the clock when blocks are removed explicitly.
+        if self.clock.len() > 2 * self.count + 64 {
+            self.compact_clock();
+        }
+    }
+
+    /// Removes a single block.
+    pub fn remove(&mut self, id: DriveIdRef, index: u64) {
+        let (removed, now_empty) = match self.files.get_mut(id) {
+            Some(blocks) => (blocks.remove(&index), blocks.is_empty()),
+            None => return,
+        };
+
+        if let Some(block) = removed {
+            self.size -= block.data.len() as u64;
+            self.count -= 1;
+        }
+        if now_empty {
+            self.files.remove(id);
+        }
+    }
+
+    /// Removes all blocks of a file.
+    pub fn remove_file(&mut self, id: DriveIdRef) {
+        if let Some(blocks) = self.files.remove(id) {
+            self.size -= blocks.values().map(|b| b.data.len() as u64).sum::<u64>();
+            self.count -= blocks.len();
+        }
+    }
+
+    /// Returns the indices of the resident blocks of a file, in increasing order.
+    #[cfg(test)]
+    pub fn resident_blocks(&self, id: DriveIdRef) -> Vec<u64> {
+        self.files
+            .get(id)
+            .map(|blocks| blocks.keys().cloned().collect())
+            .unwrap_or_default()
+    }
+
+    /// The total size of all resident blocks.
+    pub fn size(&self) -> u64 {
+        self.size
+    }
+
+    /// The number of resident blocks.
+    #[cfg(test)]
+    pub fn len(&self) -> usize {
+        self.count
+    }
+
+    /// Whether there are no resident blocks.
+    #[cfg(test)]
+    pub fn is_empty(&self) -> bool {
+        self.files.is_empty()
+    }
+
+    /// Advances the clock hand until a block is evicted. Returns false if there is nothing left
+    /// to evict.
+    fn evict_one(&mut self) -> bool {
+        while let Some((id, index, generation)) = self.clock.pop_front() {
+            let second_chance = match self.files.get_mut(&id).and_then(|b| b.get_mut(&index)) {
+                Some(ref mut block) if block.generation == generation => {
+                    let referenced = block.referenced;
+                    block.referenced = false;
+                    referenced && block.inserted.elapsed() < self.ttl
+                }
+                _ => continue,
+            };
+
+            if second_chance {
+                self.clock.push_back((id, index, generation));
+            } else {
+                self.remove(&id, index);
+                return true;
+            }
+        }
+
+        false
+    }
+
+    /// Drops the stale entries of the clock.
+    fn compact_clock(&mut self) {
+        let files = &self.files;
+        self.clock.retain(|&(ref id, index, generation)| {
+            files
+                .get(id)
+                .and_then(|blocks| blocks.get(&index))
+                .map_or(false, |block| block.generation == generation)
+        });
+    }
+}
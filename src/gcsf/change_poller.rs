@@ -0,0 +1,341 @@
+use super::drive_facade::GcDrive;
+use super::scheduler;
+use super::scheduler::{Priority, RetryDelegate};
+use drive3;
+use failure::{err_msg, Error};
+use hyper::net::Fresh;
+use hyper::server::{Listening, Request, Response, Server};
+use rand;
+use std::cmp;
+use std::sync::mpsc::{channel, Receiver, RecvTimeoutError, Sender};
+use std::sync::Mutex;
+use std::thread;
+use std::time::{Duration, SystemTime, UNIX_EPOCH};
+
+const PAGE_SIZE: i32 = 1000;
+const CHANGE_FIELDS: &str = "kind,nextPageToken,newStartPageToken,changes(kind,type,time,removed,fileId,file(name,id,size,mimeType,md5Checksum,owners,parents,trashed,modifiedTime,createdTime,viewedByMeTime))";
+
+/// While push notifications arrive, Drive is still polled this often, in case one is lost.
+const WATCHED_POLL_INTERVAL: Duration = Duration::from_secs(600);
+
+/// A push channel is renewed this long before it expires.
+const CHANNEL_RENEWAL_MARGIN: Duration = Duration::from_secs(300);
+
+/// How long to wait before trying again to register a push channel, after failing to.
+const WATCH_RETRY_INTERVAL: Duration = Duration::from_secs(600);
+
+/// How long to keep a push channel which came without an expiration time.
+const DEFAULT_CHANNEL_LIFETIME: Duration = Duration::from_secs(3600);
+
+/// Retrieves all changes which happened since `token` was issued. Returns them along with the
+/// token to use for the next call.
+pub fn list_changes(hub: &GcDrive, token: &str) -> Result<(Vec<drive3::Change>, String), Error> {
+    let mut all_changes = Vec::new();
+    let mut token = token.to_string();
+
+    loop {
+        let (_response, changelist) = hub
+            .changes()
+            .list(&token)
+            .param("fields", CHANGE_FIELDS)
+            .spaces("drive")
+            .restrict_to_my_drive(true)
+            // Whether to include changes indicating that items have been removed from the list of changes, for example by deletion or loss of access. (Default: true)
+            .include_removed(false) // ^wtf?
+            .supports_team_drives(false)
+            .include_team_drive_items(false)
+            .page_size(PAGE_SIZE)
+            .add_scope(drive3::Scope::Full)
+            .delegate(&mut RetryDelegate::default())
+            .doit()
+            .map_err(|e| err_msg(format!("{:#?}", e)))?;
+
+        match changelist.changes {
+            Some(changes) => all_changes.extend(changes),
+            _ => warn!("Changelist does not contain any changes!"),
+        };
+
+        match (changelist.next_page_token, changelist.new_start_page_token) {
+            (Some(next), _) => token = next,
+            (None, Some(new_start)) => return Ok((all_changes, new_start)),
+            (None, None) => return Err(err_msg("Changelist does not contain any page token")),
+        }
+    }
+}
+
+/// Where Drive should send push notifications about changes.
+#[derive(Debug, Clone)]
+pub struct Webhook {
+    /// The public HTTPS address which Drive sends notifications to.
+    pub address: String,
+
+    /// The local address to listen on. Requests to `address` must be forwarded here.
+    pub listen: String,
+}
+
+/// The changes which a poll has found, possibly none, along with the token which follows them.
+struct ChangeBatch {
+    changes: Vec<drive3::Change>,
+    token: String,
+}
+
+enum Signal {
+    /// Poll for changes right away.
+    Poll,
+
+    /// Stop polling.
+    Stop,
+}
+
+/// Polls Drive for changes on a background thread, so that no file system operation has to wait
+/// for the round trips. The changes are handed over in batches, to be applied by the owner of the
+/// file tree whenever it is convenient.
+///
+/// If a webhook is configured, Drive is also asked to push a notification whenever something
+/// changes (see `changes.watch`), in which case the poller asks for the changes right away.
+pub struct ChangePoller {
+    batches: Receiver<ChangeBatch>,
+    signals: Sender<Signal>,
+
+    /// The HTTP server which receives push notifications.
+    listening: Option<Listening>,
+}
+
+impl ChangePoller {
+    /// Starts polling for the changes which happened since `token` was issued, every `interval`.
+    /// The hub used for polling is created by `create_hub` on the polling thread.
+    pub fn start<F>(
+        create_hub: F,
+        token: String,
+        interval: Duration,
+        webhook: Option<Webhook>,
+    ) -> Result<Self, Error>
+    where
+        F: FnOnce() -> Result<GcDrive, Error> + Send + 'static,
+    {
+        let (batch_sender, batches) = channel();
+        let (signals, signal_receiver) = channel();
+
+        // Notifications carry this secret, so that they can not be forged by others.
+        let secret = format!(
+            "{:016x}{:016x}",
+            rand::random::<u64>(),
+            rand::random::<u64>()
+        );
+        let listening = match webhook {
+            Some(ref webhook) => match Self::listen(webhook, secret.clone(), signals.clone()) {
+                Ok(listening) => Some(listening),
+                Err(e) => {
+                    error!("Could not listen for change notifications: {}", e);
+                    None
+                }
+            },
+            None => None,
+        };
+        let webhook = webhook.filter(|_| listening.is_some());
+
+        thread::Builder::new()
+            .name("change-poller".to_string())
+            .spawn(move || {
+                scheduler::set_priority(Priority::Sync);
+                let hub = match create_hub() {
+                    Ok(hub) => hub,
+                    Err(e) => {
+                        error!("Could not start polling for changes: {}", e);
+                        return;
+                    }
+                };
+
+                let mut poller = PollLoop {
+                    hub,
+                    token,
+                    secret,
+                    webhook,
+                    channel: None,
+                    channel_expiration: UNIX_EPOCH,
+                };
+                poller.run(interval, &signal_receiver, &batch_sender);
+                poller.stop_channel();
+            })?;
+
+        Ok(ChangePoller {
+            batches,
+            signals,
+            listening,
+        })
+    }
+
+    /// Returns all changes found since the last call, without blocking, along with the token
+    /// which follows them. Returns none if no poll has finished since the last call.
+    pub fn take_changes(&self) -> Option<(Vec<drive3::Change>, String)> {
+        let mut result: Option<(Vec<drive3::Change>, String)> = None;
+        while let Ok(batch) = self.batches.try_recv() {
+            match result {
+                Some((ref mut changes, ref mut token)) => {
+                    changes.extend(batch.changes);
+                    *token = batch.token;
+                }
+                None => result = Some((batch.changes, batch.token)),
+            }
+        }
+        result
+    }
+
+    /// Starts an HTTP server which wakes up the poller whenever Drive sends a notification.
+    fn listen(
+        webhook: &Webhook,
+        secret: String,
+        signals: Sender<Signal>,
+    ) -> Result<Listening, Error> {
+        let signals = Mutex::new(signals);
+        let listening = Server::http(webhook.listen.as_str())?.handle(
+            move |request: Request, _response: Response<Fresh>| {
+                let authentic = request
+                    .headers
+                    .get_raw("X-Goog-Channel-Token")
+                    .and_then(|values| values.first())
+                    .map_or(false, |value| value[..] == *secret.as_bytes());
+                if authentic {
+                    debug!("Received a change notification");
+                    let _ = signals.lock().unwrap().send(Signal::Poll);
+                }
+                // The response is sent with status 200 once it is dropped.
+            },
+        )?;
+
+        info!("Listening for change notifications on {}", &webhook.listen);
+        Ok(listening)
+    }
+}
+
+impl Drop for ChangePoller {
+    fn drop(&mut self) {
+        let _ = self.signals.send(Signal::Stop);
+        if let Some(ref mut listening) = self.listening {
+            let _ = listening.close();
+        }
+    }
+}
+
+/// The state of the polling thread.
+struct PollLoop {
+    hub: GcDrive,
+    token: String,
+    secret: String,
+    webhook: Option<Webhook>,
+
+    /// The push channel which is currently registered, if any.
+    channel: Option<drive3::Channel>,
+
+    /// When the current channel expires. After failing to register a channel, this is set so
+    /// that the next attempt happens only after `WATCH_RETRY_INTERVAL`.
+    channel_expiration: SystemTime,
+}
+
+impl PollLoop {
+    fn run(
+        &mut self,
+        interval: Duration,
+        signals: &Receiver<Signal>,
+        batches: &Sender<ChangeBatch>,
+    ) {
+        loop {
+            self.renew_channel();
+            let timeout = if self.channel.is_some() {
+                cmp::max(interval, WATCHED_POLL_INTERVAL)
+            } else {
+                interval
+            };
+
+            match signals.recv_timeout(timeout) {
+                Ok(Signal::Poll) | Err(RecvTimeoutError::Timeout) => {}
+                Ok(Signal::Stop) | Err(RecvTimeoutError::Disconnected) => return,
+            }
+            // Notifications often come in bursts. One poll answers all of them.
+            while let Ok(signal) = signals.try_recv() {
+                if let Signal::Stop = signal {
+                    return;
+                }
+            }
+
+            match list_changes(&self.hub, &self.token) {
+                Ok((changes, token)) => {
+                    self.token = token.clone();
+                    if !changes.is_empty() {
+                        debug!("Found {} changes", changes.len());
+                    }
+                    // Even an empty batch is sent, so that the file manager knows when it has
+                    // caught up with this poll.
+                    if batches.send(ChangeBatch { changes, token }).is_err() {
+                        return;
+                    }
+                }
+                Err(e) => warn!("Could not poll for changes: {}", e),
+            }
+        }
+    }
+
+    /// Registers a push channel if a webhook is configured and the current channel is about to
+    /// expire.
+    fn renew_channel(&mut self) {
+        let webhook = match self.webhook {
+            Some(ref webhook) => webhook.clone(),
+            None => return,
+        };
+        if SystemTime::now() + CHANNEL_RENEWAL_MARGIN < self.channel_expiration {
+            return;
+        }
+
+        let request = drive3::Channel {
+            id: Some(format!("gcsf-{:016x}", rand::random::<u64>())),
+            type_: Some("web_hook".to_string()),
+            address: Some(webhook.address),
+            token: Some(self.secret.clone()),
+            ..Default::default()
+        };
+        let result = self
+            .hub
+            .changes()
+            .watch(request, &self.token)
+            .spaces("drive")
+            .restrict_to_my_drive(true)
+            .include_removed(false)
+            .supports_team_drives(false)
+            .include_team_drive_items(false)
+            .add_scope(drive3::Scope::Full)
+            .delegate(&mut RetryDelegate::default())
+            .doit();
+
+        match result {
+            Ok((_, channel)) => {
+                // The expiration is given in milliseconds since the epoch.
+                self.channel_expiration = channel
+                    .expiration
+                    .as_ref()
+                    .and_then(|ms| ms.parse::<u64>().ok())
+                    .map(|ms| UNIX_EPOCH + Duration::from_millis(ms))
+                    .unwrap_or_else(|| SystemTime::now() + DEFAULT_CHANNEL_LIFETIME);
+                info!("Watching for changes through channel {:?}", &channel.id);
+
+                self.stop_channel();
+                self.channel = Some(channel);
+            }
+            Err(e) => {
+                warn!("Could not watch for changes: {:#?}", e);
+                // Keep polling at the usual interval and try again later.
+                self.stop_channel();
+                self.channel_expiration =
+                    SystemTime::now() + CHANNEL_RENEWAL_MARGIN + WATCH_RETRY_INTERVAL;
+            }
+        }
+    }
+
+    /// Asks Drive to stop sending notifications through the current channel.
+    fn stop_channel(&mut self) {
+        if let Some(channel) = self.channel.take() {
+            if let Err(e) = self.hub.channels().stop(channel).doit() {
+                warn!("Could not stop watching for changes: {:#?}", e);
+            }
+        }
+    }
+}
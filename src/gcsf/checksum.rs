@@ -0,0 +1,77 @@
+use md5;
+use std::fmt;
+use std::io;
+use std::io::Read;
+
+/// Computes MD5 checksums incrementally, as content is written, so that it can be compared with
+/// the `md5Checksum` which Drive reports for every file with binary content.
+///
+/// MD5 is only used for telling whether two contents are the same, never for security.
+#[derive(Clone)]
+pub struct Md5 {
+    context: md5::Context,
+
+    /// The number of bytes hashed so far.
+    len: u64,
+}
+
+impl Default for Md5 {
+    fn default() -> Self {
+        Md5 {
+            context: md5::Context::new(),
+            len: 0,
+        }
+    }
+}
+
+impl fmt::Debug for Md5 {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        f.debug_struct("Md5").field("len", &self.len).finish()
+    }
+}
+
+impl Md5 {
+    /// Starts the checksum of empty content.
+    pub fn new() -> Self {
+        Md5::default()
+    }
+
+    /// The checksum of `data`, as a string of 32 lowercase hexadecimal digits.
+    pub fn digest(data: &[u8]) -> String {
+        format!("{:x}", md5::compute(data))
+    }
+
+    /// The checksum of everything read from `content`, as a string of 32 lowercase hexadecimal
+    /// digits.
+    pub fn digest_reader<R: Read>(content: &mut R) -> io::Result<String> {
+        let mut md5 = Md5::new();
+        let mut buff = vec![0; 64 * 1024];
+        loop {
+            match content.read(&mut buff)? {
+                0 => return Ok(md5.finish()),
+                read => md5.update(&buff[..read]),
+            }
+        }
+    }
+
+    /// The number of bytes hashed so far.
+    pub fn len(&self) -> u64 {
+        self.len
+    }
+
+    /// Appends `data` to the hashed content.
+    pub fn update(&mut self, data: &[u8]) {
+        self.len += data.len() as u64;
+        self.context.consume(data);
+    }
+
+    /// The checksum of the hashed content, as a string of 32 lowercase hexadecimal digits.
+    pub fn finish(self) -> String {
+        format!("{:x}", self.context.compute())
+    }
+
+    /// Whether `checksum` looks like an MD5 checksum, as opposed to e.g. a modification time.
+    pub fn is_checksum(checksum: &str) -> bool {
+        checksum.len() == 32 && checksum.bytes().all(|b| b.is_ascii_hexdigit())
+    }
+}
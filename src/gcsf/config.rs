@@ -1,3 +1,5 @@
+use super::change_poller::Webhook;
+use std::cmp;
 use std::path::{Path, PathBuf};
 use std::time::Duration;
 
@@ -11,12 +13,60 @@ pub struct Config {
     pub mount_check: Option<bool>,
     /// How long to cache the contents of a file after it has been accessed.
     pub cache_max_seconds: Option<u64>,
-    /// How how many files to cache.
-    pub cache_max_items: Option<u64>,
+    /// How many bytes of file content to cache.
+    pub cache_max_bytes: Option<u64>,
+    /// How many bytes to download at once when reading a file.
+    pub read_chunk_size: Option<u64>,
+    /// How many chunks to prefetch at most while a file is being read sequentially.
+    pub read_ahead_chunks: Option<u64>,
+    /// How many threads download prefetched chunks.
+    pub prefetch_workers: Option<usize>,
+    /// How many threads serve reads.
+    pub io_workers: Option<usize>,
+    /// How many threads upload flushed files.
+    pub upload_workers: Option<usize>,
+    /// How many HTTPS connections to Drive may be in use at the same time.
+    pub max_connections: Option<usize>,
+    /// How many requests per second to send to Drive at most, on average.
+    pub requests_per_second: Option<f64>,
+    /// How many bytes written to a file to keep in memory before spooling them to disk.
+    pub write_buffer_max_bytes: Option<u64>,
+    /// How many bytes of a file to upload at once.
+    pub upload_chunk_size: Option<u64>,
+    /// Whether to upload written files in the background, after they have been closed.
+    pub write_back: Option<bool>,
+    /// Whether to also cache file contents on disk, so that they survive remounts.
+    pub disk_cache: Option<bool>,
+    /// How many bytes of file content to cache on disk.
+    pub disk_cache_max_bytes: Option<u64>,
     /// How long to cache the size and capacity of the file system.
     pub cache_statfs_seconds: Option<u64>,
+    /// How long the kernel may cache the result of a successful lookup.
+    pub entry_ttl_seconds: Option<u64>,
+    /// How long the kernel may cache the attributes of a file.
+    pub attr_ttl_seconds: Option<u64>,
+    /// How long the kernel may cache the absence of a file.
+    pub negative_ttl_seconds: Option<u64>,
     /// How many seconds to wait before checking for remote changes and updating them locally.
     pub sync_interval: Option<u64>,
+    /// Whether to poll for remote changes on a background thread.
+    pub background_sync: Option<bool>,
+    /// The public HTTPS address which Drive sends change notifications to.
+    pub changes_webhook_address: Option<String>,
+    /// The local address on which to receive change notifications.
+    pub changes_webhook_listen: Option<String>,
+    /// Into how many partitions to split the listing of all files, each listed concurrently.
+    pub listing_partitions: Option<usize>,
+    /// Whether to list each directory the first time it is needed, instead of all files on mount.
+    pub lazy_loading: Option<bool>,
+    /// Whether to store the file tree on disk, so that it does not have to be listed on mount.
+    pub metadata_snapshot: Option<bool>,
+    /// How many seconds to wait between two snapshots of the file tree.
+    pub snapshot_interval: Option<u64>,
+    /// The address under which the Drive API is served.
+    pub api_root_url: Option<String>,
+    /// The local address on which to serve metrics.
+    pub metrics_listen: Option<String>,
     /// Mount options.
     pub mount_options: Option<Vec<String>>,
     /// Config directory (see XDG_CONFIG_HOME).
@@ -51,9 +101,88 @@ impl Config {
         Duration::from_secs(self.cache_max_seconds.unwrap_or(10))
     }
 
-    /// How how many files to cache.
-    pub fn cache_max_items(&self) -> u64 {
-        self.cache_max_items.unwrap_or(10)
+    /// How many bytes of file content to keep in memory. Files are cached in chunks of
+    /// `read_chunk_size` bytes, and the least recently used chunks are evicted first.
+    pub fn cache_max_bytes(&self) -> u64 {
+        self.cache_max_bytes.unwrap_or(256 * 1024 * 1024)
+    }
+
+    /// How many bytes to download at once when reading a file. Reads are aligned to multiples of
+    /// this value, so reading a few bytes from a large file only downloads a single chunk.
+    pub fn read_chunk_size(&self) -> u64 {
+        cmp::max(1, self.read_chunk_size.unwrap_or(1024 * 1024))
+    }
+
+    /// How many chunks to download ahead of a reader which reads a file sequentially. The
+    /// read-ahead window grows up to this value while the reads stay sequential. Zero disables
+    /// prefetching.
+    pub fn read_ahead_chunks(&self) -> u64 {
+        self.read_ahead_chunks.unwrap_or(8)
+    }
+
+    /// How many threads download prefetched chunks in the background.
+    pub fn prefetch_workers(&self) -> usize {
+        self.prefetch_workers.unwrap_or(4)
+    }
+
+    /// How many threads serve reads in the background. Requests which only need the local file
+    /// tree are answered right away, even while these workers wait for Drive.
+    pub fn io_workers(&self) -> usize {
+        self.io_workers.unwrap_or(8)
+    }
+
+    /// How many threads upload flushed files in the background. Uploads have threads of their
+    /// own, so that reads never wait behind a long upload of another file.
+    pub fn upload_workers(&self) -> usize {
+        self.upload_workers.unwrap_or(4)
+    }
+
+    /// How many HTTPS connections to Drive may be in use at the same time, across all threads.
+    /// Connections are kept alive once released and reused by later requests.
+    pub fn max_connections(&self) -> usize {
+        cmp::max(1, self.max_connections.unwrap_or(16))
+    }
+
+    /// How many requests per second are sent to Drive at most, on average, so as to stay within
+    /// the quota of the API project. Zero means no limit.
+    pub fn requests_per_second(&self) -> f64 {
+        self.requests_per_second.unwrap_or(50.0).max(0.0)
+    }
+
+    /// How many bytes written to a file are kept in memory until the file is flushed. Beyond
+    /// this, the written data is moved to a spool file in `spool_dir()`.
+    pub fn write_buffer_max_bytes(&self) -> u64 {
+        self.write_buffer_max_bytes.unwrap_or(64 * 1024 * 1024)
+    }
+
+    /// How many bytes of a file are sent to Drive in one request of an upload. Drive acknowledges
+    /// every chunk, so an interrupted upload resumes after the last chunk it received. The size
+    /// is rounded up to a multiple of 256 KiB, as Drive requires.
+    pub fn upload_chunk_size(&self) -> u64 {
+        const GRANULARITY: u64 = 256 * 1024;
+        let size = cmp::max(1, self.upload_chunk_size.unwrap_or(8 * 1024 * 1024));
+        (size + GRANULARITY - 1) / GRANULARITY * GRANULARITY
+    }
+
+    /// Whether closing a written file returns right away, leaving the upload to the upload
+    /// workers. Queued uploads are recorded in `upload_journal_dir()`, so that those which have
+    /// not finished by the time the file system stops are resumed when it is mounted again. Closing
+    /// then succeeds before the upload has run, so a failed upload only shows up in the log. If
+    /// false (the default), closing a written file waits for its upload and reports whether it
+    /// failed.
+    pub fn write_back(&self) -> bool {
+        self.write_back.unwrap_or(false)
+    }
+
+    /// Whether to also cache file contents on disk, in `cache_dir()`. Cached content survives
+    /// remounts and is served for as long as the file does not change on Drive.
+    pub fn disk_cache(&self) -> bool {
+        self.disk_cache.unwrap_or(false)
+    }
+
+    /// How many bytes of file content to cache on disk.
+    pub fn disk_cache_max_bytes(&self) -> u64 {
+        self.disk_cache_max_bytes.unwrap_or(1024 * 1024 * 1024)
     }
 
     /// How long to cache the size and capacity of the filesystem. These are the values reported by `df`.
@@ -61,11 +190,95 @@ impl Config {
         Duration::from_secs(self.cache_statfs_seconds.unwrap_or(100))
     }
 
+    /// How long the kernel may cache the result of a successful lookup, during which the
+    /// result is not asked for again. There is no way to take it back earlier, so remote changes
+    /// to the names of files may take this long to show up.
+    pub fn entry_ttl(&self) -> Duration {
+        Duration::from_secs(self.entry_ttl_seconds.unwrap_or(10))
+    }
+
+    /// How long the kernel may cache the attributes (size, times, ...) of a file. Like for
+    /// `entry_ttl()`, remote changes may take this long to show up.
+    pub fn attr_ttl(&self) -> Duration {
+        Duration::from_secs(self.attr_ttl_seconds.unwrap_or(10))
+    }
+
+    /// How long the kernel may remember that a name does not exist in a directory. Probes for
+    /// missing files (`.git`, `__pycache__`, ...) are then answered by the kernel itself. Files
+    /// created on Drive under such a name may take this long to show up; zero disables caching.
+    pub fn negative_ttl(&self) -> Duration {
+        Duration::from_secs(self.negative_ttl_seconds.unwrap_or(10))
+    }
+
     /// How many seconds to wait before checking for remote changes and updating them locally.
     pub fn sync_interval(&self) -> Duration {
         Duration::from_secs(self.sync_interval.unwrap_or(10))
     }
 
+    /// Whether to poll for remote changes on a background thread every `sync_interval()`. If
+    /// disabled, changes are retrieved while listing a directory, once `sync_interval()` has
+    /// passed since the last time.
+    pub fn background_sync(&self) -> bool {
+        self.background_sync.unwrap_or(true)
+    }
+
+    /// Where Drive should push change notifications, if both the public address and the local
+    /// address to listen on are set. Only used with `background_sync()`.
+    pub fn changes_webhook(&self) -> Option<Webhook> {
+        match (&self.changes_webhook_address, &self.changes_webhook_listen) {
+            (&Some(ref address), &Some(ref listen)) => Some(Webhook {
+                address: address.clone(),
+                listen: listen.clone(),
+            }),
+            _ => None,
+        }
+    }
+
+    /// Into how many partitions to split the listing of all files when mounting without a
+    /// snapshot. Partitions are listed concurrently, each over its own connection.
+    pub fn listing_partitions(&self) -> usize {
+        cmp::max(1, self.listing_partitions.unwrap_or(1))
+    }
+
+    /// Whether to list the children of each directory the first time it is looked into, instead
+    /// of listing every file when mounting. Mounting then takes the same time whatever the size
+    /// of the account, and only the directories which are used are held in memory.
+    pub fn lazy_loading(&self) -> bool {
+        self.lazy_loading.unwrap_or(false)
+    }
+
+    /// Whether to store the file tree in `snapshot_file()` on unmount and every
+    /// `snapshot_interval()`. The next mount loads it and only asks Drive for the changes since,
+    /// instead of listing every file.
+    pub fn metadata_snapshot(&self) -> bool {
+        self.metadata_snapshot.unwrap_or(true)
+    }
+
+    /// How much time to wait between two snapshots of the file tree.
+    pub fn snapshot_interval(&self) -> Duration {
+        Duration::from_secs(self.snapshot_interval.unwrap_or(300))
+    }
+
+    /// The address under which the Drive API is served, ending with a slash. Every request goes
+    /// to a path below it, e.g. `drive/v3/files`. Only worth changing in order to mount against
+    /// a local stand-in for Drive, such as the server of the end-to-end benchmark.
+    pub fn api_root_url(&self) -> String {
+        let mut url = self
+            .api_root_url
+            .clone()
+            .unwrap_or_else(|| String::from("https://www.googleapis.com/"));
+        if !url.ends_with('/') {
+            url.push('/');
+        }
+        url
+    }
+
+    /// The local address on which to serve metrics in the Prometheus text format, on
+    /// `/metrics`. Metrics are not served unless it is set.
+    pub fn metrics_listen(&self) -> Option<String> {
+        self.metrics_listen.clone()
+    }
+
     /// A list of mount options.
     pub fn mount_options(&self) -> Vec<String> {
         match self.mount_options {
@@ -84,6 +297,46 @@ impl Config {
         Path::new(self.config_dir.as_ref().unwrap()).join(Path::new(self.session_name()))
     }
 
+    /// The path to the directory which holds the disk cache of the current session.
+    pub fn cache_dir(&self) -> PathBuf {
+        self.config_dir()
+            .join(Path::new("cache"))
+            .join(Path::new(self.session_name()))
+    }
+
+    /// The path to the directory which holds the spool files of the current session.
+    pub fn spool_dir(&self) -> PathBuf {
+        self.config_dir()
+            .join(Path::new("spool"))
+            .join(Path::new(self.session_name()))
+    }
+
+    /// The path to the directory which holds the queued uploads of the current session.
+    pub fn upload_journal_dir(&self) -> PathBuf {
+        self.config_dir()
+            .join(Path::new("uploads"))
+            .join(Path::new(self.session_name()))
+    }
+
+    /// The path to the file which holds the snapshot of the file tree of the current session.
+    pub fn snapshot_file(&self) -> PathBuf {
+        self.config_dir()
+            .join(Path::new("snapshot"))
+            .join(Path::new(self.session_name()))
+    }
+
+    /// The files and directories which hold the local state of the current session, besides its
+    /// token file: the disk cache, the spool files, the queued uploads and the snapshot. They
+    /// belong to the account the session is logged into, so they are removed on logout.
+    pub fn session_data_paths(&self) -> Vec<PathBuf> {
+        vec![
+            self.cache_dir(),
+            self.spool_dir(),
+            self.upload_journal_dir(),
+            self.snapshot_file(),
+        ]
+    }
+
     /// The path to the config dir.
     pub fn config_dir(&self) -> &PathBuf {
         self.config_dir.as_ref().unwrap()
@@ -100,7 +353,6 @@ impl Config {
     }
 
     /// If set to true, all files with identical name will get an increasing number attached to the suffix.
-    /// The mount-time also rises dramatically with higher file counts. Not recommended.
     pub fn rename_identical_files(&self) -> bool {
         self.rename_identical_files.unwrap_or(false)
     }
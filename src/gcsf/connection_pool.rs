@@ -0,0 +1,200 @@
+use super::metrics::ExchangeTracker;
+use super::scheduler;
+use super::scheduler::{Outcome, Permit, Scheduler};
+use failure::Error;
+use hyper;
+use hyper::client::pool::{Config as PoolConfig, Pool};
+use hyper::http::h1::Http11Protocol;
+use hyper::net::{HttpsConnector, NetworkConnector, NetworkStream};
+use hyper_native_tls::NativeTlsClient;
+use std::cmp;
+use std::io;
+use std::io::{Read, Write};
+use std::net::{Shutdown, SocketAddr};
+use std::str;
+use std::sync::Arc;
+use std::time::Duration;
+
+/// How many bytes at the start of a response are inspected for what Drive answered.
+const INSPECTED_BYTES: usize = 4096;
+
+/// A set of persistent HTTPS connections to Drive, shared by all the clients created from it.
+///
+/// Every hub, downloader and background thread used to own a `hyper::Client` with a pool of its
+/// own, so a connection (and its TLS handshake) could only be reused by the thread which opened
+/// it. Clients created by `client()` share a single pool instead: a connection released by one
+/// thread is kept alive and picked up by the next request from any thread. All these clients
+/// are authorized by the same `GcAuthenticator`, whose token requests use the pool as well.
+/// Cloning a `ConnectionPool` is cheap.
+///
+/// Every request is admitted by a `Scheduler` before it gets a connection, according to the
+/// priority of the thread sending it. The start of every response is inspected, so that the
+/// scheduler backs off whenever Drive asks to slow down, whichever client sent the request.
+#[derive(Clone)]
+pub struct ConnectionPool {
+    connector: ScheduledConnector<Pool<HttpsConnector<NativeTlsClient>>>,
+}
+
+impl ConnectionPool {
+    /// Creates a pool which keeps up to `max_connections` connections open (at least one), and
+    /// sends no more than `requests_per_second` requests per second on average (zero meaning no
+    /// limit).
+    pub fn new(max_connections: usize, requests_per_second: f64) -> Result<Self, Error> {
+        let max_connections = cmp::max(1, max_connections);
+        let pool = Pool::with_connector(
+            PoolConfig {
+                max_idle: max_connections,
+            },
+            HttpsConnector::new(NativeTlsClient::new()?),
+        );
+
+        Ok(ConnectionPool {
+            connector: ScheduledConnector {
+                connector: Arc::new(pool),
+                scheduler: Arc::new(Scheduler::new(max_connections, requests_per_second)),
+            },
+        })
+    }
+
+    /// Creates an HTTPS client which sends its requests through the pool.
+    pub fn client(&self) -> hyper::Client {
+        hyper::Client::with_protocol(Http11Protocol::with_connector(self.connector.clone()))
+    }
+}
+
+/// Opens connections through a shared connector, once the scheduler admits the request.
+struct ScheduledConnector<C> {
+    connector: Arc<C>,
+    scheduler: Arc<Scheduler>,
+}
+
+impl<C> Clone for ScheduledConnector<C> {
+    fn clone(&self) -> Self {
+        ScheduledConnector {
+            connector: Arc::clone(&self.connector),
+            scheduler: Arc::clone(&self.scheduler),
+        }
+    }
+}
+
+impl<C, S> NetworkConnector for ScheduledConnector<C>
+where
+    C: NetworkConnector<Stream = S>,
+    S: NetworkStream + Send,
+{
+    type Stream = ScheduledStream<S>;
+
+    fn connect(&self, host: &str, port: u16, scheme: &str) -> hyper::Result<ScheduledStream<S>> {
+        // hyper asks for a connection for every request, even if it then reuses a pooled one.
+        let permit = Scheduler::admit(&self.scheduler, scheduler::priority());
+        Ok(ScheduledStream {
+            stream: self.connector.connect(host, port, scheme)?,
+            permit,
+            inspected: 0,
+            status: None,
+            throttled: false,
+            tracker: ExchangeTracker::new(),
+        })
+    }
+}
+
+/// The connection of a single request. Its slot in the scheduler is held until it is dropped;
+/// the underlying pooled connection is then returned to the pool. The request is recorded in the
+/// metrics at the same time.
+struct ScheduledStream<S> {
+    stream: S,
+    permit: Permit,
+
+    /// How many bytes of the response have been inspected.
+    inspected: usize,
+
+    /// The status of the response, once known.
+    status: Option<u16>,
+
+    /// Whether Drive asked to slow down.
+    throttled: bool,
+
+    tracker: ExchangeTracker,
+}
+
+impl<S> ScheduledStream<S> {
+    /// Looks at the start of the response for what Drive answered, and reports it to the
+    /// scheduler.
+    fn inspect(&mut self, data: &[u8]) {
+        if self.status.is_none() {
+            // The status line comes first, e.g. "HTTP/1.1 429 Too Many Requests".
+            self.status = str::from_utf8(&data[..cmp::min(data.len(), 16)])
+                .ok()
+                .filter(|line| line.starts_with("HTTP/"))
+                .and_then(|line| line.split_whitespace().nth(1))
+                .and_then(|code| code.parse().ok());
+        }
+        self.inspected += data.len();
+
+        let outcome = match self.status {
+            // A 403 only asks to slow down if its body gives a rate limit as the reason
+            // ("userRateLimitExceeded", "rateLimitExceeded"). Keep looking until it does.
+            Some(403) if String::from_utf8_lossy(data).contains("ateLimitExceeded") => {
+                Outcome::Throttled
+            }
+            Some(403) => return,
+            Some(status) if scheduler::is_throttling(status, false) => Outcome::Throttled,
+            Some(_) => Outcome::Accepted,
+            None => {
+                self.inspected = INSPECTED_BYTES;
+                return;
+            }
+        };
+
+        self.throttled = outcome == Outcome::Throttled;
+        self.permit.scheduler().report(outcome);
+        self.inspected = INSPECTED_BYTES;
+    }
+}
+
+impl<S> Drop for ScheduledStream<S> {
+    fn drop(&mut self) {
+        self.tracker.finish(self.status, self.throttled);
+    }
+}
+
+impl<S: NetworkStream> Read for ScheduledStream<S> {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        let read = self.stream.read(buf)?;
+        self.tracker.received(read);
+        if self.inspected < INSPECTED_BYTES && read > 0 {
+            self.inspect(&buf[..read]);
+        }
+        Ok(read)
+    }
+}
+
+impl<S: NetworkStream> Write for ScheduledStream<S> {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        let written = self.stream.write(buf)?;
+        self.tracker.sent(&buf[..written]);
+        Ok(written)
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        self.stream.flush()
+    }
+}
+
+impl<S: NetworkStream> NetworkStream for ScheduledStream<S> {
+    fn peer_addr(&mut self) -> io::Result<SocketAddr> {
+        self.stream.peer_addr()
+    }
+
+    fn set_read_timeout(&self, dur: Option<Duration>) -> io::Result<()> {
+        self.stream.set_read_timeout(dur)
+    }
+
+    fn set_write_timeout(&self, dur: Option<Duration>) -> io::Result<()> {
+        self.stream.set_write_timeout(dur)
+    }
+
+    fn close(&mut self, how: Shutdown) -> io::Result<()> {
+        self.stream.close(how)
+    }
+}
@@ -0,0 +1,678 @@
+use super::checksum::Md5;
+use super::drive_facade::GcDrive;
+use super::metrics;
+use super::metrics::CacheLookup;
+use super::prefetcher::{ChunkStore, Downloader};
+use super::scheduler::RetryDelegate;
+use super::upload_journal::{UploadJournal, UploadSession};
+use super::{Chunk, WriteBuffer};
+use drive3;
+use failure::{err_msg, Error};
+use hyper::client::Response;
+use mime_sniffer::MimeTypeSniffer;
+use std::cmp;
+use std::collections::{HashMap, HashSet};
+use std::io;
+use std::io::{Read, Seek, SeekFrom};
+use std::sync::Arc;
+
+type DriveIdRef<'a> = &'a str;
+
+/// How many bytes from the start of a file are used for guessing its MIME type.
+const SNIFF_LENGTH: u64 = 1024;
+
+/// How many times an upload is attempted, as long as Drive keeps its upload session open.
+const UPLOAD_ATTEMPTS: u32 = 5;
+
+lazy_static! {
+    static ref MIME_TYPES: HashMap<&'static str, &'static str> = hashmap! {
+        "application/vnd.google-apps.document" => "application/vnd.oasis.opendocument.text",
+        "application/vnd.google-apps.presentation" => "application/vnd.oasis.opendocument.presentation",
+        "application/vnd.google-apps.spreadsheet" => "application/vnd.oasis.opendocument.spreadsheet",
+        "application/vnd.google-apps.drawing" => "image/png",
+        "application/vnd.google-apps.site" => "text/plain",
+    };
+}
+
+lazy_static! {
+    static ref UNEXPORTABLE_MIME_TYPES: HashSet<&'static str> = hashset! {
+        "application/vnd.google-apps.form",
+        "application/vnd.google-apps.map",
+    };
+}
+
+/// Transfers the content of Drive files. Unlike the `DriveFacade`, which owns the file tree and
+/// the pending writes, a `ContentClient` only shares the content caches with others, so several
+/// of them can serve reads and flushes in parallel, each on its own worker thread.
+pub struct ContentClient {
+    /// The `drive3::Drive` hub used by this client alone.
+    hub: GcDrive,
+
+    /// Used for downloads restricted to a byte range, which `drive3` can not express.
+    downloader: Downloader,
+
+    /// The content caches, shared with the `DriveFacade`, the prefetch workers and the other
+    /// clients.
+    store: Arc<ChunkStore>,
+
+    /// The size of a chunk. Reads are aligned to multiples of this value and only the chunks
+    /// which overlap the requested range are downloaded.
+    chunk_size: u64,
+
+    /// How many bytes are sent in one request of an upload.
+    upload_chunk_size: u64,
+}
+
+impl ContentClient {
+    /// Creates a client which talks to Drive through `hub` and `downloader`, caches chunks of
+    /// `chunk_size` bytes in `store` and uploads `upload_chunk_size` bytes per request.
+    pub fn new(
+        hub: GcDrive,
+        downloader: Downloader,
+        store: Arc<ChunkStore>,
+        chunk_size: u64,
+        upload_chunk_size: u64,
+    ) -> Self {
+        ContentClient {
+            hub,
+            downloader,
+            store,
+            chunk_size,
+            upload_chunk_size,
+        }
+    }
+
+    /// Will still detect a file even if it is in Trash.
+    pub fn contains(&self, id: DriveIdRef) -> Result<bool, Error> {
+        let mut delegate = RetryDelegate::default();
+        let response = self
+            .hub
+            .files()
+            .get(&id)
+            .add_scope(drive3::Scope::Full)
+            .delegate(&mut delegate)
+            .doit();
+
+        match response {
+            Ok((_, file)) => Ok(file.id == Some(id.to_string())),
+            Err(_) if delegate.not_found() => Ok(false),
+            Err(e) => Err(err_msg(format!("{:#?}", e))),
+        }
+    }
+
+    /// Retrieves the metadata of a Drive file.
+    pub fn get_file_metadata(&self, id: DriveIdRef) -> Result<drive3::File, Error> {
+        self.hub
+            .files()
+            .get(id)
+            .param("fields", "id,name,parents,mimeType,webContentLink")
+            .add_scope(drive3::Scope::Full)
+            .delegate(&mut RetryDelegate::default())
+            .doit()
+            .map(|(_response, file)| file)
+            .map_err(|e| err_msg(format!("{:#?}", e)))
+    }
+
+    /// Retrieves the MD5 checksum of the content of a Drive file. Google documents have none.
+    pub fn get_checksum(&self, id: DriveIdRef) -> Result<Option<String>, Error> {
+        self.hub
+            .files()
+            .get(id)
+            .param("fields", "md5Checksum")
+            .add_scope(drive3::Scope::Full)
+            .delegate(&mut RetryDelegate::default())
+            .doit()
+            .map(|(_response, file)| file.md5_checksum)
+            .map_err(|e| err_msg(format!("{:#?}", e)))
+    }
+
+    /// Retrieves the length of the content of a Drive file. Files which must be exported have no
+    /// such length.
+    pub fn get_size(&self, id: DriveIdRef) -> Result<Option<u64>, Error> {
+        self.hub
+            .files()
+            .get(id)
+            .param("fields", "size")
+            .add_scope(drive3::Scope::Full)
+            .delegate(&mut RetryDelegate::default())
+            .doit()
+            .map(|(_response, file)| file.size.and_then(|size| size.parse().ok()))
+            .map_err(|e| err_msg(format!("{:#?}", e)))
+    }
+
+    /// Retrieves the content of a Drive file. If `mime_type` is specified, this method will
+    /// attempt to export the file in some appropriate format rather than just download it as is.
+    /// This is the only way of retrieving Docs, Sheets, Slides, Sites and Drawings.
+    pub fn get_file_content(
+        &self,
+        drive_id: &str,
+        mime_type: Option<String>,
+    ) -> Result<Vec<u8>, Error> {
+        if let Some(mime) = mime_type.clone() {
+            if UNEXPORTABLE_MIME_TYPES.contains::<str>(&mime) {
+                return Ok(format!(
+                    "UNEXPORTABLE_FILE: The MIME type of this \
+                     file is {:?}, which can not be exported from Drive. Web \
+                     content link provided by Drive: {:?}\n",
+                    mime,
+                    self.get_file_metadata(drive_id)
+                        .ok()
+                        .map(|metadata| metadata.web_view_link)
+                        .unwrap_or_default()
+                )
+                .as_bytes()
+                .to_vec());
+            }
+        }
+
+        let export_type: Option<&'static str> = mime_type
+            .and_then(|ref t| MIME_TYPES.get::<str>(&t))
+            .cloned();
+
+        let mut response = match export_type {
+            Some(t) => {
+                let response = self
+                    .hub
+                    .files()
+                    .export(drive_id, &t)
+                    .add_scope(drive3::Scope::Full)
+                    .delegate(&mut RetryDelegate::default())
+                    .doit()
+                    .map_err(|e| err_msg(format!("{:#?}", e)))?;
+
+                debug!("response: {:?}", &response);
+                response
+            }
+            None => self.download(drive_id)?,
+        };
+
+        // A broken off download fails, rather than being cached and sized as the whole content.
+        let mut content: Vec<u8> = Vec::new();
+        response.read_to_end(&mut content)?;
+
+        Ok(content)
+    }
+
+    /// Starts downloading the content of a Drive file as is. The content is streamed from the
+    /// returned response.
+    fn download(&self, drive_id: DriveIdRef) -> Result<Response, Error> {
+        let (response, _empty_file) = self
+            .hub
+            .files()
+            .get(&drive_id)
+            .supports_team_drives(false)
+            .param("alt", "media")
+            .add_scope(drive3::Scope::Full)
+            .delegate(&mut RetryDelegate::default())
+            .doit()
+            .map_err(|e| err_msg(format!("{:#?}", e)))?;
+        Ok(response)
+    }
+
+    /// Returns a chunk of a Drive file, stored under `key` (see `ChunkStore::content_key()`).
+    /// Prefers the memory cache, then the disk cache (if the version of the file is known) and
+    /// downloads the chunk from Drive as a last resort. If the chunk is already being downloaded
+    /// by another thread, waits for it instead.
+    fn fetch_chunk(
+        &mut self,
+        drive_id: DriveIdRef,
+        key: &str,
+        mime_type: &Option<String>,
+        version: Option<&str>,
+        index: u64,
+    ) -> Result<Chunk, Error> {
+        loop {
+            if let Some(chunk) = self.store.get(key, index) {
+                metrics::record_cache(CacheLookup::Memory);
+                return Ok(chunk);
+            }
+            if self.store.begin_download(key, drive_id, index) {
+                break;
+            }
+            self.store.wait_for_download(key, index);
+        }
+
+        let chunk = match self.store.get_from_disk(key, version, index) {
+            Some(chunk) => {
+                metrics::record_cache(CacheLookup::Disk);
+                Ok(chunk)
+            }
+            None => {
+                metrics::record_cache(CacheLookup::Miss);
+                self.download_chunks(drive_id, key, mime_type, version, index)
+            }
+        };
+
+        match chunk {
+            Ok(chunk) => {
+                self.store
+                    .end_download(key, version, index, Some(chunk.clone()));
+                Ok(chunk)
+            }
+            Err(e) => {
+                self.store.end_download(key, version, index, None);
+                Err(e)
+            }
+        }
+    }
+
+    /// Downloads a chunk of a Drive file. Files which must be exported are retrieved in full and
+    /// split into chunks, since Drive can not export only a part of a file. In that case the
+    /// other chunks, which share the downloaded buffer, are cached right away and only the
+    /// requested one is returned.
+    fn download_chunks(
+        &mut self,
+        drive_id: DriveIdRef,
+        key: &str,
+        mime_type: &Option<String>,
+        version: Option<&str>,
+        index: u64,
+    ) -> Result<Chunk, Error> {
+        if !Self::must_be_exported(mime_type) {
+            let start = index * self.chunk_size;
+            return self
+                .downloader
+                .get_range(drive_id, start, start + self.chunk_size - 1)
+                .map(Chunk::from);
+        }
+
+        let content = Chunk::from(self.get_file_content(drive_id, mime_type.clone())?);
+        self.store
+            .set_length(drive_id, version, content.len() as u64);
+        let chunk_size = self.chunk_size as usize;
+        let chunk_count = (content.len() + chunk_size - 1) / chunk_size;
+        for i in (0..chunk_count).filter(|&i| i as u64 != index) {
+            let chunk = content.slice(i * chunk_size, (i + 1) * chunk_size);
+            self.store.insert(key, version, i as u64, chunk);
+        }
+
+        // The requested chunk is inserted last, by the caller, so that it is the one kept if the
+        // cache is too small for the whole export.
+        let start = index as usize * chunk_size;
+        Ok(content.slice(start, start + chunk_size))
+    }
+
+    /// Whether the content of a file with the given MIME type can only be retrieved by exporting
+    /// it.
+    pub fn must_be_exported(mime_type: &Option<String>) -> bool {
+        mime_type.as_ref().map_or(false, |t| {
+            MIME_TYPES.contains_key::<str>(t) || UNEXPORTABLE_MIME_TYPES.contains::<str>(t)
+        })
+    }
+
+    /// The version under which the content of a file is cached, given the `version` of the file
+    /// (see `File::content_version()`). The content of an exported file also depends on the
+    /// format it is exported to, which is therefore part of its version.
+    pub fn cache_version(mime_type: &Option<String>, version: Option<&str>) -> Option<String> {
+        let export_type = mime_type.as_ref().and_then(|t| MIME_TYPES.get::<str>(t));
+        match (version, export_type) {
+            (Some(version), Some(export_type)) => Some(format!("{} {}", version, export_type)),
+            (version, _) => version.map(str::to_string),
+        }
+    }
+
+    /// Reads the contents of a Drive file starting at a certain offset.
+    /// Only the chunks which overlap the requested range are read. Prefers reading them from
+    /// cache if possible, otherwise fetches them from Drive. The `version` of the file (see
+    /// `File::content_version()`) allows chunks to be served from the disk cache.
+    pub fn read(
+        &mut self,
+        drive_id: DriveIdRef,
+        mime_type: &Option<String>,
+        version: Option<&str>,
+        offset: usize,
+        size: usize,
+    ) -> Result<Chunk, Error> {
+        if size == 0 {
+            return Ok(Chunk::from(Vec::new()));
+        }
+        let version = Self::cache_version(mime_type, version);
+        let version = version.as_ref().map(String::as_str);
+        let key = ChunkStore::content_key(drive_id, version);
+
+        let (offset, size) = (offset as u64, size as u64);
+        let first_chunk = offset / self.chunk_size;
+        let last_chunk = (offset + size - 1) / self.chunk_size;
+
+        let mut parts = Vec::new();
+        for index in first_chunk..=last_chunk {
+            let chunk = self.fetch_chunk(drive_id, &key, mime_type, version, index)?;
+
+            let chunk_start = index * self.chunk_size;
+            let from = offset.saturating_sub(chunk_start);
+            let to = offset + size - chunk_start;
+            parts.push(chunk.slice(from as usize, to as usize));
+
+            // A short chunk marks the end of the file.
+            if (chunk.len() as u64) < self.chunk_size {
+                break;
+            }
+        }
+
+        // Reads which fall within a single chunk, the common case, are served without copying.
+        if parts.len() == 1 {
+            return Ok(parts.remove(0));
+        }
+
+        let mut buff = Vec::with_capacity(size as usize);
+        for part in &parts {
+            buff.extend_from_slice(part);
+        }
+        Ok(Chunk::from(buff))
+    }
+
+    /// Applies the buffered writes on the content of a file and uploads the result. Similar to
+    /// flushing a stream. Unless the new content is entirely known and held in memory, it is
+    /// assembled in the spool file of the buffer, with the original content streamed in from
+    /// Drive, so that large files never have to fit in memory.
+    ///
+    /// If the upload is recorded in a journal (as `entry`), the upload session opened by Drive is
+    /// stored along with it, so that an upload resumed after a restart continues where it
+    /// stopped.
+    ///
+    /// Content which keeps the length of the content on Drive may well be unchanged, e.g. when a
+    /// file is saved again without being edited. Its MD5 checksum is then compared with the one
+    /// on Drive and nothing is uploaded if they match.
+    pub fn flush(
+        &mut self,
+        id: DriveIdRef,
+        mut buffer: WriteBuffer,
+        entry: Option<(&UploadJournal, usize)>,
+    ) -> Result<(), Error> {
+        // The listed length may be outdated by another client, so it is checked before the
+        // download of the original content is skipped on its account.
+        if buffer.may_skip_base() {
+            if let Some(len) = self.get_size(id)? {
+                buffer.confirm_base_len(len);
+            }
+        }
+
+        let same_len = buffer
+            .base_len()
+            .map_or(false, |len| buffer.len(len) == len);
+        let checksum = if same_len { buffer.checksum() } else { None };
+
+        // The original content is only downloaded if some of it survives the buffered writes.
+        // Otherwise, the upload itself fails if the file no longer exists.
+        let needs_base = buffer.needs_base();
+        if !needs_base {
+            debug!("flush({}): content is fully known locally", id);
+        } else if let Ok(false) = self.contains(id) {
+            return Err(err_msg(format!(
+                "flush({}): file doesn't exist on drive!",
+                id
+            )));
+        }
+
+        if buffer.is_spooled() || needs_base {
+            let mut file = if needs_base {
+                // Without the original content, the bytes which were not written locally are
+                // unknown. The upload fails rather than replacing them with zeros; a journaled
+                // upload is then retried on the next mount.
+                let mut response = self.download(id).map_err(|e| {
+                    err_msg(format!(
+                        "flush({}): could not download the original content: {}",
+                        id, e
+                    ))
+                })?;
+                buffer.into_file(&mut response)?
+            } else {
+                buffer.into_file(&mut io::empty())?
+            };
+            let checksum = match checksum {
+                None if same_len => {
+                    let checksum = Md5::digest_reader(&mut file)?;
+                    file.seek(SeekFrom::Start(0))?;
+                    Some(checksum)
+                }
+                checksum => checksum,
+            };
+            if self.is_unchanged(id, checksum) {
+                return Ok(());
+            }
+            self.update_file_content(id, file, entry)?;
+        } else {
+            let mut file_data = Vec::new();
+            buffer.apply(&mut file_data)?;
+            let checksum = match checksum {
+                None if same_len => Some(Md5::digest(&file_data)),
+                checksum => checksum,
+            };
+            if self.is_unchanged(id, checksum) {
+                return Ok(());
+            }
+            self.update_file_content(id, DummyFile::new(file_data), entry)?;
+        }
+
+        // Chunks of the old content may have been cached while the upload was running.
+        self.store.remove_file(id);
+        Ok(())
+    }
+
+    /// Whether the content of a file on Drive has the given checksum, in which case it does not
+    /// have to be uploaded again. If the checksum on Drive can not be retrieved, the content is
+    /// considered changed.
+    fn is_unchanged(&self, id: DriveIdRef, checksum: Option<String>) -> bool {
+        let checksum = match checksum {
+            Some(checksum) => checksum,
+            None => return false,
+        };
+        match self.get_checksum(id) {
+            Ok(Some(ref remote)) if *remote == checksum => {
+                debug!("flush({}): content is unchanged, skipping the upload", id);
+                true
+            }
+            Ok(_) => false,
+            Err(e) => {
+                warn!("flush({}): could not retrieve the checksum: {}", id, e);
+                false
+            }
+        }
+    }
+
+    /// Updates the content of a file on Drive. The MIME type is guessed appropriately based on the
+    /// content. The content is sent in chunks of `upload_chunk_size` bytes, read from `content`
+    /// one at a time. If the upload breaks off, it is resumed after the last chunk which Drive
+    /// has received.
+    fn update_file_content<R: Read + Seek>(
+        &mut self,
+        id: DriveIdRef,
+        mut content: R,
+        entry: Option<(&UploadJournal, usize)>,
+    ) -> Result<(Response, drive3::File), Error> {
+        let mut head = Vec::with_capacity(SNIFF_LENGTH as usize);
+        content.by_ref().take(SNIFF_LENGTH).read_to_end(&mut head)?;
+        let len = content.seek(SeekFrom::End(0))?;
+
+        let mime_guess = head
+            .sniff_mime_type()
+            .unwrap_or("application/octet-stream")
+            .to_string();
+        debug!(
+            "Updating file content for {}. Mime type guess based on content: {}",
+            &id, &mime_guess
+        );
+
+        let file = drive3::File {
+            mime_type: Some(mime_guess.to_string()),
+            ..Default::default()
+        };
+
+        let mut delegate = UploadDelegate::new(id, len, self.upload_chunk_size, entry);
+        let mut attempt = 1;
+        loop {
+            content.seek(SeekFrom::Start(0))?;
+            let result = self
+                .hub
+                .files()
+                .update(file.clone(), id)
+                .add_scope(drive3::Scope::Full)
+                .delegate(&mut delegate)
+                .upload_resumable(&mut content, mime_guess.parse().unwrap());
+
+            match result {
+                Ok(result) => {
+                    delegate.store_session(None);
+                    return Ok(result);
+                }
+                // Drive forgets the upload session if it can not be resumed anymore.
+                Err(e) if delegate.session.is_some() && attempt < UPLOAD_ATTEMPTS => {
+                    attempt += 1;
+                    metrics::mark_retry();
+                    warn!(
+                        "Upload of {} was interrupted after {} of {} bytes, resuming: {:?}",
+                        id, delegate.sent, len, e
+                    );
+                }
+                Err(e) => return Err(err_msg(format!("{:#?}", e))),
+            }
+        }
+    }
+}
+
+/// Drives a resumable upload: hands the upload session which Drive opened for an earlier attempt
+/// to the next attempt, which then asks Drive how far the content got and sends the rest.
+struct UploadDelegate<'a> {
+    retry: RetryDelegate,
+    id: DriveIdRef<'a>,
+    len: u64,
+    chunk_size: u64,
+
+    /// The upload session opened by Drive, if any.
+    session: Option<String>,
+
+    /// Where the session is stored, so that it survives a restart.
+    entry: Option<(&'a UploadJournal, usize)>,
+
+    /// How many bytes have been sent, as of the start of the last chunk.
+    sent: u64,
+}
+
+impl<'a> UploadDelegate<'a> {
+    fn new(
+        id: DriveIdRef<'a>,
+        len: u64,
+        chunk_size: u64,
+        entry: Option<(&'a UploadJournal, usize)>,
+    ) -> Self {
+        // A session stored for content of another length belongs to another upload.
+        let session = entry
+            .and_then(|(journal, number)| journal.session(number))
+            .filter(|session| session.len == len)
+            .map(|session| session.url);
+        if session.is_some() {
+            info!("Resuming an earlier upload of {}", id);
+        }
+
+        metrics::add_upload_progress(len as i64, 0);
+        UploadDelegate {
+            retry: RetryDelegate::default(),
+            id,
+            len,
+            chunk_size,
+            session,
+            entry,
+            sent: 0,
+        }
+    }
+
+    fn store_session(&mut self, url: Option<&str>) {
+        self.session = url.map(String::from);
+        if let Some((journal, number)) = self.entry {
+            let session = url.map(|url| UploadSession {
+                url: url.to_string(),
+                len: self.len,
+            });
+            if let Err(e) = journal.set_session(number, session.as_ref()) {
+                warn!("Could not store the upload session of {}: {}", self.id, e);
+            }
+        }
+    }
+}
+
+impl<'a> drive3::Delegate for UploadDelegate<'a> {
+    fn http_failure(
+        &mut self,
+        response: &Response,
+        client_error: Option<drive3::JsonServerError>,
+        server_error: Option<drive3::ServerError>,
+    ) -> drive3::Retry {
+        self.retry
+            .http_failure(response, client_error, server_error)
+    }
+
+    fn upload_url(&mut self) -> Option<String> {
+        self.session.clone()
+    }
+
+    fn store_upload_url(&mut self, url: Option<&str>) {
+        self.store_session(url);
+    }
+
+    fn chunk_size(&mut self) -> u64 {
+        self.chunk_size
+    }
+
+    fn cancel_chunk_upload(&mut self, range: &drive3::ContentRange) -> bool {
+        if let Some(ref chunk) = range.range {
+            // Drive has acknowledged everything before the chunk which is about to be sent.
+            metrics::add_upload_progress(0, chunk.first as i64 - self.sent as i64);
+            self.sent = chunk.first;
+            debug!(
+                "Uploading bytes {}-{} of {} of {}",
+                chunk.first, chunk.last, range.total_length, self.id
+            );
+        }
+        false
+    }
+}
+
+impl<'a> Drop for UploadDelegate<'a> {
+    fn drop(&mut self) {
+        metrics::add_upload_progress(-(self.len as i64), -(self.sent as i64));
+    }
+}
+
+/// A virtual (in-memory) file which implements the Read + Seek traits. Can be constructed from a
+/// vector of bytes. Useful for uploading some file content to Drive without actually storing the
+/// file locally on disk.
+pub struct DummyFile {
+    cursor: u64,
+    data: Vec<u8>,
+}
+
+impl DummyFile {
+    /// Creates a virtual file holding `data`.
+    pub fn new(data: Vec<u8>) -> DummyFile {
+        DummyFile { cursor: 0, data }
+    }
+}
+
+impl Seek for DummyFile {
+    fn seek(&mut self, pos: SeekFrom) -> io::Result<u64> {
+        let position: i64 = match pos {
+            SeekFrom::Start(offset) => offset as i64,
+            SeekFrom::End(offset) => self.data.len() as i64 + offset,
+            SeekFrom::Current(offset) => self.cursor as i64 + offset,
+        };
+
+        if position < 0 {
+            Err(io::Error::from(io::ErrorKind::InvalidInput))
+        } else {
+            self.cursor = position as u64;
+            Ok(self.cursor)
+        }
+    }
+}
+
+impl Read for DummyFile {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        // The cursor may have been moved past the end.
+        let start = cmp::min(self.cursor, self.data.len() as u64) as usize;
+        let copied = cmp::min(buf.len(), self.data.len() - start);
+        buf[..copied].copy_from_slice(&self.data[start..start + copied]);
+
+        self.cursor += copied as u64;
+        Ok(copied)
+    }
+}
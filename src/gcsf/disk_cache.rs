@@ -0,0 +1,347 @@
+use failure::Error;
+use std::collections::{BTreeSet, HashMap};
+use std::fs;
+use std::io;
+use std::io::Write;
+use std::path::{Path, PathBuf};
+use std::time::SystemTime;
+
+type DriveId = String;
+type DriveIdRef<'a> = &'a str;
+
+const VERSION_FILE: &str = "version";
+const LENGTH_FILE: &str = "length";
+
+/// A size-limited cache for blocks of file content which is stored on disk and therefore
+/// survives remounts. Every file gets its own directory, named after its Drive ID, which holds
+/// one file per block along with the version of the Drive file that the blocks belong to. A
+/// block is only served if the requested version matches the stored one; otherwise all blocks
+/// of the file are considered stale and are removed. The length of the file may be stored along
+/// with its blocks, for files whose length Drive does not report (see `set_length()`).
+///
+/// All operations are best-effort: I/O errors are logged and treated as cache misses.
+pub struct DiskCache {
+    /// The directory which holds the cache.
+    dir: PathBuf,
+
+    /// Maps Drive IDs to the version of their stored blocks.
+    versions: HashMap<DriveId, String>,
+
+    /// Maps Drive IDs to the stored length of the corresponding file, in its stored version.
+    lengths: HashMap<DriveId, u64>,
+
+    /// Maps Drive IDs to the stored blocks of the corresponding file, each with its size and
+    /// the stamp of its last use.
+    blocks: HashMap<DriveId, HashMap<u64, (u64, u64)>>,
+
+    /// All stored blocks, ordered from the least to the most recently used.
+    lru: BTreeSet<(u64, DriveId, u64)>,
+
+    /// The total size of all stored blocks.
+    size: u64,
+
+    /// The size which the cache must not exceed.
+    max_size: u64,
+
+    /// Incremented every time a block is used.
+    stamp: u64,
+}
+
+impl DiskCache {
+    /// Opens the cache stored in `dir`, creating the directory if it does not exist. Blocks left
+    /// over from previous mounts are indexed, the least recently written ones being evicted
+    /// first. Blocks are expected to be `chunk_size` bytes long, except for the last block of a
+    /// file; other blocks, e.g. of another chunk size, are removed.
+    pub fn open(dir: PathBuf, max_size: u64, chunk_size: u64) -> Result<Self, Error> {
+        fs::create_dir_all(&dir)?;
+
+        let mut cache = DiskCache {
+            dir,
+            versions: HashMap::new(),
+            lengths: HashMap::new(),
+            blocks: HashMap::new(),
+            lru: BTreeSet::new(),
+            size: 0,
+            max_size,
+            stamp: 0,
+        };
+
+        let mut found = Vec::new();
+        for entry in fs::read_dir(&cache.dir)? {
+            let path = match entry {
+                Ok(entry) => entry.path(),
+                Err(e) => {
+                    warn!("Could not read an entry of the disk cache: {}", e);
+                    continue;
+                }
+            };
+            if !path.is_dir() {
+                warn!("Removing stray file {:?} from the disk cache", &path);
+                let _ = fs::remove_file(&path);
+                continue;
+            }
+
+            let id = match path.file_name() {
+                Some(name) => name.to_string_lossy().to_string(),
+                None => continue,
+            };
+            let (version, blocks) = match Self::read_entry(&path, chunk_size) {
+                Ok(entry) => entry,
+                Err(e) => {
+                    // E.g. an entry which was being written when the file system crashed.
+                    warn!("Removing unreadable cache entry {:?}: {}", &path, e);
+                    let _ = fs::remove_dir_all(&path);
+                    continue;
+                }
+            };
+
+            for (modified, index, len) in blocks {
+                found.push((modified, id.clone(), index, len));
+            }
+            if let Some(len) = fs::read_to_string(path.join(LENGTH_FILE))
+                .ok()
+                .and_then(|len| len.parse().ok())
+            {
+                cache.lengths.insert(id.clone(), len);
+            }
+            cache.versions.insert(id, version);
+        }
+
+        found.sort();
+        for (_, id, index, len) in found {
+            cache.track(id, index, len);
+        }
+        cache.evict();
+
+        info!(
+            "Disk cache {:?} contains {} bytes from {} files",
+            &cache.dir,
+            cache.size,
+            cache.versions.len()
+        );
+        Ok(cache)
+    }
+
+    /// Reads the version stored in the directory of a file and lists its blocks, each with the
+    /// time it was written, its index and its size. Blocks of the wrong size are removed: only
+    /// the last block of a file may be shorter than `chunk_size`, and no block is empty.
+    fn read_entry(
+        path: &Path,
+        chunk_size: u64,
+    ) -> io::Result<(String, Vec<(SystemTime, u64, u64)>)> {
+        let version = fs::read_to_string(path.join(VERSION_FILE))?;
+        if version.is_empty() {
+            return Err(io::Error::new(io::ErrorKind::InvalidData, "empty version"));
+        }
+
+        let mut blocks = Vec::new();
+        for block in fs::read_dir(path)? {
+            let block = block?;
+            let name = block.file_name().to_string_lossy().to_string();
+            let index = match name.parse::<u64>() {
+                Ok(index) => index,
+                Err(_) => {
+                    // Leftovers of interrupted writes.
+                    if name != VERSION_FILE && name != LENGTH_FILE {
+                        let _ = fs::remove_file(block.path());
+                    }
+                    continue;
+                }
+            };
+            let metadata = block.metadata()?;
+            blocks.push((metadata.modified()?, index, metadata.len(), block.path()));
+        }
+
+        // A short block which is not the last one would read as the end of the file.
+        let last = blocks.iter().map(|&(_, index, _, _)| index).max();
+        let mut valid = Vec::with_capacity(blocks.len());
+        for (modified, index, len, path) in blocks {
+            let full = len == chunk_size || (Some(index) == last && 0 < len && len < chunk_size);
+            if full {
+                valid.push((modified, index, len));
+            } else {
+                warn!("Removing cached block {:?} of {} bytes", &path, len);
+                let _ = fs::remove_file(&path);
+            }
+        }
+        Ok((version, valid))
+    }
+
+    /// Returns a stored block of a file if the stored version matches `version`.
+    pub fn get(&mut self, id: DriveIdRef, version: &str, index: u64) -> Option<Vec<u8>> {
+        if !self.has_version(id, version) {
+            return None;
+        }
+
+        let len = self.blocks.get(id)?.get(&index)?.0;
+        match fs::read(self.block_path(id, index)) {
+            Ok(data) => {
+                self.untrack(id, index);
+                self.track(id.to_string(), index, len);
+                Some(data)
+            }
+            Err(e) => {
+                warn!("Could not read cached block {} of {}: {}", index, id, e);
+                self.untrack(id, index);
+                None
+            }
+        }
+    }
+
+    /// Stores a block of a file. Blocks of any other version of the file are removed first.
+    pub fn insert(&mut self, id: DriveIdRef, version: &str, index: u64, data: &[u8]) {
+        if let Err(e) = self.try_insert(id, version, index, data) {
+            warn!("Could not cache block {} of {}: {}", index, id, e);
+        }
+        self.evict();
+    }
+
+    /// Returns the stored length of a file if the stored version matches `version`.
+    pub fn length(&self, id: DriveIdRef, version: &str) -> Option<u64> {
+        if !self.has_version(id, version) {
+            return None;
+        }
+        self.lengths.get(id).cloned()
+    }
+
+    /// Stores the length of a file. Blocks of any other version of the file are removed first.
+    pub fn set_length(&mut self, id: DriveIdRef, version: &str, len: u64) {
+        let result = self.use_version(id, version).and_then(|_| {
+            Self::write_atomically(
+                &self.dir.join(id).join(LENGTH_FILE),
+                len.to_string().as_bytes(),
+            )
+        });
+        match result {
+            Ok(()) => {
+                self.lengths.insert(id.to_string(), len);
+            }
+            Err(e) => warn!("Could not cache the length of {}: {}", id, e),
+        }
+    }
+
+    /// Removes all stored blocks of a file.
+    pub fn remove_file(&mut self, id: DriveIdRef) {
+        self.lengths.remove(id);
+        if self.versions.remove(id).is_none() {
+            return;
+        }
+
+        let indices: Vec<u64> = self
+            .blocks
+            .get(id)
+            .map(|blocks| blocks.keys().cloned().collect())
+            .unwrap_or_default();
+        for index in indices {
+            self.untrack(id, index);
+        }
+
+        if let Err(e) = fs::remove_dir_all(self.dir.join(id)) {
+            warn!("Could not remove cached blocks of {}: {}", id, e);
+        }
+    }
+
+    /// The total size of all stored blocks.
+    pub fn size(&self) -> u64 {
+        self.size
+    }
+
+    fn try_insert(
+        &mut self,
+        id: DriveIdRef,
+        version: &str,
+        index: u64,
+        data: &[u8],
+    ) -> Result<(), Error> {
+        self.use_version(id, version)?;
+
+        // The content of a block never changes within a version, so it is not written again.
+        let stored_len = self
+            .blocks
+            .get(id)
+            .and_then(|blocks| blocks.get(&index))
+            .map(|&(len, _)| len);
+        self.untrack(id, index);
+        if stored_len == Some(data.len() as u64) {
+            self.track(id.to_string(), index, data.len() as u64);
+            return Ok(());
+        }
+
+        Self::write_atomically(&self.block_path(id, index), data)?;
+        self.track(id.to_string(), index, data.len() as u64);
+        Ok(())
+    }
+
+    /// Makes `version` the stored version of a file, removing whatever is stored for any other
+    /// version.
+    fn use_version(&mut self, id: DriveIdRef, version: &str) -> Result<(), Error> {
+        if !self.has_version(id, version) {
+            self.remove_file(id);
+            fs::create_dir_all(self.dir.join(id))?;
+            Self::write_atomically(&self.dir.join(id).join(VERSION_FILE), version.as_bytes())?;
+            self.versions.insert(id.to_string(), version.to_string());
+        }
+        Ok(())
+    }
+
+    fn has_version(&self, id: DriveIdRef, version: &str) -> bool {
+        self.versions.get(id).map(String::as_str) == Some(version)
+    }
+
+    fn block_path(&self, id: DriveIdRef, index: u64) -> PathBuf {
+        self.dir.join(id).join(index.to_string())
+    }
+
+    /// Writes to a temporary file first, which is synced before being renamed into place, so
+    /// that a crash never leaves a partial block behind.
+    fn write_atomically(path: &Path, data: &[u8]) -> Result<(), Error> {
+        let tmp = path.with_extension("tmp");
+        {
+            let mut file = fs::File::create(&tmp)?;
+            file.write_all(data)?;
+            file.sync_all()?;
+        }
+        fs::rename(&tmp, path)?;
+        Ok(())
+    }
+
+    fn track(&mut self, id: DriveId, index: u64, len: u64) {
+        self.stamp += 1;
+        self.size += len;
+        self.lru.insert((self.stamp, id.clone(), index));
+        self.blocks
+            .entry(id)
+            .or_insert_with(HashMap::new)
+            .insert(index, (len, self.stamp));
+    }
+
+    fn untrack(&mut self, id: DriveIdRef, index: u64) {
+        let removed = self
+            .blocks
+            .get_mut(id)
+            .and_then(|blocks| blocks.remove(&index));
+
+        if let Some((len, stamp)) = removed {
+            self.size -= len;
+            self.lru.remove(&(stamp, id.to_string(), index));
+        }
+        if self.blocks.get(id).map_or(false, HashMap::is_empty) {
+            self.blocks.remove(id);
+        }
+    }
+
+    /// Removes the least recently used blocks until the total size fits the limit.
+    fn evict(&mut self) {
+        while self.size > self.max_size {
+            let (id, index) = match self.lru.iter().next() {
+                Some(&(_, ref id, index)) => (id.clone(), index),
+                None => break,
+            };
+
+            self.untrack(&id, index);
+            if let Err(e) = fs::remove_file(self.block_path(&id, index)) {
+                warn!("Could not evict cached block {} of {}: {}", index, id, e);
+            }
+        }
+    }
+}
@@ -1,75 +1,166 @@
-use super::Config;
+use super::change_poller;
+use super::change_poller::ChangePoller;
+use super::connection_pool::ConnectionPool;
+use super::content_client::{ContentClient, DummyFile};
+use super::metrics;
+use super::metrics::MetricsServer;
+use super::prefetcher::{ChunkStore, Downloader, Prefetcher};
+use super::scheduler;
+use super::scheduler::{Priority, RetryDelegate};
+use super::upload_journal::{QueuedUpload, UploadJournal};
+use super::worker_pool::WorkerPool;
+use super::{BatchCall, Batcher, BlockCache, Chunk, Config, DiskCache, ReadStream, WriteBuffer};
+use super::{DriveBackend, Listing};
+use chrono::NaiveDateTime;
 use drive3;
 use failure::{err_msg, Error};
 use hyper;
-use hyper::client::Response;
-use hyper_native_tls::NativeTlsClient;
-use lru_time_cache::LruCache;
-use mime_sniffer::MimeTypeSniffer;
+use hyper::method::Method;
 use oauth2;
+use oauth2::GetToken;
 use serde_json;
 use std::cmp;
-use std::collections::{HashMap, HashSet};
-use std::io;
-use std::io::{Read, Seek, SeekFrom};
+use std::collections::HashMap;
+use std::error::Error as StdError;
+use std::fs;
+use std::iter;
+use std::path::PathBuf;
+use std::sync::mpsc::{sync_channel, Receiver};
+use std::sync::{Arc, Mutex};
+use std::thread;
+use std::time::{Duration, SystemTime, UNIX_EPOCH};
 
 const PAGE_SIZE: i32 = 1000;
+const FILES_PATH: &str = "/drive/v3/files";
+const LIST_FIELDS: &str = "nextPageToken,files(name,id,size,mimeType,md5Checksum,owners,parents,trashed,modifiedTime,createdTime,viewedByMeTime)";
+
+/// How many listed pages per partition may wait to be processed.
+const LISTING_QUEUE: usize = 2;
+
+/// A parallel listing assumes that files were last modified after this time (2006-01-01).
+/// Files modified before it are still listed by the first partition.
+const LISTING_EPOCH: i64 = 1_136_073_600;
 type DriveId = String;
 type DriveIdRef<'a> = &'a str;
 
-type GcClient = hyper::Client;
-type GcAuthenticator = oauth2::Authenticator<
+pub type GcClient = hyper::Client;
+pub type GcDrive = drive3::Drive<GcClient, GcAuthenticator>;
+
+type TokenAuthenticator = oauth2::Authenticator<
     oauth2::DefaultAuthenticatorDelegate,
     oauth2::DiskTokenStorage,
     hyper::Client,
 >;
-type GcDrive = drive3::Drive<GcClient, GcAuthenticator>;
+
+/// The authenticator of the Drive account, shared by all hubs, downloaders and background
+/// threads. Cloning a `GcAuthenticator` is cheap. Sharing it means the access token is refreshed
+/// by one thread at a time, and the token file is written by a single authenticator.
+///
+/// Token requests go through the `ConnectionPool` like any other request. Every thread waits for
+/// a refresh, whichever thread sends it, so it is admitted as an interactive request rather than
+/// at the priority of the sending thread.
+#[derive(Clone)]
+pub struct GcAuthenticator {
+    auth: Arc<Mutex<TokenAuthenticator>>,
+}
+
+impl GetToken for GcAuthenticator {
+    fn token<'b, I, T>(&mut self, scopes: I) -> Result<oauth2::Token, Box<dyn StdError>>
+    where
+        T: AsRef<str> + Ord + 'b,
+        I: IntoIterator<Item = &'b T>,
+    {
+        let mut auth = self.auth.lock().unwrap();
+        let priority = scheduler::priority();
+        scheduler::set_priority(Priority::Interactive);
+        let token = auth.token(scopes);
+        scheduler::set_priority(priority);
+        token
+    }
+
+    fn api_key(&mut self) -> Option<String> {
+        self.auth.lock().unwrap().api_key()
+    }
+}
 
 /// Provides a simple high-level interface for interacting with the Google Drive API.
 pub struct DriveFacade {
     /// The `drive3::Drive` hub used for interacting with the API.
     pub hub: GcDrive,
 
-    /// A buffer used for temporarily caching read blocks. Storing this inside the struct makes it possible to return a reference to the data without the danger of the data outliving the struct.
-    buff: Vec<u8>,
+    /// Used on the calling thread for content-related requests which do not have to be answered
+    /// asynchronously.
+    content: ContentClient,
+
+    /// Runs reads in the background, each worker with its own `ContentClient`, so that slow
+    /// transfers do not hold up the rest of the file system.
+    workers: WorkerPool<ContentClient>,
 
-    /// Maps Drive IDs to a list of pending write operations that must be applied on them.
-    pending_writes: HashMap<DriveId, Vec<PendingWrite>>,
+    /// Runs uploads in the background, apart from `workers`, so that reads never wait behind an
+    /// upload of another file.
+    uploaders: WorkerPool<ContentClient>,
 
-    /// The LRU cache used for storing the file contents for any given Drive ID.
-    cache: LruCache<DriveId, Vec<u8>>,
+    /// Maps Drive IDs to the number of uploads of the file which are queued on `uploaders`. Reads
+    /// of such a file are queued behind its uploads instead of on `workers`, so that they see the
+    /// uploaded content.
+    uploading: Arc<Mutex<HashMap<DriveId, usize>>>,
+
+    /// Maps Drive IDs to the writes which have been performed on them but not yet flushed.
+    pending_writes: HashMap<DriveId, WriteBuffer>,
+
+    /// Maps Drive IDs to the length of their content on Drive, for files whose content is known
+    /// better locally than by the file tree: files created in this session are empty until their
+    /// first flush, and the length of flushed files is unknown until they are listed again.
+    content_lengths: HashMap<DriveId, Option<u64>>,
+
+    /// Records the uploads queued on the workers until they finish, if writes are uploaded in
+    /// the background (see `Config::write_back()`).
+    journal: Option<Arc<UploadJournal>>,
+
+    /// Write buffers larger than this are moved from memory to a spool file in `spool_dir`.
+    write_buffer_max_bytes: u64,
+    spool_dir: PathBuf,
+
+    /// The caches used for storing file contents: one in memory and an optional second level,
+    /// stored on disk. Each entry holds one chunk of a file, identified by its Drive ID and the
+    /// index of the chunk. Chunks on disk are tagged with the version of the file they belong to,
+    /// so that they are never served after the file changes on Drive. The caches are shared with
+    /// the prefetch workers.
+    store: Arc<ChunkStore>,
+
+    /// Downloads chunks in the background, ahead of sequential readers.
+    prefetcher: Prefetcher,
+
+    /// The size of a chunk. Reads are aligned to multiples of this value and only the chunks
+    /// which overlap the requested range are downloaded.
+    chunk_size: u64,
 
     /// Keeps track of the page token used for receiving changes from the `changes.list` API endpoint.
     changes_token: Option<String>,
 
+    /// Polls for changes in the background, once started.
+    poller: Option<ChangePoller>,
+
+    /// Sends deletions, moves and trashing to Drive in batches.
+    batcher: Batcher,
+
     /// The root id is only stored once, effectively caching the root id.
     root_id: Option<String>,
-}
 
-/// Represents a write operation that has been performed from the user's point of view but has not
-/// yet been applied to the local or remote file.
-#[derive(Debug)]
-struct PendingWrite {
-    id: DriveId,
-    offset: usize,
-    data: Vec<u8>,
-}
+    /// Listing threads create their own hubs using this config.
+    config: Config,
 
-lazy_static! {
-    static ref MIME_TYPES: HashMap<&'static str, &'static str> = hashmap! {
-        "application/vnd.google-apps.document" => "application/vnd.oasis.opendocument.text",
-        "application/vnd.google-apps.presentation" => "application/vnd.oasis.opendocument.presentation",
-        "application/vnd.google-apps.spreadsheet" => "application/vnd.oasis.opendocument.spreadsheet",
-        "application/vnd.google-apps.drawing" => "image/png",
-        "application/vnd.google-apps.site" => "text/plain",
-    };
-}
+    /// The authenticator shared by all hubs and clients.
+    auth: GcAuthenticator,
+
+    /// The HTTPS connections shared by all hubs and clients.
+    connections: ConnectionPool,
 
-lazy_static! {
-    static ref UNEXPORTABLE_MIME_TYPES: HashSet<&'static str> = hashset! {
-        "application/vnd.google-apps.form",
-        "application/vnd.google-apps.map",
-    };
+    /// Into how many partitions to split a full listing, each listed over its own connection.
+    listing_partitions: usize,
+
+    /// Serves the metrics over HTTP, if enabled (see `Config::metrics_listen()`), until dropped.
+    _metrics: Option<MetricsServer>,
 }
 
 impl DriveFacade {
@@ -77,21 +168,179 @@ impl DriveFacade {
     pub fn new(config: &Config) -> Self {
         debug!("DriveFacade::new()");
 
-        let ttl = config.cache_max_seconds();
-        let max_count = config.cache_max_items() as usize;
+        let connections =
+            ConnectionPool::new(config.max_connections(), config.requests_per_second()).unwrap();
+        let auth = DriveFacade::create_drive_auth(&config, &connections).unwrap();
+        let downloader =
+            Downloader::new(connections.client(), auth.clone(), &config.api_root_url());
+        let store = Arc::new(ChunkStore::new(
+            BlockCache::new(config.cache_max_bytes(), config.cache_max_seconds()),
+            if config.disk_cache() {
+                DiskCache::open(
+                    config.cache_dir(),
+                    config.disk_cache_max_bytes(),
+                    config.read_chunk_size(),
+                )
+                .map_err(|e| error!("Could not open disk cache: {}", e))
+                .ok()
+            } else {
+                None
+            },
+        ));
+        let prefetcher = Prefetcher::new(
+            downloader.clone(),
+            Arc::clone(&store),
+            config.read_chunk_size(),
+            config.prefetch_workers(),
+        );
+
+        let chunk_size = config.read_chunk_size();
+        let upload_chunk_size = config.upload_chunk_size();
+        let content = ContentClient::new(
+            DriveFacade::create_drive(&config, &connections, &auth).unwrap(),
+            downloader.clone(),
+            Arc::clone(&store),
+            chunk_size,
+            upload_chunk_size,
+        );
+        let create_content = {
+            let (config, connections, auth) = (config.clone(), connections.clone(), auth.clone());
+            let (downloader, store) = (downloader, Arc::clone(&store));
+            move || {
+                Ok(ContentClient::new(
+                    DriveFacade::create_drive(&config, &connections, &auth)?,
+                    downloader.clone(),
+                    Arc::clone(&store),
+                    chunk_size,
+                    upload_chunk_size,
+                ))
+            }
+        };
+        let workers = WorkerPool::new("io", config.io_workers(), create_content.clone());
+        let uploaders = WorkerPool::new("upload", config.upload_workers(), create_content);
+
+        let batcher = {
+            let (client, auth) = (connections.client(), auth.clone());
+            Batcher::start(&config.api_root_url(), move || Ok((client, auth)))
+        };
 
-        DriveFacade {
-            hub: DriveFacade::create_drive(&config).unwrap(),
-            buff: Vec::new(),
+        // Spool files are removed along with their write buffers, so any left over belong to a
+        // mount which did not stop cleanly. The uploads it queued are kept in the journal.
+        let _ = fs::remove_dir_all(config.spool_dir());
+
+        let (journal, queued_uploads) = if config.write_back() {
+            match UploadJournal::open(
+                config.upload_journal_dir(),
+                config.write_buffer_max_bytes(),
+                &config.spool_dir(),
+            ) {
+                Ok((journal, uploads)) => (Some(Arc::new(journal)), uploads),
+                Err(e) => {
+                    error!("Could not open upload journal: {}", e);
+                    (None, Vec::new())
+                }
+            }
+        } else {
+            (None, Vec::new())
+        };
+
+        let metrics = config.metrics_listen().and_then(|address| {
+            MetricsServer::start(&address, Arc::clone(&store))
+                .map_err(|e| error!("Could not serve metrics on {}: {}", address, e))
+                .ok()
+        });
+
+        let mut df = DriveFacade {
+            hub: DriveFacade::create_drive(&config, &connections, &auth).unwrap(),
+            content,
+            workers,
+            uploaders,
+            uploading: Arc::new(Mutex::new(HashMap::new())),
             pending_writes: HashMap::new(),
-            cache: LruCache::<String, Vec<u8>>::with_expiry_duration_and_capacity(ttl, max_count),
+            content_lengths: HashMap::new(),
+            journal,
+            write_buffer_max_bytes: config.write_buffer_max_bytes(),
+            spool_dir: config.spool_dir(),
+            store,
+            prefetcher,
+            chunk_size,
             root_id: None,
             changes_token: None,
+            poller: None,
+            batcher,
+            config: config.clone(),
+            auth,
+            connections,
+            listing_partitions: config.listing_partitions(),
+            _metrics: metrics,
+        };
+        df.resume_uploads(queued_uploads);
+        df
+    }
+
+    /// Queues the uploads which were left in the journal when the file system last stopped.
+    fn resume_uploads(&mut self, uploads: Vec<QueuedUpload>) {
+        let journal = match self.journal {
+            Some(ref journal) => Arc::clone(journal),
+            None => return,
+        };
+
+        for upload in uploads {
+            info!("Resuming the upload of {}", &upload.id);
+            self.invalidate(&upload.id);
+            self.content_lengths.insert(upload.id.clone(), None);
+
+            let journal = Arc::clone(&journal);
+            let pending = upload.buffer.dirty_bytes() as i64;
+            metrics::add_pending_write_bytes(pending);
+            let pending = PendingBytes(pending);
+            self.queue_upload(&upload.id.clone(), move |content| {
+                let _pending = pending;
+                let id = upload.id.clone();
+                let exists = content.contains(&id);
+                let result = upload.resume(&journal, exists, |id, buffer, entry| {
+                    content.flush(id, buffer, entry)
+                });
+                if let Err(e) = result {
+                    error!("Could not resume the upload of {}: {}", &id, e);
+                }
+            });
         }
     }
 
-    /// Creates a Drive authenticator.
-    fn create_drive_auth(config: &Config) -> Result<GcAuthenticator, Error> {
+    /// Runs an upload of the file with the Drive ID `id` on the upload workers, after the uploads
+    /// of the file which are already queued.
+    fn queue_upload<F>(&self, id: DriveIdRef, job: F)
+    where
+        F: FnOnce(&mut ContentClient) + Send + 'static,
+    {
+        *self
+            .uploading
+            .lock()
+            .unwrap()
+            .entry(id.to_string())
+            .or_insert(0) += 1;
+        let queued = QueuedOnUploaders {
+            id: id.to_string(),
+            uploading: Arc::clone(&self.uploading),
+        };
+        self.uploaders.execute(id, move |content| {
+            let _queued = queued;
+            scheduler::set_priority(Priority::Bulk);
+            job(content);
+        });
+    }
+
+    /// Whether an upload of the file with the Drive ID `id` is queued or running.
+    fn is_uploading(&self, id: DriveIdRef) -> bool {
+        self.uploading.lock().unwrap().contains_key(id)
+    }
+
+    /// Creates the Drive authenticator, which is then shared by all hubs and clients.
+    fn create_drive_auth(
+        config: &Config,
+        connections: &ConnectionPool,
+    ) -> Result<GcAuthenticator, Error> {
         let secret: oauth2::ConsoleApplicationSecret =
             serde_json::from_str(config.client_secret())?;
         let secret = secret
@@ -101,7 +350,7 @@ impl DriveFacade {
         let auth = oauth2::Authenticator::new(
             &secret,
             oauth2::DefaultAuthenticatorDelegate,
-            hyper::Client::with_connector(hyper::net::HttpsConnector::new(NativeTlsClient::new()?)),
+            connections.client(),
             oauth2::DiskTokenStorage::new(&config.token_file().to_str().unwrap().to_string())
                 .unwrap(),
             Some(if config.authorize_using_code() {
@@ -111,135 +360,312 @@ impl DriveFacade {
             }),
         );
 
-        Ok(auth)
+        Ok(GcAuthenticator {
+            auth: Arc::new(Mutex::new(auth)),
+        })
     }
 
-    /// Creates a drive hub.
-    fn create_drive(config: &Config) -> Result<GcDrive, Error> {
-        let auth = Self::create_drive_auth(config)?;
-        Ok(drive3::Drive::new(
-            hyper::Client::with_connector(hyper::net::HttpsConnector::new(NativeTlsClient::new()?)),
-            auth,
-        ))
+    /// Creates a drive hub which sends its requests through the shared connections, authorized
+    /// by the shared authenticator, to the Drive API served under `Config::api_root_url()`.
+    fn create_drive(
+        config: &Config,
+        connections: &ConnectionPool,
+        auth: &GcAuthenticator,
+    ) -> Result<GcDrive, Error> {
+        let mut hub = drive3::Drive::new(connections.client(), auth.clone());
+        let root_url = config.api_root_url();
+        hub.base_url(format!("{}drive/v3/", root_url));
+        hub.root_url(root_url);
+        Ok(hub)
     }
 
-    /// Will still detect a file even if it is in Trash.
-    fn contains(&self, id: DriveIdRef) -> Result<bool, Error> {
-        let response = self
-            .hub
-            .files()
-            .get(&id)
+    /// Returns the start page token for the `changes.list` API endpoint.
+    fn get_start_page_token(&mut self) -> Result<String, Error> {
+        self.hub
+            .changes()
+            .get_start_page_token()
             .add_scope(drive3::Scope::Full)
-            .doit();
+            .delegate(&mut RetryDelegate::default())
+            .doit()
+            .map_err(|e| err_msg(format!("{:#?}", e)))
+            .map(|result| {
+                result.1.start_page_token.unwrap_or_else(|| {
+                    err_msg(
+                        "Received OK response from drive but there is no startPageToken included.",
+                    )
+                    .to_string()
+                })
+            })
+    }
 
-        match response {
-            Ok((_, file)) => Ok(file.id == Some(id.to_string())),
-            Err(e) => Err(err_msg(format!("{:#?}", e))),
-        }
+    /// Returns a list of all files from Drive. If the `parents` list is provided, only files which are children of any one of the list's elements are returned. If `trashed` is provided, only files which are trashed/not trashed are returned. The two filters can be used together.
+    pub fn get_all_files(
+        &mut self,
+        parents: Option<Vec<DriveId>>,
+        trashed: Option<bool>,
+    ) -> Result<Vec<drive3::File>, Error> {
+        let query = Self::files_query(&parents, trashed).join(" and ");
+        self.list_query(&query)
     }
 
-    #[allow(dead_code)]
-    fn get_file_size(&self, drive_id: DriveIdRef, mime_type: Option<String>) -> u64 {
-        self.get_file_content(drive_id, mime_type).unwrap().len() as u64
+    /// Returns all files matching a `files.list` query, requesting one page after the other.
+    fn list_query(&self, query: &str) -> Result<Vec<drive3::File>, Error> {
+        let mut all_files = Vec::new();
+        let mut page_token: Option<String> = None;
+        let mut current_page = 1;
+        loop {
+            let filelist = Self::list_page(&self.hub, query, page_token)?;
+
+            match filelist.files {
+                Some(files) => {
+                    info!(
+                        "Received page {} containing {} files",
+                        current_page,
+                        files.len()
+                    );
+                    all_files.extend(files);
+                }
+                _ => warn!("Filelist does not contain any files!"),
+            };
+
+            current_page += 1;
+            page_token = filelist.next_page_token;
+            if page_token.is_none() {
+                break;
+            }
+        }
+        Ok(all_files)
     }
 
-    fn get_file_metadata(&self, id: DriveIdRef) -> Result<drive3::File, Error> {
-        self.hub
+    /// Requests a single page of files matching `query`.
+    fn list_page(
+        hub: &GcDrive,
+        query: &str,
+        page_token: Option<String>,
+    ) -> Result<drive3::FileList, Error> {
+        let mut retry = RetryDelegate::default();
+        let mut request = hub
             .files()
-            .get(id)
-            .param("fields", "id,name,parents,mimeType,webContentLink")
+            .list()
+            .param("fields", LIST_FIELDS)
+            .spaces("drive") // TODO: maybe add photos as well
+            .corpora("user")
+            .page_size(PAGE_SIZE)
             .add_scope(drive3::Scope::Full)
+            .delegate(&mut retry);
+
+        if let Some(token) = page_token {
+            request = request.page_token(&token);
+        };
+
+        let (_, filelist) = request
+            .q(query)
             .doit()
-            .map(|(_response, file)| file)
-            .map_err(|e| err_msg(format!("{:#?}", e)))
+            .map_err(|e| err_msg(format!("{:#?}", e)))?;
+        Ok(filelist)
     }
 
-    /// Retrieves the content of a Drive file. If `mime_type` is specified, this method will
-    /// attempt to export the file in some appropriate format rather than just download it as is.
-    /// This is the only way of retrieving Docs, Sheets, Slides, Sites and Drawings.
-    fn get_file_content(
-        &self,
-        drive_id: &str,
-        mime_type: Option<String>,
-    ) -> Result<Vec<u8>, Error> {
-        if let Some(mime) = mime_type.clone() {
-            if UNEXPORTABLE_MIME_TYPES.contains::<str>(&mime) {
-                return Ok(format!(
-                    "UNEXPORTABLE_FILE: The MIME type of this \
-                     file is {:?}, which can not be exported from Drive. Web \
-                     content link provided by Drive: {:?}\n",
-                    mime,
-                    self.get_file_metadata(drive_id)
-                        .ok()
-                        .map(|metadata| metadata.web_view_link)
-                        .unwrap_or_default()
-                )
-                .as_bytes()
-                .to_vec());
-            }
+    /// Returns the conditions of a `files.list` query which filters files by parents and
+    /// trashed status. The conditions must be joined with "and".
+    fn files_query(parents: &Option<Vec<DriveId>>, trashed: Option<bool>) -> Vec<String> {
+        let mut query_chain: Vec<String> = Vec::new();
+        if let Some(ref p) = parents {
+            let q = p
+                .iter()
+                .map(|id| format!("'{}' in parents", id))
+                .collect::<Vec<_>>()
+                .join(" or ");
+
+            query_chain.push(format!("({})", q));
         }
+        if let Some(trash) = trashed {
+            query_chain.push(format!("trashed = {}", trash));
+        }
+        query_chain
+    }
 
-        let export_type: Option<&'static str> = mime_type
-            .and_then(|ref t| MIME_TYPES.get::<str>(&t))
-            .cloned();
-
-        let mut response = match export_type {
-            Some(t) => {
-                let response = self
-                    .hub
-                    .files()
-                    .export(drive_id, &t)
-                    .add_scope(drive3::Scope::Full)
-                    .doit()
-                    .map_err(|e| err_msg(format!("{:#?}", e)))?;
-
-                debug!("response: {:?}", &response);
-                response
-            }
-            None => {
-                let (response, _empty_file) = self
-                    .hub
-                    .files()
-                    .get(&drive_id)
-                    .supports_team_drives(false)
-                    .param("alt", "media")
-                    .add_scope(drive3::Scope::Full)
-                    .doit()
-                    .map_err(|e| err_msg(format!("{:#?}", e)))?;
-                response
-            }
-        };
+    /// Splits all modification times into `partitions` consecutive ranges, each given by its
+    /// inclusive start and exclusive end (none meaning unbounded). Recent files are usually far
+    /// more numerous than old ones, so every range covers half the time span of the one before
+    /// it, the last one ending at `now`.
+    fn modified_time_ranges(partitions: usize, now: i64) -> Vec<(Option<i64>, Option<i64>)> {
+        let span = cmp::max(now - LISTING_EPOCH, 1);
+        let boundaries: Vec<i64> = (1..cmp::max(partitions, 1))
+            .map(|k| now - (span >> cmp::min(k, 62)))
+            .collect();
+
+        let starts = iter::once(None).chain(boundaries.iter().cloned().map(Some));
+        let ends = boundaries.iter().cloned().map(Some).chain(iter::once(None));
+        starts.zip(ends).collect()
+    }
+
+    /// Formats a Unix timestamp the way `files.list` queries expect it. Times are in UTC.
+    fn format_time(timestamp: i64) -> String {
+        NaiveDateTime::from_timestamp(timestamp, 0)
+            .format("%Y-%m-%dT%H:%M:%S")
+            .to_string()
+    }
 
-        let mut content: Vec<u8> = Vec::new();
-        let _result = response.read_to_end(&mut content);
+    /// Schedules the background download of `count` chunks of a file, starting with the chunk
+    /// at index `first_chunk`. Chunks past the end of the file (of `file_size` bytes) are never
+    /// requested, nor are chunks which are cached or being downloaded. Files which must be
+    /// exported are not prefetched, since they can only be downloaded in full. The requests
+    /// are dropped once the reader in `stream` seeks elsewhere.
+    pub fn prefetch(
+        &mut self,
+        drive_id: DriveIdRef,
+        mime_type: &Option<String>,
+        version: Option<&str>,
+        first_chunk: u64,
+        count: u64,
+        file_size: u64,
+        stream: ReadStream,
+    ) {
+        if ContentClient::must_be_exported(mime_type) {
+            return;
+        }
+
+        let chunks_in_file = (file_size + self.chunk_size - 1) / self.chunk_size;
+        let end = cmp::min(first_chunk.saturating_add(count), chunks_in_file);
+        let key = ChunkStore::content_key(drive_id, version);
+        for index in first_chunk..end {
+            if !self.store.contains(&key, index) && !self.store.is_downloading(&key, index) {
+                self.prefetcher
+                    .prefetch(drive_id, version, index, stream.clone());
+            }
+        }
+    }
 
-        Ok(content)
+    /// The size of the chunks in which files are read.
+    pub fn chunk_size(&self) -> u64 {
+        self.chunk_size
     }
 
-    /// Applies all pending writes accumulated so far on a data buffer. The pending writes are then
-    /// cleared.
-    fn apply_pending_writes_on_data(&mut self, id: DriveId, data: &mut Vec<u8>) {
+    /// Returns the write buffer of a file, creating it if needed. `remote_len` is the length of
+    /// the file as last listed; a length known to this session takes precedence and is trusted.
+    fn write_buffer(&mut self, id: DriveId, remote_len: Option<u64>) -> &mut WriteBuffer {
+        let known_len = self.content_lengths.get(&id).cloned();
+        let (max_bytes, spool_dir) = (self.write_buffer_max_bytes, &self.spool_dir);
         self.pending_writes
-            .entry(id.clone())
-            .or_insert_with(Vec::new)
-            .iter()
-            .filter(|write| write.id == id)
-            .for_each(|pending_write| {
-                debug!(
-                    "Applying pending write with offset {} on {}",
-                    &pending_write.offset, &pending_write.id
-                );
-                let required_size = pending_write.offset + pending_write.data.len();
-
-                data.resize(required_size, 0);
-                data[pending_write.offset..].copy_from_slice(&pending_write.data[..]);
+            .entry(id)
+            .or_insert_with(|| match known_len {
+                Some(Some(len)) => {
+                    let mut buffer = WriteBuffer::new(max_bytes, spool_dir.clone(), None);
+                    buffer.confirm_base_len(len);
+                    buffer
+                }
+                Some(None) => WriteBuffer::new(max_bytes, spool_dir.clone(), None),
+                None => WriteBuffer::new(max_bytes, spool_dir.clone(), remote_len),
+            })
+    }
+
+    /// Reads the contents of a Drive file starting at a certain offset, on a worker thread. Only
+    /// the chunks which overlap the requested range are read. Prefers reading them from cache if
+    /// possible, otherwise fetches them from Drive. The `version` of the file (see
+    /// `File::content_version()`) allows chunks to be served from the disk cache. `done` is
+    /// called on the worker thread with the result.
+    pub fn read<F>(
+        &mut self,
+        drive_id: DriveId,
+        mime_type: Option<String>,
+        version: Option<String>,
+        offset: usize,
+        size: usize,
+        done: F,
+    ) where
+        F: FnOnce(Result<Chunk, Error>) + Send + 'static,
+    {
+        let key = drive_id.clone();
+        let job = move |content: &mut ContentClient| {
+            scheduler::set_priority(Priority::Interactive);
+            let version = version.as_ref().map(String::as_str);
+            done(content.read(&drive_id, &mime_type, version, offset, size));
+        };
+        // A read of a file which is being uploaded waits for the upload to finish.
+        if self.is_uploading(&key) {
+            self.uploaders.execute(&key, job);
+        } else {
+            self.workers.execute(&key, job);
+        }
+    }
+
+    /// Uploads all pending writes and waits until every queued upload and read has finished.
+    /// Called once the file system has been unmounted.
+    pub fn drain(&mut self) {
+        let ids: Vec<DriveId> = self.pending_writes.keys().cloned().collect();
+        for id in ids {
+            self.flush(&id, |result| {
+                if let Err(e) = result {
+                    error!("Could not upload pending writes: {}", e);
+                }
             });
+        }
 
-        self.pending_writes.remove(&id);
+        if let Some(ref journal) = self.journal {
+            info!("Waiting for {} queued uploads", journal.len());
+        }
+        self.uploaders.wait();
+        self.workers.wait();
     }
 
-    /// Returns the Drive ID of the root "My Drive" directory
-    pub fn root_id(&mut self) -> Result<&String, Error> {
+    /// Returns the size and capacity of the Drive account. In some cases, the limit can be absent.
+    pub fn size_and_capacity(&mut self) -> Result<(u64, Option<u64>), Error> {
+        let (_response, about) = self
+            .hub
+            .about()
+            .get()
+            .param("fields", "storageQuota")
+            .add_scope(drive3::Scope::Full)
+            .delegate(&mut RetryDelegate::default())
+            .doit()
+            .map_err(|e| err_msg(format!("{:#?}", e)))?;
+
+        let storage_quota = about
+            .storage_quota
+            .ok_or_else(|| err_msg("size_and_capacity(): no storage quota in response"))?;
+
+        let usage = storage_quota.usage.unwrap().parse::<u64>().unwrap();
+        let limit = storage_quota.limit.map(|s| s.parse::<u64>().unwrap());
+
+        Ok((usage, limit))
+    }
+}
+
+/// The dirty bytes of a buffer which is being uploaded. They stop counting as pending once it is
+/// dropped, whether the upload succeeded or not.
+struct PendingBytes(i64);
+
+impl Drop for PendingBytes {
+    fn drop(&mut self) {
+        metrics::add_pending_write_bytes(-self.0);
+    }
+}
+
+/// Counts an upload as queued on the upload workers until it is dropped, whether the upload
+/// succeeded or not.
+struct QueuedOnUploaders {
+    id: DriveId,
+    uploading: Arc<Mutex<HashMap<DriveId, usize>>>,
+}
+
+impl Drop for QueuedOnUploaders {
+    fn drop(&mut self) {
+        let mut uploading = self.uploading.lock().unwrap();
+        let done = match uploading.get_mut(&self.id) {
+            Some(count) => {
+                *count -= 1;
+                *count == 0
+            }
+            None => false,
+        };
+        if done {
+            uploading.remove(&self.id);
+        }
+    }
+}
+
+impl DriveBackend for DriveFacade {
+    fn root_id(&mut self) -> Result<&String, Error> {
         if self.root_id.is_some() {
             return Ok(self.root_id.as_ref().unwrap());
         }
@@ -254,6 +680,7 @@ impl DriveFacade {
             .page_size(1)
             .q("'root' in parents")
             .add_scope(drive3::Scope::Full)
+            .delegate(&mut RetryDelegate::default())
             .doit()
             .map_err(|e| err_msg(format!("{:#?}", e)))?
             .1
@@ -276,26 +703,6 @@ impl DriveFacade {
         Ok(self.root_id.as_ref().unwrap())
     }
 
-    /// Returns the start page token for the `changes.list` API endpoint.
-    fn get_start_page_token(&mut self) -> Result<String, Error> {
-        self.hub
-            .changes()
-            .get_start_page_token()
-            .add_scope(drive3::Scope::Full)
-            .doit()
-            .map_err(|e| err_msg(format!("{:#?}", e)))
-            .map(|result| {
-                result.1.start_page_token.unwrap_or_else(|| {
-                    err_msg(
-                        "Received OK response from drive but there is no startPageToken included.",
-                    )
-                    .to_string()
-                })
-            })
-    }
-
-    /// Returns the current token for the `changes.list` API endpoint, or the start page token if
-    /// absent.
     fn changes_token(&mut self) -> Result<&String, Error> {
         if self.changes_token.is_none() {
             self.changes_token = Some(self.get_start_page_token()?);
@@ -304,140 +711,131 @@ impl DriveFacade {
         Ok(self.changes_token.as_ref().unwrap())
     }
 
-    /// Returns a list of all changes reported by Drive which are more recent than the changes
-    /// token indicates.
-    pub fn get_all_changes(&mut self) -> Result<Vec<drive3::Change>, Error> {
-        let mut all_changes = Vec::new();
+    fn set_changes_token(&mut self, token: Option<String>) {
+        self.changes_token = token;
+    }
 
-        loop {
-            let token = self.changes_token()?.clone();
-            let (_response, changelist) = self.hub
-                .changes()
-                .list(&token)
-                .param("fields", "kind,newStartPageToken,changes(kind,type,time,removed,fileId,file(name,id,size,mimeType,owners,parents,trashed,modifiedTime,createdTime,viewedByMeTime))")
-                .spaces("drive")
-                .restrict_to_my_drive(true)
-                // Whether to include changes indicating that items have been removed from the list of changes, for example by deletion or loss of access. (Default: true)
-                .include_removed(false) // ^wtf?
-                .supports_team_drives(false)
-                .include_team_drive_items(false)
-                .page_size(PAGE_SIZE)
-                .add_scope(drive3::Scope::Full)
-                .doit()
-                .map_err(|e| err_msg(format!("{:#?}", e)))?;
-
-            match changelist.changes {
-                Some(changes) => all_changes.extend(changes),
-                _ => warn!("Changelist does not contain any changes!"),
-            };
+    fn get_all_changes(&mut self) -> Result<Vec<drive3::Change>, Error> {
+        let token = self.changes_token()?.clone();
+        let (changes, token) = change_poller::list_changes(&self.hub, &token)?;
+        self.changes_token = Some(token);
+        Ok(changes)
+    }
 
-            self.changes_token = changelist.next_page_token;
-            if self.changes_token.is_none() {
-                self.changes_token = changelist.new_start_page_token;
-                break;
-            }
+    /// Does nothing if background sync is disabled.
+    fn start_polling_changes(&mut self, interval: Duration) -> Result<(), Error> {
+        if !self.config.background_sync() || self.poller.is_some() {
+            return Ok(());
         }
 
-        Ok(all_changes)
+        let token = self.changes_token()?.clone();
+        let (config, connections) = (self.config.clone(), self.connections.clone());
+        let auth = self.auth.clone();
+        self.poller = Some(ChangePoller::start(
+            move || DriveFacade::create_drive(&config, &connections, &auth),
+            token,
+            interval,
+            self.config.changes_webhook(),
+        )?);
+        Ok(())
     }
 
-    /// Returns a list of all files from Drive. If the `parents` list is provided, only files which are children of any one of the list's elements are returned. If `trashed` is provided, only files which are trashed/not trashed are returned. The two filters can be used together.
-    pub fn get_all_files(
-        &mut self,
-        parents: Option<Vec<DriveId>>,
-        trashed: Option<bool>,
-    ) -> Result<Vec<drive3::File>, Error> {
-        let mut all_files = Vec::new();
-        let mut page_token: Option<String> = None;
-        let mut current_page = 1;
-        loop {
-            let mut request = self.hub.files()
-                .list()
-                .param("fields", "nextPageToken,files(name,id,size,mimeType,owners,parents,trashed,modifiedTime,createdTime,viewedByMeTime)")
-                .spaces("drive") // TODO: maybe add photos as well
-                .corpora("user")
-                .page_size(PAGE_SIZE)
-                .add_scope(drive3::Scope::Full);
-
-            if let Some(token) = page_token {
-                request = request.page_token(&token);
-            };
+    fn is_polling_changes(&self) -> bool {
+        self.poller.is_some()
+    }
 
-            let mut query_chain: Vec<String> = Vec::new();
-            if let Some(ref p) = parents {
-                let q = p
-                    .iter()
-                    .map(|id| format!("'{}' in parents", id))
-                    .collect::<Vec<_>>()
-                    .join(" or ");
+    fn take_polled_changes(&mut self) -> Option<Vec<drive3::Change>> {
+        let (changes, token) = self.poller.as_ref().and_then(ChangePoller::take_changes)?;
+        self.changes_token = Some(token);
+        Some(changes)
+    }
 
-                query_chain.push(format!("({})", q));
+    /// Lists the files in the background. If `listing_partitions` is greater than one, the files
+    /// are split into that many disjoint ranges of modification time, which are listed
+    /// concurrently over separate connections. The pages of different partitions arrive in no
+    /// particular order.
+    fn list_all_files(
+        &self,
+        trashed: Option<bool>,
+    ) -> Result<Receiver<Result<Vec<drive3::File>, Error>>, Error> {
+        let now = SystemTime::now()
+            .duration_since(UNIX_EPOCH)
+            .map(|d| d.as_secs() as i64)
+            .unwrap_or(LISTING_EPOCH);
+        let ranges = Self::modified_time_ranges(self.listing_partitions, now);
+        let (sender, receiver) = sync_channel(LISTING_QUEUE * ranges.len());
+
+        for (i, (after, before)) in ranges.into_iter().enumerate() {
+            let mut query_chain = Self::files_query(&None, trashed);
+            if let Some(after) = after {
+                query_chain.push(format!("modifiedTime >= '{}'", Self::format_time(after)));
             }
-            if let Some(trash) = trashed {
-                query_chain.push(format!("trashed = {}", trash));
+            if let Some(before) = before {
+                query_chain.push(format!("modifiedTime < '{}'", Self::format_time(before)));
             }
-
             let query = query_chain.join(" and ");
-            let (_, filelist) = request
-                .q(&query)
-                .doit()
-                .map_err(|e| err_msg(format!("{:#?}", e)))?;
 
-            match filelist.files {
-                Some(files) => {
-                    info!(
-                        "Received page {} containing {} files",
-                        current_page,
-                        files.len()
-                    );
-                    all_files.extend(files);
-                }
-                _ => warn!("Filelist does not contain any files!"),
-            };
+            let (config, connections) = (self.config.clone(), self.connections.clone());
+            let (auth, sender) = (self.auth.clone(), sender.clone());
+            thread::Builder::new()
+                .name(format!("listing-{}", i))
+                .spawn(move || {
+                    scheduler::set_priority(Priority::Sync);
+                    let result = Self::create_drive(&config, &connections, &auth).and_then(|hub| {
+                        let mut page_token: Option<String> = None;
+                        loop {
+                            let filelist = Self::list_page(&hub, &query, page_token)?;
+                            debug!("Listed a page of partition {}", i);
+
+                            // The receiver is gone if the caller has given up on the listing.
+                            if sender.send(Ok(filelist.files.unwrap_or_default())).is_err() {
+                                return Ok(());
+                            }
+                            page_token = filelist.next_page_token;
+                            if page_token.is_none() {
+                                return Ok(());
+                            }
+                        }
+                    });
+
+                    if let Err(e) = result {
+                        let _ = sender.send(Err(e));
+                    }
+                })?;
+        }
 
-            current_page += 1;
-            page_token = filelist.next_page_token;
-            if page_token.is_none() {
-                break;
+        Ok(receiver)
+    }
+
+    fn list_files(&mut self, listing: Listing) -> Result<Vec<drive3::File>, Error> {
+        let query = match listing {
+            Listing::Children(parent) => {
+                Self::files_query(&Some(vec![parent.to_string()]), Some(false)).join(" and ")
             }
-        }
-        Ok(all_files)
+            Listing::Shared => String::from("sharedWithMe = true and trashed = false"),
+            Listing::Trashed => String::from("trashed = true"),
+        };
+        self.list_query(&query)
     }
 
-    /// Reads the contents of a Drive file starting at a certain offset.
-    /// Prefers reading from cache if possible, otherwise fetches the content from Drive.
-    pub fn read(
-        &mut self,
+    fn exported_len(
+        &self,
         drive_id: DriveIdRef,
-        mime_type: Option<String>,
-        offset: usize,
-        size: usize,
-    ) -> Option<&[u8]> {
-        if self.cache.contains_key(drive_id) {
-            let data = self.cache.get(drive_id).unwrap();
-            self.buff =
-                data[cmp::min(data.len(), offset)..cmp::min(data.len(), offset + size)].to_vec();
-            return Some(&self.buff);
-        }
-
-        match self.get_file_content(&drive_id, mime_type) {
-            Ok(data) => {
-                self.buff = data[cmp::min(data.len(), offset)..cmp::min(data.len(), offset + size)]
-                    .to_vec();
-                self.cache.insert(drive_id.to_string(), data.to_vec());
-                Some(&self.buff)
-            }
-            Err(e) => {
-                error!("Got error: {:?}", e);
-                None
-            }
+        mime_type: &Option<String>,
+        version: Option<&str>,
+    ) -> Option<u64> {
+        if !ContentClient::must_be_exported(mime_type) {
+            return None;
         }
+        let version = ContentClient::cache_version(mime_type, version);
+        self.store
+            .length(drive_id, version.as_ref().map(String::as_str))
     }
 
-    /// Creates a new file on Drive. If successful, returns the file id.
-    pub fn create(&mut self, drive_file: &drive3::File) -> Result<DriveId, Error> {
-        let dummy_file = DummyFile::new(&[]);
-        self.hub
+    fn create(&mut self, drive_file: &drive3::File) -> Result<DriveId, Error> {
+        let dummy_file = DummyFile::new(Vec::new());
+        let id = self
+            .hub
             .files()
             .create(drive_file.clone())
             .use_content_as_indexable_text(true)
@@ -449,195 +847,163 @@ impl DriveFacade {
                 file.id.unwrap_or_else(|| {
                     err_msg("Received file from drive but it has no drive id.").to_string()
                 })
-            })
-    }
-
-    /// Writes some data to a Drive file starting at a certain offset.
-    /// This is a lazy operation. It creates a pending write which only gets executed when flus()
-    /// is called.
-    pub fn write(&mut self, id: DriveId, offset: usize, data: &[u8]) {
-        let pending_write = PendingWrite {
-            id: id.clone(),
-            offset,
-            data: data.to_vec(),
-        };
-
-        self.pending_writes
-            .entry(id)
-            .or_insert_with(|| Vec::with_capacity(3000))
-            .push(pending_write);
-    }
+            })?;
 
-    /// Deletes a file permanently from Drive.
-    pub fn delete_permanently(&mut self, id: DriveIdRef) -> Result<bool, Error> {
-        self.hub
-            .files()
-            .delete(&id)
-            .supports_team_drives(false)
-            .add_scope(drive3::Scope::Full)
-            .doit()
-            .map(|response| response.status.is_success())
-            .map_err(|e| err_msg(format!("{:#?}", e)))
+        // The file was created empty, so its first flush does not have to download anything.
+        self.content_lengths.insert(id.clone(), Some(0));
+        Ok(id)
     }
 
-    /// `mv` operation. Can potentially move a file to a new directory and/or rename it.
-    pub fn move_to(
+    fn write(
         &mut self,
-        id: DriveIdRef,
-        parent: DriveIdRef,
-        new_name: &str,
-    ) -> Result<(Response, drive3::File), Error> {
-        let current_parents = self
-            .get_file_metadata(id)?
-            .parents
-            .unwrap_or_else(|| vec![String::from("root")])
-            .join(",");
+        id: DriveId,
+        offset: usize,
+        data: &[u8],
+        remote_len: Option<u64>,
+    ) -> Result<(), Error> {
+        let buffer = self.write_buffer(id, remote_len);
+        let before = buffer.dirty_bytes();
+        let result = buffer.write(offset as u64, data);
+        metrics::add_pending_write_bytes(buffer.dirty_bytes() as i64 - before as i64);
+        result
+    }
 
-        let f = drive3::File {
-            name: Some(new_name.to_string()),
-            ..Default::default()
-        };
-        self.hub
-            .files()
-            .update(f, id)
-            .remove_parents(&current_parents)
-            .add_parents(parent)
-            .add_scope(drive3::Scope::Full)
-            .doit_without_upload()
-            .map_err(|e| err_msg(format!("DriveFacade::move_to() {}", e)))
+    fn truncate(&mut self, id: DriveId, size: u64, remote_len: Option<u64>) -> Result<(), Error> {
+        let buffer = self.write_buffer(id, remote_len);
+        let before = buffer.dirty_bytes();
+        let result = buffer.truncate(size);
+        metrics::add_pending_write_bytes(buffer.dirty_bytes() as i64 - before as i64);
+        result
     }
 
-    /// Marks a Google Drive file as trashed.
-    pub fn move_to_trash(&mut self, id: DriveId) -> Result<(), Error> {
-        let f = drive3::File {
-            trashed: Some(true),
-            ..Default::default()
+    /// Flushes on a worker thread. Flushes and reads of the same file are run in the order they
+    /// were requested.
+    ///
+    /// If the upload journal is enabled, the upload is recorded in it as the first step of the
+    /// job, and stays there until it succeeds, so that it is resumed on the next mount if it does
+    /// not. Recording a large buffer only links its spool file into the journal, but is still
+    /// kept off the dispatch thread. `drain()` and `sync()` wait for the job, so the entry is
+    /// recorded by the time they return.
+    fn flush<F>(&mut self, id: DriveIdRef, done: F)
+    where
+        F: FnOnce(Result<(), Error>) + Send + 'static,
+    {
+        let buffer = match self.pending_writes.remove(id) {
+            Some(buffer) => buffer,
+            None => {
+                debug!("flush({}): no pending writes", id);
+                return done(Ok(()));
+            }
         };
-
-        self.hub
-            .files()
-            .update(f, &id)
-            .add_scope(drive3::Scope::Full)
-            .doit_without_upload()
-            .map(|_| ())
-            .map_err(|e| err_msg(format!("DriveFacade::move_to_trash() {}", e)))
+        self.invalidate(id);
+        self.content_lengths.insert(id.to_string(), None);
+
+        let journal = self.journal.clone();
+        let id = id.to_string();
+        let pending = PendingBytes(buffer.dirty_bytes() as i64);
+        self.queue_upload(&id.clone(), move |content| {
+            let _pending = pending;
+            let entry = journal.and_then(|journal| match journal.record(&id, &buffer) {
+                Ok(entry) => Some((journal, entry)),
+                Err(e) => {
+                    warn!(
+                        "Could not record the upload of {} in the journal: {}",
+                        id, e
+                    );
+                    None
+                }
+            });
+            let result = content.flush(
+                &id,
+                buffer,
+                entry
+                    .as_ref()
+                    .map(|&(ref journal, entry)| (&**journal, entry)),
+            );
+            if let (true, Some((journal, entry))) = (result.is_ok(), entry) {
+                journal.finish(entry);
+            }
+            done(result);
+        });
     }
 
-    /// Applies pending write operations. Similar to flushing a stream.
-    pub fn flush(&mut self, id: DriveIdRef) -> Result<(), Error> {
-        if !self.pending_writes.contains_key(id) {
-            debug!("flush({}): no pending writes", id);
-            return Ok(());
+    fn sync<F>(&mut self, id: DriveIdRef, done: F)
+    where
+        F: FnOnce(Result<(), Error>) + Send + 'static,
+    {
+        if self.pending_writes.contains_key(id) {
+            return self.flush(id, done);
         }
-        self.cache.remove(id);
-
-        if let Ok(false) = self.contains(id) {
-            return Err(err_msg(format!(
-                "flush({}): file doesn't exist on drive!",
-                id
-            )));
+        if !self.is_uploading(id) {
+            return done(Ok(()));
         }
-
-        let mut file_data = self.get_file_content(&id, None).unwrap_or_default();
-        self.apply_pending_writes_on_data(DriveId::from(id), &mut file_data);
-        self.update_file_content(DriveId::from(id), &file_data)?;
-
-        Ok(())
+        // Jobs for the same file run in order, so this one waits for the queued uploads.
+        self.uploaders.execute(id, move |_| done(Ok(())));
     }
 
-    /// Updates the content of a file on Drive. The MIME type is guessed appropriately based on the
-    /// content.
-    fn update_file_content(
-        &mut self,
-        id: DriveId,
-        data: &[u8],
-    ) -> Result<(Response, drive3::File), Error> {
-        let mime_guess = data.sniff_mime_type().unwrap_or("application/octet-stream");
-        debug!(
-            "Updating file content for {}. Mime type guess based on content: {}",
-            &id, &mime_guess
-        );
-
-        let file = drive3::File {
-            mime_type: Some(mime_guess.to_string()),
-            ..Default::default()
+    /// Like the other metadata mutations, the call is sent in a batch along with the mutations
+    /// requested around the same time. `done` is called on the batching thread.
+    fn delete_permanently<F>(&mut self, id: DriveIdRef, done: F)
+    where
+        F: FnOnce(Result<(), Error>) + Send + 'static,
+    {
+        let call = BatchCall {
+            method: Method::Delete,
+            path: format!("{}/{}", FILES_PATH, id),
+            body: None,
         };
-
-        self.hub
-            .files()
-            .update(file, &id)
-            .add_scope(drive3::Scope::Full)
-            .upload_resumable(DummyFile::new(data), mime_guess.parse().unwrap())
-            .map_err(|e| err_msg(format!("{:#?}", e)))
+        self.batcher.submit(call, done);
     }
 
-    /// Returns the size and capacity of the Drive account. In some cases, the limit can be absent.
-    pub fn size_and_capacity(&mut self) -> Result<(u64, Option<u64>), Error> {
-        let (_response, about) = self
-            .hub
-            .about()
-            .get()
-            .param("fields", "storageQuota")
-            .add_scope(drive3::Scope::Full)
-            .doit()
-            .map_err(|e| err_msg(format!("{:#?}", e)))?;
-
-        let storage_quota = about
-            .storage_quota
-            .ok_or_else(|| err_msg("size_and_capacity(): no storage quota in response"))?;
-
-        let usage = storage_quota.usage.unwrap().parse::<u64>().unwrap();
-        let limit = storage_quota.limit.map(|s| s.parse::<u64>().unwrap());
-
-        Ok((usage, limit))
-    }
-}
-
-/// A virtual (in-memory) file which implements the Read + Seek traits. Can be constructed from a
-/// slice of bytes. Useful for uploading some file content to Drive without actually storing the
-/// file locally on disk.
-struct DummyFile {
-    cursor: u64,
-    data: Vec<u8>,
-}
+    fn move_to<F>(
+        &mut self,
+        id: DriveIdRef,
+        parent: DriveIdRef,
+        new_name: &str,
+        current_parents: Option<Vec<DriveId>>,
+        done: F,
+    ) where
+        F: FnOnce(Result<(), Error>) + Send + 'static,
+    {
+        let current_parents = match current_parents {
+            Some(parents) => parents,
+            None => match self.content.get_file_metadata(id) {
+                Ok(file) => file.parents.unwrap_or_else(|| vec![String::from("root")]),
+                Err(e) => return done(Err(e)),
+            },
+        };
+        let name = match serde_json::to_string(new_name) {
+            Ok(name) => name,
+            Err(e) => return done(Err(e.into())),
+        };
 
-impl DummyFile {
-    fn new(data: &[u8]) -> DummyFile {
-        DummyFile {
-            cursor: 0,
-            data: Vec::from(data),
-        }
+        let call = BatchCall {
+            method: Method::Patch,
+            path: format!(
+                "{}/{}?removeParents={}&addParents={}",
+                FILES_PATH,
+                id,
+                current_parents.join(","),
+                parent
+            ),
+            body: Some(format!("{{\"name\":{}}}", name)),
+        };
+        self.batcher.submit(call, done);
     }
-}
 
-impl Seek for DummyFile {
-    fn seek(&mut self, pos: SeekFrom) -> io::Result<u64> {
-        let position: i64 = match pos {
-            SeekFrom::Start(offset) => offset as i64,
-            SeekFrom::End(offset) => self.data.len() as i64 - offset,
-            SeekFrom::Current(offset) => self.cursor as i64 + offset,
+    fn move_to_trash<F>(&mut self, id: DriveId, done: F)
+    where
+        F: FnOnce(Result<(), Error>) + Send + 'static,
+    {
+        let call = BatchCall {
+            method: Method::Patch,
+            path: format!("{}/{}", FILES_PATH, id),
+            body: Some(String::from("{\"trashed\":true}")),
         };
-
-        if position < 0 {
-            Err(io::Error::from(io::ErrorKind::InvalidInput))
-        } else {
-            self.cursor = position as u64;
-            Ok(self.cursor)
-        }
+        self.batcher.submit(call, done);
     }
-}
-
-impl Read for DummyFile {
-    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
-        let remaining = self.data.len() - self.cursor as usize;
-        let copied = cmp::min(buf.len(), remaining);
-
-        if copied > 0 {
-            buf[..]
-                .copy_from_slice(&self.data[self.cursor as usize..self.cursor as usize + copied]);
-        }
 
-        self.cursor += copied as u64;
-        Ok(copied)
+    fn invalidate(&mut self, id: DriveIdRef) {
+        self.store.remove_file(id);
     }
 }
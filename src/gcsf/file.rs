@@ -1,8 +1,9 @@
+use super::interner::Interned;
+use super::snapshot::FileAttrDef;
 use chrono::DateTime;
 use drive3;
 use failure::{err_msg, Error};
 use fuse::{FileAttr, FileType};
-use id_tree::NodeId;
 use std::collections::HashMap;
 use time::Timespec;
 
@@ -16,31 +17,103 @@ type DriveId = String;
 /// `identical_name_id`: if there are multiple files with the same name, this attribute indicates
 /// an additional numeric identifier for this particular file. This identifier influences the
 /// reported file name (e.g some_file.txt.1)
-/// `drive_file`: the associated Drive file (if one exists)
-#[derive(Debug, Clone)]
+/// `drive`: the metadata of the associated Drive file (if one exists)
+#[derive(Debug, Clone, Serialize, Deserialize)]
 pub struct File {
     pub name: String,
+    #[serde(with = "FileAttrDef")]
     pub attr: FileAttr,
     pub identical_name_id: Option<usize>,
-    pub drive_file: Option<drive3::File>,
+    pub drive: Option<DriveMeta>,
+}
+
+/// The part of the metadata of a Drive file which GCSF keeps for every file.
+///
+/// A `drive3::File` holds dozens of optional fields, most of which GCSF never reads, and every
+/// id and mime type in it is a string of its own. Only the fields below are kept; ids and mime
+/// types are `Interned`, so that the id of a directory is stored once however many children
+/// refer to it. Anything else can still be requested from Drive when it is needed (see
+/// `ContentClient::get_file_metadata`).
+#[derive(Debug, Clone, Default, Serialize, Deserialize)]
+pub struct DriveMeta {
+    /// The id of the file on Drive. Files which have not been created on Drive yet have none.
+    pub id: Option<Interned>,
+
+    /// The ids of the parent directories on Drive.
+    pub parents: Vec<Interned>,
+
+    /// The mime type of the file.
+    pub mime_type: Option<Interned>,
+
+    /// See `File::content_version()`.
+    pub version: Option<Box<str>>,
+
+    /// The length of the content stored on Drive. Google documents have none, since they are
+    /// exported instead.
+    pub size: Option<u64>,
+
+    /// Whether the file is in the trash.
+    pub trashed: bool,
+}
+
+impl DriveMeta {
+    /// Picks the fields which GCSF uses out of a Drive file.
+    pub fn from_drive_file(drive_file: &drive3::File) -> Self {
+        DriveMeta {
+            id: drive_file.id.as_ref().map(|id| Interned::new(id)),
+            parents: drive_file
+                .parents
+                .iter()
+                .flatten()
+                .map(|id| Interned::new(id))
+                .collect(),
+            mime_type: drive_file.mime_type.as_ref().map(|t| Interned::new(t)),
+            version: drive_file
+                .md5_checksum
+                .as_ref()
+                .or_else(|| drive_file.modified_time.as_ref())
+                .map(|v| v.as_str().into()),
+            size: drive_file.size.as_ref().and_then(|s| s.parse().ok()),
+            trashed: drive_file.trashed == Some(true),
+        }
+    }
+
+    /// The Drive file to create for a new local file named `name`.
+    pub fn to_drive_file(&self, name: &str) -> drive3::File {
+        drive3::File {
+            name: Some(name.to_string()),
+            mime_type: self.mime_type.as_ref().map(|t| t.to_string()),
+            parents: Some(self.parents.iter().map(|id| id.to_string()).collect()),
+            ..Default::default()
+        }
+    }
 }
 
 /// Specifies multiple ways of identifying a file:
 ///
 /// * by inode
 /// * by Drive ID
-/// * by Node ID (the ID stored in the file tree)
 /// * by parent inode + file name (as required by some fuse methods)
 ///
 /// These types are somewhat equivalent and can be converted into one another.
 #[derive(Debug, Clone)]
 pub enum FileId {
+    /// The inode of the file.
     Inode(Inode),
+    /// The Drive ID of the file.
     DriveId(String),
-    NodeId(NodeId),
-    ParentAndName { parent: Inode, name: String },
+    /// The inode of the directory holding the file, and the name of the file within it.
+    ParentAndName {
+        /// The inode of the directory.
+        parent: Inode,
+        /// The name of the file, as shown in the file system.
+        name: String,
+    },
 }
 
+/// The size reported for files whose size is not known yet.
+const UNKNOWN_SIZE: u64 = 10 * 1024 * 1024;
+
 lazy_static! {
     static ref EXTENSIONS: HashMap<&'static str, &'static str> = hashmap! {
             "application/vnd.google-apps.document" => "#.odt",
@@ -52,13 +125,11 @@ lazy_static! {
 }
 
 impl File {
-    /// Creates a new file using a Drive file as a template.
-    pub fn from_drive_file(inode: Inode, drive_file: drive3::File, add_extension: bool) -> Self {
-        let mut size = drive_file
-            .size
-            .clone()
-            .map(|size| size.parse::<u64>().unwrap_or_default())
-            .unwrap_or(10 * 1024 * 1024);
+    /// Creates a new file using a Drive file as a template. Drive reports no size for files which
+    /// must be exported (e.g. Google documents); these get `UNKNOWN_SIZE` until their export has
+    /// been downloaded once (see `FileManager::update_exported_size()`).
+    pub fn from_drive_file(inode: Inode, drive_file: &drive3::File, add_extension: bool) -> Self {
+        let mut size = Self::size_of(drive_file).unwrap_or(UNKNOWN_SIZE);
 
         let kind =
             if drive_file.mime_type == Some(String::from("application/vnd.google-apps.folder")) {
@@ -68,24 +139,9 @@ impl File {
                 FileType::RegularFile
             };
 
-        let times: Vec<_> = vec![
-            &drive_file.created_time,
-            &drive_file.modified_time,
-            &drive_file.viewed_by_me_time,
-        ]
-        .iter()
-        .map(
-            |time| match DateTime::parse_from_rfc3339(time.as_ref().unwrap_or(&String::new())) {
-                Ok(t) => Timespec {
-                    sec: t.timestamp(),
-                    nsec: t.timestamp_subsec_nanos() as i32,
-                },
-                Err(_) => Timespec { sec: 0, nsec: 0 },
-            },
-        )
-        .collect();
-
-        let (crtime, mtime, atime) = (times[0], times[1], times[2]);
+        let crtime = Self::parse_time(&drive_file.created_time);
+        let mtime = Self::parse_time(&drive_file.modified_time);
+        let atime = Self::parse_time(&drive_file.viewed_by_me_time);
         let bsize = 512;
 
         let mut attr = FileAttr {
@@ -109,51 +165,127 @@ impl File {
             attr.size = 512;
         }
 
-        let mut filename = drive_file.name.clone().unwrap();
-        // let owners: Vec<String> = drive_file
-        //     .owners
-        //     .clone()
-        //     .unwrap()
-        //     .into_iter()
-        //     .map(|owner| owner.email_address.unwrap())
-        //     .collect();
+        File {
+            name: Self::name_of(drive_file, add_extension),
+            attr,
+            identical_name_id: None,
+            drive: Some(DriveMeta::from_drive_file(drive_file)),
+        }
+    }
+
+    /// Updates the file after Drive reported a change of `drive_file`, which it was created
+    /// from. Only the fields which differ are replaced, and the creation time, which can not
+    /// change, is not parsed again.
+    ///
+    /// The name is left as is, since the name index of the parent directory needs the old one.
+    /// If the name or the parent of the file changed, the new name is returned, so that the
+    /// caller can move the file (see `FileManager::relink()`).
+    pub fn update_from_drive_file(
+        &mut self,
+        drive_file: &drive3::File,
+        add_extension: bool,
+    ) -> Option<String> {
+        let drive = self.drive.get_or_insert_with(DriveMeta::default);
+        let size = Self::size_of(drive_file);
+        let version = drive_file
+            .md5_checksum
+            .as_ref()
+            .or_else(|| drive_file.modified_time.as_ref())
+            .map(String::as_str);
+
+        // An exported file gets its size again once its new version has been downloaded.
+        let resized = drive.size != size || (size.is_none() && drive.version.as_deref() != version);
+        if drive.version.as_deref() != version {
+            drive.version = version.map(Into::into);
+        }
+        if drive.mime_type.as_ref().map(Interned::as_str) != drive_file.mime_type.as_deref() {
+            drive.mime_type = drive_file.mime_type.as_ref().map(|t| Interned::new(t));
+        }
+        drive.size = size;
+        drive.trashed = drive_file.trashed == Some(true);
 
+        // A file which Drive reports without parents stays where it is.
+        let parents = drive_file.parents.as_ref().filter(|p| !p.is_empty());
+        let reparented = parents.map_or(false, |parents| {
+            !drive
+                .parents
+                .iter()
+                .map(Interned::as_str)
+                .eq(parents.iter().map(String::as_str))
+        });
+        if reparented {
+            drive.parents = parents
+                .into_iter()
+                .flatten()
+                .map(|id| Interned::new(id))
+                .collect();
+        }
+
+        if resized && self.attr.kind != FileType::Directory {
+            self.set_size(size.unwrap_or(UNKNOWN_SIZE));
+        }
+        self.attr.mtime = Self::parse_time(&drive_file.modified_time);
+        self.attr.ctime = self.attr.mtime;
+        self.attr.atime = Self::parse_time(&drive_file.viewed_by_me_time);
+
+        let name = Self::name_of(drive_file, add_extension);
+        if reparented || name != self.name {
+            Some(name)
+        } else {
+            None
+        }
+    }
+
+    /// The length of the content of a Drive file. Drive reports none for files which must be
+    /// exported.
+    fn size_of(drive_file: &drive3::File) -> Option<u64> {
+        drive_file
+            .size
+            .as_ref()
+            .map(|size| size.parse::<u64>().unwrap_or_default())
+    }
+
+    /// Parses a time reported by Drive. Missing and malformed times become the epoch.
+    fn parse_time(time: &Option<String>) -> Timespec {
+        match time.as_ref().map(|time| DateTime::parse_from_rfc3339(time)) {
+            Some(Ok(t)) => Timespec {
+                sec: t.timestamp(),
+                nsec: t.timestamp_subsec_nanos() as i32,
+            },
+            _ => Timespec { sec: 0, nsec: 0 },
+        }
+    }
+
+    /// The name under which a Drive file is shown: its name on Drive without the characters
+    /// which are not allowed in file names, and with an extension for Google documents if
+    /// `add_extension` is set.
+    fn name_of(drive_file: &drive3::File, add_extension: bool) -> String {
+        let mut filename = drive_file.name.clone().unwrap_or_default();
         if add_extension {
-            let ext = drive_file
+            if let Some(ext) = drive_file
                 .mime_type
-                .clone()
-                .and_then(|t| EXTENSIONS.get::<str>(&t));
-            if ext.is_some() {
-                filename = format!("{}{}", filename, ext.unwrap());
+                .as_ref()
+                .and_then(|t| EXTENSIONS.get::<str>(t))
+            {
+                filename.push_str(ext);
             }
         }
 
-        File {
-            // name: format!("{} ({})", filename, owners.join(", ")),
-            name: filename
-                .chars()
-                .filter(|c| File::is_posix(c))
-                .collect::<String>(),
-            attr,
-            identical_name_id: None,
-            drive_file: Some(drive_file),
+        if filename.chars().all(|c| File::is_posix(&c)) {
+            return filename;
         }
+        filename.chars().filter(|c| File::is_posix(c)).collect()
     }
 
     /// Whether a character can be used in a valid POSIX file name.
     /// Read the [Wikipedia article](https://en.wikipedia.org/wiki/Filename)
     fn is_posix(c: &char) -> bool {
-        let forbidden = String::from("*/:<>?\\|");
-        !forbidden.contains(*c)
+        !"*/:<>?\\|".contains(*c)
     }
 
     /// Whether this file is trashed on Drive.
     pub fn is_trashed(&self) -> bool {
-        self.drive_file
-            .as_ref()
-            .map(|f| f.trashed)
-            .unwrap_or_default()
-            .unwrap_or(false)
+        self.drive.as_ref().map_or(false, |d| d.trashed)
     }
 
     // Trashing a file does not trigger a file update from Drive. Therefore this field must be
@@ -161,8 +293,8 @@ impl File {
     // permanently the next time unlink() is called.
     pub fn set_trashed(&mut self, trashed: bool) -> Result<(), Error> {
         let ino = self.inode();
-        if let Some(ref mut drive_file) = self.drive_file.as_mut() {
-            drive_file.trashed = Some(trashed);
+        if let Some(drive) = self.drive.as_mut() {
+            drive.trashed = trashed;
             Ok(())
         } else {
             Err(err_msg(format!(
@@ -175,11 +307,8 @@ impl File {
 
     #[allow(dead_code)]
     pub fn is_drive_document(&self) -> bool {
-        self.drive_file
-            .as_ref()
-            .and_then(|f| f.mime_type.clone())
-            .map(|t| EXTENSIONS.contains_key::<str>(&t))
-            == Some(true)
+        self.mime_type()
+            .map_or(false, |t| EXTENSIONS.contains_key::<str>(t))
     }
 
     pub fn name(&self) -> String {
@@ -189,6 +318,13 @@ impl File {
         }
     }
 
+    /// Sets the size of the file, along with the number of blocks it takes.
+    pub fn set_size(&mut self, size: u64) {
+        let bsize = 512;
+        self.attr.size = size;
+        self.attr.blocks = size / bsize + if size % bsize > 0 { 1 } else { 0 };
+    }
+
     pub fn inode(&self) -> Inode {
         self.attr.ino
     }
@@ -198,33 +334,32 @@ impl File {
     }
 
     pub fn drive_parent(&self) -> Option<String> {
-        self.drive_file.as_ref()?;
-
-        self.drive_file
-            .clone()
-            .unwrap()
+        self.drive
+            .as_ref()?
             .parents
-            .and_then(|parents| parents.iter().take(1).next().cloned())
+            .first()
+            .map(|id| id.to_string())
     }
 
     pub fn drive_id(&self) -> Option<String> {
-        self.drive_file.as_ref()?;
-
-        self.drive_file.as_ref().unwrap().id.clone()
+        self.drive.as_ref()?.id.as_ref().map(|id| id.to_string())
     }
 
     pub fn set_drive_id(&mut self, id: DriveId) {
-        if self.drive_file.is_none() {
-            return;
+        if let Some(drive) = self.drive.as_mut() {
+            drive.id = Some(Interned::new(&id));
         }
-
-        self.drive_file.as_mut().unwrap().id = Some(id);
     }
 
-    #[allow(dead_code)]
-    pub fn mime_type(&self) -> Option<String> {
-        self.drive_file.as_ref()?;
+    /// Identifies the current version of the file content, so that cached content can be told
+    /// apart from content which has changed since. Uses the MD5 checksum if Drive provides one
+    /// and the modification time otherwise (e.g. for Google documents). Files modified locally
+    /// have no version until they are listed again.
+    pub fn content_version(&self) -> Option<String> {
+        self.drive.as_ref()?.version.as_ref().map(|v| v.to_string())
+    }
 
-        self.drive_file.as_ref().unwrap().mime_type.clone()
+    pub fn mime_type(&self) -> Option<&str> {
+        self.drive.as_ref()?.mime_type.as_ref().map(|t| t.as_str())
     }
 }
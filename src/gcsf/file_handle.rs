@@ -0,0 +1,147 @@
+use super::ReadAhead;
+use fuse::FileType;
+use std::collections::HashMap;
+
+type Inode = u64;
+
+/// The state of a single open file, i.e. of one `open()` (or `create()`) and everything done
+/// through the handle it returned until the matching `release()`.
+#[derive(Debug)]
+pub struct FileHandle {
+    /// The file which was opened.
+    pub inode: Inode,
+
+    /// The access pattern of the reads made through this handle. Readers of the same file which
+    /// opened it separately are tracked separately, so each sequential stream gets its own
+    /// prefetching.
+    pub read_ahead: ReadAhead,
+
+    /// Whether anything was written through this handle since it was opened or synced.
+    pub written: bool,
+}
+
+/// An entry of a directory listing.
+#[derive(Debug, Clone, PartialEq)]
+pub struct DirEntry {
+    /// The inode of the child.
+    pub inode: Inode,
+
+    /// The kind of the child.
+    pub kind: FileType,
+
+    /// The name under which the child is listed.
+    pub name: String,
+}
+
+/// The state of an open directory: the listing captured by `opendir()`, which every `readdir()`
+/// through the handle pages through. Changes made to the directory while it is open do not
+/// shift the entries under a reader which is halfway through it.
+#[derive(Debug)]
+struct DirHandle {
+    inode: Inode,
+    entries: Vec<DirEntry>,
+}
+
+/// The open file handles of the file system.
+///
+/// Writes to a file are buffered per file, whichever handle they come through, so that every
+/// handle sees the same content. They are uploaded once the last handle which wrote to the file
+/// is released (or when a handle is synced), instead of on every `flush()`, which the kernel
+/// sends for each `close()` of a duplicated descriptor.
+#[derive(Debug, Default)]
+pub struct FileHandles {
+    handles: HashMap<u64, FileHandle>,
+
+    /// The open directories. Their handles are given out from the same sequence as those of
+    /// files.
+    directories: HashMap<u64, DirHandle>,
+
+    /// Maps inodes to the number of handles open for them.
+    open_counts: HashMap<Inode, usize>,
+
+    /// The last handle given out. Handles are never reused, so that a stale handle can not be
+    /// mistaken for a new one.
+    last_handle: u64,
+}
+
+impl FileHandles {
+    /// Creates an empty set of handles.
+    pub fn new() -> Self {
+        FileHandles::default()
+    }
+
+    /// Opens a handle for a file, reading ahead by at most `read_ahead_chunks` chunks. Returns
+    /// the handle, which is never zero.
+    pub fn open(&mut self, inode: Inode, read_ahead_chunks: u64) -> u64 {
+        self.last_handle += 1;
+        self.handles.insert(
+            self.last_handle,
+            FileHandle {
+                inode,
+                read_ahead: ReadAhead::new(read_ahead_chunks),
+                written: false,
+            },
+        );
+        *self.open_counts.entry(inode).or_insert(0) += 1;
+        self.last_handle
+    }
+
+    /// Returns the state of an open handle. Handles of other files than `inode` are ignored,
+    /// since the kernel may send requests without a handle (e.g. a truncation by path).
+    pub fn get_mut(&mut self, fh: u64, inode: Inode) -> Option<&mut FileHandle> {
+        self.handles
+            .get_mut(&fh)
+            .filter(|handle| handle.inode == inode)
+    }
+
+    /// Closes a handle and returns its final state.
+    pub fn release(&mut self, fh: u64) -> Option<FileHandle> {
+        let handle = self.handles.remove(&fh)?;
+        let closed = self
+            .open_counts
+            .get_mut(&handle.inode)
+            .map_or(false, |count| {
+                *count -= 1;
+                *count == 0
+            });
+        if closed {
+            self.open_counts.remove(&handle.inode);
+        }
+        Some(handle)
+    }
+
+    /// Whether any open handle of a file has been written to since it was opened or synced.
+    pub fn is_written(&self, inode: Inode) -> bool {
+        self.handles
+            .values()
+            .any(|handle| handle.inode == inode && handle.written)
+    }
+
+    /// Whether any handle of a file is open.
+    pub fn is_open(&self, inode: Inode) -> bool {
+        self.open_counts.contains_key(&inode)
+    }
+
+    /// Opens a handle for a directory, holding its listing. Returns the handle, which is never
+    /// zero.
+    pub fn open_dir(&mut self, inode: Inode, entries: Vec<DirEntry>) -> u64 {
+        self.last_handle += 1;
+        self.directories
+            .insert(self.last_handle, DirHandle { inode, entries });
+        self.last_handle
+    }
+
+    /// Returns the listing held by an open directory handle, unless it belongs to another
+    /// directory than `inode`.
+    pub fn dir_entries(&self, fh: u64, inode: Inode) -> Option<&[DirEntry]> {
+        self.directories
+            .get(&fh)
+            .filter(|handle| handle.inode == inode)
+            .map(|handle| handle.entries.as_slice())
+    }
+
+    /// Closes a directory handle, dropping its listing.
+    pub fn release_dir(&mut self, fh: u64) {
+        self.directories.remove(&fh);
+    }
+}
@@ -1,15 +1,16 @@
-use super::{File, FileId};
+use super::inode_table::InodeTable;
+use super::interner::Interned;
+use super::metrics;
+use super::{DriveBackend, DriveMeta, File, FileId, Listing, Snapshot, SnapshotEntry};
 use drive3;
 use failure::{err_msg, Error};
 use fuse::{FileAttr, FileType};
-use id_tree::InsertBehavior::*;
-use id_tree::MoveBehavior::*;
-use id_tree::RemoveBehavior::*;
-use id_tree::{Node, NodeId, Tree, TreeBuilder};
-use std::collections::HashMap;
-use std::collections::LinkedList;
+use std::cmp;
+use std::collections::{HashMap, HashSet};
 use std::fmt;
-use std::time::{Duration, SystemTime};
+use std::mem;
+use std::path::{Path, PathBuf};
+use std::time::{Duration, SystemTime, UNIX_EPOCH};
 use time::Timespec;
 use DriveFacade;
 
@@ -20,6 +21,10 @@ const ROOT_INODE: Inode = 1;
 const TRASH_INODE: Inode = 2;
 const SHARED_INODE: Inode = 3;
 
+/// How many files may be removed from the tree before the strings which only they used are
+/// freed. Freeing them scans every stored string, so it is not done after every change.
+const GARBAGE_THRESHOLD: usize = 1024;
+
 macro_rules! unwrap_or_continue {
     ($res:expr) => {
         match $res {
@@ -33,21 +38,29 @@ macro_rules! unwrap_or_continue {
 }
 
 /// Manages files locally and uses a DriveFacade in order to communicate with Google Drive and to ensure consistency between the local and remote state.
-pub struct FileManager {
-    /// A representation of the file tree. Each tree node stores the inode of the corresponding file.
-    tree: Tree<Inode>,
-
-    /// Maps inodes to the corresponding files.
-    pub files: HashMap<Inode, File>,
-
-    /// Maps inodes to corresponding node ids that `tree` uses.
-    pub node_ids: HashMap<Inode, NodeId>,
-
-    /// Maps Google Drive ids (i.e strings) to corresponding inodes.
-    pub drive_ids: HashMap<DriveId, Inode>,
+///
+/// The backend can be replaced by any other `DriveBackend`, such as the in-memory
+/// `SyntheticDrive`.
+pub struct FileManager<B = DriveFacade> {
+    /// The file tree: every file, indexed by inode, along with its place in the tree.
+    pub files: InodeTable,
+
+    /// Maps Google Drive ids (i.e strings) to corresponding inodes. The ids are shared with the
+    /// metadata of the files.
+    pub drive_ids: HashMap<Interned, Inode>,
+
+    /// Maps the inode of every directory to the names of its children, as shown in the file
+    /// system, and the inodes of the children with each name. Makes looking up a file by its
+    /// parent and name independent of the size of the directory.
+    child_names: HashMap<Inode, HashMap<String, Vec<Inode>>>,
+
+    /// Maps the inode of every directory to the number of children which have each name, not
+    /// counting the numeric suffixes added to identical names. Only kept if
+    /// `rename_identical_files` is enabled.
+    base_name_counts: HashMap<Inode, HashMap<String, usize>>,
 
     /// A `DriveFacade` is used in order to communicate with the Google Drive API.
-    pub df: DriveFacade,
+    pub df: B,
 
     /// The last timestamp when the file manager asked Google Drive for remote changes.
     pub last_sync: SystemTime,
@@ -66,45 +79,230 @@ pub struct FileManager {
     /// Deleting trashed files always removes them permanently.
     pub skip_trash: bool,
 
+    /// If enabled, the children of a directory are only listed the first time they are needed
+    /// (see `load_children()`), instead of listing every file on Drive when mounting.
+    lazy_loading: bool,
+
+    /// The directories whose children have been listed, if `lazy_loading` is enabled. Changes
+    /// to the children of other directories are ignored, since they are listed later anyway.
+    loaded: HashSet<Inode>,
+
+    /// Where to store the snapshot of the file tree, if snapshots are enabled.
+    snapshot_file: Option<PathBuf>,
+
+    /// Specifies how much time is needed to pass since `last_snapshot` for a new snapshot to be
+    /// stored during a sync.
+    snapshot_interval: Duration,
+
+    /// The last timestamp when the file tree was stored in `snapshot_file`.
+    last_snapshot: SystemTime,
+
+    /// How many files have been removed from the tree since unused strings were last freed.
+    removed_files: usize,
+
     last_inode: Inode,
 }
 
-impl FileManager {
+impl<B: DriveBackend> FileManager<B> {
     /// Creates a new FileManager with a specific `sync_interval` and an injected `DriveFacade`.
     /// Also populates the manager's file tree with files contained in "My Drive" and "Trash".
+    ///
+    /// If a `snapshot_file` is given and holds a snapshot of the tree, the tree is loaded from it
+    /// and only the changes made since the snapshot are retrieved from Drive.
+    ///
+    /// With `lazy_loading`, only the root and the special directories are created, and every
+    /// directory is listed once it is first looked into.
     pub fn with_drive_facade(
         rename_identical_files: bool,
         add_extensions_to_special_files: bool,
         skip_trash: bool,
+        lazy_loading: bool,
         sync_interval: Duration,
-        df: DriveFacade,
+        snapshot_file: Option<PathBuf>,
+        snapshot_interval: Duration,
+        df: B,
     ) -> Result<Self, Error> {
         let mut manager = FileManager {
-            tree: TreeBuilder::new().with_node_capacity(500).build(),
-            files: HashMap::new(),
-            node_ids: HashMap::new(),
+            files: InodeTable::new(),
             drive_ids: HashMap::new(),
+            child_names: HashMap::new(),
+            base_name_counts: HashMap::new(),
             last_sync: SystemTime::now(),
             rename_identical_files,
             add_extensions_to_special_files,
             skip_trash,
+            lazy_loading,
+            loaded: HashSet::new(),
             sync_interval,
+            snapshot_file,
+            snapshot_interval,
+            last_snapshot: SystemTime::now(),
+            removed_files: 0,
             df,
-            last_inode: 2,
+            // The special directories take the first inodes.
+            last_inode: SHARED_INODE,
         };
 
-        manager
-            .populate()
+        let mut restored = false;
+        if let Some(path) = manager.snapshot_file.clone() {
+            if path.exists() {
+                match manager.restore(&path) {
+                    Ok(()) => restored = true,
+                    Err(e) => {
+                        warn!("Could not restore snapshot {:?}: {}", &path, e);
+                        manager.clear();
+                    }
+                }
+            }
+        }
+
+        if !restored {
+            manager.populate_all()?;
+        }
+        metrics::record_sync();
+
+        let sync_interval = manager.sync_interval;
+        if let Err(e) = manager.df.start_polling_changes(sync_interval) {
+            error!("Could not poll for changes in the background: {}", e);
+        }
+        Ok(manager)
+    }
+
+    /// Retrieves all files from Drive, including the trashed ones, and adds them locally.
+    fn populate_all(&mut self) -> Result<(), Error> {
+        // Changes made while the files are being listed must not be missed by the first sync.
+        self.df
+            .changes_token()
+            .map_err(|e| err_msg(format!("Could not get changes token:\n{}", e)))?;
+        // Store a snapshot during the first sync.
+        self.last_snapshot = UNIX_EPOCH;
+
+        self.add_special_dirs()?;
+        if self.lazy_loading {
+            return Ok(());
+        }
+        self.populate()
             .map_err(|e| err_msg(format!("Could not populate file system:\n{}", e)))?;
-        manager
-            .populate_trash()
+        self.populate_trash()
             .map_err(|e| err_msg(format!("Could not populate trash dir:\n{}", e)))?;
-        Ok(manager)
+        Ok(())
+    }
+
+    /// Loads the file tree from a snapshot and applies the changes made on Drive since the
+    /// snapshot was taken.
+    fn restore(&mut self, path: &Path) -> Result<(), Error> {
+        let snapshot = Snapshot::load(path)?;
+        if snapshot.root_id != *self.df.root_id()? {
+            return Err(err_msg("Snapshot was taken of another account"));
+        }
+        if snapshot.add_extensions_to_special_files != self.add_extensions_to_special_files
+            || snapshot.rename_identical_files != self.rename_identical_files
+        {
+            return Err(err_msg(
+                "Snapshot was taken with different file naming settings",
+            ));
+        }
+
+        // A snapshot without the list of loaded directories holds the whole tree.
+        let loaded = match (snapshot.loaded_dirs, self.lazy_loading) {
+            (Some(_), false) => {
+                return Err(err_msg("Snapshot holds only the directories loaded lazily"));
+            }
+            (Some(loaded), true) => Some(loaded),
+            (None, _) => None,
+        };
+
+        info!(
+            "Loading {} files from snapshot {:?}",
+            snapshot.entries.len(),
+            path
+        );
+        for entry in snapshot.entries {
+            if loaded.is_none() && self.lazy_loading && entry.file.kind() == FileType::Directory {
+                self.loaded.insert(entry.file.inode());
+            }
+            self.insert_locally(entry.file, entry.parent.map(FileId::Inode))?;
+        }
+        self.loaded.extend(loaded.unwrap_or_default());
+        self.last_inode = snapshot.last_inode;
+        self.df.set_changes_token(Some(snapshot.changes_token));
+
+        // Catch up with the changes made while the file system was not mounted.
+        self.last_sync = UNIX_EPOCH;
+        self.sync()
+    }
+
+    /// Forgets all files, e.g. after failing to restore a snapshot.
+    fn clear(&mut self) {
+        self.files.clear();
+        self.drive_ids.clear();
+        self.child_names.clear();
+        self.base_name_counts.clear();
+        self.loaded.clear();
+        self.last_inode = SHARED_INODE;
+        self.df.set_changes_token(None);
+    }
+
+    /// Stores the file tree in the snapshot file, if snapshots are enabled.
+    pub fn save_snapshot(&mut self) -> Result<(), Error> {
+        let path = match self.snapshot_file.clone() {
+            Some(path) => path,
+            None => return Ok(()),
+        };
+
+        // Parents are listed before their children, so that the tree can be rebuilt in order.
+        let mut entries = Vec::with_capacity(self.files.len());
+        if let Some(root) = self.files.root() {
+            let mut stack: Vec<(Option<Inode>, Inode)> = vec![(None, root)];
+
+            while let Some((parent, inode)) = stack.pop() {
+                let file = self
+                    .files
+                    .get(inode)
+                    .ok_or_else(|| err_msg(format!("Cannot find file with inode {}", inode)))?;
+                entries.push(SnapshotEntry {
+                    parent,
+                    file: file.clone(),
+                });
+
+                // Children come out of the stack last one first. Since they are inserted in
+                // front of their siblings, this restores them in their current order.
+                stack.extend(self.files.children(inode).map(|child| (Some(inode), child)));
+            }
+        }
+
+        let snapshot = Snapshot::new(
+            self.df.root_id()?.clone(),
+            self.df.changes_token()?.clone(),
+            self.last_inode,
+            self.add_extensions_to_special_files,
+            self.rename_identical_files,
+            entries,
+            if self.lazy_loading {
+                Some(self.loaded.iter().cloned().collect())
+            } else {
+                None
+            },
+        );
+        snapshot.save(&path)?;
+        self.last_snapshot = SystemTime::now();
+
+        info!(
+            "Stored {} files in snapshot {:?}",
+            snapshot.entries.len(),
+            &path
+        );
+        Ok(())
     }
 
     /// Tries to retrieve recent changes from the `DriveFacade` and apply them locally in order to
-    /// maintain data consistency. Fails early if not enough time has passed since the last sync.
+    /// maintain data consistency. If changes are polled for in the background, applies the ones
+    /// found so far. Otherwise, fails early if not enough time has passed since the last sync.
     pub fn sync(&mut self) -> Result<(), Error> {
+        if self.df.is_polling_changes() {
+            return self.apply_polled_changes();
+        }
+
         if SystemTime::now().duration_since(self.last_sync).unwrap() < self.sync_interval {
             return Err(err_msg(
                 "Not enough time has passed since last sync. Will do nothing.",
@@ -114,36 +312,92 @@ impl FileManager {
         info!("Checking for changes and possibly applying them.");
         self.last_sync = SystemTime::now();
 
-        for change in self
-            .df
-            .get_all_changes()?
-            .into_iter()
-            .filter(|change| change.file.is_some())
-        {
-            debug!("Processing a change from {:?}", &change.time);
-            let id = FileId::DriveId(change.file_id.unwrap());
+        let changes = self.df.get_all_changes()?;
+        self.apply_changes(changes)?;
+        metrics::record_sync();
+        Ok(())
+    }
+
+    /// Applies the changes which the background poller has found so far. Does not block and does
+    /// not communicate with Drive, so it can be called before serving any request.
+    pub fn apply_polled_changes(&mut self) -> Result<(), Error> {
+        let changes = match self.df.take_polled_changes() {
+            Some(changes) => changes,
+            None => return Ok(()),
+        };
+        if !changes.is_empty() {
+            debug!("Applying {} changes found in the background", changes.len());
+        }
+        self.last_sync = SystemTime::now();
+        self.apply_changes(changes)?;
+        // Every poll which has finished so far is applied, so the file tree is up to date.
+        metrics::record_sync();
+        Ok(())
+    }
+
+    /// Applies changes reported by Drive to the local file tree. Stores a snapshot afterwards if
+    /// enough time has passed since the last one.
+    ///
+    /// Only the last change of every file is applied, and only the fields which it changes are
+    /// updated. Files are only moved if their name or their parent changed.
+    fn apply_changes(&mut self, changes: Vec<drive3::Change>) -> Result<(), Error> {
+        let changed = !changes.is_empty();
+        let changes = Self::latest_changes(changes);
+        if changed {
+            debug!("Applying changes to {} files", changes.len());
+        }
+
+        for change in changes.into_iter().filter(|change| change.file.is_some()) {
+            let drive_id = change.file_id.unwrap();
+            let id = FileId::DriveId(drive_id.clone());
             let drive_f = change.file.unwrap();
 
+            // Cached content of a file which changed on Drive is stale.
+            let version = drive_f
+                .md5_checksum
+                .as_ref()
+                .or(drive_f.modified_time.as_ref())
+                .map(String::as_str);
+            let unchanged = self.get_file(&id).map_or(false, |f| {
+                f.drive.as_ref().and_then(|d| d.version.as_deref()) == version
+                    && Some(true) != drive_f.trashed
+            });
+            if !unchanged {
+                self.df.invalidate(&drive_id);
+            }
+
+            // A file in a directory which has not been loaded yet is listed along with it.
+            if self.is_outside_loaded_dirs(&id, &drive_f) {
+                if self.contains(&id) {
+                    debug!("Moved to a directory which is not loaded. Remove it locally.");
+                    if let Err(e) = self.delete_locally(&id) {
+                        error!("Could not delete locally: {:?}", e)
+                    }
+                }
+                continue;
+            }
+
             // New file. Create it locally
             if !self.contains(&id) {
-                debug!("New file. Create it locally");
                 let f = File::from_drive_file(
                     self.next_available_inode(),
-                    drive_f.clone(),
+                    &drive_f,
                     self.add_extensions_to_special_files,
                 );
-                debug!("newly created file: {:#?}", &f);
-
-                let parent = f.drive_parent().unwrap();
-                debug!("drive parent: {:#?}", &parent);
-                self.add_file_locally(f, Some(FileId::DriveId(parent)))?;
-                debug!("self.add_file_locally() finished");
+                // As in `populate()`, a file without a known parent is shown in "Shared with me".
+                let parent = f
+                    .drive_parent()
+                    .map(FileId::DriveId)
+                    .filter(|parent| self.contains(parent))
+                    .unwrap_or(FileId::Inode(SHARED_INODE));
+                debug!("New file {:?} in {:?}. Create it locally", &f.name, &parent);
+                self.add_file_locally(f, Some(parent))?;
             }
 
             // Trashed file. Move it to trash locally
             if Some(true) == drive_f.trashed {
                 debug!("Trashed file. Move it to trash locally");
-                let result = self.move_file_to_trash(&id, false);
+                let result = self.move_file_to_trash_locally(&id);
                 if result.is_err() {
                     error!("Could not move to trash: {:?}", result)
                 }
@@ -160,84 +414,217 @@ impl FileManager {
                 continue;
             }
 
-            // Anything else: reconstruct the file locally and move it under its parent.
-            debug!("Anything else: reconstruct the file locally and move it under its parent.");
-            let new_parent = {
+            // Anything else: update the file locally and move it if it was renamed or moved.
+            let (inode, new_name, new_parent) = {
                 let add_extension = self.add_extensions_to_special_files;
                 let f = unwrap_or_continue!(self.get_mut_file(&id));
-                *f = File::from_drive_file(f.inode(), drive_f.clone(), add_extension);
-                FileId::DriveId(f.drive_parent().unwrap())
+                let new_name = match f.update_from_drive_file(&drive_f, add_extension) {
+                    Some(new_name) => new_name,
+                    None => continue,
+                };
+                (f.inode(), new_name, f.drive_parent())
             };
-            let result = self.move_locally(&id, &new_parent);
+            debug!("{:?} was renamed or moved", &new_name);
+            let result = new_parent
+                .and_then(|parent| self.get_inode(&FileId::DriveId(parent)))
+                .ok_or_else(|| err_msg("Target node doesn't exist"))
+                .and_then(|parent| self.relink(inode, parent, new_name));
             if result.is_err() {
                 error!("Could not move locally: {:?}", result)
             }
         }
 
+        // Ids of files which have been removed may not be used anymore.
+        if self.removed_files >= GARBAGE_THRESHOLD {
+            Interned::collect_garbage();
+            self.removed_files = 0;
+        }
+
+        if self.snapshot_file.is_some()
+            && SystemTime::now()
+                .duration_since(self.last_snapshot)
+                .unwrap_or_default()
+                >= self.snapshot_interval
+        {
+            if let Err(e) = self.save_snapshot() {
+                error!("Could not store snapshot: {}", e);
+            }
+        }
+
         Ok(())
     }
 
+    /// Keeps the last change of every file, in the order in which those last changes were made.
+    /// Drive reports a file once for every time it changed, while only its latest state
+    /// matters.
+    fn latest_changes(changes: Vec<drive3::Change>) -> Vec<drive3::Change> {
+        let mut seen = HashSet::with_capacity(changes.len());
+        let mut latest: Vec<drive3::Change> = changes
+            .into_iter()
+            .rev()
+            .filter(|change| match change.file_id {
+                Some(ref id) => seen.insert(id.clone()),
+                None => true,
+            })
+            .collect();
+        latest.reverse();
+        latest
+    }
+
     /// Retrieves all files and directories shown in "My Drive" and "Shared with me" and adds them locally.
     fn populate(&mut self) -> Result<(), Error> {
-        let root = self.new_root_file();
-        self.add_file_locally(root, None)?;
+        // Files whose parent has not been listed yet wait in "Shared with me", grouped by the
+        // Drive ID of that parent, which adopts them as soon as it is listed.
+        let mut orphans: HashMap<DriveId, Vec<Inode>> = HashMap::new();
+        let mut current_page = 1;
+
+        for page in self.df.list_all_files(Some(false))? {
+            let page = page?;
+            info!(
+                "Received page {} containing {} files",
+                current_page,
+                page.len()
+            );
+            current_page += 1;
 
-        let shared = self.new_special_dir("Shared with me", Some(SHARED_INODE));
-        self.add_file_locally(shared, Some(FileId::Inode(ROOT_INODE)))?;
+            for drive_file in page {
+                let file = File::from_drive_file(
+                    self.next_available_inode(),
+                    &drive_file,
+                    self.add_extensions_to_special_files,
+                );
+                let inode = file.inode();
+                let drive_id = file.drive_id();
 
-        for drive_file in self.df.get_all_files(None, Some(false))? {
-            let file = File::from_drive_file(
-                self.next_available_inode(),
-                drive_file,
-                self.add_extensions_to_special_files,
-            );
-            self.add_file_locally(file, Some(FileId::Inode(3)))?;
-        }
+                match file.drive_parent() {
+                    Some(ref parent) if self.contains(&FileId::DriveId(parent.clone())) => {
+                        self.add_file_locally(file, Some(FileId::DriveId(parent.clone())))?;
+                    }
+                    parent => {
+                        self.add_file_locally(file, Some(FileId::Inode(SHARED_INODE)))?;
+                        if let Some(parent) = parent {
+                            orphans.entry(parent).or_insert_with(Vec::new).push(inode);
+                        }
+                    }
+                }
 
-        let mut moves: LinkedList<(FileId, FileId)> = LinkedList::new();
-        for (inode, file) in &self.files {
-            if let Some(parent) = file.drive_parent() {
-                if self.contains(&FileId::DriveId(parent.clone())) {
-                    moves.push_back((FileId::Inode(*inode), FileId::DriveId(parent)));
+                for child in drive_id
+                    .and_then(|id| orphans.remove(&id))
+                    .unwrap_or_default()
+                {
+                    if let Err(e) = self.move_locally(&FileId::Inode(child), &FileId::Inode(inode))
+                    {
+                        error!("{}", e);
+                    }
                 }
             }
         }
 
-        for (inode, parent) in &moves {
-            if let Err(e) = self.move_locally(inode, parent) {
-                error!("{}", e);
+        Ok(())
+    }
+
+    /// Retrieves all trashed files and directories and adds them locally in the Trash dir.
+    fn populate_trash(&mut self) -> Result<(), Error> {
+        for page in self.df.list_all_files(Some(true))? {
+            for drive_file in page? {
+                let file = File::from_drive_file(
+                    self.next_available_inode(),
+                    &drive_file,
+                    self.add_extensions_to_special_files,
+                );
+                self.add_file_locally(file, Some(FileId::Inode(TRASH_INODE)))?;
             }
         }
 
         Ok(())
     }
 
-    /// Retrieves all trashed files and directories and adds them locally in a special directory.
-    fn populate_trash(&mut self) -> Result<(), Error> {
-        let root_id = self.df.root_id()?.to_string();
+    /// Creates the root directory along with the "Shared with me" and "Trash" directories in it.
+    fn add_special_dirs(&mut self) -> Result<(), Error> {
+        let root = self.new_root_file();
+        self.add_file_locally(root, None)?;
+
+        let shared = self.new_special_dir("Shared with me", Some(SHARED_INODE));
+        self.add_file_locally(shared, Some(FileId::Inode(ROOT_INODE)))?;
+
         let trash = self.new_special_dir("Trash", Some(TRASH_INODE));
-        self.add_file_locally(trash.clone(), Some(FileId::DriveId(root_id)))?;
+        self.add_file_locally(trash, Some(FileId::Inode(ROOT_INODE)))?;
+
+        Ok(())
+    }
+
+    /// Lists the children of a directory on Drive and adds them locally, if `lazy_loading` is
+    /// enabled and they have not been listed yet. Must be called before looking into a
+    /// directory. Files which are already known (e.g. shared files, which may appear in more
+    /// than one place) are left where they are.
+    pub fn load_children(&mut self, inode: Inode) -> Result<(), Error> {
+        if !self.lazy_loading || self.loaded.contains(&inode) {
+            return Ok(());
+        }
+        let drive_id = match self.files.get(inode) {
+            Some(file) if file.kind() == FileType::Directory => file.drive_id(),
+            _ => return Ok(()),
+        };
+        let listing = match (inode, drive_id.as_ref()) {
+            (SHARED_INODE, _) => Listing::Shared,
+            (TRASH_INODE, _) => Listing::Trashed,
+            (_, Some(id)) => Listing::Children(id),
+            (_, None) => return Ok(()),
+        };
+
+        let children = self.df.list_files(listing)?;
+        debug!("Loaded {} children of inode {}", children.len(), inode);
+        for drive_file in children {
+            let known = drive_file
+                .id
+                .as_ref()
+                .map_or(true, |id| self.contains(&FileId::DriveId(id.clone())));
+            if known {
+                continue;
+            }
 
-        for drive_file in self.df.get_all_files(None, Some(true))? {
             let file = File::from_drive_file(
                 self.next_available_inode(),
-                drive_file,
+                &drive_file,
                 self.add_extensions_to_special_files,
             );
-            self.add_file_locally(file, Some(FileId::Inode(trash.inode())))?;
+            self.add_file_locally(file, Some(FileId::Inode(inode)))?;
         }
 
+        self.loaded.insert(inode);
         Ok(())
     }
 
+    /// Whether a change puts an untrashed file into a directory whose children have not been
+    /// listed, if `lazy_loading` is enabled. Files which were listed in "Shared with me" stay
+    /// there, wherever their parent is.
+    fn is_outside_loaded_dirs(&self, id: &FileId, drive_file: &drive3::File) -> bool {
+        if !self.lazy_loading || Some(true) == drive_file.trashed {
+            return false;
+        }
+
+        let loaded = drive_file
+            .parents
+            .as_ref()
+            .and_then(|parents| parents.first())
+            .and_then(|parent| self.get_inode(&FileId::DriveId(parent.clone())))
+            .map_or(false, |parent| self.loaded.contains(&parent));
+        let shared = self
+            .get_inode(id)
+            .and_then(|inode| self.files.parent(inode))
+            == Some(SHARED_INODE);
+        !loaded && !shared
+    }
+
     /// Creates a new File struct which represents the root directory. If possible, it fills in the exact DriveId. If not, it
     /// keeps using "root" as a placeholder id.
     fn new_root_file(&mut self) -> File {
-        let mut drive_file = drive3::File::default();
-
         let fallback_id = String::from("root");
         let root_id = self.df.root_id().unwrap_or(&fallback_id);
-        drive_file.id = Some(root_id.to_string());
+        let drive = DriveMeta {
+            id: Some(Interned::new(root_id)),
+            ..Default::default()
+        };
 
         File {
             name: String::from("."),
@@ -258,7 +645,7 @@ impl FileManager {
                 flags: 0,
             },
             identical_name_id: None,
-            drive_file: Some(drive_file),
+            drive: Some(drive),
         }
     }
 
@@ -284,7 +671,7 @@ impl FileManager {
                 flags: 0,
             },
             identical_name_id: None,
-            drive_file: None,
+            drive: None,
         }
     }
 
@@ -297,30 +684,12 @@ impl FileManager {
     /// Returns true if the file identified by a given id exists in the filesystem.
     pub fn contains(&self, file_id: &FileId) -> bool {
         match file_id {
-            FileId::Inode(inode) => self.node_ids.contains_key(&inode),
-            FileId::DriveId(drive_id) => self.drive_ids.contains_key(drive_id),
-            FileId::NodeId(node_id) => self.tree.get(&node_id).is_ok(),
+            FileId::Inode(inode) => self.files.contains(*inode),
+            FileId::DriveId(drive_id) => self.drive_ids.contains_key(drive_id.as_str()),
             pn @ FileId::ParentAndName { .. } => self.get_file(&pn).is_some(),
         }
     }
 
-    /// Returns the NodeId of a file identified by a given id.
-    /// The NodeId indicates the placement of the file in the file tree.
-    pub fn get_node_id(&self, file_id: &FileId) -> Option<NodeId> {
-        match file_id {
-            FileId::Inode(inode) => self.node_ids.get(&inode).cloned(),
-            FileId::DriveId(drive_id) => self.get_node_id(&FileId::Inode(
-                self.get_inode(&FileId::DriveId(drive_id.to_string()))
-                    .unwrap(),
-            )),
-            FileId::NodeId(node_id) => Some(node_id.clone()),
-            ref pn @ FileId::ParentAndName { .. } => {
-                let inode = self.get_inode(&pn)?;
-                self.get_node_id(&FileId::Inode(inode))
-            }
-        }
-    }
-
     /// Returns the DriveId of a file identified by a given id.
     /// The DriveId points to a Google Drive file.
     pub fn get_drive_id(&self, id: &FileId) -> Option<DriveId> {
@@ -331,54 +700,46 @@ impl FileManager {
     pub fn get_inode(&self, id: &FileId) -> Option<Inode> {
         match id {
             FileId::Inode(inode) => Some(*inode),
-            FileId::DriveId(drive_id) => self.drive_ids.get(drive_id).cloned(),
-            FileId::NodeId(node_id) => self
-                .tree
-                .get(&node_id)
-                .map(|node| node.data())
-                .ok()
-                .cloned(),
+            FileId::DriveId(drive_id) => self.drive_ids.get(drive_id.as_str()).cloned(),
             FileId::ParentAndName {
                 ref parent,
                 ref name,
-            } => self
-                .get_children(&FileId::Inode(*parent))?
-                .into_iter()
-                .find(|child| child.name() == *name)
-                .map(|child| child.inode()),
+            } => self.child_names.get(parent)?.get(name)?.first().cloned(),
         }
     }
 
     /// Returns the children of a directory identified by a given id.
-    pub fn get_children(&self, id: &FileId) -> Option<Vec<&File>> {
-        let node_id = self.get_node_id(&id)?;
-        let children: Vec<&File> = self
-            .tree
-            .children(&node_id)
-            .unwrap()
-            .map(|child| self.get_file(&FileId::Inode(*child.data())))
-            .filter(Option::is_some)
-            .map(Option::unwrap)
-            .collect();
-
-        Some(children)
+    pub fn get_children<'a>(&'a self, id: &FileId) -> Option<impl Iterator<Item = &'a File>> {
+        let inode = self
+            .get_inode(&id)
+            .filter(|&inode| self.files.contains(inode))?;
+        Some(
+            self.files
+                .children(inode)
+                .filter_map(move |child| self.files.get(child)),
+        )
     }
 
     /// Returns a const reference to a file identified by a given id.
     pub fn get_file(&self, id: &FileId) -> Option<&File> {
         let inode = self.get_inode(id)?;
-        self.files.get(&inode)
+        self.files.get(inode)
     }
 
     /// Returns a mutable reference to a file identified by a given id.
     pub fn get_mut_file(&mut self, id: &FileId) -> Option<&mut File> {
         let inode = self.get_inode(&id)?;
-        self.files.get_mut(&inode)
+        self.files.get_mut(inode)
     }
 
     /// Creates a file on Drive and adds it to the local file tree.
     pub fn create_file(&mut self, mut file: File, parent: Option<FileId>) -> Result<(), Error> {
-        let drive_id = self.df.create(file.drive_file.as_ref().unwrap())?;
+        let drive_file = file
+            .drive
+            .as_ref()
+            .ok_or_else(|| err_msg(format!("{:?} can not be created on Drive", &file.name)))?
+            .to_drive_file(&file.name);
+        let drive_id = self.df.create(&drive_file)?;
         file.set_drive_id(drive_id);
         self.add_file_locally(file, parent)?;
 
@@ -386,179 +747,313 @@ impl FileManager {
     }
 
     /// Passes along the FLUSH system call to the `DriveFacade`.
-    pub fn flush(&mut self, id: &FileId) -> Result<(), Error> {
-        let file = self
-            .get_drive_id(&id)
-            .ok_or_else(|| err_msg(format!("Cannot find drive id of {:?}", &id)))?;
-        self.df.flush(&file)
+    pub fn flush<F>(&mut self, id: &FileId, done: F)
+    where
+        F: FnOnce(Result<(), Error>) + Send + 'static,
+    {
+        match self.get_drive_id(&id) {
+            Some(file) => self.df.flush(&file, done),
+            None => done(Err(err_msg(format!("Cannot find drive id of {:?}", &id)))),
+        }
+    }
+
+    /// Passes along the FSYNC system call to the `DriveFacade`, which waits for the uploads of
+    /// the file which are still queued.
+    pub fn fsync<F>(&mut self, id: &FileId, done: F)
+    where
+        F: FnOnce(Result<(), Error>) + Send + 'static,
+    {
+        match self.get_drive_id(&id) {
+            Some(file) => self.df.sync(&file, done),
+            None => done(Err(err_msg(format!("Cannot find drive id of {:?}", &id)))),
+        }
     }
 
     /// Adds a file to the local file tree. Does not communicate with Drive.
     fn add_file_locally(&mut self, mut file: File, parent: Option<FileId>) -> Result<(), Error> {
-        let node_id = match parent {
-            Some(id) => {
-                let parent_id = self.get_node_id(&id).ok_or_else(|| {
-                    err_msg("FileManager::add_file_locally() could not find parent by FileId")
-                })?;
-
-                if self.rename_identical_files {
-                    let identical_filename_count = self
-                        .get_children(&id)
-                        .ok_or_else(|| {
-                            err_msg("FileManager::add_file_locally() could not get file siblings")
-                        })?
-                        .iter()
-                        .filter(|child| child.name == file.name)
-                        .count();
-
-                    if identical_filename_count > 0 {
-                        file.identical_name_id = Some(identical_filename_count);
-                    }
-                }
+        if let (true, Some(id)) = (self.rename_identical_files, parent.as_ref()) {
+            let parent_inode = self.get_inode(id).ok_or_else(|| {
+                err_msg("FileManager::add_file_locally() could not find parent by FileId")
+            })?;
+            file.identical_name_id = self.identical_name_id(parent_inode, &file.name);
+        }
 
-                self.tree
-                    .insert(Node::new(file.inode()), UnderNode(&parent_id))?
-            }
-            None => self.tree.insert(Node::new(file.inode()), AsRoot)?,
+        self.insert_locally(file, parent)
+    }
+
+    /// Inserts a file in the local file tree as it is, without renaming it. Does not communicate
+    /// with Drive.
+    fn insert_locally(&mut self, file: File, parent: Option<FileId>) -> Result<(), Error> {
+        let parent_inode = match parent {
+            Some(id) => Some(
+                self.get_inode(&id)
+                    .filter(|&inode| self.files.contains(inode))
+                    .ok_or_else(|| {
+                        err_msg("FileManager::insert_locally() could not find parent by FileId")
+                    })?,
+            ),
+            None => None,
         };
 
-        self.node_ids.insert(file.inode(), node_id);
-        file.drive_id()
-            .and_then(|drive_id| self.drive_ids.insert(drive_id, file.inode()));
-        self.files.insert(file.inode(), file);
+        let inode = file.inode();
+        let drive_id = file.drive.as_ref().and_then(|d| d.id.clone());
+        self.files.insert(file, parent_inode)?;
+        if let Some(drive_id) = drive_id {
+            self.drive_ids.insert(drive_id, inode);
+        }
 
+        if let Some(parent_inode) = parent_inode {
+            self.index_name(parent_inode, inode);
+        }
         Ok(())
     }
 
     /// Moves a file somewhere else in the local file tree. Does not communicate with Drive.
     fn move_locally(&mut self, id: &FileId, new_parent: &FileId) -> Result<(), Error> {
-        let current_node = self
-            .get_node_id(&id)
-            .ok_or_else(|| err_msg(format!("Cannot find node_id of {:?}", &id)))?;
-        let target_node = self
-            .get_node_id(&new_parent)
+        let inode = self
+            .get_inode(&id)
+            .ok_or_else(|| err_msg(format!("Cannot find inode of {:?}", &id)))?;
+        let parent = self
+            .get_inode(&new_parent)
             .ok_or_else(|| err_msg("Target node doesn't exist"))?;
+        let name = self
+            .files
+            .get(inode)
+            .map(|file| file.name.clone())
+            .ok_or_else(|| err_msg(format!("Cannot find {:?}", &id)))?;
+
+        self.relink(inode, parent, name)
+    }
+
+    /// Moves a file under `new_parent` in the local file tree and names it `new_name`, keeping
+    /// the name index up to date. Does not communicate with Drive.
+    fn relink(&mut self, inode: Inode, new_parent: Inode, new_name: String) -> Result<(), Error> {
+        if !self.files.contains(inode) {
+            return Err(err_msg(format!("Cannot find {:?}", FileId::Inode(inode))));
+        }
+        if !self.files.contains(new_parent) {
+            return Err(err_msg("Target node doesn't exist"));
+        }
+
+        let old_parent = self.files.parent(inode);
+        let same_name = self.files.get(inode).map_or(false, |f| f.name == new_name);
+        if old_parent == Some(new_parent) && same_name {
+            return Ok(());
+        }
+
+        if old_parent != Some(new_parent) {
+            self.files.move_to(inode, new_parent)?;
+        }
+        if let Some(old_parent) = old_parent {
+            self.unindex_name(old_parent, inode);
+        }
+
+        let identical_name_id = if self.rename_identical_files {
+            self.identical_name_id(new_parent, &new_name)
+        } else {
+            None
+        };
+        if let Some(file) = self.files.get_mut(inode) {
+            file.name = new_name;
+            file.identical_name_id = identical_name_id;
+        }
+        self.index_name(new_parent, inode);
 
-        self.tree.move_node(&current_node, ToParent(&target_node))?;
         Ok(())
     }
 
     /// Deletes a file and its children from the local file tree. Does not communicate with Drive.
     fn delete_locally(&mut self, id: &FileId) -> Result<(), Error> {
-        let node_id = self
-            .get_node_id(id)
-            .ok_or_else(|| err_msg(format!("Cannot find node_id of {:?}", &id)))?;
         let inode = self
             .get_inode(id)
+            .filter(|&inode| self.files.contains(inode))
             .ok_or_else(|| err_msg(format!("Cannot find inode of {:?}", &id)))?;
-        let drive_id = self
-            .get_drive_id(id)
-            .ok_or_else(|| err_msg(format!("Cannot find drive id of {:?}", &id)))?;
 
-        self.tree.remove_node(node_id, DropChildren)?;
-        self.files.remove(&inode);
-        self.node_ids.remove(&inode);
-        self.drive_ids.remove(&drive_id);
+        if let Some(parent) = self.files.parent(inode) {
+            self.unindex_name(parent, inode);
+        }
+
+        for file in self.files.remove(inode) {
+            self.removed_files += 1;
+            if let Some(drive_id) = file.drive_id() {
+                self.drive_ids.remove(drive_id.as_str());
+            }
+            self.child_names.remove(&file.inode());
+            self.base_name_counts.remove(&file.inode());
+        }
 
         Ok(())
     }
 
-    /// Deletes a file locally *and* on Drive.
-    pub fn delete(&mut self, id: &FileId) -> Result<(), Error> {
-        let drive_id = self
-            .get_drive_id(id)
-            .ok_or_else(|| err_msg("No such file"))?;
+    /// Adds a file to the name index of `parent`, the directory which contains it.
+    fn index_name(&mut self, parent: Inode, inode: Inode) {
+        let file = match self.files.get(inode) {
+            Some(file) => file,
+            None => return,
+        };
+
+        self.child_names
+            .entry(parent)
+            .or_insert_with(HashMap::new)
+            .entry(file.name())
+            .or_insert_with(Vec::new)
+            .push(inode);
+
+        if self.rename_identical_files {
+            *self
+                .base_name_counts
+                .entry(parent)
+                .or_insert_with(HashMap::new)
+                .entry(file.name.clone())
+                .or_insert(0) += 1;
+        }
+    }
+
+    /// Removes a file from the name index of `parent`, the directory which contains it.
+    fn unindex_name(&mut self, parent: Inode, inode: Inode) {
+        let file = match self.files.get(inode) {
+            Some(file) => file,
+            None => return,
+        };
+
+        if let Some(names) = self.child_names.get_mut(&parent) {
+            let name = file.name();
+            let unused = names.get_mut(&name).map_or(false, |inodes| {
+                inodes.retain(|&other| other != inode);
+                inodes.is_empty()
+            });
+            if unused {
+                names.remove(&name);
+            }
+        }
 
-        self.delete_locally(id)?;
-        match self.df.delete_permanently(&drive_id) {
-            Ok(response) => {
-                debug!("{:?}", response);
-                Ok(())
+        if let Some(counts) = self.base_name_counts.get_mut(&parent) {
+            let unused = counts.get_mut(&file.name).map_or(false, |count| {
+                *count = count.saturating_sub(1);
+                *count == 0
+            });
+            if unused {
+                counts.remove(&file.name);
             }
-            Err(e) => Err(err_msg(format!("{}", e))),
         }
     }
 
-    /// Moves a file to the Trash directory locally *and* on Drive.
-    pub fn move_file_to_trash(&mut self, id: &FileId, also_on_drive: bool) -> Result<(), Error> {
-        debug!("Moving {:?} to trash.", &id);
-        let node_id = self
-            .get_node_id(id)
-            .ok_or_else(|| err_msg(format!("Cannot find node_id of {:?}", &id)))?;
-        let drive_id = self
+    /// Picks the numeric suffix of a file called `name` which is about to be added to `parent`:
+    /// none for the first file with this name, otherwise the number of files with this name
+    /// already in `parent`, increased until the resulting name is not taken.
+    fn identical_name_id(&self, parent: Inode, name: &str) -> Option<usize> {
+        let names = self.child_names.get(&parent);
+        let taken = |candidate: &str| names.map_or(false, |names| names.contains_key(candidate));
+        let count = self
+            .base_name_counts
+            .get(&parent)
+            .and_then(|counts| counts.get(name))
+            .cloned()
+            .unwrap_or(0);
+
+        if count == 0 && !taken(name) {
+            return None;
+        }
+
+        let mut id = cmp::max(count, 1);
+        while taken(&format!("{}.{}", name, id)) {
+            id += 1;
+        }
+        Some(id)
+    }
+
+    /// Deletes a file locally *and* on Drive. The file is removed from the local tree right away;
+    /// `done` is called with the result of the deletion on Drive, possibly on another thread.
+    pub fn delete<F>(&mut self, id: &FileId, done: F)
+    where
+        F: FnOnce(Result<(), Error>) + Send + 'static,
+    {
+        let deleted = self
             .get_drive_id(id)
-            .ok_or_else(|| err_msg(format!("Cannot find drive_id of {:?}", &id)))?;
-        let trash_id = self
-            .get_node_id(&FileId::Inode(TRASH_INODE))
-            .ok_or_else(|| err_msg("Cannot find node_id of Trash dir"))?;
+            .ok_or_else(|| err_msg("No such file"))
+            .and_then(|drive_id| self.delete_locally(id).map(|_| drive_id));
 
-        self.tree.move_node(&node_id, ToParent(&trash_id))?;
+        match deleted {
+            Ok(drive_id) => self.df.delete_permanently(&drive_id, done),
+            Err(e) => done(Err(e)),
+        }
+    }
 
-        // File cannot be identified by FileId::ParentAndName now because the parent has changed.
-        // Using DriveId instead.
-        if also_on_drive {
+    /// Moves a file to the Trash directory locally *and* on Drive. `done` is called with the
+    /// result of the change on Drive, possibly on another thread.
+    pub fn move_file_to_trash<F>(&mut self, id: &FileId, done: F)
+    where
+        F: FnOnce(Result<(), Error>) + Send + 'static,
+    {
+        let trashed = self.move_file_to_trash_locally(id).and_then(|drive_id| {
+            // File cannot be identified by FileId::ParentAndName now because the parent has
+            // changed. Using DriveId instead.
             self.get_mut_file(&FileId::DriveId(drive_id.clone()))
                 .ok_or_else(|| err_msg(format!("Cannot find {:?}", &drive_id)))?
                 .set_trashed(true)?;
-            self.df.move_to_trash(drive_id)?;
+            Ok(drive_id)
+        });
+
+        match trashed {
+            Ok(drive_id) => self.df.move_to_trash(drive_id, done),
+            Err(e) => done(Err(e)),
         }
+    }
 
-        Ok(())
+    /// Moves a file to the Trash directory. Does not communicate with Drive. Returns the Drive ID
+    /// of the file.
+    fn move_file_to_trash_locally(&mut self, id: &FileId) -> Result<DriveId, Error> {
+        debug!("Moving {:?} to trash.", &id);
+        let drive_id = self
+            .get_drive_id(id)
+            .ok_or_else(|| err_msg(format!("Cannot find drive_id of {:?}", &id)))?;
+        if !self.contains(&FileId::Inode(TRASH_INODE)) {
+            return Err(err_msg("Cannot find Trash dir"));
+        }
+
+        self.move_locally(id, &FileId::Inode(TRASH_INODE))?;
+        Ok(drive_id)
     }
 
     /// Whether a file is trashed on Drive.
     pub fn file_is_trashed(&mut self, id: &FileId) -> Result<bool, Error> {
         let file = self
             .get_file(id)
-            .ok_or_else(|| err_msg(format!("Cannot find node_id of {:?}", &id)))?;
+            .ok_or_else(|| err_msg(format!("Cannot find inode of {:?}", &id)))?;
 
         Ok(file.is_trashed())
     }
 
-    /// Moves/renames a file locally *and* on Drive.
-    pub fn rename(
+    /// Moves/renames a file locally *and* on Drive. The local tree changes right away; `done` is
+    /// called with the result of the move on Drive, possibly on another thread.
+    pub fn rename<F>(&mut self, id: &FileId, new_parent: Inode, new_name: String, done: F)
+    where
+        F: FnOnce(Result<(), Error>) + Send + 'static,
+    {
+        match self.rename_locally(id, new_parent, new_name.clone()) {
+            Ok((drive_id, parent_id, current_parents)) => {
+                debug!("parent_id: {}", &parent_id);
+                self.df
+                    .move_to(&drive_id, &parent_id, &new_name, current_parents, done);
+            }
+            Err(e) => done(Err(e)),
+        }
+    }
+
+    /// Moves/renames a file in the local tree. Returns the Drive ID of the file, that of its new
+    /// parent and its parents on Drive before the move, if known.
+    fn rename_locally(
         &mut self,
         id: &FileId,
         new_parent: Inode,
         new_name: String,
-    ) -> Result<(), Error> {
+    ) -> Result<(DriveId, DriveId, Option<Vec<DriveId>>), Error> {
         // Identify the file by its inode instead of (parent, name) because both the parent and
         // name will probably change in this method.
-        let id = FileId::Inode(
-            self.get_inode(id)
-                .ok_or_else(|| err_msg(format!("Cannot find node_id of {:?}", &id)))?,
-        );
-
-        let current_node = self
-            .get_node_id(&id)
-            .ok_or_else(|| err_msg(format!("Cannot find node_id of {:?}", &id)))?;
-        let target_node = self
-            .get_node_id(&FileId::Inode(new_parent))
-            .ok_or_else(|| err_msg("Target node doesn't exist"))?;
-
-        self.tree.move_node(&current_node, ToParent(&target_node))?;
-
-        {
-            if self.rename_identical_files {
-                let identical_filename_count = self
-                    .get_children(&FileId::Inode(new_parent))
-                    .ok_or_else(|| err_msg("FileManager::rename() could not get file siblings"))?
-                    .iter()
-                    .filter(|child| child.name == new_name)
-                    .count();
-
-                let file = self
-                    .get_mut_file(&id)
-                    .ok_or_else(|| err_msg("File doesn't exist"))?;
-                file.name = new_name.clone();
-
-                if identical_filename_count > 0 {
-                    file.identical_name_id = Some(identical_filename_count);
-                } else {
-                    file.identical_name_id = None;
-                }
-            }
-        }
+        let inode = self
+            .get_inode(id)
+            .ok_or_else(|| err_msg(format!("Cannot find inode of {:?}", &id)))?;
+        let id = FileId::Inode(inode);
 
         let drive_id = self
             .get_drive_id(&id)
@@ -572,42 +1067,107 @@ impl FileManager {
                 ))
             })?;
 
-        debug!("parent_id: {}", &parent_id);
-        self.df.move_to(&drive_id, &parent_id, &new_name)?;
-        Ok(())
+        self.relink(inode, new_parent, new_name)?;
+
+        // The parents known locally save asking Drive for them. They are updated right away, so
+        // that a following move of the same file starts from the right place.
+        let current_parents = self
+            .get_mut_file(&id)
+            .and_then(|f| f.drive.as_mut())
+            .map(|d| mem::replace(&mut d.parents, vec![Interned::new(&parent_id)]))
+            .filter(|parents| !parents.is_empty())
+            .map(|parents| parents.iter().map(|id| id.to_string()).collect());
+
+        Ok((drive_id, parent_id, current_parents))
     }
 
     /// Writes to a file locally *and* on Drive. Note: the pending write is not necessarily applied
     /// instantly by the `DriveFacade`.
-    pub fn write(&mut self, id: FileId, offset: usize, data: &[u8]) {
+    pub fn write(&mut self, id: FileId, offset: usize, data: &[u8]) -> Result<(), Error> {
         let drive_id = self.get_drive_id(&id).unwrap();
-        self.df.write(drive_id, offset, data);
+        let remote_len = self.get_remote_len(&id);
+        self.df.write(drive_id, offset, data, remote_len)?;
+        self.forget_version(&id);
+        Ok(())
     }
-}
 
-impl fmt::Debug for FileManager {
-    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
-        writeln!(f, "FileManager(")?;
+    /// Passes along the truncation of a file to the `DriveFacade`.
+    pub fn truncate(&mut self, id: &FileId, size: u64) -> Result<(), Error> {
+        let drive_id = self
+            .get_drive_id(&id)
+            .ok_or_else(|| err_msg(format!("Cannot find drive id of {:?}", &id)))?;
+        let remote_len = self.get_remote_len(&id);
+        self.df.truncate(drive_id, size, remote_len)?;
+        self.forget_version(id);
+        Ok(())
+    }
 
-        if self.tree.root_node_id().is_none() {
-            return writeln!(f, ")");
+    /// Replaces the placeholder size of a file which must be exported (e.g. a Google document) by
+    /// the length of its export, once the export has been downloaded in the current version of
+    /// the file. Other files are left untouched.
+    pub fn update_exported_size(&mut self, id: &FileId) {
+        let inode = match self.get_inode(id) {
+            Some(inode) => inode,
+            None => return,
+        };
+        let len = match self.files.get(inode) {
+            Some(file) if file.kind() == FileType::RegularFile => {
+                let mime_type = file.mime_type().map(str::to_string);
+                let version = file.content_version();
+                file.drive_id().and_then(|drive_id| {
+                    self.df.exported_len(
+                        &drive_id,
+                        &mime_type,
+                        version.as_ref().map(String::as_str),
+                    )
+                })
+            }
+            _ => None,
+        };
+
+        if let (Some(len), Some(file)) = (len, self.files.get_mut(inode)) {
+            if file.attr.size != len {
+                debug!("{:?} is {} bytes long once exported", &file.name, len);
+                file.set_size(len);
+            }
         }
+    }
 
-        let mut stack: Vec<(u32, &NodeId)> = vec![(0, self.tree.root_node_id().unwrap())];
+    /// The length of the content of a file on Drive, as of the last time it was listed. Files
+    /// which must be exported have no such length.
+    fn get_remote_len(&self, id: &FileId) -> Option<u64> {
+        self.get_file(id)?.drive.as_ref()?.size
+    }
+
+    /// Forgets the version of a file which has been modified locally, until Drive reports the
+    /// version of the uploaded content. Until then its chunks are cached under its Drive ID,
+    /// which the upload invalidates, rather than under the checksum of its previous content.
+    fn forget_version(&mut self, id: &FileId) {
+        if let Some(drive) = self.get_mut_file(id).and_then(|f| f.drive.as_mut()) {
+            drive.version = None;
+        }
+    }
+}
 
-        while !stack.is_empty() {
-            let (level, node_id) = stack.pop().unwrap();
+impl<B> fmt::Debug for FileManager<B> {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        writeln!(f, "FileManager(")?;
 
+        let mut stack: Vec<(u32, Inode)> = self
+            .files
+            .root()
+            .map(|root| (0, root))
+            .into_iter()
+            .collect();
+        while let Some((level, inode)) = stack.pop() {
             for _ in 0..level {
                 write!(f, "\t")?;
             }
 
-            let file = self.get_file(&FileId::NodeId(node_id.clone())).unwrap();
-            writeln!(f, "{:3} => {}", file.inode(), file.name)?;
-
-            self.tree.children_ids(node_id).unwrap().for_each(|id| {
-                stack.push((level + 1, id));
-            });
+            if let Some(file) = self.files.get(inode) {
+                writeln!(f, "{:3} => {}", file.inode(), file.name)?;
+            }
+            stack.extend(self.files.children(inode).map(|child| (level + 1, child)));
         }
 
         writeln!(f, ")")
@@ -1,16 +1,20 @@
-use super::{Config, File, FileId, FileManager};
-use drive3;
-use failure::Error;
+use super::metrics;
+use super::metrics::FuseOp;
+use super::{Config, DirEntry, DriveMeta, File, FileHandles, FileId, FileManager, Interned};
+use failure::{err_msg, Error};
 use fuse::{
     FileAttr, FileType, Filesystem, ReplyAttr, ReplyCreate, ReplyData, ReplyDirectory, ReplyEmpty,
-    ReplyEntry, ReplyStatfs, ReplyWrite, Request,
+    ReplyEntry, ReplyOpen, ReplyStatfs, ReplyWrite, Request,
 };
-use libc::{ENOENT, ENOTDIR, ENOTRECOVERABLE, EREMOTE};
+use libc::{EIO, ENOENT, ENOTDIR, ENOTRECOVERABLE, EREMOTE};
 use lru_time_cache::LruCache;
 use std;
 use std::clone::Clone;
 use std::cmp;
 use std::ffi::OsStr;
+use std::mem;
+use std::sync::mpsc;
+use std::time::Duration;
 use time::Timespec;
 use DriveFacade;
 
@@ -31,20 +35,15 @@ macro_rules! log_result {
     };
 }
 
-macro_rules! log_result_and_fill_reply {
-    ($expr:expr,$reply:ident) => {
-        match $expr {
-            Ok(t) => {
-                debug!("{:?}", t);
-                $reply.ok();
-            }
-            Err(e) => {
-                error!("{:?}", e);
-                $reply.error(ENOTRECOVERABLE);
-                return;
-            }
+/// Returns a callback which answers a request once the result of a change on Drive is known.
+fn reply_when_done(reply: ReplyEmpty) -> impl FnOnce(Result<(), Error>) + Send + 'static {
+    move |result| match result {
+        Ok(()) => reply.ok(),
+        Err(e) => {
+            error!("{:?}", e);
+            reply.error(ENOTRECOVERABLE);
         }
-    };
+    }
 }
 
 /// An empty FUSE file system. It can be used in a mounting test aimed to determine whether or
@@ -57,9 +56,47 @@ impl Filesystem for NullFs {}
 pub struct Gcsf {
     manager: FileManager,
     statfs_cache: LruCache<String, u64>,
+
+    /// The open files, each tracking its own access pattern in order to prefetch ahead of
+    /// sequential readers.
+    handles: FileHandles,
+    read_ahead_chunks: u64,
+
+    /// Whether closing a written file returns before it has been uploaded.
+    write_back: bool,
+
+    /// How long the kernel may cache lookups, attributes and the absence of files.
+    entry_ttl: Timespec,
+    attr_ttl: Timespec,
+    negative_ttl: Timespec,
+}
+
+/// Converts a duration to the type used by FUSE for TTLs.
+fn to_timespec(duration: Duration) -> Timespec {
+    Timespec::new(duration.as_secs() as i64, duration.subsec_nanos() as i32)
 }
 
-const TTL: Timespec = Timespec { sec: 1, nsec: 0 }; // 1 second
+/// The attributes of a negative entry. Replying to a lookup with inode 0 makes the kernel cache
+/// the absence of the name for the TTL of the reply.
+fn negative_entry() -> FileAttr {
+    let epoch = Timespec::new(0, 0);
+    FileAttr {
+        ino: 0,
+        size: 0,
+        blocks: 0,
+        atime: epoch,
+        mtime: epoch,
+        ctime: epoch,
+        crtime: epoch,
+        kind: FileType::RegularFile,
+        perm: 0,
+        nlink: 0,
+        uid: 0,
+        gid: 0,
+        rdev: 0,
+        flags: 0,
+    }
+}
 
 impl Gcsf {
     /// Constructs a Gcsf instance using a given Config.
@@ -69,27 +106,83 @@ impl Gcsf {
                 config.rename_identical_files(),
                 config.add_extensions_to_special_files(),
                 config.skip_trash(),
+                config.lazy_loading(),
                 config.sync_interval(),
+                if config.metadata_snapshot() {
+                    Some(config.snapshot_file())
+                } else {
+                    None
+                },
+                config.snapshot_interval(),
                 DriveFacade::new(&config),
             )?,
             statfs_cache: LruCache::<String, u64>::with_expiry_duration_and_capacity(
                 config.cache_statfs_seconds(),
                 2,
             ),
+            handles: FileHandles::new(),
+            read_ahead_chunks: config.read_ahead_chunks(),
+            write_back: config.write_back(),
+            entry_ttl: to_timespec(config.entry_ttl()),
+            attr_ttl: to_timespec(config.attr_ttl()),
+            negative_ttl: to_timespec(config.negative_ttl()),
         })
     }
+
+    /// Lists the children of a directory, once the changes found on Drive have been applied.
+    fn list_dir(&mut self, ino: Inode) -> Option<Vec<DirEntry>> {
+        if let Err(e) = self.manager.sync() {
+            debug!("Could not perform sync: {}", e);
+        }
+        if let Err(e) = self.manager.load_children(ino) {
+            error!("Could not load the children of inode {}: {}", ino, e);
+            return None;
+        }
+
+        let children = self.manager.get_children(&FileId::Inode(ino))?;
+        Some(
+            children
+                .map(|child| DirEntry {
+                    inode: child.inode(),
+                    kind: child.kind(),
+                    name: child.name(),
+                })
+                .collect(),
+        )
+    }
+}
+
+/// The file system is dropped once it has been unmounted.
+impl Drop for Gcsf {
+    fn drop(&mut self) {
+        self.manager.df.drain();
+        if let Err(e) = self.manager.save_snapshot() {
+            error!("Could not store snapshot: {}", e);
+        }
+    }
 }
 
 impl Filesystem for Gcsf {
     fn lookup(&mut self, _req: &Request, parent: Inode, name: &OsStr, reply: ReplyEntry) {
-        // self.manager.sync();
+        let _timer = metrics::time(FuseOp::Lookup);
+        if let Err(e) = self.manager.apply_polled_changes() {
+            error!("Could not apply changes: {}", e);
+        }
+
+        if let Err(e) = self.manager.load_children(parent) {
+            error!("Could not load the children of inode {}: {}", parent, e);
+        }
 
         let name = name.to_str().unwrap().to_string();
         let id = FileId::ParentAndName { parent, name };
+        self.manager.update_exported_size(&id);
 
         match self.manager.get_file(&id) {
             Some(ref file) => {
-                reply.entry(&TTL, &file.attr, 0);
+                reply.entry(&self.entry_ttl, &file.attr, 0);
+            }
+            None if self.negative_ttl.sec > 0 && self.manager.contains(&FileId::Inode(parent)) => {
+                reply.entry(&self.negative_ttl, &negative_entry(), 0);
             }
             None => {
                 reply.error(ENOENT);
@@ -98,10 +191,15 @@ impl Filesystem for Gcsf {
     }
 
     fn getattr(&mut self, _req: &Request, ino: Inode, reply: ReplyAttr) {
-        // self.manager.sync();
+        let _timer = metrics::time(FuseOp::Getattr);
+        if let Err(e) = self.manager.apply_polled_changes() {
+            error!("Could not apply changes: {}", e);
+        }
+        self.manager.update_exported_size(&FileId::Inode(ino));
+
         match self.manager.get_file(&FileId::Inode(ino)) {
             Some(file) => {
-                reply.attr(&TTL, &file.attr);
+                reply.attr(&self.attr_ttl, &file.attr);
             }
             None => {
                 reply.error(ENOENT);
@@ -113,36 +211,66 @@ impl Filesystem for Gcsf {
         &mut self,
         _req: &Request,
         ino: Inode,
-        _fh: u64,
+        fh: u64,
         offset: i64,
         size: u32,
         reply: ReplyData,
     ) {
+        let timer = metrics::time(FuseOp::Read);
         if !self.manager.contains(&FileId::Inode(ino)) {
             reply.error(ENOENT);
             return;
         }
 
-        let (mime, id) = self
+        let (mime, id, version, file_size) = self
             .manager
             .get_file(&FileId::Inode(ino))
             .map(|f| {
-                let mime = f
-                    .drive_file
-                    .as_ref()
-                    .and_then(|f| f.mime_type.as_ref())
-                    .cloned();
+                let mime = f.mime_type().map(str::to_string);
                 let id = f.drive_id().unwrap();
 
-                (mime, id)
+                (mime, id, f.content_version(), f.attr.size)
             })
             .unwrap();
 
-        reply.data(
-            self.manager
-                .df
-                .read(&id, mime, offset as usize, size as usize)
-                .unwrap_or(&[]),
+        // Prefetching starts before the current read so that both run in parallel.
+        let prefetch = self.handles.get_mut(fh, ino).and_then(|handle| {
+            match handle.read_ahead.record(offset as u64, u64::from(size)) {
+                0 => None,
+                window => Some((window, handle.read_ahead.stream())),
+            }
+        });
+        if let (Some((window, stream)), true) = (prefetch, size > 0) {
+            let chunk_size = self.manager.df.chunk_size();
+            let next_chunk = (offset as u64 + u64::from(size) - 1) / chunk_size + 1;
+            self.manager.df.prefetch(
+                &id,
+                &mime,
+                version.as_ref().map(String::as_str),
+                next_chunk,
+                window,
+                file_size,
+                stream,
+            );
+        }
+
+        // The reply is sent from a worker thread once the data has been retrieved.
+        self.manager.df.read(
+            id,
+            mime,
+            version,
+            offset as usize,
+            size as usize,
+            move |result| {
+                let _timer = timer;
+                match result {
+                    Ok(data) => reply.data(&data),
+                    Err(e) => {
+                        error!("{:?}", e);
+                        reply.error(EREMOTE);
+                    }
+                }
+            },
         );
     }
 
@@ -150,18 +278,26 @@ impl Filesystem for Gcsf {
         &mut self,
         _req: &Request,
         ino: Inode,
-        _fh: u64,
+        fh: u64,
         offset: i64,
         data: &[u8],
         _flags: u32,
         reply: ReplyWrite,
     ) {
+        let _timer = metrics::time(FuseOp::Write);
         let offset: usize = cmp::max(offset, 0) as usize;
-        self.manager.write(FileId::Inode(ino), offset, data);
+        if let Err(e) = self.manager.write(FileId::Inode(ino), offset, data) {
+            error!("{:?}", e);
+            reply.error(EIO);
+            return;
+        }
+        if let Some(handle) = self.handles.get_mut(fh, ino) {
+            handle.written = true;
+        }
 
         match self.manager.get_mut_file(&FileId::Inode(ino)) {
             Some(ref mut file) => {
-                file.attr.size = offset as u64 + data.len() as u64;
+                file.attr.size = cmp::max(file.attr.size, offset as u64 + data.len() as u64);
                 reply.written(data.len() as u32);
             }
             None => {
@@ -170,35 +306,54 @@ impl Filesystem for Gcsf {
         };
     }
 
+    fn opendir(&mut self, _req: &Request, ino: Inode, _flags: u32, reply: ReplyOpen) {
+        match self.list_dir(ino) {
+            Some(entries) => {
+                let fh = self.handles.open_dir(ino, entries);
+                reply.opened(fh, 0);
+            }
+            None => reply.error(ENOENT),
+        }
+    }
+
     fn readdir(
         &mut self,
         _req: &Request,
         ino: Inode,
-        _fh: u64,
+        fh: u64,
         offset: i64,
         mut reply: ReplyDirectory,
     ) {
-        if let Err(e) = self.manager.sync() {
-            debug!("Could not perform sync: {}", e);
-        }
-        // println!("current state: {:#?}", self.manager);
-
-        let mut curr_offs = offset + 1;
-        match self.manager.get_children(&FileId::Inode(ino)) {
-            Some(children) => {
-                for child in children.iter().skip(offset as usize) {
-                    if reply.add(child.inode(), curr_offs, child.kind(), &child.name()) {
-                        break;
-                    } else {
-                        curr_offs += 1;
-                    }
+        let _timer = metrics::time(FuseOp::Readdir);
+
+        // The listing is normally captured by opendir(). Without a handle of its own, the
+        // directory is listed again for every call.
+        let listed;
+        let entries = match self.handles.dir_entries(fh, ino) {
+            Some(entries) => entries,
+            None => match self.list_dir(ino) {
+                Some(entries) => {
+                    listed = entries;
+                    &listed[..]
                 }
-                reply.ok();
-            }
-            None => {
-                reply.error(ENOENT);
-            }
+                None => return reply.error(ENOENT),
+            },
         };
+
+        // The offset of an entry is its position in the listing, plus one.
+        let start = cmp::min(cmp::max(offset, 0) as usize, entries.len());
+        for (i, entry) in entries[start..].iter().enumerate() {
+            let next_offset = (start + i + 1) as i64;
+            if reply.add(entry.inode, next_offset, entry.kind, &entry.name) {
+                break;
+            }
+        }
+        reply.ok();
+    }
+
+    fn releasedir(&mut self, _req: &Request, _ino: Inode, fh: u64, _flags: u32, reply: ReplyEmpty) {
+        self.handles.release_dir(fh);
+        reply.ok();
     }
 
     fn rename(
@@ -220,19 +375,28 @@ impl Filesystem for Gcsf {
         );
 
         if new_parent == TRASH_INODE {
-            let rename_res = self.manager.rename(&id, parent, new_name);
-            log_result!(&rename_res);
-
-            let trash_res = self.manager.move_file_to_trash(&id, true);
-            log_result!(&trash_res);
-
-            if rename_res.is_ok() && trash_res.is_ok() {
-                reply.ok();
-            } else {
-                reply.error(EREMOTE);
-            }
+            // Both changes are sent to Drive together. The reply waits for both results.
+            let (rename_sender, rename_receiver) = mpsc::channel();
+            self.manager.rename(&id, parent, new_name, move |result| {
+                let _ = rename_sender.send(result);
+            });
+
+            self.manager.move_file_to_trash(&id, move |trash_res| {
+                let rename_res = rename_receiver
+                    .recv()
+                    .unwrap_or_else(|_| Err(err_msg("The rename was dropped")));
+                log_result!(&rename_res);
+                log_result!(&trash_res);
+
+                if rename_res.is_ok() && trash_res.is_ok() {
+                    reply.ok();
+                } else {
+                    reply.error(EREMOTE);
+                }
+            });
         } else {
-            log_result_and_fill_reply!(self.manager.rename(&id, new_parent, new_name), reply);
+            self.manager
+                .rename(&id, new_parent, new_name, reply_when_done(reply));
         }
     }
 
@@ -259,6 +423,22 @@ impl Filesystem for Gcsf {
             return;
         }
 
+        if let Some(size) = size {
+            if let Err(e) = self.manager.truncate(&FileId::Inode(ino), size) {
+                error!("{:?}", e);
+                reply.error(EIO);
+                return;
+            }
+            // A truncation by path comes without any open handle whose release would upload it.
+            if !self.handles.is_open(ino) {
+                self.manager.flush(&FileId::Inode(ino), |result| {
+                    if let Err(e) = result {
+                        error!("Could not upload truncated file: {:?}", e);
+                    }
+                });
+            }
+        }
+
         let file = self.manager.get_mut_file(&FileId::Inode(ino)).unwrap();
 
         let new_attr = FileAttr {
@@ -279,7 +459,7 @@ impl Filesystem for Gcsf {
         };
 
         file.attr = new_attr;
-        reply.attr(&TTL, &file.attr);
+        reply.attr(&self.attr_ttl, &file.attr);
     }
 
     fn create(
@@ -315,7 +495,7 @@ impl Filesystem for Gcsf {
         }
 
         let file = File {
-            name: filename.clone(),
+            name: filename,
             attr: FileAttr {
                 ino: self.manager.next_available_inode(),
                 kind: FileType::RegularFile,
@@ -333,13 +513,10 @@ impl Filesystem for Gcsf {
                 flags: 0,
             },
             identical_name_id: None,
-            drive_file: Some(drive3::File {
-                name: Some(filename),
-                mime_type: None,
-                parents: Some(vec![self
-                    .manager
-                    .get_drive_id(&FileId::Inode(parent))
-                    .unwrap()]),
+            drive: Some(DriveMeta {
+                parents: vec![Interned::new(
+                    &self.manager.get_drive_id(&FileId::Inode(parent)).unwrap(),
+                )],
                 ..Default::default()
             }),
         };
@@ -347,7 +524,8 @@ impl Filesystem for Gcsf {
         let attr = file.attr;
         match self.manager.create_file(file, Some(FileId::Inode(parent))) {
             Ok(()) => {
-                reply.created(&TTL, &attr, 0, 0, 0);
+                let fh = self.handles.open(attr.ino, self.read_ahead_chunks);
+                reply.created(&self.entry_ttl, &attr, 0, fh, 0);
             }
             Err(e) => {
                 error!("create: {}", e);
@@ -369,25 +547,23 @@ impl Filesystem for Gcsf {
 
         match self.manager.file_is_trashed(&id) {
             Ok(trashed) => {
-                let res = if trashed {
+                if trashed {
                     debug!("{:?} is already trashed. Deleting permanently.", id);
-                    self.manager.delete(&id)
+                    self.manager.delete(&id, reply_when_done(reply));
                 } else if self.manager.skip_trash {
                     debug!(
                         "{:?} was not trashed. Deleting it permanently instead of moving to Trash \
                     because skip_trash is enabled in the configuration.",
                         id
                     );
-                    self.manager.delete(&id)
+                    self.manager.delete(&id, reply_when_done(reply));
                 } else {
                     debug!(
                         "{:?} was not trashed. Moving it to Trash instead of deleting permanently.",
                         id
                     );
-                    self.manager.move_file_to_trash(&id, true)
-                };
-
-                log_result_and_fill_reply!(res, reply);
+                    self.manager.move_file_to_trash(&id, reply_when_done(reply));
+                }
             }
             Err(e) => {
                 error!("{:?}", e);
@@ -430,7 +606,7 @@ impl Filesystem for Gcsf {
         }
 
         let dir = File {
-            name: dirname.clone(),
+            name: dirname,
             attr: FileAttr {
                 ino: self.manager.next_available_inode(),
                 kind: FileType::Directory,
@@ -448,13 +624,11 @@ impl Filesystem for Gcsf {
                 flags: 0,
             },
             identical_name_id: None,
-            drive_file: Some(drive3::File {
-                name: Some(dirname),
-                mime_type: Some("application/vnd.google-apps.folder".to_string()),
-                parents: Some(vec![self
-                    .manager
-                    .get_drive_id(&FileId::Inode(parent))
-                    .unwrap()]),
+            drive: Some(DriveMeta {
+                mime_type: Some(Interned::new("application/vnd.google-apps.folder")),
+                parents: vec![Interned::new(
+                    &self.manager.get_drive_id(&FileId::Inode(parent)).unwrap(),
+                )],
                 ..Default::default()
             }),
         };
@@ -462,7 +636,7 @@ impl Filesystem for Gcsf {
         let attr = dir.attr;
         match self.manager.create_file(dir, Some(FileId::Inode(parent))) {
             Ok(()) => {
-                reply.entry(&TTL, &attr, 0);
+                reply.entry(&self.entry_ttl, &attr, 0);
             }
             Err(e) => {
                 error!("mkdir: {}", e);
@@ -475,14 +649,83 @@ impl Filesystem for Gcsf {
         self.unlink(_req, parent, name, reply);
     }
 
-    fn flush(&mut self, _req: &Request, ino: Inode, _fh: u64, _lock_owner: u64, reply: ReplyEmpty) {
-        match self.manager.flush(&FileId::Inode(ino)) {
-            Ok(()) => reply.ok(),
-            Err(e) => {
-                error!("{:?}", e);
-                reply.error(EREMOTE);
+    fn open(&mut self, _req: &Request, ino: Inode, _flags: u32, reply: ReplyOpen) {
+        if !self.manager.contains(&FileId::Inode(ino)) {
+            reply.error(ENOENT);
+            return;
+        }
+
+        let fh = self.handles.open(ino, self.read_ahead_chunks);
+        reply.opened(fh, 0);
+    }
+
+    fn flush(&mut self, _req: &Request, ino: Inode, fh: u64, _lock_owner: u64, reply: ReplyEmpty) {
+        let timer = metrics::time(FuseOp::Flush);
+        // Sent for every close() of a descriptor, even if others remain open. In write-back
+        // mode, writes are uploaded once the file is released or synced instead.
+        let written = !self.write_back
+            && self
+                .handles
+                .get_mut(fh, ino)
+                .map_or(false, |handle| mem::replace(&mut handle.written, false));
+        if !written {
+            reply.ok();
+            return;
+        }
+
+        // Otherwise, close() waits for the upload, so that it can report a failure.
+        self.manager.flush(&FileId::Inode(ino), move |result| {
+            let _timer = timer;
+            match result {
+                Ok(()) => reply.ok(),
+                Err(e) => {
+                    error!("{:?}", e);
+                    reply.error(EREMOTE);
+                }
             }
+        });
+    }
+
+    fn release(
+        &mut self,
+        _req: &Request,
+        ino: Inode,
+        fh: u64,
+        _flags: u32,
+        _lock_owner: u64,
+        _flush: bool,
+        reply: ReplyEmpty,
+    ) {
+        let written = self
+            .handles
+            .release(fh)
+            .map_or(false, |handle| handle.written);
+        // Nobody waits for a release, so a failed upload can only be logged.
+        reply.ok();
+
+        // Readers which keep the file open do not hold up the upload.
+        if (written && !self.handles.is_written(ino)) || !self.handles.is_open(ino) {
+            self.manager.flush(&FileId::Inode(ino), |result| {
+                if let Err(e) = result {
+                    error!("Could not upload released file: {:?}", e);
+                }
+            });
+        }
+    }
+
+    fn fsync(&mut self, _req: &Request, ino: Inode, fh: u64, _datasync: bool, reply: ReplyEmpty) {
+        if let Some(handle) = self.handles.get_mut(fh, ino) {
+            handle.written = false;
         }
+
+        self.manager
+            .fsync(&FileId::Inode(ino), move |result| match result {
+                Ok(()) => reply.ok(),
+                Err(e) => {
+                    error!("{:?}", e);
+                    reply.error(EREMOTE);
+                }
+            });
     }
 
     fn statfs(&mut self, _req: &Request, _ino: u64, reply: ReplyStatfs) {
@@ -0,0 +1,269 @@
+use super::File;
+use failure::{err_msg, Error};
+use std::mem;
+
+type Inode = u64;
+
+/// A file along with its links to the surrounding files in the tree.
+#[derive(Debug)]
+struct Entry {
+    file: File,
+    parent: Option<Inode>,
+    first_child: Option<Inode>,
+    prev_sibling: Option<Inode>,
+    next_sibling: Option<Inode>,
+}
+
+/// The file tree, stored as a table indexed by inode.
+///
+/// Inodes are handed out by a counter, so they are dense and can index a `Vec` directly. Every
+/// entry holds its file along with the inodes of its parent, its first child and its siblings,
+/// which makes finding a file a single index, walking the children of a directory a walk
+/// through neighbouring entries, and moving a file to another directory a constant number of
+/// link updates.
+///
+/// Inodes are never reused within a mount, so the slots of removed files stay empty. Entries are
+/// boxed, so that an empty slot costs a single pointer rather than a whole file.
+///
+/// Children are linked in front of their siblings, so a directory lists its newest children
+/// first.
+#[derive(Debug, Default)]
+pub struct InodeTable {
+    entries: Vec<Option<Box<Entry>>>,
+    len: usize,
+    root: Option<Inode>,
+}
+
+impl InodeTable {
+    /// Creates an empty table.
+    pub fn new() -> Self {
+        InodeTable::default()
+    }
+
+    /// Forgets all files.
+    pub fn clear(&mut self) {
+        self.entries.clear();
+        self.len = 0;
+        self.root = None;
+    }
+
+    /// The number of files in the table.
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    /// Whether the table holds no file.
+    pub fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+
+    /// The inode of the root directory, if it has been inserted.
+    pub fn root(&self) -> Option<Inode> {
+        self.root
+    }
+
+    /// Whether there is a file with the given inode.
+    pub fn contains(&self, inode: Inode) -> bool {
+        self.entry(inode).is_some()
+    }
+
+    /// Returns the file with the given inode.
+    pub fn get(&self, inode: Inode) -> Option<&File> {
+        self.entry(inode).map(|entry| &entry.file)
+    }
+
+    /// Returns a mutable reference to the file with the given inode.
+    pub fn get_mut(&mut self, inode: Inode) -> Option<&mut File> {
+        self.entry_mut(inode).map(|entry| &mut entry.file)
+    }
+
+    /// Returns the inode of the directory which contains a file.
+    pub fn parent(&self, inode: Inode) -> Option<Inode> {
+        self.entry(inode)?.parent
+    }
+
+    /// Iterates over the inodes of the children of a directory.
+    pub fn children(&self, inode: Inode) -> Children<'_> {
+        Children {
+            table: self,
+            next: self.entry(inode).and_then(|entry| entry.first_child),
+        }
+    }
+
+    /// Inserts a file under `parent`, or as the root of the tree if there is no parent. Fails if
+    /// its inode is taken, if the parent does not exist or if a root is inserted twice.
+    pub fn insert(&mut self, file: File, parent: Option<Inode>) -> Result<(), Error> {
+        let inode = file.inode();
+        if self.contains(inode) {
+            return Err(err_msg(format!("Inode {} is already taken", inode)));
+        }
+        match parent {
+            Some(parent) if !self.contains(parent) => {
+                return Err(err_msg(format!("Parent inode {} does not exist", parent)));
+            }
+            None if self.root.is_some() => {
+                return Err(err_msg("The tree already has a root"));
+            }
+            None => self.root = Some(inode),
+            _ => {}
+        }
+
+        let index = inode as usize;
+        if index >= self.entries.len() {
+            // Grows geometrically, so that a counter of inodes causes few reallocations.
+            self.entries.resize_with(index + 1, || None);
+        }
+        self.entries[index] = Some(Box::new(Entry {
+            file,
+            parent: None,
+            first_child: None,
+            prev_sibling: None,
+            next_sibling: None,
+        }));
+        self.len += 1;
+
+        if let Some(parent) = parent {
+            self.link(inode, parent);
+        }
+        Ok(())
+    }
+
+    /// Moves a file, along with its children, under another directory. Fails if either does not
+    /// exist, or if the directory is within the moved file.
+    pub fn move_to(&mut self, inode: Inode, new_parent: Inode) -> Result<(), Error> {
+        if !self.contains(inode) || !self.contains(new_parent) {
+            return Err(err_msg(format!(
+                "Cannot move inode {} under inode {}",
+                inode, new_parent
+            )));
+        }
+        if self.parent(inode) == Some(new_parent) {
+            return Ok(());
+        }
+
+        let mut ancestor = Some(new_parent);
+        while let Some(current) = ancestor {
+            if current == inode {
+                return Err(err_msg(format!(
+                    "Cannot move inode {} within itself",
+                    inode
+                )));
+            }
+            ancestor = self.parent(current);
+        }
+
+        self.unlink(inode);
+        self.link(inode, new_parent);
+        Ok(())
+    }
+
+    /// Removes a file along with all of its descendants. Returns the removed files, starting
+    /// with the given one.
+    pub fn remove(&mut self, inode: Inode) -> Vec<File> {
+        if !self.contains(inode) {
+            return Vec::new();
+        }
+        self.unlink(inode);
+        if self.root == Some(inode) {
+            self.root = None;
+        }
+
+        let mut removed = Vec::new();
+        let mut stack = vec![inode];
+        while let Some(current) = stack.pop() {
+            let entry = match self
+                .entries
+                .get_mut(current as usize)
+                .and_then(Option::take)
+            {
+                Some(entry) => entry,
+                None => continue,
+            };
+            self.len -= 1;
+
+            let mut child = entry.first_child;
+            while let Some(c) = child {
+                stack.push(c);
+                child = self.entry(c).and_then(|e| e.next_sibling);
+            }
+            removed.push(entry.file);
+        }
+        removed
+    }
+
+    fn entry(&self, inode: Inode) -> Option<&Entry> {
+        self.entries
+            .get(inode as usize)?
+            .as_ref()
+            .map(|entry| &**entry)
+    }
+
+    fn entry_mut(&mut self, inode: Inode) -> Option<&mut Entry> {
+        self.entries
+            .get_mut(inode as usize)?
+            .as_mut()
+            .map(|entry| &mut **entry)
+    }
+
+    /// Links a detached file in front of the children of `parent`.
+    fn link(&mut self, inode: Inode, parent: Inode) {
+        let first = match self.entry_mut(parent) {
+            Some(entry) => mem::replace(&mut entry.first_child, Some(inode)),
+            None => return,
+        };
+        if let Some(first) = first {
+            if let Some(entry) = self.entry_mut(first) {
+                entry.prev_sibling = Some(inode);
+            }
+        }
+        if let Some(entry) = self.entry_mut(inode) {
+            entry.parent = Some(parent);
+            entry.prev_sibling = None;
+            entry.next_sibling = first;
+        }
+    }
+
+    /// Detaches a file from its parent and siblings.
+    fn unlink(&mut self, inode: Inode) {
+        let (parent, prev, next) = match self.entry_mut(inode) {
+            Some(entry) => (
+                entry.parent.take(),
+                entry.prev_sibling.take(),
+                entry.next_sibling.take(),
+            ),
+            None => return,
+        };
+
+        match prev {
+            Some(prev) => {
+                if let Some(entry) = self.entry_mut(prev) {
+                    entry.next_sibling = next;
+                }
+            }
+            None => {
+                if let Some(entry) = parent.and_then(|p| self.entry_mut(p)) {
+                    entry.first_child = next;
+                }
+            }
+        }
+        if let Some(entry) = next.and_then(|n| self.entry_mut(n)) {
+            entry.prev_sibling = prev;
+        }
+    }
+}
+
+/// The inodes of the children of a directory, as returned by `InodeTable::children()`.
+pub struct Children<'a> {
+    table: &'a InodeTable,
+    next: Option<Inode>,
+}
+
+impl<'a> Iterator for Children<'a> {
+    type Item = Inode;
+
+    fn next(&mut self) -> Option<Inode> {
+        let current = self.next?;
+        self.next = self.table.entry(current).and_then(|e| e.next_sibling);
+        Some(current)
+    }
+}
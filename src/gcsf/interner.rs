@@ -0,0 +1,92 @@
+use serde::de::{Deserialize, Deserializer};
+use serde::ser::{Serialize, Serializer};
+use std::borrow::Borrow;
+use std::collections::HashSet;
+use std::fmt;
+use std::ops::Deref;
+use std::sync::{Arc, Mutex};
+
+lazy_static! {
+    static ref STRINGS: Mutex<HashSet<Arc<str>>> = Mutex::new(HashSet::new());
+}
+
+/// An immutable string which is stored only once, however many times it is used.
+///
+/// Drive ids show up in the metadata of a file (its own id and those of its parents) and in the
+/// indexes which map ids to inodes, and a handful of mime types are shared by every file. Each
+/// distinct string is kept in a single allocation which all of its copies point to, so cloning
+/// an `Interned` string is cheap and a tree of many files keeps each id only once.
+#[derive(Clone, PartialEq, Eq, Hash, PartialOrd, Ord)]
+pub struct Interned(Arc<str>);
+
+impl Interned {
+    /// Returns the shared copy of `s`, storing it first if it is not stored yet.
+    pub fn new(s: &str) -> Self {
+        let mut strings = STRINGS.lock().unwrap();
+        if let Some(existing) = strings.get(s) {
+            return Interned(Arc::clone(existing));
+        }
+
+        let stored: Arc<str> = Arc::from(s);
+        strings.insert(Arc::clone(&stored));
+        Interned(stored)
+    }
+
+    /// The string itself.
+    pub fn as_str(&self) -> &str {
+        &self.0
+    }
+
+    /// Frees the strings which are not used anymore. Takes time proportional to the number of
+    /// stored strings, so it should only be called once in a while (e.g. after files have been
+    /// removed).
+    pub fn collect_garbage() {
+        STRINGS.lock().unwrap().retain(|s| Arc::strong_count(s) > 1);
+    }
+}
+
+impl Deref for Interned {
+    type Target = str;
+
+    fn deref(&self) -> &str {
+        &self.0
+    }
+}
+
+impl Borrow<str> for Interned {
+    fn borrow(&self) -> &str {
+        &self.0
+    }
+}
+
+impl<'a> From<&'a str> for Interned {
+    fn from(s: &'a str) -> Self {
+        Interned::new(s)
+    }
+}
+
+impl fmt::Debug for Interned {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        fmt::Debug::fmt(&*self.0, f)
+    }
+}
+
+impl fmt::Display for Interned {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        fmt::Display::fmt(&*self.0, f)
+    }
+}
+
+impl Serialize for Interned {
+    fn serialize<S: Serializer>(&self, serializer: S) -> Result<S::Ok, S::Error> {
+        serializer.serialize_str(&self.0)
+    }
+}
+
+impl<'de> Deserialize<'de> for Interned {
+    fn deserialize<D: Deserializer<'de>>(deserializer: D) -> Result<Self, D::Error> {
+        // Strings loaded from a snapshot are shared just like those received from Drive.
+        let s = String::deserialize(deserializer)?;
+        Ok(Interned::new(&s))
+    }
+}
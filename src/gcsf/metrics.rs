@@ -0,0 +1,738 @@
+use super::prefetcher::ChunkStore;
+use failure::Error;
+use hyper::net::Fresh;
+use hyper::server::{Listening, Request, Response, Server};
+use hyper::status::StatusCode;
+use hyper::uri::RequestUri;
+use std::cell::Cell;
+use std::fmt::Write;
+use std::sync::atomic::{AtomicI64, AtomicU64, Ordering};
+use std::sync::Arc;
+use std::time::{Duration, Instant, SystemTime, UNIX_EPOCH};
+
+/// The upper bounds of the buckets of every latency histogram, in microseconds, from 100µs to
+/// 10s. Slower operations fall in a last, unbounded bucket.
+const BUCKET_BOUNDS: [u64; 16] = [
+    100, 250, 500, 1_000, 2_500, 5_000, 10_000, 25_000, 50_000, 100_000, 250_000, 500_000,
+    1_000_000, 2_500_000, 5_000_000, 10_000_000,
+];
+
+/// How many bytes at the start of a request are kept until its request line is complete.
+const MAX_REQUEST_LINE: usize = 4096;
+
+lazy_static! {
+    /// The metrics of the whole process. Every part of the file system records into them.
+    static ref METRICS: Metrics = Metrics::default();
+}
+
+thread_local! {
+    static RETRYING: Cell<bool> = Cell::new(false);
+}
+
+/// Counts durations in buckets, like a Prometheus histogram. Durations are recorded with atomic
+/// operations only, so that recording never waits for a lock.
+#[derive(Default)]
+pub struct Histogram {
+    /// How many durations fell in each bucket (not cumulative). The last one is unbounded.
+    buckets: [AtomicU64; 17],
+
+    /// The sum of all recorded durations, in microseconds.
+    sum_micros: AtomicU64,
+}
+
+impl Histogram {
+    /// Records a duration in the bucket it falls in.
+    pub fn record(&self, duration: Duration) {
+        let micros = duration.as_micros() as u64;
+        let bucket = BUCKET_BOUNDS
+            .iter()
+            .position(|&bound| micros <= bound)
+            .unwrap_or(BUCKET_BOUNDS.len());
+        self.buckets[bucket].fetch_add(1, Ordering::Relaxed);
+        self.sum_micros.fetch_add(micros, Ordering::Relaxed);
+    }
+
+    /// How many durations have been recorded.
+    pub fn count(&self) -> u64 {
+        self.buckets
+            .iter()
+            .map(|bucket| bucket.load(Ordering::Relaxed))
+            .sum()
+    }
+
+    /// The number of durations recorded up to each bound, in seconds, the last bound being
+    /// infinite.
+    pub fn cumulative(&self) -> Vec<(f64, u64)> {
+        let mut total = 0;
+        self.buckets
+            .iter()
+            .enumerate()
+            .map(|(i, bucket)| {
+                total += bucket.load(Ordering::Relaxed);
+                let bound = BUCKET_BOUNDS
+                    .get(i)
+                    .map_or(f64::INFINITY, |&micros| micros as f64 / 1e6);
+                (bound, total)
+            })
+            .collect()
+    }
+
+    /// Writes the histogram in the Prometheus text format, under the series `name` with the
+    /// label `labels` (e.g. `op="read"`).
+    fn render(&self, out: &mut String, name: &str, labels: &str) {
+        for (bound, total) in self.cumulative() {
+            let bound = if bound.is_infinite() {
+                String::from("+Inf")
+            } else {
+                bound.to_string()
+            };
+            let _ = writeln!(
+                out,
+                "{}_bucket{{{},le=\"{}\"}} {}",
+                name, labels, bound, total
+            );
+        }
+        let sum = self.sum_micros.load(Ordering::Relaxed) as f64 / 1e6;
+        let _ = writeln!(out, "{}_sum{{{}}} {}", name, labels, sum);
+        let _ = writeln!(out, "{}_count{{{}}} {}", name, labels, self.count());
+    }
+}
+
+/// The FUSE operations whose latency is measured, from the request until the reply.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum FuseOp {
+    /// `lookup`
+    Lookup,
+    /// `getattr`
+    Getattr,
+    /// `read`
+    Read,
+    /// `write`
+    Write,
+    /// `flush`, i.e. `close()`
+    Flush,
+    /// `readdir`
+    Readdir,
+}
+
+const FUSE_OPS: [FuseOp; 6] = [
+    FuseOp::Lookup,
+    FuseOp::Getattr,
+    FuseOp::Read,
+    FuseOp::Write,
+    FuseOp::Flush,
+    FuseOp::Readdir,
+];
+
+impl FuseOp {
+    /// The name of the operation, as used in the `op` label.
+    pub fn name(self) -> &'static str {
+        match self {
+            FuseOp::Lookup => "lookup",
+            FuseOp::Getattr => "getattr",
+            FuseOp::Read => "read",
+            FuseOp::Write => "write",
+            FuseOp::Flush => "flush",
+            FuseOp::Readdir => "readdir",
+        }
+    }
+}
+
+/// The Drive API endpoints which requests are counted by. The calls in a batch are only counted
+/// as one call to the batch endpoint.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Endpoint {
+    /// `files.list`
+    FilesList,
+    /// `files.get` for metadata.
+    FilesGet,
+    /// `files.get` for content (`alt=media`), including range requests.
+    FilesDownload,
+    /// `files.create` without content.
+    FilesCreate,
+    /// `files.update` without content.
+    FilesUpdate,
+    /// `files.delete`
+    FilesDelete,
+    /// `files.export`
+    FilesExport,
+    /// Any request to the upload endpoint, including every chunk of a resumable upload.
+    Upload,
+    /// A batch of calls.
+    Batch,
+    /// `changes.list`
+    ChangesList,
+    /// `changes.getStartPageToken`
+    ChangesStartPageToken,
+    /// `changes.watch`
+    ChangesWatch,
+    /// `channels.stop`
+    ChannelsStop,
+    /// `about.get`
+    About,
+    /// The OAuth token endpoint.
+    Token,
+    /// Anything else.
+    Other,
+}
+
+const ENDPOINTS: [Endpoint; 16] = [
+    Endpoint::FilesList,
+    Endpoint::FilesGet,
+    Endpoint::FilesDownload,
+    Endpoint::FilesCreate,
+    Endpoint::FilesUpdate,
+    Endpoint::FilesDelete,
+    Endpoint::FilesExport,
+    Endpoint::Upload,
+    Endpoint::Batch,
+    Endpoint::ChangesList,
+    Endpoint::ChangesStartPageToken,
+    Endpoint::ChangesWatch,
+    Endpoint::ChannelsStop,
+    Endpoint::About,
+    Endpoint::Token,
+    Endpoint::Other,
+];
+
+impl Endpoint {
+    /// Tells which endpoint a request goes to, from the method and the target of its request
+    /// line (e.g. `GET` and `/drive/v3/files/abc?alt=media`).
+    pub fn classify(method: &str, target: &str) -> Endpoint {
+        let (path, query) = match target.find('?') {
+            Some(i) => (&target[..i], &target[i + 1..]),
+            None => (target, ""),
+        };
+        let segments: Vec<&str> = path.split('/').filter(|s| !s.is_empty()).collect();
+
+        match segments.first() {
+            Some(&"upload") => return Endpoint::Upload,
+            Some(&"batch") => return Endpoint::Batch,
+            _ => {}
+        }
+        let api = match segments.windows(2).position(|w| w == ["drive", "v3"]) {
+            Some(i) => &segments[i + 2..],
+            None if segments.last() == Some(&"token") => return Endpoint::Token,
+            None => return Endpoint::Other,
+        };
+
+        match (method, api) {
+            ("GET", ["files"]) => Endpoint::FilesList,
+            ("POST", ["files"]) => Endpoint::FilesCreate,
+            ("GET", ["files", _]) if query.split('&').any(|p| p == "alt=media") => {
+                Endpoint::FilesDownload
+            }
+            ("GET", ["files", _]) => Endpoint::FilesGet,
+            ("PATCH", ["files", _]) => Endpoint::FilesUpdate,
+            ("DELETE", ["files", _]) => Endpoint::FilesDelete,
+            (_, ["files", _, "export"]) => Endpoint::FilesExport,
+            (_, ["changes"]) => Endpoint::ChangesList,
+            (_, ["changes", "startPageToken"]) => Endpoint::ChangesStartPageToken,
+            (_, ["changes", "watch"]) => Endpoint::ChangesWatch,
+            (_, ["channels", "stop"]) => Endpoint::ChannelsStop,
+            (_, ["about"]) => Endpoint::About,
+            _ => Endpoint::Other,
+        }
+    }
+
+    /// The name of the endpoint, as used in the `endpoint` label.
+    pub fn name(self) -> &'static str {
+        match self {
+            Endpoint::FilesList => "files.list",
+            Endpoint::FilesGet => "files.get",
+            Endpoint::FilesDownload => "files.download",
+            Endpoint::FilesCreate => "files.create",
+            Endpoint::FilesUpdate => "files.update",
+            Endpoint::FilesDelete => "files.delete",
+            Endpoint::FilesExport => "files.export",
+            Endpoint::Upload => "upload",
+            Endpoint::Batch => "batch",
+            Endpoint::ChangesList => "changes.list",
+            Endpoint::ChangesStartPageToken => "changes.getStartPageToken",
+            Endpoint::ChangesWatch => "changes.watch",
+            Endpoint::ChannelsStop => "channels.stop",
+            Endpoint::About => "about.get",
+            Endpoint::Token => "token",
+            Endpoint::Other => "other",
+        }
+    }
+}
+
+/// A request sent to Drive, as seen by its connection.
+#[derive(Debug, Clone)]
+pub struct Exchange {
+    /// Where the request went.
+    pub endpoint: Endpoint,
+
+    /// The status of the response, if one arrived.
+    pub status: Option<u16>,
+
+    /// Whether Drive asked to slow down.
+    pub throttled: bool,
+
+    /// Whether the request repeats one which failed.
+    pub retry: bool,
+
+    /// How many bytes were sent, headers included.
+    pub sent: u64,
+
+    /// How many bytes were received, headers included.
+    pub received: u64,
+
+    /// How long the request took, from sending it until the response had been read.
+    pub duration: Duration,
+}
+
+/// Where a chunk read by a user was found.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum CacheLookup {
+    /// In the in-memory cache.
+    Memory,
+    /// In the disk cache.
+    Disk,
+    /// Nowhere: it had to be downloaded.
+    Miss,
+}
+
+#[derive(Default)]
+struct EndpointStats {
+    calls: AtomicU64,
+    errors: AtomicU64,
+    retries: AtomicU64,
+    throttled: AtomicU64,
+    latency: Histogram,
+}
+
+/// Counters, gauges and histograms describing the file system since it was mounted.
+#[derive(Default)]
+pub struct Metrics {
+    fuse_ops: [Histogram; 6],
+    endpoints: [EndpointStats; 16],
+    sent_bytes: AtomicU64,
+    received_bytes: AtomicU64,
+    cache_lookups: [AtomicU64; 3],
+
+    /// The dirty bytes held by write buffers, which have not been uploaded yet.
+    pending_write_bytes: AtomicI64,
+
+    /// The total length of the resumable uploads in progress, and how many of their bytes Drive
+    /// has acknowledged so far.
+    upload_bytes: AtomicI64,
+    uploaded_bytes: AtomicI64,
+
+    /// When the file tree last caught up with Drive, in milliseconds since the epoch. Zero if it
+    /// never has.
+    last_sync_millis: AtomicU64,
+}
+
+impl Metrics {
+    /// Records how long a FUSE operation took.
+    pub fn record_op(&self, op: FuseOp, duration: Duration) {
+        self.fuse_ops[op as usize].record(duration);
+    }
+
+    /// Records a request sent to Drive. A request which got no response or an error status
+    /// counts as an error.
+    pub fn record_exchange(&self, exchange: &Exchange) {
+        let stats = &self.endpoints[exchange.endpoint as usize];
+        stats.calls.fetch_add(1, Ordering::Relaxed);
+        if exchange.status.map_or(true, |status| status >= 400) {
+            stats.errors.fetch_add(1, Ordering::Relaxed);
+        }
+        if exchange.retry {
+            stats.retries.fetch_add(1, Ordering::Relaxed);
+        }
+        if exchange.throttled {
+            stats.throttled.fetch_add(1, Ordering::Relaxed);
+        }
+        stats.latency.record(exchange.duration);
+
+        self.sent_bytes.fetch_add(exchange.sent, Ordering::Relaxed);
+        self.received_bytes
+            .fetch_add(exchange.received, Ordering::Relaxed);
+    }
+
+    /// Records where a chunk was found.
+    pub fn record_cache(&self, lookup: CacheLookup) {
+        self.cache_lookups[lookup as usize].fetch_add(1, Ordering::Relaxed);
+    }
+
+    /// Adds `delta` (possibly negative) to the bytes waiting to be uploaded.
+    pub fn add_pending_write_bytes(&self, delta: i64) {
+        self.pending_write_bytes.fetch_add(delta, Ordering::Relaxed);
+    }
+
+    /// Adds `len` and `acknowledged` (possibly negative) to the length of the uploads in progress
+    /// and to the bytes of them which Drive has acknowledged.
+    pub fn add_upload_progress(&self, len: i64, acknowledged: i64) {
+        self.upload_bytes.fetch_add(len, Ordering::Relaxed);
+        self.uploaded_bytes
+            .fetch_add(acknowledged, Ordering::Relaxed);
+    }
+
+    /// Records that the file tree caught up with Drive at `time`.
+    pub fn record_sync(&self, time: SystemTime) {
+        let millis = time
+            .duration_since(UNIX_EPOCH)
+            .map(|since| since.as_millis() as u64)
+            .unwrap_or(0);
+        self.last_sync_millis.store(millis, Ordering::Relaxed);
+    }
+
+    /// Writes all metrics in the Prometheus text format. The resident bytes of the caches are
+    /// passed in, since they are only known to the caches themselves.
+    pub fn render(&self, now: SystemTime, memory_bytes: u64, disk_bytes: Option<u64>) -> String {
+        let mut out = String::new();
+
+        let _ = writeln!(
+            out,
+            "# HELP gcsf_fuse_op_duration_seconds Time taken to answer FUSE operations."
+        );
+        let _ = writeln!(out, "# TYPE gcsf_fuse_op_duration_seconds histogram");
+        for &op in &FUSE_OPS {
+            self.fuse_ops[op as usize].render(
+                &mut out,
+                "gcsf_fuse_op_duration_seconds",
+                &format!("op=\"{}\"", op.name()),
+            );
+        }
+
+        let counters: [(&str, &str, fn(&EndpointStats) -> &AtomicU64); 4] = [
+            ("requests", "Requests sent to Drive.", |s| &s.calls),
+            (
+                "errors",
+                "Requests which failed or got an error status.",
+                |s| &s.errors,
+            ),
+            ("retries", "Requests which repeated a failed one.", |s| {
+                &s.retries
+            }),
+            (
+                "throttled",
+                "Requests which Drive answered by asking to slow down.",
+                |s| &s.throttled,
+            ),
+        ];
+        for &(name, help, counter) in &counters {
+            let _ = writeln!(out, "# HELP gcsf_drive_{}_total {}", name, help);
+            let _ = writeln!(out, "# TYPE gcsf_drive_{}_total counter", name);
+            for &endpoint in &ENDPOINTS {
+                let stats = &self.endpoints[endpoint as usize];
+                let _ = writeln!(
+                    out,
+                    "gcsf_drive_{}_total{{endpoint=\"{}\"}} {}",
+                    name,
+                    endpoint.name(),
+                    counter(stats).load(Ordering::Relaxed)
+                );
+            }
+        }
+
+        let _ = writeln!(
+            out,
+            "# HELP gcsf_drive_request_duration_seconds Time taken by requests sent to Drive."
+        );
+        let _ = writeln!(out, "# TYPE gcsf_drive_request_duration_seconds histogram");
+        for &endpoint in &ENDPOINTS {
+            self.endpoints[endpoint as usize].latency.render(
+                &mut out,
+                "gcsf_drive_request_duration_seconds",
+                &format!("endpoint=\"{}\"", endpoint.name()),
+            );
+        }
+
+        let _ = writeln!(
+            out,
+            "# HELP gcsf_drive_sent_bytes_total Bytes sent to Drive, headers included."
+        );
+        let _ = writeln!(out, "# TYPE gcsf_drive_sent_bytes_total counter");
+        let _ = writeln!(
+            out,
+            "gcsf_drive_sent_bytes_total {}",
+            self.sent_bytes.load(Ordering::Relaxed)
+        );
+        let _ = writeln!(
+            out,
+            "# HELP gcsf_drive_received_bytes_total Bytes received from Drive, headers included."
+        );
+        let _ = writeln!(out, "# TYPE gcsf_drive_received_bytes_total counter");
+        let _ = writeln!(
+            out,
+            "gcsf_drive_received_bytes_total {}",
+            self.received_bytes.load(Ordering::Relaxed)
+        );
+
+        let lookups: Vec<u64> = self
+            .cache_lookups
+            .iter()
+            .map(|count| count.load(Ordering::Relaxed))
+            .collect();
+        let _ = writeln!(
+            out,
+            "# HELP gcsf_cache_lookups_total Chunks read, by where they were found."
+        );
+        let _ = writeln!(out, "# TYPE gcsf_cache_lookups_total counter");
+        for &(result, count) in &[
+            ("memory", lookups[CacheLookup::Memory as usize]),
+            ("disk", lookups[CacheLookup::Disk as usize]),
+            ("miss", lookups[CacheLookup::Miss as usize]),
+        ] {
+            let _ = writeln!(
+                out,
+                "gcsf_cache_lookups_total{{result=\"{}\"}} {}",
+                result, count
+            );
+        }
+        let total: u64 = lookups.iter().sum();
+        if total > 0 {
+            let _ = writeln!(
+                out,
+                "# HELP gcsf_cache_hit_ratio Share of chunks read which were found in a cache."
+            );
+            let _ = writeln!(out, "# TYPE gcsf_cache_hit_ratio gauge");
+            let hits = total - lookups[CacheLookup::Miss as usize];
+            let _ = writeln!(out, "gcsf_cache_hit_ratio {}", hits as f64 / total as f64);
+        }
+
+        let _ = writeln!(
+            out,
+            "# HELP gcsf_cache_resident_bytes Bytes of file content held by each cache."
+        );
+        let _ = writeln!(out, "# TYPE gcsf_cache_resident_bytes gauge");
+        let _ = writeln!(
+            out,
+            "gcsf_cache_resident_bytes{{cache=\"memory\"}} {}",
+            memory_bytes
+        );
+        if let Some(disk_bytes) = disk_bytes {
+            let _ = writeln!(
+                out,
+                "gcsf_cache_resident_bytes{{cache=\"disk\"}} {}",
+                disk_bytes
+            );
+        }
+
+        let _ = writeln!(
+            out,
+            "# HELP gcsf_pending_write_bytes Written bytes which have not been uploaded yet."
+        );
+        let _ = writeln!(out, "# TYPE gcsf_pending_write_bytes gauge");
+        let _ = writeln!(
+            out,
+            "gcsf_pending_write_bytes {}",
+            self.pending_write_bytes.load(Ordering::Relaxed)
+        );
+
+        let _ = writeln!(
+            out,
+            "# HELP gcsf_upload_bytes The length of the resumable uploads in progress."
+        );
+        let _ = writeln!(out, "# TYPE gcsf_upload_bytes gauge");
+        let _ = writeln!(
+            out,
+            "gcsf_upload_bytes {}",
+            self.upload_bytes.load(Ordering::Relaxed)
+        );
+        let _ = writeln!(
+            out,
+            "# HELP gcsf_upload_acknowledged_bytes Bytes of the resumable uploads in progress which Drive has acknowledged."
+        );
+        let _ = writeln!(out, "# TYPE gcsf_upload_acknowledged_bytes gauge");
+        let _ = writeln!(
+            out,
+            "gcsf_upload_acknowledged_bytes {}",
+            self.uploaded_bytes.load(Ordering::Relaxed)
+        );
+
+        let last_sync = self.last_sync_millis.load(Ordering::Relaxed);
+        if last_sync > 0 {
+            let now = now
+                .duration_since(UNIX_EPOCH)
+                .map(|since| since.as_millis() as u64)
+                .unwrap_or(0);
+            let _ = writeln!(
+                out,
+                "# HELP gcsf_sync_lag_seconds Time since the file tree last caught up with Drive."
+            );
+            let _ = writeln!(out, "# TYPE gcsf_sync_lag_seconds gauge");
+            let _ = writeln!(
+                out,
+                "gcsf_sync_lag_seconds {}",
+                now.saturating_sub(last_sync) as f64 / 1e3
+            );
+        }
+
+        out
+    }
+}
+
+/// Measures a FUSE operation until it is dropped, which should happen once the reply has been
+/// sent. Replies sent from another thread take the timer along.
+pub struct OpTimer {
+    op: FuseOp,
+    start: Instant,
+}
+
+impl Drop for OpTimer {
+    fn drop(&mut self) {
+        METRICS.record_op(self.op, self.start.elapsed());
+    }
+}
+
+/// Starts measuring a FUSE operation.
+pub fn time(op: FuseOp) -> OpTimer {
+    OpTimer {
+        op,
+        start: Instant::now(),
+    }
+}
+
+/// Records a request sent to Drive.
+pub fn record_exchange(exchange: &Exchange) {
+    METRICS.record_exchange(exchange);
+}
+
+/// Records where a chunk read by a user was found.
+pub fn record_cache(lookup: CacheLookup) {
+    METRICS.record_cache(lookup);
+}
+
+/// Adds `delta` (possibly negative) to the bytes waiting to be uploaded.
+pub fn add_pending_write_bytes(delta: i64) {
+    METRICS.add_pending_write_bytes(delta);
+}
+
+/// Adds `len` and `acknowledged` (possibly negative) to the length of the uploads in progress and
+/// to the bytes of them which Drive has acknowledged.
+pub fn add_upload_progress(len: i64, acknowledged: i64) {
+    METRICS.add_upload_progress(len, acknowledged);
+}
+
+/// Records that the file tree has just caught up with Drive.
+pub fn record_sync() {
+    METRICS.record_sync(SystemTime::now());
+}
+
+/// Marks the next request sent by the current thread as a retry.
+pub fn mark_retry() {
+    RETRYING.with(|retrying| retrying.set(true));
+}
+
+/// Whether the current thread is retrying a request. Clears the mark.
+pub fn take_retry() -> bool {
+    RETRYING.with(|retrying| retrying.replace(false))
+}
+
+/// Follows a request through its connection, so that it can be recorded once it is done.
+pub struct ExchangeTracker {
+    /// The start of the request, kept until its request line is complete.
+    request_line: Vec<u8>,
+    endpoint: Option<Endpoint>,
+    retry: bool,
+    sent: u64,
+    received: u64,
+    start: Instant,
+}
+
+impl ExchangeTracker {
+    /// Starts following a request which is about to be sent by the current thread.
+    pub fn new() -> Self {
+        ExchangeTracker {
+            request_line: Vec::new(),
+            endpoint: None,
+            retry: take_retry(),
+            sent: 0,
+            received: 0,
+            start: Instant::now(),
+        }
+    }
+
+    /// Looks at bytes sent for the request line.
+    pub fn sent(&mut self, data: &[u8]) {
+        self.sent += data.len() as u64;
+        if self.endpoint.is_some() {
+            return;
+        }
+
+        let wanted = MAX_REQUEST_LINE - self.request_line.len();
+        self.request_line
+            .extend_from_slice(&data[..data.len().min(wanted)]);
+        if let Some(end) = self.request_line.iter().position(|&b| b == b'\n') {
+            let line = String::from_utf8_lossy(&self.request_line[..end]).into_owned();
+            let mut parts = line.split_whitespace();
+            let method = parts.next().unwrap_or("");
+            let target = parts.next().unwrap_or("");
+            self.endpoint = Some(Endpoint::classify(method, target));
+            self.request_line = Vec::new();
+        } else if self.request_line.len() >= MAX_REQUEST_LINE {
+            self.endpoint = Some(Endpoint::Other);
+            self.request_line = Vec::new();
+        }
+    }
+
+    /// Counts bytes received.
+    pub fn received(&mut self, len: usize) {
+        self.received += len as u64;
+    }
+
+    /// Records the request, given what Drive answered. Does nothing if nothing was sent.
+    pub fn finish(&self, status: Option<u16>, throttled: bool) {
+        if let Some(endpoint) = self.endpoint {
+            record_exchange(&Exchange {
+                endpoint,
+                status,
+                throttled,
+                retry: self.retry,
+                sent: self.sent,
+                received: self.received,
+                duration: self.start.elapsed(),
+            });
+        }
+    }
+}
+
+/// Serves the metrics in the Prometheus text format on `/metrics`, until dropped.
+pub struct MetricsServer {
+    listening: Listening,
+}
+
+impl MetricsServer {
+    /// Starts listening on `address` (e.g. `127.0.0.1:9100`). The resident bytes of the caches
+    /// are read from `store` whenever the metrics are scraped.
+    pub fn start(address: &str, store: Arc<ChunkStore>) -> Result<Self, Error> {
+        let listening = Server::http(address)?.handle_threads(
+            move |request: Request, mut response: Response<Fresh>| {
+                let scraped = match request.uri {
+                    RequestUri::AbsolutePath(ref path) => {
+                        path == "/metrics" || path.starts_with("/metrics?")
+                    }
+                    _ => false,
+                };
+                if !scraped {
+                    *response.status_mut() = StatusCode::NotFound;
+                    return;
+                }
+
+                let memory_bytes = store.memory.lock().unwrap().size();
+                let disk_bytes = store.disk.as_ref().map(|disk| disk.lock().unwrap().size());
+                let body = METRICS.render(SystemTime::now(), memory_bytes, disk_bytes);
+                response
+                    .headers_mut()
+                    .set_raw("Content-Type", vec![b"text/plain; version=0.0.4".to_vec()]);
+                if let Err(e) = response.send(body.as_bytes()) {
+                    debug!("Could not send metrics: {}", e);
+                }
+            },
+            2,
+        )?;
+
+        info!("Serving metrics on http://{}/metrics", address);
+        Ok(MetricsServer { listening })
+    }
+}
+
+impl Drop for MetricsServer {
+    fn drop(&mut self) {
+        let _ = self.listening.close();
+    }
+}
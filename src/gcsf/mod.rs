@@ -1,10 +1,56 @@
+pub use self::backend::{DriveBackend, Listing};
+#[cfg(test)]
+pub use self::batch::Batch;
+pub use self::batch::{BatchCall, Batcher};
+pub use self::block_cache::{BlockCache, Chunk};
+#[cfg(test)]
+pub use self::checksum::Md5;
 pub use self::config::Config;
+#[cfg(test)]
+pub use self::content_client::DummyFile;
+pub use self::disk_cache::DiskCache;
 pub use self::drive_facade::DriveFacade;
-pub use self::file::{File, FileId};
+pub use self::file::{DriveMeta, File, FileId};
+pub use self::file_handle::{DirEntry, FileHandles};
 pub use self::file_manager::FileManager;
+#[cfg(test)]
+pub use self::inode_table::InodeTable;
+pub use self::interner::Interned;
+#[cfg(test)]
+pub use self::metrics::{Endpoint, Exchange, FuseOp, Histogram, Metrics};
+#[cfg(test)]
+pub use self::prefetcher::ChunkStore;
+pub use self::read_ahead::{ReadAhead, ReadStream};
+#[cfg(test)]
+pub use self::scheduler::{is_throttling, Priority, Scheduler};
+pub use self::snapshot::{Snapshot, SnapshotEntry};
+pub use self::synthetic_drive::SyntheticDrive;
+#[cfg(test)]
+pub use self::upload_journal::{UploadJournal, UploadSession};
+pub use self::write_buffer::WriteBuffer;
 
+mod backend;
+mod batch;
+mod block_cache;
+mod change_poller;
+mod checksum;
 mod config;
+mod connection_pool;
+mod content_client;
+mod disk_cache;
 mod drive_facade;
 mod file;
+mod file_handle;
 mod file_manager;
 pub mod filesystem;
+mod inode_table;
+mod interner;
+mod metrics;
+mod prefetcher;
+mod read_ahead;
+mod scheduler;
+mod snapshot;
+mod synthetic_drive;
+mod upload_journal;
+mod worker_pool;
+mod write_buffer;
@@ -0,0 +1,447 @@
+use super::checksum::Md5;
+use super::drive_facade::{GcAuthenticator, GcClient};
+use super::metrics;
+use super::scheduler;
+use super::scheduler::{Priority, MAX_RETRIES};
+use super::{BlockCache, Chunk, DiskCache, ReadStream};
+use drive3;
+use failure::{err_msg, Error};
+use hyper::header::{Authorization, Bearer, ByteRangeSpec, Range};
+use hyper::status::StatusCode;
+use oauth2::GetToken;
+use std::collections::HashMap;
+use std::io;
+use std::io::Read;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::mpsc::{channel, Sender};
+use std::sync::{Arc, Condvar, Mutex};
+use std::thread;
+
+type DriveId = String;
+type DriveIdRef<'a> = &'a str;
+
+/// Downloads byte ranges of Drive files. Cloning a `Downloader` is cheap and the clones can be
+/// used from any thread.
+#[derive(Clone)]
+pub struct Downloader {
+    client: Arc<GcClient>,
+    auth: GcAuthenticator,
+
+    /// The address of the `files` collection of the Drive API.
+    files_url: Arc<String>,
+}
+
+impl Downloader {
+    /// Creates a downloader which sends its requests through `client`, authorized by `auth`, to
+    /// the Drive API served under `api_root_url` (see `Config::api_root_url()`).
+    pub fn new(client: GcClient, auth: GcAuthenticator, api_root_url: &str) -> Self {
+        Downloader {
+            client: Arc::new(client),
+            auth,
+            files_url: Arc::new(format!("{}drive/v3/files", api_root_url)),
+        }
+    }
+
+    /// Retrieves the bytes `start..=end` of a Drive file using an HTTP Range request. The result
+    /// is shorter than requested if the file ends before `end`, and empty if it ends before
+    /// `start`. Can not be used for files which must be exported.
+    pub fn get_range(&self, drive_id: DriveIdRef, start: u64, end: u64) -> Result<Vec<u8>, Error> {
+        let token = self
+            .auth
+            .clone()
+            .token(&[drive3::Scope::Full])
+            .map_err(|e| err_msg(format!("{:#?}", e)))?;
+
+        let mut attempts = 0;
+        let mut response = loop {
+            let response = self
+                .client
+                .get(&format!("{}/{}?alt=media", self.files_url, drive_id))
+                .header(Authorization(Bearer {
+                    token: token.access_token.clone(),
+                }))
+                .header(Range::Bytes(vec![ByteRangeSpec::FromTo(start, end)]))
+                .send()
+                .map_err(|e| err_msg(format!("{:#?}", e)))?;
+
+            // The scheduler pauses before sending the retried request.
+            if scheduler::is_throttling(response.status.to_u16(), false) && attempts < MAX_RETRIES {
+                attempts += 1;
+                debug!("get_range({}): retrying, attempt {}", drive_id, attempts);
+                metrics::mark_retry();
+                continue;
+            }
+            break response;
+        };
+
+        match response.status {
+            StatusCode::PartialContent => {}
+            StatusCode::RangeNotSatisfiable => return Ok(Vec::new()),
+            // The range was ignored and the whole file is being sent. Skip the unwanted prefix.
+            StatusCode::Ok => {
+                io::copy(&mut response.by_ref().take(start), &mut io::sink())?;
+            }
+            status => {
+                return Err(err_msg(format!(
+                    "get_range({}, {}, {}): unexpected status {:?}",
+                    drive_id, start, end, status
+                )));
+            }
+        }
+
+        let length = end - start + 1;
+        let mut content: Vec<u8> = Vec::with_capacity(length as usize);
+        response.take(length).read_to_end(&mut content)?;
+
+        Ok(content)
+    }
+}
+
+/// The content caches, shared between the `DriveFacade` and the prefetch workers. Also keeps
+/// track of the chunks which are being downloaded, so that the same chunk is never downloaded
+/// twice at the same time.
+///
+/// Chunks are stored under the key given by `content_key()` rather than under the Drive ID of
+/// their file, so that files with the same content share their chunks.
+pub struct ChunkStore {
+    /// The in-memory cache.
+    pub memory: Mutex<BlockCache>,
+
+    /// The optional on-disk cache.
+    pub disk: Option<Mutex<DiskCache>>,
+
+    /// The chunks being downloaded, or being written to the disk cache once downloaded. Locked
+    /// before the in-memory cache whenever both are needed, and never held across disk I/O.
+    in_flight: Mutex<HashMap<(String, u64), Download>>,
+    download_finished: Condvar,
+
+    /// Maps Drive IDs to the length of the corresponding file and the version it belongs to, for
+    /// files whose length Drive does not report (i.e. exported files).
+    lengths: Mutex<HashMap<DriveId, (Option<String>, u64)>>,
+}
+
+impl ChunkStore {
+    /// Creates a store around the given caches.
+    pub fn new(memory: BlockCache, disk: Option<DiskCache>) -> Self {
+        ChunkStore {
+            memory: Mutex::new(memory),
+            disk: disk.map(Mutex::new),
+            in_flight: Mutex::new(HashMap::new()),
+            download_finished: Condvar::new(),
+            lengths: Mutex::new(HashMap::new()),
+        }
+    }
+
+    /// The key under which the chunks of a file are stored, given its Drive ID and its `version`
+    /// (see `ContentClient::cache_version()`). A version which is an MD5 checksum identifies the
+    /// content itself, so the copies of a file, e.g. the same installer in many directories, are
+    /// stored and downloaded once. Other files are stored under their Drive ID.
+    pub fn content_key(id: DriveIdRef, version: Option<&str>) -> String {
+        match version {
+            Some(version) if Md5::is_checksum(version) => format!("md5-{}", version),
+            _ => id.to_string(),
+        }
+    }
+
+    /// Whether a chunk is present in the in-memory cache.
+    pub fn contains(&self, key: &str, index: u64) -> bool {
+        self.memory.lock().unwrap().contains(key, index)
+    }
+
+    /// Whether a chunk is being downloaded, not counting downloads which only write it to disk.
+    pub fn is_downloading(&self, key: &str, index: u64) -> bool {
+        self.in_flight
+            .lock()
+            .unwrap()
+            .get(&(key.to_string(), index))
+            .map_or(false, |download| !download.done)
+    }
+
+    /// Returns a chunk from the in-memory cache.
+    pub fn get(&self, key: &str, index: u64) -> Option<Chunk> {
+        self.memory.lock().unwrap().get(key, index)
+    }
+
+    /// Looks up a chunk in the disk cache.
+    pub fn get_from_disk(&self, key: &str, version: Option<&str>, index: u64) -> Option<Chunk> {
+        match (self.disk.as_ref(), version) {
+            (Some(disk), Some(version)) => disk
+                .lock()
+                .unwrap()
+                .get(key, version, index)
+                .map(Chunk::from),
+            _ => None,
+        }
+    }
+
+    /// Stores a chunk in both caches.
+    pub fn insert(&self, key: &str, version: Option<&str>, index: u64, chunk: Chunk) {
+        if let (Some(disk), Some(version)) = (self.disk.as_ref(), version) {
+            disk.lock().unwrap().insert(key, version, index, &chunk);
+        }
+        self.memory
+            .lock()
+            .unwrap()
+            .insert(key.to_string(), index, chunk);
+    }
+
+    /// Returns the length of a file in the given version, as recorded by `set_length()`. Looks in
+    /// the disk cache if the length is not known in memory.
+    pub fn length(&self, id: DriveIdRef, version: Option<&str>) -> Option<u64> {
+        if let Some(&(ref known, len)) = self.lengths.lock().unwrap().get(id) {
+            if known.as_ref().map(String::as_str) == version {
+                return Some(len);
+            }
+        }
+
+        let len = match (self.disk.as_ref(), version) {
+            (Some(disk), Some(version)) => disk.lock().unwrap().length(id, version)?,
+            _ => return None,
+        };
+        self.lengths
+            .lock()
+            .unwrap()
+            .insert(id.to_string(), (version.map(str::to_string), len));
+        Some(len)
+    }
+
+    /// Records the length of a file in the given version, in memory and on disk.
+    pub fn set_length(&self, id: DriveIdRef, version: Option<&str>, len: u64) {
+        if let (Some(disk), Some(version)) = (self.disk.as_ref(), version) {
+            disk.lock().unwrap().set_length(id, version, len);
+        }
+        self.lengths
+            .lock()
+            .unwrap()
+            .insert(id.to_string(), (version.map(str::to_string), len));
+    }
+
+    /// Drops the cached content of a file which is stored under its Drive ID. Chunks of the file
+    /// which are being downloaded at the moment will be discarded instead of cached once they
+    /// arrive. Content stored under its checksum stays, since it is still valid for any file with
+    /// that checksum.
+    pub fn remove_file(&self, id: DriveIdRef) {
+        for (&(ref key, _), download) in self.in_flight.lock().unwrap().iter() {
+            if key == id || download.source == id {
+                download.valid.store(false, Ordering::SeqCst);
+            }
+        }
+
+        self.memory.lock().unwrap().remove_file(id);
+        self.lengths.lock().unwrap().remove(id);
+        if let Some(disk) = self.disk.as_ref() {
+            disk.lock().unwrap().remove_file(id);
+        }
+    }
+
+    /// Marks a chunk as being downloaded from the file with the Drive ID `id`. Returns false if
+    /// it already is, possibly from another file with the same content.
+    pub fn begin_download(&self, key: &str, id: DriveIdRef, index: u64) -> bool {
+        let mut in_flight = self.in_flight.lock().unwrap();
+        let key = (key.to_string(), index);
+        if let Some(previous) = in_flight.get(&key) {
+            if !previous.done {
+                return false;
+            }
+            // The previous download is still being written to disk, but did not make it to the
+            // memory cache. It is superseded, so its chunk is not written after all.
+            previous.valid.store(false, Ordering::SeqCst);
+        }
+        in_flight.insert(
+            key,
+            Download {
+                source: id.to_string(),
+                valid: Arc::new(AtomicBool::new(true)),
+                done: false,
+            },
+        );
+        true
+    }
+
+    /// Marks a chunk as no longer being downloaded and wakes up whoever waits for it. The
+    /// downloaded chunk, if any, is cached unless the file was invalidated in the meantime.
+    ///
+    /// The chunk is put in memory under the `in_flight` lock, so a `remove_file()` either marks
+    /// it invalid before it is checked, or drops it after it is inserted. The download is then
+    /// marked as done, and the chunk is written to the disk cache without the lock, under the
+    /// same rule: `remove_file()` takes the disk cache lock after invalidating the download.
+    pub fn end_download(&self, key: &str, version: Option<&str>, index: u64, chunk: Option<Chunk>) {
+        let entry = (key.to_string(), index);
+        let valid = {
+            let mut in_flight = self.in_flight.lock().unwrap();
+            let valid = match in_flight.get_mut(&entry) {
+                Some(download) => {
+                    download.done = true;
+                    Arc::clone(&download.valid)
+                }
+                None => Arc::new(AtomicBool::new(false)),
+            };
+            if let (true, Some(chunk)) = (valid.load(Ordering::SeqCst), chunk.as_ref()) {
+                self.memory
+                    .lock()
+                    .unwrap()
+                    .insert(key.to_string(), index, chunk.clone());
+            }
+            valid
+        };
+        self.download_finished.notify_all();
+
+        if let (Some(disk), Some(version), Some(chunk)) = (self.disk.as_ref(), version, chunk) {
+            let mut disk = disk.lock().unwrap();
+            if valid.load(Ordering::SeqCst) {
+                disk.insert(key, version, index, &chunk);
+            }
+        }
+
+        // Unless a new download of the chunk has taken its place in the meantime.
+        let mut in_flight = self.in_flight.lock().unwrap();
+        if in_flight
+            .get(&entry)
+            .map_or(false, |download| Arc::ptr_eq(&download.valid, &valid))
+        {
+            in_flight.remove(&entry);
+        }
+    }
+
+    /// Blocks until a chunk is no longer being downloaded. Returns immediately if it is not.
+    pub fn wait_for_download(&self, key: &str, index: u64) {
+        let key = (key.to_string(), index);
+        let mut in_flight = self.in_flight.lock().unwrap();
+        while in_flight.get(&key).map_or(false, |download| !download.done) {
+            in_flight = self.download_finished.wait(in_flight).unwrap();
+        }
+    }
+}
+
+/// A chunk which is being downloaded, as tracked by a `ChunkStore`.
+struct Download {
+    /// The Drive ID of the file the chunk is downloaded from.
+    source: DriveId,
+
+    /// Whether the chunk may still be cached once it arrives. Shared with `end_download()`, which
+    /// checks it again before writing the chunk to disk, and tells downloads of the same chunk
+    /// apart.
+    valid: Arc<AtomicBool>,
+
+    /// Whether the download has finished and the chunk is only being written to disk.
+    done: bool,
+}
+
+/// A request to download a chunk in the background.
+struct PrefetchJob {
+    id: DriveId,
+    version: Option<String>,
+    index: u64,
+}
+
+/// A pool of worker threads which download chunks ahead of time and put them in a `ChunkStore`.
+pub struct Prefetcher {
+    sender: Option<Sender<PrefetchJob>>,
+
+    /// The chunks which are waiting in the queue, so that each is only queued once, along with
+    /// the stream of the reader which last asked for them.
+    queued: Arc<Mutex<HashMap<(DriveId, u64), ReadStream>>>,
+}
+
+impl Prefetcher {
+    /// Starts `workers` threads which download chunks of `chunk_size` bytes. With zero workers,
+    /// prefetch requests are ignored.
+    pub fn new(
+        downloader: Downloader,
+        store: Arc<ChunkStore>,
+        chunk_size: u64,
+        workers: usize,
+    ) -> Self {
+        let queued = Arc::new(Mutex::new(HashMap::new()));
+        if workers == 0 {
+            return Prefetcher {
+                sender: None,
+                queued,
+            };
+        }
+
+        let (sender, receiver) = channel::<PrefetchJob>();
+        let receiver = Arc::new(Mutex::new(receiver));
+
+        for i in 0..workers {
+            let receiver = Arc::clone(&receiver);
+            let queued = Arc::clone(&queued);
+            let downloader = downloader.clone();
+            let store = Arc::clone(&store);
+
+            let spawned = thread::Builder::new()
+                .name(format!("prefetch-{}", i))
+                .spawn(move || {
+                    scheduler::set_priority(Priority::Prefetch);
+                    loop {
+                        // The channel is closed when the Prefetcher is dropped.
+                        let job = match receiver.lock().unwrap().recv() {
+                            Ok(job) => job,
+                            Err(_) => break,
+                        };
+                        let stream = queued.lock().unwrap().remove(&(job.id.clone(), job.index));
+                        if !stream.map_or(false, |stream| stream.is_current()) {
+                            debug!("Dropped prefetch of chunk {} of {}", job.index, &job.id);
+                            continue;
+                        }
+                        Self::run(&downloader, &store, chunk_size, job);
+                    }
+                });
+            if let Err(e) = spawned {
+                error!("Could not start prefetch worker: {}", e);
+            }
+        }
+
+        Prefetcher {
+            sender: Some(sender),
+            queued,
+        }
+    }
+
+    /// Asks for a chunk to be downloaded in the background for the reader in `stream`. A chunk
+    /// which is already queued is not queued again, but is downloaded for this reader instead.
+    /// Chunks which are cached or being downloaded by the time a worker picks them up are
+    /// skipped, as are those whose reader has seeked elsewhere in the meantime.
+    pub fn prefetch(&self, id: DriveIdRef, version: Option<&str>, index: u64, stream: ReadStream) {
+        let sender = match self.sender {
+            Some(ref sender) => sender,
+            None => return,
+        };
+        let mut queued = self.queued.lock().unwrap();
+        if queued.insert((id.to_string(), index), stream).is_some() {
+            return;
+        }
+        let _ = sender.send(PrefetchJob {
+            id: id.to_string(),
+            version: version.map(str::to_string),
+            index,
+        });
+    }
+
+    fn run(downloader: &Downloader, store: &ChunkStore, chunk_size: u64, job: PrefetchJob) {
+        let version = job.version.as_ref().map(String::as_str);
+        let key = ChunkStore::content_key(&job.id, version);
+        if store.contains(&key, job.index) || !store.begin_download(&key, &job.id, job.index) {
+            return;
+        }
+
+        let chunk = store.get_from_disk(&key, version, job.index).or_else(|| {
+            let start = job.index * chunk_size;
+            match downloader.get_range(&job.id, start, start + chunk_size - 1) {
+                Ok(chunk) => {
+                    debug!("Prefetched chunk {} of {}", job.index, &job.id);
+                    Some(Chunk::from(chunk))
+                }
+                Err(e) => {
+                    warn!(
+                        "Could not prefetch chunk {} of {}: {}",
+                        job.index, &job.id, e
+                    );
+                    None
+                }
+            }
+        });
+
+        store.end_download(&key, version, job.index, chunk);
+    }
+}
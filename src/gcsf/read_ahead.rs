@@ -0,0 +1,78 @@
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Arc;
+
+/// Detects sequential reads of a file and decides how far ahead of the reader to prefetch.
+///
+/// The read-ahead window starts at one chunk when a sequential stream is detected, doubles with
+/// every further sequential read up to `max_window` chunks, and is dropped as soon as the reader
+/// seeks elsewhere.
+#[derive(Debug, Clone)]
+pub struct ReadAhead {
+    /// Where the next read starts if the access pattern stays sequential.
+    next_offset: u64,
+
+    /// How many chunks to prefetch, currently.
+    window: u64,
+
+    /// The upper bound of `window`.
+    max_window: u64,
+
+    /// Counts the sequential streams detected so far. Prefetch requests are tagged with the
+    /// current one, so that those made before a seek can be dropped.
+    generation: Arc<AtomicU64>,
+}
+
+/// The sequential stream of a reader which a prefetch request was made for.
+#[derive(Debug, Clone)]
+pub struct ReadStream {
+    generation: Arc<AtomicU64>,
+    started: u64,
+}
+
+impl ReadStream {
+    /// Whether the reader is still in this stream, i.e. has not seeked elsewhere since.
+    pub fn is_current(&self) -> bool {
+        self.generation.load(Ordering::SeqCst) == self.started
+    }
+}
+
+impl ReadAhead {
+    /// Creates a detector which never prefetches more than `max_window` chunks at once.
+    pub fn new(max_window: u64) -> Self {
+        ReadAhead {
+            next_offset: 0,
+            window: 0,
+            max_window,
+            generation: Arc::new(AtomicU64::new(0)),
+        }
+    }
+
+    /// Records a read of `size` bytes at `offset` and returns how many chunks past the end of
+    /// the read should be prefetched.
+    pub fn record(&mut self, offset: u64, size: u64) -> u64 {
+        if offset == self.next_offset {
+            self.window = if self.window == 0 {
+                1
+            } else {
+                self.window.saturating_mul(2)
+            };
+            self.window = ::std::cmp::min(self.window, self.max_window);
+        } else {
+            if self.window > 0 {
+                self.generation.fetch_add(1, Ordering::SeqCst);
+            }
+            self.window = 0;
+        }
+
+        self.next_offset = offset + size;
+        self.window
+    }
+
+    /// The current sequential stream, which ends with the next seek.
+    pub fn stream(&self) -> ReadStream {
+        ReadStream {
+            generation: Arc::clone(&self.generation),
+            started: self.generation.load(Ordering::SeqCst),
+        }
+    }
+}
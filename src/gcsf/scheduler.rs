@@ -0,0 +1,285 @@
+use super::metrics;
+use drive3;
+use hyper;
+use rand;
+use std::cell::Cell;
+use std::cmp;
+use std::sync::{Arc, Condvar, Mutex};
+use std::time::{Duration, Instant};
+
+/// How long a request waits for a connection slot before it is admitted anyway. A thread may
+/// hold a connection while it opens another one (e.g. when a flush downloads the original
+/// content of a file while uploading the new one), so waiting forever could deadlock.
+const SLOT_WAIT: Duration = Duration::from_secs(10);
+
+/// The first pause after Drive asks to slow down. Every further request to slow down doubles it.
+const INITIAL_BACKOFF: Duration = Duration::from_secs(1);
+
+/// The longest pause after Drive asks to slow down.
+const MAX_BACKOFF: Duration = Duration::from_secs(64);
+
+/// How many times a request is retried after Drive asks to slow down.
+pub const MAX_RETRIES: u32 = 5;
+
+/// The classes of requests sent to Drive, from the most to the least urgent. When requests wait
+/// for their turn, those of a more urgent class always go first.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
+pub enum Priority {
+    /// Requests which a user is waiting for: lookups, reads, deletions.
+    Interactive = 0,
+
+    /// Downloads of chunks which have not been asked for yet.
+    Prefetch = 1,
+
+    /// Listings and polls for changes.
+    Sync = 2,
+
+    /// Uploads of flushed files.
+    Bulk = 3,
+}
+
+const PRIORITIES: usize = 4;
+
+thread_local! {
+    static PRIORITY: Cell<Priority> = Cell::new(Priority::Interactive);
+}
+
+/// Sets the class of the requests sent by the current thread from now on. Threads start out
+/// sending interactive requests.
+pub fn set_priority(priority: Priority) {
+    PRIORITY.with(|p| p.set(priority));
+}
+
+/// The class of the requests sent by the current thread.
+pub fn priority() -> Priority {
+    PRIORITY.with(Cell::get)
+}
+
+/// What Drive answered to a request, as far as the scheduler is concerned.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Outcome {
+    /// Drive handled the request, whether it succeeded or not.
+    Accepted,
+
+    /// Drive asked to slow down (rate limit exceeded or backend overloaded).
+    Throttled,
+}
+
+/// Whether an HTTP status asks for the request to be retried later. A 403 only does if Drive
+/// gives a rate limit as the reason, which `rate_limited` tells.
+pub fn is_throttling(status: u16, rate_limited: bool) -> bool {
+    match status {
+        429 | 500 | 502 | 503 | 504 => true,
+        403 => rate_limited,
+        _ => false,
+    }
+}
+
+/// Decides when each request may be sent to Drive. All requests of the file system go through
+/// one scheduler, which enforces three things:
+///
+/// - a token bucket, so that no more than `requests_per_second` requests are sent on average;
+/// - a limit of `max_slots` requests in flight, a quarter of which are reserved for interactive
+///   requests, so that background work can never take all connections;
+/// - a pause whenever Drive asks to slow down, doubling with every further such answer (plus
+///   some jitter, so that waiting threads do not all retry at once) and shrinking again as
+///   requests succeed.
+///
+/// Waiting requests are admitted by priority: a request only goes ahead once no request of a
+/// more urgent class is waiting.
+pub struct Scheduler {
+    state: Mutex<State>,
+    changed: Condvar,
+    max_slots: usize,
+    requests_per_second: f64,
+}
+
+struct State {
+    in_flight: usize,
+    tokens: f64,
+    refilled: Instant,
+    waiting: [usize; PRIORITIES],
+    backoff: Duration,
+    paused_until: Instant,
+}
+
+impl Scheduler {
+    /// Creates a scheduler allowing `max_slots` requests in flight (at least one) and
+    /// `requests_per_second` requests per second on average. A rate of zero means no limit.
+    pub fn new(max_slots: usize, requests_per_second: f64) -> Self {
+        let now = Instant::now();
+        Scheduler {
+            state: Mutex::new(State {
+                in_flight: 0,
+                tokens: requests_per_second.max(1.0),
+                refilled: now,
+                waiting: [0; PRIORITIES],
+                backoff: Duration::from_secs(0),
+                paused_until: now,
+            }),
+            changed: Condvar::new(),
+            max_slots: cmp::max(1, max_slots),
+            requests_per_second,
+        }
+    }
+
+    /// Waits until a request of the given class may be sent. The slot it takes is released when
+    /// the returned permit is dropped.
+    pub fn admit(scheduler: &Arc<Scheduler>, priority: Priority) -> Permit {
+        let class = priority as usize;
+        let start = Instant::now();
+        let mut state = scheduler.state.lock().unwrap();
+
+        loop {
+            let now = Instant::now();
+            scheduler.refill(&mut state, now);
+
+            let slots = if priority == Priority::Interactive {
+                scheduler.max_slots
+            } else {
+                scheduler.max_slots - scheduler.max_slots / 4
+            };
+            let deadlocked = now >= start + SLOT_WAIT;
+            let has_slot = state.in_flight < slots || deadlocked;
+            let has_token = scheduler.requests_per_second <= 0.0 || state.tokens >= 1.0;
+            let paused = now < state.paused_until;
+            let preceded = state.waiting[..class].iter().any(|&n| n > 0);
+
+            if has_slot && has_token && !paused && !preceded {
+                if deadlocked && state.in_flight >= slots {
+                    warn!(
+                        "No slot for a request after {:?}, sending it anyway",
+                        SLOT_WAIT
+                    );
+                }
+                state.in_flight += 1;
+                if scheduler.requests_per_second > 0.0 {
+                    state.tokens -= 1.0;
+                }
+                break;
+            }
+
+            let wait = if paused {
+                state.paused_until - now
+            } else if !has_token {
+                Duration::from_millis(
+                    ((1.0 - state.tokens) * 1000.0 / scheduler.requests_per_second) as u64 + 1,
+                )
+            } else if !has_slot {
+                start + SLOT_WAIT - now
+            } else {
+                // Woken up once the more urgent requests have gone ahead.
+                SLOT_WAIT
+            };
+
+            state.waiting[class] += 1;
+            state = scheduler.changed.wait_timeout(state, wait).unwrap().0;
+            state.waiting[class] -= 1;
+        }
+
+        // Less urgent requests may have been waiting for this one to go ahead.
+        scheduler.changed.notify_all();
+        Permit {
+            scheduler: Arc::clone(scheduler),
+        }
+    }
+
+    /// Records what Drive answered to a request, which adapts the pause between requests.
+    pub fn report(&self, outcome: Outcome) {
+        let mut state = self.state.lock().unwrap();
+        match outcome {
+            Outcome::Accepted => {
+                state.backoff /= 2;
+                if state.backoff < INITIAL_BACKOFF {
+                    state.backoff = Duration::from_secs(0);
+                }
+            }
+            Outcome::Throttled => {
+                state.backoff = cmp::min(cmp::max(state.backoff * 2, INITIAL_BACKOFF), MAX_BACKOFF);
+                let jitter = Duration::from_millis(
+                    rand::random::<u64>() % (state.backoff.as_millis() as u64 / 2 + 1),
+                );
+                let until = Instant::now() + state.backoff + jitter;
+                if until > state.paused_until {
+                    state.paused_until = until;
+                }
+                warn!(
+                    "Drive asks to slow down, pausing for {:?}",
+                    state.backoff + jitter
+                );
+            }
+        }
+    }
+
+    fn refill(&self, state: &mut State, now: Instant) {
+        if self.requests_per_second > 0.0 {
+            let elapsed = now - state.refilled;
+            let elapsed = elapsed.as_secs() as f64 + f64::from(elapsed.subsec_nanos()) * 1e-9;
+            // A second's worth of requests can be sent in a burst.
+            state.tokens = (state.tokens + elapsed * self.requests_per_second)
+                .min(self.requests_per_second.max(1.0));
+        }
+        state.refilled = now;
+    }
+}
+
+/// A request admitted by a `Scheduler`. Dropping it frees the slot of the request.
+pub struct Permit {
+    scheduler: Arc<Scheduler>,
+}
+
+impl Permit {
+    /// The scheduler which admitted the request.
+    pub fn scheduler(&self) -> &Scheduler {
+        &self.scheduler
+    }
+}
+
+impl Drop for Permit {
+    fn drop(&mut self) {
+        self.scheduler.state.lock().unwrap().in_flight -= 1;
+        self.scheduler.changed.notify_all();
+    }
+}
+
+/// A delegate for `drive3` calls which retries them when Drive asks to slow down. The pause
+/// itself is enforced by the `Scheduler`, before the retried request is sent.
+#[derive(Default)]
+pub struct RetryDelegate {
+    attempts: u32,
+
+    /// The status of the last failed response.
+    status: Option<u16>,
+}
+
+impl RetryDelegate {
+    /// Whether the request failed because Drive does not know the requested file.
+    pub fn not_found(&self) -> bool {
+        self.status == Some(404)
+    }
+}
+
+impl drive3::Delegate for RetryDelegate {
+    fn http_failure(
+        &mut self,
+        response: &hyper::client::Response,
+        _client_error: Option<drive3::JsonServerError>,
+        server_error: Option<drive3::ServerError>,
+    ) -> drive3::Retry {
+        self.status = Some(response.status.to_u16());
+        let rate_limited = server_error.map_or(false, |e| {
+            e.errors
+                .iter()
+                .any(|m| m.reason.ends_with("ateLimitExceeded"))
+        });
+
+        if is_throttling(response.status.to_u16(), rate_limited) && self.attempts < MAX_RETRIES {
+            self.attempts += 1;
+            debug!("Retrying a request, attempt {}", self.attempts);
+            metrics::mark_retry();
+            drive3::Retry::After(Duration::from_secs(0))
+        } else {
+            drive3::Retry::Abort
+        }
+    }
+}
@@ -0,0 +1,156 @@
+use super::File;
+use failure::{err_msg, Error};
+use fuse::{FileAttr, FileType};
+use serde_json;
+use std::fs;
+use std::io::{BufReader, BufWriter, Write};
+use std::path::Path;
+use time::Timespec;
+
+type Inode = u64;
+
+/// Incremented whenever the layout of a snapshot changes. Snapshots of any other format are
+/// ignored.
+const SNAPSHOT_FORMAT: u32 = 3;
+
+/// The local state of a `FileManager`, as stored on disk between mounts.
+///
+/// Loading a snapshot and asking Drive for the changes which happened since `changes_token` is
+/// much faster than listing every file again, which is what a mount without a snapshot does.
+#[derive(Serialize, Deserialize, Debug)]
+pub struct Snapshot {
+    format: u32,
+
+    /// The Drive ID of the root directory of the account the snapshot was taken of. A snapshot
+    /// of another account, e.g. after logging in again under the same session name, is never
+    /// restored.
+    pub root_id: String,
+
+    /// The token for the `changes.list` API endpoint which the snapshot is up to date with.
+    pub changes_token: String,
+
+    /// The last inode handed out, so that new files never reuse inodes from the snapshot.
+    pub last_inode: Inode,
+
+    /// Whether special files had extensions added to their names when the snapshot was taken.
+    pub add_extensions_to_special_files: bool,
+
+    /// Whether files with identical names were renamed when the snapshot was taken.
+    pub rename_identical_files: bool,
+
+    /// All files, each one listed after its parent.
+    pub entries: Vec<SnapshotEntry>,
+
+    /// The directories whose children had been listed, if directories were loaded lazily. A
+    /// snapshot without them holds every file.
+    #[serde(default)]
+    pub loaded_dirs: Option<Vec<Inode>>,
+}
+
+/// A file of the tree, along with the inode of its parent directory (none for the root).
+#[derive(Serialize, Deserialize, Debug)]
+pub struct SnapshotEntry {
+    /// The inode of the parent directory.
+    pub parent: Option<Inode>,
+
+    /// The file itself.
+    pub file: File,
+}
+
+impl Snapshot {
+    /// Creates a snapshot of the given entries, which must list every file after its parent.
+    pub fn new(
+        root_id: String,
+        changes_token: String,
+        last_inode: Inode,
+        add_extensions_to_special_files: bool,
+        rename_identical_files: bool,
+        entries: Vec<SnapshotEntry>,
+        loaded_dirs: Option<Vec<Inode>>,
+    ) -> Self {
+        Snapshot {
+            format: SNAPSHOT_FORMAT,
+            root_id,
+            changes_token,
+            last_inode,
+            add_extensions_to_special_files,
+            rename_identical_files,
+            entries,
+            loaded_dirs,
+        }
+    }
+
+    /// Reads a snapshot from a file. Fails if the file holds a snapshot of another format.
+    pub fn load(path: &Path) -> Result<Self, Error> {
+        let reader = BufReader::new(fs::File::open(path)?);
+        let snapshot: Snapshot = serde_json::from_reader(reader)?;
+        if snapshot.format != SNAPSHOT_FORMAT {
+            return Err(err_msg(format!(
+                "Snapshot {:?} has format {}, expected {}",
+                path, snapshot.format, SNAPSHOT_FORMAT
+            )));
+        }
+        Ok(snapshot)
+    }
+
+    /// Writes the snapshot to a file. A temporary file is written first and then renamed, so
+    /// a crash never leaves a partial snapshot behind.
+    pub fn save(&self, path: &Path) -> Result<(), Error> {
+        if let Some(dir) = path.parent() {
+            fs::create_dir_all(dir)?;
+        }
+
+        let tmp = path.with_extension("tmp");
+        {
+            let mut writer = BufWriter::new(fs::File::create(&tmp)?);
+            serde_json::to_writer(&mut writer, self)?;
+            writer.flush()?;
+        }
+        fs::rename(&tmp, path)?;
+        Ok(())
+    }
+}
+
+/// Mirrors `fuse::FileAttr`, which does not implement serde's traits itself.
+#[derive(Serialize, Deserialize)]
+#[serde(remote = "FileAttr")]
+pub struct FileAttrDef {
+    ino: u64,
+    size: u64,
+    blocks: u64,
+    #[serde(with = "TimespecDef")]
+    atime: Timespec,
+    #[serde(with = "TimespecDef")]
+    mtime: Timespec,
+    #[serde(with = "TimespecDef")]
+    ctime: Timespec,
+    #[serde(with = "TimespecDef")]
+    crtime: Timespec,
+    #[serde(with = "FileTypeDef")]
+    kind: FileType,
+    perm: u16,
+    nlink: u32,
+    uid: u32,
+    gid: u32,
+    rdev: u32,
+    flags: u32,
+}
+
+#[derive(Serialize, Deserialize)]
+#[serde(remote = "Timespec")]
+struct TimespecDef {
+    sec: i64,
+    nsec: i32,
+}
+
+#[derive(Serialize, Deserialize)]
+#[serde(remote = "FileType")]
+enum FileTypeDef {
+    NamedPipe,
+    CharDevice,
+    BlockDevice,
+    Directory,
+    RegularFile,
+    Symlink,
+    Socket,
+}
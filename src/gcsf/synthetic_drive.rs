@@ -0,0 +1,397 @@
+use super::checksum::Md5;
+use super::upload_journal::{QueuedUpload, UploadJournal};
+use super::{DriveBackend, Listing, WriteBuffer};
+use drive3;
+use failure::{err_msg, Error};
+use std::collections::HashMap;
+use std::env;
+use std::mem;
+use std::sync::mpsc::{channel, Receiver};
+use std::time::Duration;
+
+type DriveId = String;
+type DriveIdRef<'a> = &'a str;
+
+/// How many files `list_all_files()` puts in a page, as Drive does.
+const PAGE_SIZE: usize = 1000;
+
+/// The time given to every synthetic file.
+const TIMESTAMP: &str = "2020-01-01T00:00:00.000Z";
+
+const FOLDER_MIME_TYPE: &str = "application/vnd.google-apps.folder";
+
+/// An in-memory stand-in for Drive, which holds a made-up account.
+///
+/// Files are added through `add_folder()` and `add_file()` before a `FileManager` lists them, and
+/// changed through `change_file()` afterwards, which queues a change for the next sync, as if
+/// the file had been changed by someone else. Everything the `FileManager` asks for is answered
+/// right away, from memory, so the file tree can be measured without the cost of a network.
+pub struct SyntheticDrive {
+    root_id: DriveId,
+
+    /// Every file, in the order in which it was added.
+    files: Vec<drive3::File>,
+
+    /// Maps the ID of every file to its position in `files`.
+    indexes: HashMap<DriveId, usize>,
+
+    /// The content of every file which has any.
+    contents: HashMap<DriveId, Vec<u8>>,
+
+    /// The writes which have not been flushed yet.
+    pending_writes: HashMap<DriveId, WriteBuffer>,
+
+    /// The number of flushes which uploaded new content.
+    uploads: u64,
+
+    /// The changes which have not been retrieved yet.
+    changes: Vec<drive3::Change>,
+
+    /// Incremented whenever changes are retrieved.
+    changes_token: Option<String>,
+    token_counter: u64,
+
+    last_id: u64,
+}
+
+impl Default for SyntheticDrive {
+    fn default() -> Self {
+        SyntheticDrive {
+            root_id: String::from("synthetic-root"),
+            files: Vec::new(),
+            indexes: HashMap::new(),
+            contents: HashMap::new(),
+            pending_writes: HashMap::new(),
+            uploads: 0,
+            changes: Vec::new(),
+            changes_token: None,
+            token_counter: 0,
+            last_id: 0,
+        }
+    }
+}
+
+impl SyntheticDrive {
+    /// Creates an account without any files.
+    pub fn new() -> Self {
+        SyntheticDrive::default()
+    }
+
+    /// The Drive ID of the root "My Drive" directory.
+    pub fn root(&self) -> DriveIdRef<'_> {
+        &self.root_id
+    }
+
+    /// The number of files in the account.
+    pub fn len(&self) -> usize {
+        self.indexes.len()
+    }
+
+    /// Whether the account holds no file.
+    pub fn is_empty(&self) -> bool {
+        self.indexes.is_empty()
+    }
+
+    /// Adds a directory named `name` to the directory with the ID `parent`. Returns its ID.
+    pub fn add_folder(&mut self, name: &str, parent: DriveIdRef) -> DriveId {
+        self.insert(name, parent, FOLDER_MIME_TYPE, None)
+    }
+
+    /// Adds a regular file named `name`, holding `content`, to the directory with the ID
+    /// `parent`. Returns its ID.
+    pub fn add_file(&mut self, name: &str, parent: DriveIdRef, content: Vec<u8>) -> DriveId {
+        let id = self.insert(
+            name,
+            parent,
+            "application/octet-stream",
+            Some(content.len() as u64),
+        );
+        self.contents.insert(id.clone(), content);
+        id
+    }
+
+    /// Changes the metadata of a file and queues the change for the next sync.
+    pub fn change_file<F>(&mut self, id: DriveIdRef, change: F) -> Result<(), Error>
+    where
+        F: FnOnce(&mut drive3::File),
+    {
+        let file = self.file_mut(id)?;
+        change(file);
+        let file = file.clone();
+        self.record_change(file);
+        Ok(())
+    }
+
+    /// The content of a file, as of its last flush.
+    pub fn content(&self, id: DriveIdRef) -> Option<&[u8]> {
+        self.contents.get(id).map(Vec::as_slice)
+    }
+
+    /// The number of flushes which uploaded new content. Flushes which leave a file with the
+    /// checksum it already has on Drive upload nothing, as with `DriveFacade`.
+    pub fn uploads(&self) -> u64 {
+        self.uploads
+    }
+
+    /// Resumes an upload left in `journal`, as `DriveFacade` does when it is mounted again. The
+    /// upload is dropped if the file has been deleted in the meantime.
+    pub fn resume_upload(
+        &mut self,
+        journal: &UploadJournal,
+        upload: QueuedUpload,
+    ) -> Result<(), Error> {
+        let exists = Ok(self.indexes.contains_key(&upload.id));
+        upload.resume(journal, exists, |id, buffer, _| self.apply(id, buffer))
+    }
+
+    fn insert(
+        &mut self,
+        name: &str,
+        parent: DriveIdRef,
+        mime_type: &str,
+        size: Option<u64>,
+    ) -> DriveId {
+        self.last_id += 1;
+        let id = format!("synthetic-{}", self.last_id);
+
+        self.indexes.insert(id.clone(), self.files.len());
+        self.files.push(drive3::File {
+            id: Some(id.clone()),
+            name: Some(name.to_string()),
+            mime_type: Some(mime_type.to_string()),
+            parents: Some(vec![parent.to_string()]),
+            size: size.map(|size| size.to_string()),
+            trashed: Some(false),
+            modified_time: Some(TIMESTAMP.to_string()),
+            created_time: Some(TIMESTAMP.to_string()),
+            viewed_by_me_time: Some(TIMESTAMP.to_string()),
+            ..Default::default()
+        });
+        id
+    }
+
+    fn file_mut(&mut self, id: DriveIdRef) -> Result<&mut drive3::File, Error> {
+        match self.indexes.get(id) {
+            Some(&index) => Ok(&mut self.files[index]),
+            None => Err(err_msg(format!("No synthetic file has the id {}", id))),
+        }
+    }
+
+    fn record_change(&mut self, file: drive3::File) {
+        self.changes.push(drive3::Change {
+            file_id: file.id.clone(),
+            file: Some(file),
+            removed: Some(false),
+            time: Some(TIMESTAMP.to_string()),
+            ..Default::default()
+        });
+    }
+
+    /// Applies the writes of `buffer` on the content of a file, as a flush does. Nothing is
+    /// uploaded if the checksum of the content does not change.
+    fn apply(&mut self, id: DriveIdRef, buffer: WriteBuffer) -> Result<(), Error> {
+        let remote = self.file_mut(id)?.md5_checksum.clone();
+        let mut content = self.contents.remove(id).unwrap_or_default();
+        let result = buffer.apply(&mut content).and_then(|()| {
+            let checksum = Md5::digest(&content);
+            if remote.as_ref() == Some(&checksum) {
+                return Ok(());
+            }
+            let file = self.file_mut(id)?;
+            file.size = Some(content.len().to_string());
+            if remote.is_some() {
+                file.md5_checksum = Some(checksum);
+            }
+            self.uploads += 1;
+            Ok(())
+        });
+        self.contents.insert(id.to_string(), content);
+        result
+    }
+
+    /// Moves a file to another directory and renames it, as `move_to()` does.
+    fn move_file(&mut self, id: DriveIdRef, parent: DriveIdRef, name: &str) -> Result<(), Error> {
+        let file = self.file_mut(id)?;
+        file.parents = Some(vec![parent.to_string()]);
+        file.name = Some(name.to_string());
+        Ok(())
+    }
+}
+
+impl DriveBackend for SyntheticDrive {
+    fn root_id(&mut self) -> Result<&String, Error> {
+        Ok(&self.root_id)
+    }
+
+    fn changes_token(&mut self) -> Result<&String, Error> {
+        if self.changes_token.is_none() {
+            self.changes_token = Some(self.token_counter.to_string());
+        }
+        Ok(self.changes_token.as_ref().unwrap())
+    }
+
+    fn set_changes_token(&mut self, token: Option<String>) {
+        self.changes_token = token;
+    }
+
+    fn get_all_changes(&mut self) -> Result<Vec<drive3::Change>, Error> {
+        self.token_counter += 1;
+        self.changes_token = Some(self.token_counter.to_string());
+        Ok(mem::replace(&mut self.changes, Vec::new()))
+    }
+
+    fn start_polling_changes(&mut self, _interval: Duration) -> Result<(), Error> {
+        Ok(())
+    }
+
+    fn is_polling_changes(&self) -> bool {
+        false
+    }
+
+    fn take_polled_changes(&mut self) -> Option<Vec<drive3::Change>> {
+        None
+    }
+
+    fn list_all_files(
+        &self,
+        trashed: Option<bool>,
+    ) -> Result<Receiver<Result<Vec<drive3::File>, Error>>, Error> {
+        let (sender, receiver) = channel();
+        let matching = self
+            .files
+            .iter()
+            .filter(|file| self.indexes.contains_key(file.id.as_ref().unwrap()))
+            .filter(|file| trashed.map_or(true, |trashed| file.trashed == Some(trashed)))
+            .cloned()
+            .collect::<Vec<_>>();
+
+        for page in matching.chunks(PAGE_SIZE) {
+            sender.send(Ok(page.to_vec()))?;
+        }
+        Ok(receiver)
+    }
+
+    /// No file is shared with a synthetic account.
+    fn list_files(&mut self, listing: Listing) -> Result<Vec<drive3::File>, Error> {
+        let listed = |file: &drive3::File| {
+            let trashed = file.trashed == Some(true);
+            match listing {
+                Listing::Children(parent) => {
+                    !trashed
+                        && file
+                            .parents
+                            .as_ref()
+                            .map_or(false, |parents| parents.iter().any(|p| p == parent))
+                }
+                Listing::Shared => false,
+                Listing::Trashed => trashed,
+            }
+        };
+
+        Ok(self
+            .files
+            .iter()
+            .filter(|file| self.indexes.contains_key(file.id.as_ref().unwrap()))
+            .filter(|file| listed(file))
+            .cloned()
+            .collect())
+    }
+
+    fn exported_len(
+        &self,
+        _drive_id: DriveIdRef,
+        _mime_type: &Option<String>,
+        _version: Option<&str>,
+    ) -> Option<u64> {
+        None
+    }
+
+    fn create(&mut self, drive_file: &drive3::File) -> Result<DriveId, Error> {
+        let name = drive_file.name.clone().unwrap_or_default();
+        let parent = drive_file
+            .parents
+            .as_ref()
+            .and_then(|parents| parents.first().cloned())
+            .unwrap_or_else(|| self.root_id.clone());
+        let mime_type = drive_file
+            .mime_type
+            .clone()
+            .unwrap_or_else(|| String::from("application/octet-stream"));
+
+        let id = self.insert(&name, &parent, &mime_type, Some(0));
+        self.contents.insert(id.clone(), Vec::new());
+        Ok(id)
+    }
+
+    fn write(
+        &mut self,
+        id: DriveId,
+        offset: usize,
+        data: &[u8],
+        remote_len: Option<u64>,
+    ) -> Result<(), Error> {
+        self.pending_writes
+            .entry(id)
+            .or_insert_with(|| WriteBuffer::new(u64::max_value(), env::temp_dir(), remote_len))
+            .write(offset as u64, data)
+    }
+
+    fn truncate(&mut self, id: DriveId, size: u64, remote_len: Option<u64>) -> Result<(), Error> {
+        self.pending_writes
+            .entry(id)
+            .or_insert_with(|| WriteBuffer::new(u64::max_value(), env::temp_dir(), remote_len))
+            .truncate(size)
+    }
+
+    fn flush<F>(&mut self, id: DriveIdRef, done: F)
+    where
+        F: FnOnce(Result<(), Error>) + Send + 'static,
+    {
+        let buffer = match self.pending_writes.remove(id) {
+            Some(buffer) => buffer,
+            None => return done(Ok(())),
+        };
+        let result = self.apply(id, buffer);
+        done(result);
+    }
+
+    fn sync<F>(&mut self, id: DriveIdRef, done: F)
+    where
+        F: FnOnce(Result<(), Error>) + Send + 'static,
+    {
+        self.flush(id, done);
+    }
+
+    fn delete_permanently<F>(&mut self, id: DriveIdRef, done: F)
+    where
+        F: FnOnce(Result<(), Error>) + Send + 'static,
+    {
+        // The file stays in `files`, which is why listings skip files without an index.
+        self.indexes.remove(id);
+        self.contents.remove(id);
+        self.pending_writes.remove(id);
+        done(Ok(()));
+    }
+
+    fn move_to<F>(
+        &mut self,
+        id: DriveIdRef,
+        parent: DriveIdRef,
+        new_name: &str,
+        _current_parents: Option<Vec<DriveId>>,
+        done: F,
+    ) where
+        F: FnOnce(Result<(), Error>) + Send + 'static,
+    {
+        done(self.move_file(id, parent, new_name));
+    }
+
+    fn move_to_trash<F>(&mut self, id: DriveId, done: F)
+    where
+        F: FnOnce(Result<(), Error>) + Send + 'static,
+    {
+        done(self.file_mut(&id).map(|file| file.trashed = Some(true)));
+    }
+
+    fn invalidate(&mut self, _id: DriveIdRef) {}
+}
@@ -0,0 +1,291 @@
+use super::write_buffer::SavedBuffer;
+use super::WriteBuffer;
+use failure::Error;
+use serde_json;
+use std::collections::BTreeMap;
+use std::fs;
+use std::io::{BufReader, BufWriter, Write};
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::Mutex;
+
+type DriveId = String;
+
+/// What the journal knows about a queued upload, besides its dirty data.
+#[derive(Serialize, Deserialize, Debug)]
+struct Record {
+    id: DriveId,
+    buffer: SavedBuffer,
+}
+
+/// A resumable upload session which Drive has opened for an upload, so that an interrupted
+/// upload can continue from the last byte Drive has acknowledged.
+#[derive(Serialize, Deserialize, Debug, Clone, PartialEq)]
+pub struct UploadSession {
+    /// The address to which the content is sent.
+    pub url: String,
+
+    /// The length of the content being uploaded. A session is only resumed by an upload of the
+    /// same length.
+    pub len: u64,
+}
+
+/// An upload which had been queued, but not finished, when the file system last stopped.
+#[derive(Debug)]
+pub struct QueuedUpload {
+    /// The number under which the upload is recorded in the journal.
+    pub entry: usize,
+
+    /// The file to upload.
+    pub id: DriveId,
+
+    /// The writes to upload, spooled to the data file of the entry.
+    pub buffer: WriteBuffer,
+}
+
+impl QueuedUpload {
+    /// Uploads the writes again, by passing them to `flush` along with the entry. `exists`
+    /// tells whether the file is still on Drive; if it is not, the upload is dropped instead, as
+    /// it could only fail. The entry is finished once the upload succeeds or is dropped, and is
+    /// kept otherwise, so that it is resumed on the next mount.
+    pub fn resume<F>(
+        self,
+        journal: &UploadJournal,
+        exists: Result<bool, Error>,
+        flush: F,
+    ) -> Result<(), Error>
+    where
+        F: FnOnce(&str, WriteBuffer, Option<(&UploadJournal, usize)>) -> Result<(), Error>,
+    {
+        let QueuedUpload { entry, id, buffer } = self;
+        if let Ok(false) = exists {
+            warn!(
+                "Dropping the upload of {}: file doesn't exist on drive",
+                &id
+            );
+            journal.finish(entry);
+            return Ok(());
+        }
+
+        flush(&id, buffer, Some((journal, entry)))?;
+        journal.finish(entry);
+        Ok(())
+    }
+}
+
+/// Records the uploads which have been queued but not finished yet, so that none is lost if the
+/// file system stops before the upload queue is drained.
+///
+/// Every queued upload gets an entry made of two files, named after the number of the entry: a
+/// data file holding the dirty data of its write buffer, and a record holding the rest of the
+/// buffer and the id of the file. The data file is synced before the record is renamed into
+/// place, so an entry only counts once both are complete. Once Drive has opened an upload
+/// session for the entry, its address is kept in a third file, so that the upload can resume
+/// where it stopped. Entries are removed once their upload has finished.
+#[derive(Debug)]
+pub struct UploadJournal {
+    dir: PathBuf,
+
+    /// The number of the next entry.
+    next_entry: AtomicUsize,
+
+    /// Maps the number of every entry in the journal to the file it uploads.
+    entries: Mutex<BTreeMap<usize, DriveId>>,
+}
+
+impl UploadJournal {
+    /// Opens the journal in `dir`, creating the directory if needed. Returns it along with the
+    /// uploads it holds, in the order they were queued. Their buffers, restored from their data
+    /// files, hold at most `memory_limit` bytes in memory and spool to `spool_dir`.
+    pub fn open(
+        dir: PathBuf,
+        memory_limit: u64,
+        spool_dir: &Path,
+    ) -> Result<(Self, Vec<QueuedUpload>), Error> {
+        fs::create_dir_all(&dir)?;
+
+        let mut numbers = Vec::new();
+        for entry in fs::read_dir(&dir)? {
+            let path = entry?.path();
+            let number = path
+                .file_stem()
+                .and_then(|stem| stem.to_str())
+                .and_then(|stem| stem.parse::<usize>().ok());
+            match (number, path.extension().and_then(|ext| ext.to_str())) {
+                (Some(number), Some("json")) => numbers.push(number),
+                // Data files are removed along with their records. Those without a record, and
+                // records which were never renamed into place, belong to unfinished entries.
+                (Some(number), Some("data")) | (Some(number), Some("session")) => {
+                    if !Self::record_path(&dir, number).exists() {
+                        let _ = fs::remove_file(&path);
+                    }
+                }
+                _ => {
+                    let _ = fs::remove_file(&path);
+                }
+            }
+        }
+        numbers.sort();
+
+        let next_entry = numbers.last().map_or(0, |&last| last + 1);
+        let journal = UploadJournal {
+            dir,
+            next_entry: AtomicUsize::new(next_entry),
+            entries: Mutex::new(BTreeMap::new()),
+        };
+
+        let mut uploads = Vec::new();
+        for number in numbers {
+            match journal.load(number, memory_limit, spool_dir) {
+                Ok(upload) => {
+                    journal
+                        .entries
+                        .lock()
+                        .unwrap()
+                        .insert(number, upload.id.clone());
+                    uploads.push(upload);
+                }
+                Err(e) => {
+                    warn!(
+                        "Dropping unreadable upload {} from the journal: {}",
+                        number, e
+                    );
+                    journal.remove_files(number);
+                }
+            }
+        }
+
+        Ok((journal, uploads))
+    }
+
+    /// Records a queued upload of `buffer` to the file `id`. Returns the number of its entry,
+    /// which must be passed to `finish()` once the upload is done.
+    pub fn record(&self, id: &str, buffer: &WriteBuffer) -> Result<usize, Error> {
+        let number = self.next_entry.fetch_add(1, Ordering::Relaxed);
+        let result = self.write(number, id, buffer);
+        if result.is_err() {
+            self.remove_files(number);
+        }
+        result?;
+
+        self.entries.lock().unwrap().insert(number, id.to_string());
+        Ok(number)
+    }
+
+    /// Removes an entry from the journal, along with the older entries of the same file. Their
+    /// uploads must not be resumed anymore: had they failed, replaying them would overwrite the
+    /// newer content.
+    pub fn finish(&self, entry: usize) {
+        let finished: Vec<usize> = {
+            let mut entries = self.entries.lock().unwrap();
+            let id = match entries.get(&entry) {
+                Some(id) => id.clone(),
+                None => return,
+            };
+            let finished: Vec<usize> = entries
+                .range(..=entry)
+                .filter(|&(_, other)| *other == id)
+                .map(|(&number, _)| number)
+                .collect();
+            for number in &finished {
+                entries.remove(number);
+            }
+            finished
+        };
+
+        for number in finished {
+            self.remove_files(number);
+        }
+    }
+
+    /// The upload session of an entry, if Drive has opened one.
+    pub fn session(&self, entry: usize) -> Option<UploadSession> {
+        let file = fs::File::open(Self::session_path(&self.dir, entry)).ok()?;
+        serde_json::from_reader(BufReader::new(file)).ok()
+    }
+
+    /// Stores the upload session of an entry, or forgets it.
+    pub fn set_session(&self, entry: usize, session: Option<&UploadSession>) -> Result<(), Error> {
+        let path = Self::session_path(&self.dir, entry);
+        let session = match session {
+            Some(session) => session,
+            None => {
+                let _ = fs::remove_file(path);
+                return Ok(());
+            }
+        };
+        if !self.entries.lock().unwrap().contains_key(&entry) {
+            return Ok(());
+        }
+
+        let tmp = path.with_extension("session-tmp");
+        serde_json::to_writer(fs::File::create(&tmp)?, session)?;
+        fs::rename(&tmp, path)?;
+        Ok(())
+    }
+
+    /// The number of entries in the journal.
+    pub fn len(&self) -> usize {
+        self.entries.lock().unwrap().len()
+    }
+
+    fn write(&self, number: usize, id: &str, buffer: &WriteBuffer) -> Result<(), Error> {
+        let record = Record {
+            id: id.to_string(),
+            buffer: buffer.save(&Self::data_path(&self.dir, number))?,
+        };
+
+        let path = Self::record_path(&self.dir, number);
+        let tmp = path.with_extension("tmp");
+        {
+            let file = fs::File::create(&tmp)?;
+            let mut writer = BufWriter::new(&file);
+            serde_json::to_writer(&mut writer, &record)?;
+            writer.flush()?;
+            drop(writer);
+            file.sync_all()?;
+        }
+        fs::rename(&tmp, path)?;
+        Ok(())
+    }
+
+    fn load(
+        &self,
+        number: usize,
+        memory_limit: u64,
+        spool_dir: &Path,
+    ) -> Result<QueuedUpload, Error> {
+        let reader = BufReader::new(fs::File::open(Self::record_path(&self.dir, number))?);
+        let record: Record = serde_json::from_reader(reader)?;
+        let buffer = WriteBuffer::restore(
+            record.buffer,
+            &Self::data_path(&self.dir, number),
+            memory_limit,
+            spool_dir.to_path_buf(),
+        )?;
+
+        Ok(QueuedUpload {
+            entry: number,
+            id: record.id,
+            buffer,
+        })
+    }
+
+    fn remove_files(&self, number: usize) {
+        let _ = fs::remove_file(Self::record_path(&self.dir, number));
+        let _ = fs::remove_file(Self::data_path(&self.dir, number));
+        let _ = fs::remove_file(Self::session_path(&self.dir, number));
+    }
+
+    fn record_path(dir: &Path, number: usize) -> PathBuf {
+        dir.join(format!("{:016}.json", number))
+    }
+
+    fn data_path(dir: &Path, number: usize) -> PathBuf {
+        dir.join(format!("{:016}.data", number))
+    }
+
+    fn session_path(dir: &Path, number: usize) -> PathBuf {
+        dir.join(format!("{:016}.session", number))
+    }
+}
@@ -0,0 +1,104 @@
+use failure::Error;
+use std::cmp;
+use std::collections::hash_map::DefaultHasher;
+use std::hash::{Hash, Hasher};
+use std::sync::mpsc::{channel, Sender};
+use std::sync::Arc;
+use std::thread;
+
+/// A job run by a worker, which is given mutable access to the state of the worker.
+type Job<S> = Box<dyn FnOnce(&mut S) + Send>;
+
+/// A fixed set of threads which run jobs in the background. Every worker owns some state of type
+/// `S`, created on the worker thread itself, so the state does not have to be `Send`.
+///
+/// Every job is submitted with a key. Jobs with the same key always run on the same worker, in
+/// the order they were submitted, while jobs with different keys may run in parallel.
+pub struct WorkerPool<S> {
+    senders: Vec<Sender<Job<S>>>,
+}
+
+impl<S: 'static> WorkerPool<S> {
+    /// Starts `workers` threads (at least one), named after `name`. The state of each worker is
+    /// created by calling `init` on the worker thread. A worker whose state can not be created
+    /// exits right away; the jobs sent to it are dropped.
+    pub fn new<F>(name: &str, workers: usize, init: F) -> Self
+    where
+        F: Fn() -> Result<S, Error> + Send + Sync + 'static,
+    {
+        let init = Arc::new(init);
+        let mut senders = Vec::new();
+
+        for i in 0..cmp::max(1, workers) {
+            let (sender, receiver) = channel::<Job<S>>();
+            let init = Arc::clone(&init);
+
+            let spawned = thread::Builder::new()
+                .name(format!("{}-{}", name, i))
+                .spawn(move || {
+                    let mut state = match init() {
+                        Ok(state) => state,
+                        Err(e) => {
+                            error!("Could not start worker: {}", e);
+                            return;
+                        }
+                    };
+
+                    // The channel is closed when the pool is dropped.
+                    for job in receiver {
+                        job(&mut state);
+                    }
+                });
+
+            match spawned {
+                Ok(_) => senders.push(sender),
+                Err(e) => error!("Could not start worker: {}", e),
+            }
+        }
+
+        WorkerPool { senders }
+    }
+
+    /// Runs a job on the worker responsible for `key`. If that worker is gone, the job is
+    /// dropped without running.
+    pub fn execute<F>(&self, key: &str, job: F)
+    where
+        F: FnOnce(&mut S) + Send + 'static,
+    {
+        if self.senders.is_empty() {
+            error!("No worker available, dropping job for {}", key);
+            return;
+        }
+
+        let mut hasher = DefaultHasher::new();
+        key.hash(&mut hasher);
+        let index = (hasher.finish() % self.senders.len() as u64) as usize;
+
+        if self.senders[index].send(Box::new(job)).is_err() {
+            error!("Worker {} is gone, dropping job for {}", index, key);
+        }
+    }
+
+    /// Blocks until every job submitted so far has run.
+    pub fn wait(&self) {
+        let (sender, receiver) = channel();
+        let mut waiting = 0;
+        for worker in &self.senders {
+            let sender = sender.clone();
+            let job: Job<S> = Box::new(move |_: &mut S| {
+                let _ = sender.send(());
+            });
+            if worker.send(job).is_ok() {
+                waiting += 1;
+            }
+        }
+        drop(sender);
+
+        for _ in 0..waiting {
+            // Fails once no job is left to answer, e.g. because the workers have panicked.
+            if receiver.recv().is_err() {
+                return;
+            }
+        }
+    }
+}
@@ -0,0 +1,545 @@
+use super::checksum::Md5;
+use failure::Error;
+use std::cmp;
+use std::collections::BTreeMap;
+use std::fs;
+use std::io::{Read, Seek, SeekFrom, Write};
+use std::mem;
+use std::path::{Path, PathBuf};
+use std::process;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::u64;
+
+/// Used for giving every spool file a unique name.
+static SPOOL_COUNTER: AtomicUsize = AtomicUsize::new(0);
+
+/// Collects the writes performed on a file until they are flushed to Drive.
+///
+/// Written data is kept as a map of dirty extents which never overlap: a write which overlaps or
+/// touches existing extents is merged with them, so sequential writes end up in a single extent
+/// and flushing costs one copy of the dirty data regardless of the number of writes. Once the
+/// dirty data exceeds a memory limit, it is moved to a spool file on disk, where every byte is
+/// stored at its offset in the file. Later writes go straight to the spool file, which is removed
+/// along with the buffer.
+///
+/// Truncations are recorded as well, so that the flushed content only keeps the part of the
+/// original content which survived them. If the length of the original content is known for
+/// certain, the buffer can also tell when none of it survives, in which case it does not have to
+/// be downloaded at all.
+///
+/// As long as a file is written in order from its start, e.g. when it is saved again, the MD5
+/// checksum of the written data is computed along the way (see `checksum()`), so that an upload
+/// of unchanged content can be skipped without reading the data again.
+#[derive(Debug)]
+pub struct WriteBuffer {
+    storage: Storage,
+
+    /// How many bytes of dirty data to hold in memory before moving them to a spool file.
+    memory_limit: u64,
+
+    /// The directory in which the spool file is created.
+    spool_dir: PathBuf,
+
+    /// The path of the spool file, which is removed once the buffer is dropped. Buffers restored
+    /// from an upload journal have none, since their spool file belongs to the journal.
+    spool_path: Option<PathBuf>,
+
+    /// The content of the file on Drive is only kept up to this offset.
+    base_limit: u64,
+
+    /// The size set by the last truncation. The file is at least this large.
+    min_len: u64,
+
+    /// The length of the content of the file on Drive, if known.
+    base_len: Option<u64>,
+
+    /// Whether `base_len` is known to be current, rather than taken from a listing which another
+    /// client may have outdated since.
+    base_len_confirmed: bool,
+
+    /// The checksum of the data written so far, as long as it was written in order from the
+    /// start of the file.
+    digest: Option<Md5>,
+}
+
+/// The state of a `WriteBuffer` as stored next to its dirty data on disk, which is kept in a
+/// file of its own (see `WriteBuffer::save()`).
+#[derive(Serialize, Deserialize, Debug, Clone, PartialEq)]
+pub struct SavedBuffer {
+    /// The start and end of every dirty extent, in increasing order.
+    extents: Vec<(u64, u64)>,
+    base_limit: u64,
+    min_len: u64,
+    base_len: Option<u64>,
+}
+
+#[derive(Debug)]
+enum Storage {
+    /// Maps the start of every extent to its data.
+    Memory(BTreeMap<u64, Vec<u8>>, u64),
+
+    /// Maps the start of every extent to its end. The data is in `file`, at the same offsets.
+    Spooled(BTreeMap<u64, u64>, fs::File),
+}
+
+impl WriteBuffer {
+    /// Creates an empty buffer which moves its data to a spool file in `spool_dir` once it holds
+    /// more than `memory_limit` bytes. `base_len` is the length of the content of the file on
+    /// Drive as last listed, if known. It is not relied upon until confirmed with
+    /// `confirm_base_len()`.
+    pub fn new(memory_limit: u64, spool_dir: PathBuf, base_len: Option<u64>) -> Self {
+        WriteBuffer {
+            storage: Storage::Memory(BTreeMap::new(), 0),
+            memory_limit,
+            spool_dir,
+            spool_path: None,
+            base_limit: u64::MAX,
+            min_len: 0,
+            base_len,
+            base_len_confirmed: false,
+            digest: Some(Md5::new()),
+        }
+    }
+
+    /// Records the length of the content of the file on Drive, known to be current, e.g. because
+    /// it was just retrieved from Drive or the file was created by this mount.
+    pub fn confirm_base_len(&mut self, len: u64) {
+        self.base_len = Some(len);
+        self.base_len_confirmed = true;
+    }
+
+    /// Records a write of `data` at `offset`.
+    pub fn write(&mut self, offset: u64, data: &[u8]) -> Result<(), Error> {
+        if data.is_empty() {
+            return Ok(());
+        }
+
+        match self.digest {
+            Some(ref mut md5) if md5.len() == offset => md5.update(data),
+            _ => self.digest = None,
+        }
+
+        let spill = match self.storage {
+            Storage::Memory(ref mut extents, ref mut size) => {
+                Self::merge_data(extents, size, offset, data);
+                *size > self.memory_limit
+            }
+            Storage::Spooled(ref mut ranges, ref mut file) => {
+                file.seek(SeekFrom::Start(offset))?;
+                file.write_all(data)?;
+                Self::merge_range(ranges, offset, offset + data.len() as u64);
+                false
+            }
+        };
+
+        if spill {
+            self.spill()?;
+        }
+        Ok(())
+    }
+
+    /// Records a truncation of the file to `size` bytes. Dirty data past `size` is dropped and
+    /// the file is extended with zeros if it is shorter than `size`.
+    pub fn truncate(&mut self, size: u64) -> Result<(), Error> {
+        self.base_limit = cmp::min(self.base_limit, size);
+        self.min_len = size;
+        if size == 0 {
+            self.digest = Some(Md5::new());
+        } else if self.digest.as_ref().map(Md5::len) != Some(size) {
+            self.digest = None;
+        }
+
+        match self.storage {
+            Storage::Memory(ref mut extents, ref mut memory) => {
+                for start in extents.range(size..).map(|(&s, _)| s).collect::<Vec<_>>() {
+                    *memory -= extents.remove(&start).unwrap().len() as u64;
+                }
+                if let Some((&start, data)) = extents.iter_mut().next_back() {
+                    if start + data.len() as u64 > size {
+                        *memory -= start + data.len() as u64 - size;
+                        data.truncate((size - start) as usize);
+                    }
+                }
+            }
+            Storage::Spooled(ref mut ranges, ref mut file) => {
+                for start in ranges.range(size..).map(|(&s, _)| s).collect::<Vec<_>>() {
+                    ranges.remove(&start);
+                }
+                if let Some((_, end)) = ranges.iter_mut().next_back() {
+                    *end = cmp::min(*end, size);
+                }
+                // Old data past the new end must read as zeros if the file grows again.
+                file.set_len(size)?;
+            }
+        }
+        Ok(())
+    }
+
+    /// The size of the file after applying the buffer on content of `base_len` bytes.
+    pub fn len(&self, base_len: u64) -> u64 {
+        let dirty_end = match self.storage {
+            Storage::Memory(ref extents, _) => extents
+                .iter()
+                .next_back()
+                .map_or(0, |(&start, data)| start + data.len() as u64),
+            Storage::Spooled(ref ranges, _) => ranges.iter().next_back().map_or(0, |(_, &end)| end),
+        };
+
+        cmp::max(
+            cmp::min(base_len, self.base_limit),
+            cmp::max(dirty_end, self.min_len),
+        )
+    }
+
+    /// Whether flushing the buffer requires the content of the file on Drive. This is not the
+    /// case if that content was truncated away, or is known to be empty or has been overwritten
+    /// entirely according to a confirmed `base_len`.
+    pub fn needs_base(&self) -> bool {
+        if self.base_len_confirmed {
+            self.needs_base_of(self.base_len)
+        } else {
+            self.needs_base_of(None)
+        }
+    }
+
+    /// Whether the content of the file on Drive would not be needed after all if the length of
+    /// that content given to `new()` were confirmed. Worth checking before downloading it.
+    pub fn may_skip_base(&self) -> bool {
+        self.needs_base() && !self.needs_base_of(self.base_len)
+    }
+
+    fn needs_base_of(&self, base_len: Option<u64>) -> bool {
+        let kept = match base_len {
+            Some(len) => cmp::min(len, self.base_limit),
+            None => self.base_limit,
+        };
+
+        let overwritten = match self.storage {
+            Storage::Memory(ref extents, _) => extents.get(&0).map_or(0, |e| e.len() as u64),
+            Storage::Spooled(ref ranges, _) => ranges.get(&0).cloned().unwrap_or(0),
+        };
+        overwritten < kept
+    }
+
+    /// The MD5 checksum of the content of the file once the buffer is applied, if that content
+    /// is known without the content on Drive and was written in order from its start.
+    pub fn checksum(&self) -> Option<String> {
+        let md5 = self.digest.as_ref()?;
+        if self.needs_base() || self.len(0) != md5.len() {
+            return None;
+        }
+        Some(md5.clone().finish())
+    }
+
+    /// The length of the content of the file on Drive, if known.
+    pub fn base_len(&self) -> Option<u64> {
+        self.base_len
+    }
+
+    /// Whether the dirty data has been moved to a spool file.
+    pub fn is_spooled(&self) -> bool {
+        match self.storage {
+            Storage::Memory(..) => false,
+            Storage::Spooled(..) => true,
+        }
+    }
+
+    /// The number of dirty bytes, i.e. which will be uploaded on top of the original content.
+    pub fn dirty_bytes(&self) -> u64 {
+        match self.storage {
+            Storage::Memory(_, size) => size,
+            Storage::Spooled(ref ranges, _) => {
+                ranges.iter().map(|(&start, &end)| end - start).sum()
+            }
+        }
+    }
+
+    /// The number of extents, i.e. of contiguous dirty ranges.
+    #[cfg(test)]
+    pub fn extent_count(&self) -> usize {
+        match self.storage {
+            Storage::Memory(ref extents, _) => extents.len(),
+            Storage::Spooled(ref ranges, _) => ranges.len(),
+        }
+    }
+
+    /// Applies the buffer on the original content of the file, held in memory.
+    pub fn apply(&self, data: &mut Vec<u8>) -> Result<(), Error> {
+        let len = self.len(data.len() as u64);
+        data.truncate(cmp::min(data.len() as u64, self.base_limit) as usize);
+        data.resize(len as usize, 0);
+
+        match self.storage {
+            Storage::Memory(ref extents, _) => {
+                for (&start, extent) in extents {
+                    let start = start as usize;
+                    data[start..start + extent.len()].copy_from_slice(extent);
+                }
+            }
+            Storage::Spooled(ref ranges, ref file) => {
+                let mut file = file;
+                for (&start, &end) in ranges {
+                    file.seek(SeekFrom::Start(start))?;
+                    file.read_exact(&mut data[start as usize..end as usize])?;
+                }
+            }
+        }
+        Ok(())
+    }
+
+    /// Applies the buffer on the original content of the file, streamed from `base`, and returns
+    /// the spool file holding the result, positioned at its start. Only the parts of `base` which
+    /// were not overwritten are copied into the spool file.
+    pub fn into_file<R: Read>(mut self, base: &mut R) -> Result<fs::File, Error> {
+        if !self.is_spooled() {
+            self.spill()?;
+        }
+
+        let storage = mem::replace(&mut self.storage, Storage::Memory(BTreeMap::new(), 0));
+        let (ranges, mut file) = match storage {
+            Storage::Spooled(ranges, file) => (ranges, file),
+            Storage::Memory(..) => unreachable!(),
+        };
+
+        let mut base_len = 0;
+        let mut buff = vec![0; 64 * 1024];
+        while base_len < self.base_limit {
+            let wanted = cmp::min(buff.len() as u64, self.base_limit - base_len) as usize;
+            let read = base.read(&mut buff[..wanted])?;
+            if read == 0 {
+                break;
+            }
+
+            let (start, end) = (base_len, base_len + read as u64);
+            for (from, to) in Self::gaps(&ranges, start, end) {
+                file.seek(SeekFrom::Start(from))?;
+                file.write_all(&buff[(from - start) as usize..(to - start) as usize])?;
+            }
+            base_len = end;
+        }
+
+        let dirty_end = ranges.iter().next_back().map_or(0, |(_, &end)| end);
+        file.set_len(cmp::max(base_len, cmp::max(dirty_end, self.min_len)))?;
+        file.seek(SeekFrom::Start(0))?;
+        Ok(file)
+    }
+
+    /// Stores the dirty data in a new file at `path`, each byte at its offset in the file, and
+    /// returns the rest of the state of the buffer. The spool file, if any, is linked at `path`,
+    /// so that large buffers are saved without copying their data; the data is only copied if
+    /// that fails, e.g. because `path` is on another file system. The file is synced to disk
+    /// before returning, so the buffer can be restored by `restore()` even after a crash.
+    pub fn save(&self, path: &Path) -> Result<SavedBuffer, Error> {
+        if let (&Storage::Spooled(ref ranges, ref spool), Some(spool_path)) =
+            (&self.storage, self.spool_path.as_ref())
+        {
+            if fs::hard_link(spool_path, path).is_ok() {
+                spool.sync_all()?;
+                let extents = ranges.iter().map(|(&start, &end)| (start, end)).collect();
+                return Ok(self.saved(extents));
+            }
+        }
+
+        let extents = self.copy_dirty_data(path)?;
+        Ok(self.saved(extents))
+    }
+
+    /// Copies the dirty data to a new file at `path`, as `save()` does, and returns the start and
+    /// end of every dirty extent.
+    fn copy_dirty_data(&self, path: &Path) -> Result<Vec<(u64, u64)>, Error> {
+        let mut file = fs::OpenOptions::new()
+            .read(true)
+            .write(true)
+            .create_new(true)
+            .open(path)?;
+
+        let extents = match self.storage {
+            Storage::Memory(ref extents, _) => {
+                for (&start, data) in extents {
+                    file.seek(SeekFrom::Start(start))?;
+                    file.write_all(data)?;
+                }
+                extents
+                    .iter()
+                    .map(|(&start, data)| (start, start + data.len() as u64))
+                    .collect()
+            }
+            Storage::Spooled(ref ranges, ref spool) => {
+                let mut spool = spool;
+                let mut buff = vec![0; 64 * 1024];
+                for (&start, &end) in ranges {
+                    spool.seek(SeekFrom::Start(start))?;
+                    file.seek(SeekFrom::Start(start))?;
+                    let mut position = start;
+                    while position < end {
+                        let wanted = cmp::min(buff.len() as u64, end - position) as usize;
+                        spool.read_exact(&mut buff[..wanted])?;
+                        file.write_all(&buff[..wanted])?;
+                        position += wanted as u64;
+                    }
+                }
+                ranges.iter().map(|(&start, &end)| (start, end)).collect()
+            }
+        };
+        file.sync_all()?;
+        Ok(extents)
+    }
+
+    fn saved(&self, extents: Vec<(u64, u64)>) -> SavedBuffer {
+        SavedBuffer {
+            extents,
+            base_limit: self.base_limit,
+            min_len: self.min_len,
+            base_len: self.base_len,
+        }
+    }
+
+    /// Restores a buffer saved by `save()` to `path`. The file at `path` becomes the spool file
+    /// of the buffer, so it must not be removed before the buffer has been flushed; its dirty
+    /// extents are never modified by a flush.
+    pub fn restore(
+        saved: SavedBuffer,
+        path: &Path,
+        memory_limit: u64,
+        spool_dir: PathBuf,
+    ) -> Result<Self, Error> {
+        let file = fs::OpenOptions::new().read(true).write(true).open(path)?;
+        Ok(WriteBuffer {
+            storage: Storage::Spooled(saved.extents.into_iter().collect(), file),
+            memory_limit,
+            spool_dir,
+            spool_path: None,
+            base_limit: saved.base_limit,
+            min_len: saved.min_len,
+            base_len: saved.base_len,
+            base_len_confirmed: false,
+            digest: None,
+        })
+    }
+
+    /// Moves the dirty data from memory to a new spool file. The file stays linked, so that
+    /// `save()` can link it into an upload journal; it is removed once the buffer is dropped.
+    /// Spool files left behind by a crash are removed on the next mount.
+    fn spill(&mut self) -> Result<(), Error> {
+        fs::create_dir_all(&self.spool_dir)?;
+        let path = self.spool_dir.join(format!(
+            "{}-{}",
+            process::id(),
+            SPOOL_COUNTER.fetch_add(1, Ordering::Relaxed)
+        ));
+        let mut file = fs::OpenOptions::new()
+            .read(true)
+            .write(true)
+            .create_new(true)
+            .open(&path)?;
+        self.spool_path = Some(path);
+
+        let mut ranges = BTreeMap::new();
+        if let Storage::Memory(ref extents, size) = self.storage {
+            debug!("Spooling {} dirty bytes to disk", size);
+            for (&start, data) in extents {
+                file.seek(SeekFrom::Start(start))?;
+                file.write_all(data)?;
+                ranges.insert(start, start + data.len() as u64);
+            }
+        }
+
+        self.storage = Storage::Spooled(ranges, file);
+        Ok(())
+    }
+
+    /// Merges a write into extents held in memory. `size` is the total size of the extents.
+    fn merge_data(extents: &mut BTreeMap<u64, Vec<u8>>, size: &mut u64, offset: u64, data: &[u8]) {
+        let end = offset + data.len() as u64;
+        let touching = Self::touching(
+            extents.range(..=end).map(|(&s, e)| (s, s + e.len() as u64)),
+            offset,
+        );
+
+        // The extent which starts at or before the write grows in place, which keeps sequential
+        // writes from copying the data written before them.
+        let (start, mut merged) = match touching.first() {
+            Some(&first) if first <= offset => (first, extents.remove(&first).unwrap()),
+            _ => (offset, Vec::new()),
+        };
+        *size -= merged.len() as u64;
+
+        let at = (offset - start) as usize;
+        if merged.len() < at + data.len() {
+            merged.resize(at + data.len(), 0);
+        }
+        merged[at..at + data.len()].copy_from_slice(data);
+
+        for other in touching.into_iter().filter(|&s| s != start) {
+            let extent = extents.remove(&other).unwrap();
+            *size -= extent.len() as u64;
+
+            let merged_end = start + merged.len() as u64;
+            let extent_end = other + extent.len() as u64;
+            if extent_end > merged_end {
+                merged.extend_from_slice(&extent[(merged_end - other) as usize..]);
+            }
+        }
+
+        *size += merged.len() as u64;
+        extents.insert(start, merged);
+    }
+
+    /// Merges the range `start..end` into a map of non-overlapping ranges.
+    fn merge_range(ranges: &mut BTreeMap<u64, u64>, start: u64, end: u64) {
+        let touching = Self::touching(ranges.range(..=end).map(|(&s, &e)| (s, e)), start);
+
+        let mut merged = (start, end);
+        for other in touching {
+            let other_end = ranges.remove(&other).unwrap();
+            merged = (cmp::min(merged.0, other), cmp::max(merged.1, other_end));
+        }
+        ranges.insert(merged.0, merged.1);
+    }
+
+    /// Given the extents which start before the end of a write (as `(start, end)` pairs in
+    /// increasing order), returns the starts of those which overlap or touch the write, in
+    /// increasing order.
+    fn touching<I>(extents: I, offset: u64) -> Vec<u64>
+    where
+        I: DoubleEndedIterator<Item = (u64, u64)>,
+    {
+        let mut touching: Vec<u64> = extents
+            .rev()
+            .take_while(|&(_, end)| end >= offset)
+            .map(|(start, _)| start)
+            .collect();
+        touching.reverse();
+        touching
+    }
+
+    /// Returns the parts of `start..end` which are not covered by any of `ranges`.
+    fn gaps(ranges: &BTreeMap<u64, u64>, start: u64, end: u64) -> Vec<(u64, u64)> {
+        let mut gaps = Vec::new();
+        let mut position = start;
+
+        let first = ranges
+            .range(..=start)
+            .next_back()
+            .map_or(start, |(&s, _)| s);
+        for (&range_start, &range_end) in ranges.range(first..end) {
+            if range_start > position {
+                gaps.push((position, range_start));
+            }
+            position = cmp::max(position, range_end);
+        }
+        if position < end {
+            gaps.push((position, end));
+        }
+
+        gaps
+    }
+}
+
+impl Drop for WriteBuffer {
+    fn drop(&mut self) {
+        if let Some(ref path) = self.spool_path {
+            let _ = fs::remove_file(path);
+        }
+    }
+}
@@ -14,7 +14,6 @@ extern crate fuse;
 extern crate google_drive3_fork as drive3;
 extern crate hyper;
 extern crate hyper_native_tls;
-extern crate id_tree;
 extern crate libc;
 extern crate mime_sniffer;
 #[macro_use]
@@ -22,6 +21,7 @@ extern crate log;
 #[macro_use]
 extern crate maplit;
 extern crate lru_time_cache;
+extern crate md5;
 extern crate pretty_env_logger;
 extern crate rand;
 extern crate serde;
@@ -36,7 +36,9 @@ extern crate lazy_static;
 mod gcsf;
 
 pub use gcsf::filesystem::{Gcsf, NullFs};
-pub use gcsf::{Config, DriveFacade, FileManager};
+pub use gcsf::{
+    Config, DriveBackend, DriveFacade, FileId, FileManager, Listing, SyntheticDrive, WriteBuffer,
+};
 
 #[cfg(test)]
 mod tests;
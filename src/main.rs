@@ -18,6 +18,7 @@ use failure::{err_msg, Error};
 use itertools::Itertools;
 use std::ffi::OsStr;
 use std::fs;
+use std::io;
 use std::io::prelude::*;
 use std::iter;
 use std::sync::atomic::{AtomicBool, Ordering};
@@ -25,7 +26,7 @@ use std::sync::Arc;
 use std::thread;
 use std::time;
 
-use gcsf::{Config, DriveFacade, Gcsf, NullFs};
+use gcsf::{Config, DriveBackend, DriveFacade, Gcsf, NullFs};
 
 const DEBUG_LOG: &str = "hyper::client=error,hyper::http=error,hyper::net=error,debug";
 
@@ -50,17 +51,128 @@ mount_check = true
 # How long to cache the contents of a file after it has been accessed.
 cache_max_seconds = 300
 
-# How how many files to cache.
-cache_max_items = 10
+# How many bytes of file content to keep in memory.
+cache_max_bytes = 268435456
+
+# How many bytes to download at once when reading a file. Reading a few bytes
+# from a large file only downloads the chunk that contains them.
+read_chunk_size = 1048576
+
+# While a file is being read sequentially, up to this many chunks following the
+# current read are downloaded in the background. The window starts small and
+# grows as long as the reads stay sequential. Set to 0 to disable prefetching.
+read_ahead_chunks = 8
+
+# How many threads download prefetched chunks.
+prefetch_workers = 4
+
+# How many threads serve reads. Other operations, such as listing directories,
+# do not have to wait for them.
+io_workers = 8
+
+# How many threads upload flushed files. Reads do not wait for these uploads,
+# except reads of a file which is being uploaded.
+upload_workers = 4
+
+# How many HTTPS connections to Drive may be in use at the same time. Finished
+# connections are kept open and reused, which saves a TLS handshake per request.
+max_connections = 16
+
+# How many requests per second to send to Drive at most, on average. Match this
+# to the quota of your API project. Whenever Drive still answers that the rate
+# limit is exceeded, requests are paused for a while and retried. Set to 0 to
+# send requests as fast as possible.
+requests_per_second = 50.0
+
+# How many bytes written to a file are kept in memory until the file is closed.
+# Beyond this, the written data is moved to a temporary file in the "spool"
+# directory next to the session token.
+write_buffer_max_bytes = 67108864
+
+# How many bytes of a file are uploaded in one request. Written files are
+# streamed from disk one chunk at a time, and an interrupted upload resumes
+# after the last chunk Drive has received, even after a restart. Rounded up to
+# a multiple of 262144.
+upload_chunk_size = 8388608
+
+# If set to true, closing a written file returns right away and the file is
+# uploaded in the background, several files at a time. Queued uploads are kept
+# in the "uploads" directory next to the session token until they finish, so
+# they are resumed after a crash. The price is that close() succeeds before the
+# upload runs, so a failed upload is only reported in the log. If set to false,
+# closing a written file waits until it has been uploaded and reports whether
+# the upload failed.
+write_back = false
+
+# If set to true, file contents are also cached on disk (in the "cache"
+# directory next to the session token) and survive remounts. Cached content is
+# only used for as long as the file does not change on Drive.
+disk_cache = false
+
+# How many bytes of file content to cache on disk.
+disk_cache_max_bytes = 1073741824
 
 # How long to cache the size and capacity of the file system. These are the
 # values reported by `df`.
 cache_statfs_seconds = 60
 
+# How many seconds the kernel may cache the result of looking up a file name
+# and the attributes of a file. Until then, it does not ask again, so remote
+# changes may take this long to show up. Values close to sync_interval add
+# little delay on top of it.
+entry_ttl_seconds = 10
+attr_ttl_seconds = 10
+
+# How many seconds the kernel may remember that a file name does not exist.
+# Repeated probes for missing files (".git", "__pycache__", ...) are then
+# answered without asking GCSF. Set to 0 to disable.
+negative_ttl_seconds = 10
+
 # How many seconds to wait before checking for remote changes and updating them
 # locally.
 sync_interval = 10
 
+# If set to true, remote changes are retrieved on a background thread every
+# `sync_interval` seconds, so that file system operations never wait for them.
+# If set to false, changes are retrieved while listing a directory.
+background_sync = true
+
+# Drive can also notify GCSF about changes as soon as they happen, instead of
+# GCSF polling for them. This requires a public HTTPS address which Drive sends
+# the notifications to, and which forwards them to the local address that GCSF
+# listens on. Both must be set in order to enable notifications.
+# changes_webhook_address = "https://example.com/gcsf"
+# changes_webhook_listen = "127.0.0.1:8090"
+
+# Into how many partitions to split the listing of all files, which happens when
+# mounting without a snapshot. Each partition covers a range of modification
+# times and is listed over its own connection, at the same time as the others.
+listing_partitions = 1
+
+# If set to true, nothing but the root directory is listed when mounting. Every
+# other directory is listed the first time it is looked into, then kept up to
+# date like the rest. Mounting is then fast whatever the size of the account,
+# but listing a directory for the first time waits for Drive.
+lazy_loading = false
+
+# If set to true, the file tree is stored on disk (in the "snapshot" directory
+# next to the session token) on unmount and every `snapshot_interval` seconds.
+# The next mount loads it and only asks Drive for the changes made since, which
+# is much faster than listing every file again.
+metadata_snapshot = true
+
+# How many seconds to wait between two snapshots of the file tree.
+snapshot_interval = 300
+
+# The address under which GCSF expects the Drive API. Only change this in order
+# to run GCSF against a local stand-in for Drive, e.g. for benchmarking.
+# api_root_url = "https://www.googleapis.com/"
+
+# If set, counters and latency histograms of file system operations and of the
+# requests sent to Drive are served in the Prometheus text format on this local
+# address, under /metrics.
+# metrics_listen = "127.0.0.1:9100"
+
 # Mount options
 mount_options = [
     "fsname=GCSF",
@@ -231,6 +343,20 @@ fn main() {
                 println!("Could not remove {:?}: {}", &tf, e);
             }
         };
+
+        // Another account may be logged into under the same session name later on.
+        for path in config.session_data_paths() {
+            let removed = if path.is_dir() {
+                fs::remove_dir_all(&path)
+            } else {
+                fs::remove_file(&path)
+            };
+            match removed {
+                Ok(_) => println!("Successfully removed {:?}", &path),
+                Err(ref e) if e.kind() == io::ErrorKind::NotFound => {}
+                Err(e) => println!("Could not remove {:?}: {}", &path, e),
+            }
+        }
     }
 
     if let Some(_matches) = matches.subcommand_matches("list") {
@@ -238,6 +364,7 @@ fn main() {
         let mut sessions: Vec<_> = fs::read_dir(&config.config_dir())
             .unwrap()
             .map(Result::unwrap)
+            .filter(|f| f.path().is_file())
             .map(|f| f.file_name().to_str().unwrap().to_string())
             .filter(|name| name != &exception)
             .collect();
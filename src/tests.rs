@@ -1,4 +1,1108 @@
+use drive3;
+use fuse::FileType;
+use gcsf::{
+    is_throttling, Batch, BatchCall, BlockCache, Chunk, ChunkStore, DirEntry, DiskCache,
+    DriveBackend, DummyFile, Endpoint, Exchange, File, FileHandles, FileId, FileManager, FuseOp,
+    Histogram, InodeTable, Interned, Md5, Metrics, Priority, ReadAhead, Scheduler, Snapshot,
+    SnapshotEntry, SyntheticDrive, UploadJournal, UploadSession, WriteBuffer,
+};
+use hyper::method::Method;
+use serde_json;
+use std::collections::HashMap;
+use std::env;
+use std::fs;
+use std::io::{Read, Seek, SeekFrom};
+use std::os::unix::fs::MetadataExt;
+use std::sync::Arc;
+use std::time::{Duration, Instant, SystemTime};
+
 #[test]
 fn some_test() {
     assert_eq!(2 + 2, 4);
 }
+
+#[test]
+fn block_cache_evicts_by_size() {
+    let mut cache = BlockCache::new(10, Duration::from_secs(60));
+    cache.insert("a".to_string(), 0, vec![0; 4]);
+    cache.insert("a".to_string(), 1, vec![0; 4]);
+    cache.insert("b".to_string(), 0, vec![0; 4]);
+
+    assert_eq!(cache.size(), 8);
+    assert!(!cache.contains("a", 0));
+    assert!(cache.contains("a", 1));
+    assert!(cache.contains("b", 0));
+}
+
+#[test]
+fn block_cache_gives_referenced_blocks_a_second_chance() {
+    let mut cache = BlockCache::new(8, Duration::from_secs(60));
+    cache.insert("a".to_string(), 0, vec![0; 4]);
+    cache.insert("a".to_string(), 1, vec![0; 4]);
+    assert!(cache.get("a", 0).is_some());
+    cache.insert("a".to_string(), 2, vec![0; 4]);
+
+    assert_eq!(cache.resident_blocks("a"), vec![0, 2]);
+}
+
+#[test]
+fn block_cache_keeps_oversized_block() {
+    let mut cache = BlockCache::new(4, Duration::from_secs(60));
+    cache.insert("a".to_string(), 0, vec![0; 2]);
+    cache.insert("a".to_string(), 1, vec![0; 16]);
+
+    assert_eq!(cache.resident_blocks("a"), vec![1]);
+    assert_eq!(cache.size(), 16);
+}
+
+#[test]
+fn block_cache_removes_whole_files() {
+    let mut cache = BlockCache::new(100, Duration::from_secs(60));
+    cache.insert("a".to_string(), 0, vec![0; 4]);
+    cache.insert("a".to_string(), 7, vec![0; 4]);
+    cache.insert("b".to_string(), 0, vec![0; 4]);
+    cache.remove_file("a");
+
+    assert!(cache.resident_blocks("a").is_empty());
+    assert_eq!(cache.len(), 1);
+    assert_eq!(cache.size(), 4);
+}
+
+#[test]
+fn block_cache_expires_blocks() {
+    let mut cache = BlockCache::new(100, Duration::from_secs(0));
+    cache.insert("a".to_string(), 0, vec![0; 4]);
+
+    assert!(cache.get("a", 0).is_none());
+    assert!(cache.is_empty());
+}
+
+#[test]
+fn chunks_are_sliced_without_copying() {
+    let chunk = Chunk::from(vec![0, 1, 2, 3, 4, 5]);
+    let slice = chunk.slice(1, 5);
+    assert_eq!(&slice[..], &[1, 2, 3, 4]);
+    assert_eq!(&slice.slice(2, 100)[..], &[3, 4]);
+    assert!(slice.slice(10, 20).is_empty());
+
+    let mut cache = BlockCache::new(100, Duration::from_secs(60));
+    cache.insert("a".to_string(), 0, chunk);
+    assert_eq!(&cache.get("a", 0).unwrap()[..], &[0, 1, 2, 3, 4, 5]);
+}
+
+#[test]
+fn disk_cache_survives_reopening_and_checks_versions() {
+    let dir = env::temp_dir().join(format!("gcsf-disk-cache-test-{}", ::std::process::id()));
+    let _ = fs::remove_dir_all(&dir);
+
+    {
+        let mut cache = DiskCache::open(dir.clone(), 100, 3).unwrap();
+        cache.insert("a", "v1", 0, &[1, 2, 3]);
+        cache.insert("a", "v1", 1, &[4]);
+    }
+
+    let mut cache = DiskCache::open(dir.clone(), 100, 3).unwrap();
+    assert_eq!(cache.size(), 4);
+    assert_eq!(cache.get("a", "v1", 0), Some(vec![1, 2, 3]));
+    assert_eq!(cache.get("a", "v2", 0), None);
+
+    cache.insert("a", "v2", 0, &[5]);
+    assert_eq!(cache.get("a", "v1", 1), None);
+    assert_eq!(cache.size(), 1);
+
+    fs::remove_dir_all(&dir).unwrap();
+}
+
+#[test]
+fn disk_cache_skips_broken_entries() {
+    let dir = env::temp_dir().join(format!("gcsf-disk-cache-broken-{}", ::std::process::id()));
+    let _ = fs::remove_dir_all(&dir);
+
+    {
+        let mut cache = DiskCache::open(dir.clone(), 100, 3).unwrap();
+        cache.insert("a", "v1", 0, &[1, 2, 3]);
+    }
+    fs::write(dir.join("stray"), b"not a directory").unwrap();
+    fs::create_dir(dir.join("half-written")).unwrap();
+    fs::write(dir.join("half-written").join("0"), b"block").unwrap();
+
+    let mut cache = DiskCache::open(dir.clone(), 100, 3).unwrap();
+    assert_eq!(cache.size(), 3);
+    assert_eq!(cache.get("a", "v1", 0), Some(vec![1, 2, 3]));
+    assert!(!dir.join("stray").exists());
+    assert!(!dir.join("half-written").exists());
+
+    fs::remove_dir_all(&dir).unwrap();
+}
+
+#[test]
+fn disk_cache_drops_blocks_of_the_wrong_size() {
+    let dir = env::temp_dir().join(format!("gcsf-disk-cache-short-{}", ::std::process::id()));
+    let _ = fs::remove_dir_all(&dir);
+
+    {
+        let mut cache = DiskCache::open(dir.clone(), 100, 3).unwrap();
+        cache.insert("a", "v1", 0, &[1, 2, 3]);
+        cache.insert("a", "v1", 1, &[4, 5, 6]);
+        cache.insert("a", "v1", 2, &[7]);
+        cache.insert("b", "v1", 0, &[1, 2, 3]);
+        cache.insert("b", "v1", 1, &[4]);
+    }
+    // E.g. blocks which came back empty or short after a power loss.
+    fs::write(dir.join("a").join("1"), b"").unwrap();
+    fs::write(dir.join("b").join("0"), b"1").unwrap();
+
+    let mut cache = DiskCache::open(dir.clone(), 100, 3).unwrap();
+    assert_eq!(cache.size(), 5);
+    assert_eq!(cache.get("a", "v1", 0), Some(vec![1, 2, 3]));
+    assert_eq!(cache.get("a", "v1", 1), None);
+    assert_eq!(cache.get("a", "v1", 2), Some(vec![7]));
+    assert_eq!(cache.get("b", "v1", 0), None);
+    assert_eq!(cache.get("b", "v1", 1), Some(vec![4]));
+    assert!(!dir.join("a").join("1").exists());
+
+    fs::remove_dir_all(&dir).unwrap();
+}
+
+#[test]
+fn disk_cache_keeps_the_length_of_each_version() {
+    let dir = env::temp_dir().join(format!("gcsf-disk-cache-len-{}", ::std::process::id()));
+    let _ = fs::remove_dir_all(&dir);
+
+    {
+        let mut cache = DiskCache::open(dir.clone(), 100, 3).unwrap();
+        cache.set_length("doc", "v1", 12345);
+        cache.insert("doc", "v1", 0, &[1, 2, 3]);
+    }
+
+    let mut cache = DiskCache::open(dir.clone(), 100, 3).unwrap();
+    assert_eq!(cache.length("doc", "v1"), Some(12345));
+    assert_eq!(cache.length("doc", "v2"), None);
+    assert_eq!(cache.get("doc", "v1", 0), Some(vec![1, 2, 3]));
+
+    cache.insert("doc", "v2", 0, &[4]);
+    assert_eq!(cache.length("doc", "v1"), None);
+    assert_eq!(cache.length("doc", "v2"), None);
+
+    fs::remove_dir_all(&dir).unwrap();
+}
+
+#[test]
+fn disk_cache_evicts_least_recently_used_blocks() {
+    let dir = env::temp_dir().join(format!("gcsf-disk-cache-lru-{}", ::std::process::id()));
+    let _ = fs::remove_dir_all(&dir);
+
+    let mut cache = DiskCache::open(dir.clone(), 6, 3).unwrap();
+    cache.insert("a", "v", 0, &[0; 3]);
+    cache.insert("b", "v", 0, &[0; 3]);
+    assert!(cache.get("a", "v", 0).is_some());
+    cache.insert("c", "v", 0, &[0; 3]);
+
+    assert!(cache.get("a", "v", 0).is_some());
+    assert!(cache.get("b", "v", 0).is_none());
+    assert_eq!(cache.size(), 6);
+
+    fs::remove_dir_all(&dir).unwrap();
+}
+
+#[test]
+fn read_ahead_grows_while_sequential() {
+    let mut read_ahead = ReadAhead::new(8);
+    let windows: Vec<u64> = (0..6).map(|i| read_ahead.record(i * 100, 100)).collect();
+    assert_eq!(windows, vec![1, 2, 4, 8, 8, 8]);
+}
+
+#[test]
+fn read_ahead_resets_on_seek() {
+    let mut read_ahead = ReadAhead::new(8);
+    read_ahead.record(0, 100);
+    read_ahead.record(100, 100);
+    assert_eq!(read_ahead.record(5000, 100), 0);
+    assert_eq!(read_ahead.record(5100, 100), 1);
+    assert_eq!(ReadAhead::new(0).record(0, 100), 0);
+}
+
+#[test]
+fn read_ahead_streams_end_on_seek() {
+    let mut read_ahead = ReadAhead::new(8);
+    read_ahead.record(0, 100);
+    let stream = read_ahead.stream();
+    read_ahead.record(100, 100);
+    assert!(stream.is_current());
+
+    read_ahead.record(5000, 100);
+    assert!(!stream.is_current());
+    assert!(read_ahead.stream().is_current());
+}
+
+#[test]
+fn write_buffer_merges_extents() {
+    let mut buffer = WriteBuffer::new(1024, env::temp_dir(), None);
+    buffer.write(0, &[1, 1]).unwrap();
+    buffer.write(2, &[2, 2]).unwrap();
+    buffer.write(8, &[3]).unwrap();
+    assert_eq!(buffer.extent_count(), 2);
+    buffer.write(3, &[4, 4, 4, 4, 4]).unwrap();
+    assert_eq!(buffer.extent_count(), 1);
+
+    let mut data = vec![9; 12];
+    buffer.apply(&mut data).unwrap();
+    assert_eq!(data, vec![1, 1, 2, 4, 4, 4, 4, 4, 3, 9, 9, 9]);
+}
+
+#[test]
+fn write_buffer_applies_truncations() {
+    let mut buffer = WriteBuffer::new(1024, env::temp_dir(), None);
+    buffer.truncate(0).unwrap();
+    buffer.write(0, &[1, 2, 3, 4]).unwrap();
+    buffer.truncate(2).unwrap();
+    buffer.truncate(3).unwrap();
+
+    let mut data = vec![9; 8];
+    buffer.apply(&mut data).unwrap();
+    assert_eq!(data, vec![1, 2, 0]);
+    assert_eq!(buffer.len(100), 3);
+}
+
+#[test]
+fn write_buffer_spools_to_disk() {
+    let dir = env::temp_dir().join(format!("gcsf-spool-{}", ::std::process::id()));
+    let mut buffer = WriteBuffer::new(4, dir.clone(), None);
+    buffer.write(2, &[1, 1]).unwrap();
+    assert!(!buffer.is_spooled());
+    buffer.write(4, &[2, 2, 2]).unwrap();
+    assert!(buffer.is_spooled());
+    buffer.write(10, &[3]).unwrap();
+
+    let mut file = buffer.into_file(&mut &[9u8; 8][..]).unwrap();
+    let mut data = Vec::new();
+    file.read_to_end(&mut data).unwrap();
+    assert_eq!(data, vec![9, 9, 1, 1, 2, 2, 2, 9, 0, 0, 3]);
+
+    // The spool file is removed along with the buffer.
+    assert_eq!(fs::read_dir(&dir).unwrap().count(), 0);
+    fs::remove_dir_all(&dir).unwrap();
+}
+
+#[test]
+fn dummy_file_serves_content_shorter_than_the_read() {
+    // A flush reads the head of the content for guessing its type, then seeks to the end.
+    let mut file = DummyFile::new(vec![1, 2, 3, 4, 5]);
+    let mut head = Vec::new();
+    file.by_ref().take(1024).read_to_end(&mut head).unwrap();
+    assert_eq!(head, vec![1, 2, 3, 4, 5]);
+    assert_eq!(file.seek(SeekFrom::End(0)).unwrap(), 5);
+
+    assert_eq!(file.seek(SeekFrom::End(-2)).unwrap(), 3);
+    let mut tail = Vec::new();
+    file.read_to_end(&mut tail).unwrap();
+    assert_eq!(tail, vec![4, 5]);
+
+    file.seek(SeekFrom::Start(8)).unwrap();
+    assert_eq!(file.read(&mut [0; 4]).unwrap(), 0);
+    assert!(file.seek(SeekFrom::End(-6)).is_err());
+}
+
+#[test]
+fn upload_journal_restores_queued_uploads() {
+    let dir = env::temp_dir().join(format!("gcsf-journal-{}", ::std::process::id()));
+    let spool = dir.join("spool");
+    let mut buffer = WriteBuffer::new(4, spool.clone(), Some(8));
+    buffer.write(2, &[1, 1]).unwrap();
+    buffer.write(4, &[2, 2, 2]).unwrap();
+    buffer.truncate(10).unwrap();
+
+    let first = {
+        let (journal, uploads) = UploadJournal::open(dir.join("uploads"), 4, &spool).unwrap();
+        assert!(uploads.is_empty());
+        let first = journal.record("a", &buffer).unwrap();
+        let session = UploadSession {
+            url: "https://upload".to_string(),
+            len: 10,
+        };
+        journal.set_session(first, Some(&session)).unwrap();
+        journal
+            .record("b", &WriteBuffer::new(4, spool.clone(), None))
+            .unwrap();
+        first
+    };
+
+    // The spool file was linked into the journal rather than copied.
+    let spool_file = fs::read_dir(&spool).unwrap().next().unwrap().unwrap();
+    assert_eq!(spool_file.metadata().unwrap().nlink(), 2);
+    let (journal, mut uploads) = UploadJournal::open(dir.join("uploads"), 4, &spool).unwrap();
+    assert_eq!(uploads.len(), 2);
+    let upload = uploads.remove(0);
+    assert_eq!((upload.entry, upload.id.as_str()), (first, "a"));
+    assert_eq!(journal.session(first).unwrap().url, "https://upload");
+    assert!(upload.buffer.needs_base());
+
+    let mut file = upload.buffer.into_file(&mut &[9u8; 8][..]).unwrap();
+    let mut data = Vec::new();
+    file.read_to_end(&mut data).unwrap();
+    assert_eq!(data, vec![9, 9, 1, 1, 2, 2, 2, 9, 0, 0]);
+
+    // Finishing an upload also drops the older uploads of the same file.
+    let newer = journal.record("a", &buffer).unwrap();
+    journal.finish(newer);
+    assert_eq!(journal.len(), 1);
+    assert!(journal.session(first).is_none());
+    drop(journal);
+    let (_, uploads) = UploadJournal::open(dir.join("uploads"), 4, &spool).unwrap();
+    assert_eq!(uploads.len(), 1);
+    assert_eq!(uploads[0].id, "b");
+
+    fs::remove_dir_all(&dir).unwrap();
+}
+
+#[test]
+fn resumed_uploads_of_deleted_files_are_dropped() {
+    let dir = env::temp_dir().join(format!("gcsf-resume-{}", ::std::process::id()));
+    let spool = dir.join("spool");
+    let mut drive = SyntheticDrive::new();
+    let root = drive.root().to_string();
+    let kept = drive.add_file("kept", &root, b"abc".to_vec());
+    let deleted = drive.add_file("deleted", &root, b"abc".to_vec());
+
+    let mut buffer = WriteBuffer::new(4, spool.clone(), Some(3));
+    buffer.write(1, b"x").unwrap();
+    {
+        let (journal, _) = UploadJournal::open(dir.join("uploads"), 4, &spool).unwrap();
+        journal.record(&kept, &buffer).unwrap();
+        journal.record(&deleted, &buffer).unwrap();
+    }
+    drive.delete_permanently(&deleted, |result| result.unwrap());
+
+    let (journal, uploads) = UploadJournal::open(dir.join("uploads"), 4, &spool).unwrap();
+    assert_eq!(uploads.len(), 2);
+    for upload in uploads {
+        drive.resume_upload(&journal, upload).unwrap();
+    }
+    assert_eq!(journal.len(), 0);
+    assert_eq!(drive.content(&kept), Some(&b"axc"[..]));
+    assert_eq!(drive.content(&deleted), None);
+
+    // Nothing is left to resume on the next mount.
+    drop(journal);
+    let (_, uploads) = UploadJournal::open(dir.join("uploads"), 4, &spool).unwrap();
+    assert!(uploads.is_empty());
+
+    fs::remove_dir_all(&dir).unwrap();
+}
+
+#[test]
+fn write_buffer_knows_when_the_remote_content_is_needed() {
+    let mut buffer = WriteBuffer::new(1024, env::temp_dir(), None);
+    buffer.confirm_base_len(4);
+    buffer.write(0, &[1, 2, 3]).unwrap();
+    assert!(buffer.needs_base());
+    buffer.write(3, &[4, 5]).unwrap();
+    assert!(!buffer.needs_base());
+
+    let mut buffer = WriteBuffer::new(1024, env::temp_dir(), None);
+    buffer.write(0, &[1; 100]).unwrap();
+    assert!(buffer.needs_base());
+    buffer.truncate(0).unwrap();
+    assert!(!buffer.needs_base());
+
+    // Content truncated, then overwritten up to the new length.
+    let mut buffer = WriteBuffer::new(1024, env::temp_dir(), None);
+    buffer.truncate(4).unwrap();
+    buffer.write(0, &[1, 2, 3, 4]).unwrap();
+    assert!(!buffer.needs_base());
+
+    let mut buffer = WriteBuffer::new(1024, env::temp_dir(), None);
+    buffer.confirm_base_len(0);
+    assert!(!buffer.needs_base());
+}
+
+#[test]
+fn write_buffer_does_not_trust_a_listed_length() {
+    // The file may have grown on Drive since it was listed with 4 bytes.
+    let mut buffer = WriteBuffer::new(1024, env::temp_dir(), Some(4));
+    buffer.write(0, &[1, 2, 3, 4]).unwrap();
+    assert!(buffer.needs_base());
+    assert!(buffer.may_skip_base());
+
+    buffer.confirm_base_len(8);
+    assert!(buffer.needs_base());
+    assert!(!buffer.may_skip_base());
+    buffer.confirm_base_len(4);
+    assert!(!buffer.needs_base());
+
+    // A partial write needs the content on Drive either way.
+    let mut buffer = WriteBuffer::new(1024, env::temp_dir(), Some(4));
+    buffer.write(0, &[1, 2]).unwrap();
+    assert!(!buffer.may_skip_base());
+}
+
+#[test]
+fn md5_matches_reference_checksums() {
+    assert_eq!(Md5::digest(b""), "d41d8cd98f00b204e9800998ecf8427e");
+    assert_eq!(
+        Md5::digest(b"The quick brown fox jumps over the lazy dog"),
+        "9e107d9d372bb6826bd81d3542a419d6"
+    );
+
+    // Content fed in uneven pieces, across block boundaries.
+    let data: Vec<u8> = (0..1000u32).map(|i| (i * 7) as u8).collect();
+    let mut md5 = Md5::new();
+    for piece in data.chunks(37) {
+        md5.update(piece);
+    }
+    assert_eq!(md5.finish(), Md5::digest(&data));
+    assert_eq!(
+        Md5::digest_reader(&mut &data[..]).unwrap(),
+        Md5::digest(&data)
+    );
+
+    assert!(Md5::is_checksum("9e107d9d372bb6826bd81d3542a419d6"));
+    assert!(!Md5::is_checksum("2020-01-01T00:00:00.000Z"));
+}
+
+#[test]
+fn write_buffer_checksums_content_written_in_order() {
+    // A file saved again: truncated, then written from its start.
+    let mut buffer = WriteBuffer::new(4, env::temp_dir(), Some(6));
+    buffer.truncate(0).unwrap();
+    buffer.write(0, b"abc").unwrap();
+    buffer.write(3, b"def").unwrap();
+    assert!(buffer.is_spooled());
+    assert_eq!(buffer.checksum(), Some(Md5::digest(b"abcdef")));
+
+    // Part of the content on Drive survives.
+    let mut buffer = WriteBuffer::new(1024, env::temp_dir(), None);
+    buffer.confirm_base_len(6);
+    buffer.write(0, b"abc").unwrap();
+    assert_eq!(buffer.checksum(), None);
+    buffer.write(3, b"def").unwrap();
+    assert_eq!(buffer.checksum(), Some(Md5::digest(b"abcdef")));
+
+    // Written out of order, or extended with zeros.
+    let mut buffer = WriteBuffer::new(1024, env::temp_dir(), Some(0));
+    buffer.write(3, b"def").unwrap();
+    buffer.write(0, b"abc").unwrap();
+    assert_eq!(buffer.checksum(), None);
+    let mut buffer = WriteBuffer::new(1024, env::temp_dir(), Some(0));
+    buffer.write(0, b"abc").unwrap();
+    buffer.truncate(6).unwrap();
+    assert_eq!(buffer.checksum(), None);
+}
+
+#[test]
+fn chunk_store_shares_chunks_of_identical_content() {
+    let checksum = "9e107d9d372bb6826bd81d3542a419d6";
+    let key = ChunkStore::content_key("copy-1", Some(checksum));
+    assert_eq!(key, ChunkStore::content_key("copy-2", Some(checksum)));
+    assert_eq!(
+        ChunkStore::content_key("doc", Some("2020-01-01T00:00:00.000Z")),
+        "doc"
+    );
+    assert_eq!(ChunkStore::content_key("doc", None), "doc");
+
+    let store = ChunkStore::new(BlockCache::new(1024, Duration::from_secs(60)), None);
+    assert!(store.begin_download(&key, "copy-1", 0));
+    assert!(!store.begin_download(&key, "copy-2", 0));
+    store.end_download(&key, Some(checksum), 0, Some(Chunk::from(vec![1, 2, 3])));
+    assert_eq!(&*store.get(&key, 0).unwrap(), &[1, 2, 3]);
+
+    // A chunk downloaded from a file which changes in the meantime is not cached.
+    assert!(store.begin_download(&key, "copy-1", 1));
+    store.remove_file("copy-1");
+    store.end_download(&key, Some(checksum), 1, Some(Chunk::from(vec![4])));
+    assert!(!store.contains(&key, 1));
+    assert!(store.contains(&key, 0));
+}
+
+#[test]
+fn snapshot_survives_saving_and_loading() {
+    let dir = env::temp_dir().join(format!("gcsf-snapshot-{}", ::std::process::id()));
+    let _ = fs::remove_dir_all(&dir);
+    let path = dir.join("session");
+
+    let mut drive_file = drive3::File::default();
+    drive_file.id = Some("abc".to_string());
+    drive_file.name = Some("notes.txt".to_string());
+    drive_file.size = Some("42".to_string());
+    drive_file.md5_checksum = Some("0123456789abcdef".to_string());
+    drive_file.parents = Some(vec!["root".to_string()]);
+    let mut file = File::from_drive_file(7, &drive_file, false);
+    file.identical_name_id = Some(1);
+
+    let entries = vec![SnapshotEntry {
+        parent: Some(1),
+        file,
+    }];
+    Snapshot::new(
+        "root".to_string(),
+        "token".to_string(),
+        7,
+        false,
+        true,
+        entries,
+        None,
+    )
+    .save(&path)
+    .unwrap();
+
+    let snapshot = Snapshot::load(&path).unwrap();
+    assert_eq!(snapshot.root_id, "root");
+    assert_eq!(snapshot.changes_token, "token");
+    assert_eq!(snapshot.last_inode, 7);
+    assert!(snapshot.rename_identical_files);
+    assert_eq!(snapshot.entries.len(), 1);
+
+    let entry = &snapshot.entries[0];
+    assert_eq!(entry.parent, Some(1));
+    assert_eq!(entry.file.name(), "notes.txt.1");
+    assert_eq!(entry.file.inode(), 7);
+    assert_eq!(entry.file.attr.size, 42);
+    assert_eq!(entry.file.drive_id(), Some("abc".to_string()));
+    assert_eq!(entry.file.drive_parent(), Some("root".to_string()));
+    assert_eq!(
+        entry.file.content_version(),
+        Some("0123456789abcdef".to_string())
+    );
+
+    fs::write(&path, b"{").unwrap();
+    assert!(Snapshot::load(&path).is_err());
+
+    fs::remove_dir_all(&dir).unwrap();
+}
+
+#[test]
+fn batch_maps_responses_back_to_calls() {
+    let call = |method, path: &str, body: Option<&str>| BatchCall {
+        method,
+        path: path.to_string(),
+        body: body.map(str::to_string),
+    };
+    let batch = Batch::new(vec![
+        call(Method::Delete, "/drive/v3/files/a", None),
+        call(
+            Method::Patch,
+            "/drive/v3/files/b",
+            Some("{\"trashed\":true}"),
+        ),
+        call(Method::Delete, "/drive/v3/files/c", None),
+    ]);
+
+    let request = batch.encode();
+    assert!(request.contains("Content-ID: <item1>"));
+    assert!(request.contains("PATCH /drive/v3/files/b HTTP/1.1"));
+    assert!(request.contains("{\"trashed\":true}"));
+    assert!(request.trim_end().ends_with("--"));
+
+    // Responses may come in any order. The third call is missing from the response.
+    let response = "--batch_x\r\n\
+                    Content-Type: application/http\r\n\
+                    Content-ID: <response-item1>\r\n\r\n\
+                    HTTP/1.1 404 Not Found\r\n\
+                    Content-Type: application/json\r\n\r\n\
+                    {\"error\": \"notFound\"}\r\n\
+                    --batch_x\r\n\
+                    Content-Type: application/http\r\n\
+                    Content-ID: <response-item0>\r\n\r\n\
+                    HTTP/1.1 204 No Content\r\n\r\n\
+                    --batch_x--\r\n";
+    let results = batch.decode("multipart/mixed; boundary=batch_x", response);
+
+    assert_eq!(results.len(), 3);
+    assert!(results[0].is_ok());
+    assert!(results[1].is_err());
+    assert!(format!("{}", results[1].as_ref().unwrap_err()).contains("404"));
+    assert!(results[2].is_err());
+}
+
+#[test]
+fn scheduler_keeps_slots_for_interactive_requests() {
+    let scheduler = Arc::new(Scheduler::new(4, 0.0));
+    let start = Instant::now();
+
+    // Background requests may take three of the four slots, the last one is left for users.
+    let bulk: Vec<_> = (0..3)
+        .map(|_| Scheduler::admit(&scheduler, Priority::Bulk))
+        .collect();
+    let interactive = Scheduler::admit(&scheduler, Priority::Interactive);
+    assert!(start.elapsed() < Duration::from_secs(1));
+
+    drop(bulk);
+    drop(interactive);
+    let _sync = Scheduler::admit(&scheduler, Priority::Sync);
+    assert!(start.elapsed() < Duration::from_secs(1));
+}
+
+#[test]
+fn throttling_statuses_are_recognized() {
+    assert!(is_throttling(429, false));
+    assert!(is_throttling(503, false));
+    assert!(is_throttling(403, true));
+    assert!(!is_throttling(403, false));
+    assert!(!is_throttling(404, false));
+    assert!(!is_throttling(200, false));
+}
+
+#[test]
+fn interned_strings_are_stored_once() {
+    let a = Interned::new("1a2b3c");
+    let b = Interned::new(&String::from("1a2b3c"));
+    assert_eq!(a, b);
+    assert!(::std::ptr::eq(a.as_str(), b.as_str()));
+
+    let loaded: Interned = serde_json::from_str("\"1a2b3c\"").unwrap();
+    assert!(::std::ptr::eq(a.as_str(), loaded.as_str()));
+    assert_eq!(serde_json::to_string(&loaded).unwrap(), "\"1a2b3c\"");
+
+    let mut ids = HashMap::new();
+    ids.insert(a, 7);
+    assert_eq!(ids.get("1a2b3c"), Some(&7));
+}
+
+#[test]
+fn inode_table_links_moves_and_removes_files() {
+    let file = |inode, name: &str| {
+        let mut drive_file = drive3::File::default();
+        drive_file.name = Some(name.to_string());
+        File::from_drive_file(inode, &drive_file, false)
+    };
+    let children = |table: &InodeTable, inode| table.children(inode).collect::<Vec<_>>();
+
+    let mut table = InodeTable::new();
+    table.insert(file(1, "."), None).unwrap();
+    table.insert(file(2, "a"), Some(1)).unwrap();
+    table.insert(file(3, "b"), Some(1)).unwrap();
+    table.insert(file(4, "c"), Some(2)).unwrap();
+    assert!(table.insert(file(4, "c"), Some(1)).is_err());
+    assert!(table.insert(file(5, "d"), Some(9)).is_err());
+    assert!(table.insert(file(6, "e"), None).is_err());
+
+    assert_eq!(table.len(), 4);
+    assert_eq!(table.root(), Some(1));
+    assert_eq!(children(&table, 1), vec![3, 2]);
+    assert_eq!(table.parent(4), Some(2));
+    assert_eq!(table.get(3).map(|f| f.name()), Some("b".to_string()));
+
+    table.move_to(2, 3).unwrap();
+    assert_eq!(children(&table, 1), vec![3]);
+    assert_eq!(children(&table, 3), vec![2]);
+    assert!(table.move_to(3, 4).is_err());
+
+    let removed: Vec<_> = table.remove(3).iter().map(File::inode).collect();
+    assert_eq!(removed, vec![3, 2, 4]);
+    assert_eq!(table.len(), 1);
+    assert!(children(&table, 1).is_empty());
+    assert!(!table.contains(4));
+}
+
+#[test]
+fn file_handles_track_open_and_written_files() {
+    let mut handles = FileHandles::new();
+    let reader = handles.open(5, 4);
+    let writer = handles.open(5, 4);
+    assert_ne!(reader, writer);
+    assert!(handles.get_mut(reader, 6).is_none());
+
+    handles.get_mut(writer, 5).unwrap().written = true;
+    assert!(handles.is_written(5));
+    assert!(handles.release(writer).unwrap().written);
+    assert!(!handles.is_written(5));
+    assert!(handles.is_open(5));
+
+    assert!(!handles.release(reader).unwrap().written);
+    assert!(!handles.is_open(5));
+    assert!(handles.release(reader).is_none());
+}
+
+/// A file manager over `drive`, which syncs only when asked to.
+fn manager_with(drive: SyntheticDrive, lazy_loading: bool) -> FileManager<SyntheticDrive> {
+    FileManager::with_drive_facade(
+        false,
+        false,
+        false,
+        lazy_loading,
+        Duration::from_secs(0),
+        None,
+        Duration::from_secs(3600),
+        drive,
+    )
+    .unwrap()
+}
+
+#[test]
+fn file_manager_runs_on_a_synthetic_drive() {
+    let mut drive = SyntheticDrive::new();
+    let root = drive.root().to_string();
+    let folder = drive.add_folder("folder", &root);
+    let file = drive.add_file("a.txt", &folder, b"hello".to_vec());
+
+    let mut manager = manager_with(drive, false);
+    let parent = manager.get_inode(&FileId::DriveId(folder)).unwrap();
+    let by_name = FileId::ParentAndName {
+        parent,
+        name: "a.txt".to_string(),
+    };
+    let inode = manager.get_inode(&by_name).unwrap();
+    assert_eq!(
+        manager
+            .get_children(&FileId::Inode(parent))
+            .unwrap()
+            .count(),
+        1
+    );
+
+    manager
+        .df
+        .change_file(&file, |f| f.name = Some("b.txt".to_string()))
+        .unwrap();
+    manager.sync().unwrap();
+    assert!(manager.get_inode(&by_name).is_none());
+    assert_eq!(
+        manager.get_file(&FileId::Inode(inode)).unwrap().name,
+        "b.txt"
+    );
+
+    manager.write(FileId::Inode(inode), 5, b" world").unwrap();
+    manager.flush(&FileId::Inode(inode), |result| result.unwrap());
+    assert_eq!(manager.df.content(&file).unwrap(), b"hello world");
+}
+
+#[test]
+fn file_manager_applies_the_latest_change_of_every_file() {
+    let mut drive = SyntheticDrive::new();
+    let root = drive.root().to_string();
+    let first = drive.add_folder("first", &root);
+    let second = drive.add_folder("second", &root);
+    let a = drive.add_file("a.txt", &first, b"hello".to_vec());
+    let b = drive.add_file("b.txt", &first, b"hello".to_vec());
+
+    let mut manager = manager_with(drive, false);
+    let (first_dir, second_dir) = (
+        manager.get_inode(&FileId::DriveId(first)).unwrap(),
+        manager.get_inode(&FileId::DriveId(second.clone())).unwrap(),
+    );
+    let inode_a = manager.get_inode(&FileId::DriveId(a.clone())).unwrap();
+
+    // Renamed, then renamed again and moved.
+    manager
+        .df
+        .change_file(&a, |f| f.name = Some("renamed.txt".to_string()))
+        .unwrap();
+    manager
+        .df
+        .change_file(&a, |f| {
+            f.name = Some("moved.txt".to_string());
+            f.parents = Some(vec![second.clone()]);
+        })
+        .unwrap();
+    // Only the content changed.
+    manager
+        .df
+        .change_file(&b, |f| {
+            f.size = Some("11".to_string());
+            f.md5_checksum = Some("5eb63bbbe01eeed093cb22bb8f5acdc3".to_string());
+        })
+        .unwrap();
+    manager.sync().unwrap();
+
+    let name = |parent, name: &str| FileId::ParentAndName {
+        parent,
+        name: name.to_string(),
+    };
+    assert_eq!(
+        manager.get_inode(&name(second_dir, "moved.txt")),
+        Some(inode_a)
+    );
+    assert!(manager.get_inode(&name(first_dir, "a.txt")).is_none());
+    assert!(manager.get_inode(&name(first_dir, "renamed.txt")).is_none());
+
+    let file_b = manager.get_file(&name(first_dir, "b.txt")).unwrap();
+    assert_eq!(file_b.attr.size, 11);
+    assert_eq!(
+        file_b.content_version().as_ref().map(String::as_str),
+        Some("5eb63bbbe01eeed093cb22bb8f5acdc3")
+    );
+}
+
+#[test]
+fn file_manager_shows_new_files_without_parents_as_shared() {
+    let mut manager = manager_with(SyntheticDrive::new(), false);
+
+    let root = manager.df.root().to_string();
+    let orphan = manager.df.add_file("orphan.txt", &root, Vec::new());
+    manager
+        .df
+        .change_file(&orphan, |f| f.parents = None)
+        .unwrap();
+    manager.sync().unwrap();
+
+    let shared = FileId::ParentAndName {
+        parent: 3,
+        name: "orphan.txt".to_string(),
+    };
+    let inode = manager.get_inode(&FileId::DriveId(orphan));
+    assert!(inode.is_some());
+    assert_eq!(manager.get_inode(&shared), inode);
+}
+
+#[test]
+fn file_manager_stops_sharing_chunks_of_files_written_locally() {
+    let checksum = "5d41402abc4b2a76b9719d911017c592";
+    let mut drive = SyntheticDrive::new();
+    let root = drive.root().to_string();
+    let a = drive.add_file("a.txt", &root, b"hello".to_vec());
+    let b = drive.add_file("b.txt", &root, b"hello".to_vec());
+    for id in &[&a, &b] {
+        drive
+            .change_file(id, |f| f.md5_checksum = Some(checksum.to_string()))
+            .unwrap();
+    }
+
+    let mut manager = manager_with(drive, false);
+    let key = |manager: &FileManager<SyntheticDrive>, id: &str| {
+        let version = manager
+            .get_file(&FileId::DriveId(id.to_string()))
+            .unwrap()
+            .content_version();
+        ChunkStore::content_key(id, version.as_ref().map(String::as_str))
+    };
+    // Both files share the chunks of their common content.
+    assert_eq!(key(&manager, &a), key(&manager, &b));
+
+    let id = FileId::DriveId(a.clone());
+    manager.write(id.clone(), 0, b"jello").unwrap();
+    manager.flush(&id, |result| result.unwrap());
+    assert_eq!(manager.df.content(&a), Some(&b"jello"[..]));
+
+    // The written file no longer shares the chunks of the content it had before.
+    assert_eq!(key(&manager, &a), a);
+    assert_eq!(
+        key(&manager, &b),
+        ChunkStore::content_key(&b, Some(checksum))
+    );
+}
+
+#[test]
+fn file_manager_skips_uploads_of_unchanged_content() {
+    let mut drive = SyntheticDrive::new();
+    let root = drive.root().to_string();
+    let a = drive.add_file("a.txt", &root, b"hello".to_vec());
+    drive
+        .change_file(&a, |f| f.md5_checksum = Some(Md5::digest(b"hello")))
+        .unwrap();
+
+    let mut manager = manager_with(drive, false);
+    let id = FileId::DriveId(a.clone());
+
+    // Rewriting the same bytes, as an editor saving without changes does.
+    manager.write(id.clone(), 0, b"hello").unwrap();
+    manager.flush(&id, |result| result.unwrap());
+    assert_eq!(manager.df.uploads(), 0);
+
+    manager.write(id.clone(), 0, b"jello").unwrap();
+    manager.flush(&id, |result| result.unwrap());
+    assert_eq!(manager.df.uploads(), 1);
+    assert_eq!(manager.df.content(&a), Some(&b"jello"[..]));
+}
+
+#[test]
+fn histogram_counts_durations_by_bucket() {
+    let histogram = Histogram::default();
+    histogram.record(Duration::from_micros(50));
+    histogram.record(Duration::from_micros(100));
+    histogram.record(Duration::from_millis(3));
+    histogram.record(Duration::from_secs(60));
+
+    let buckets = histogram.cumulative();
+    assert_eq!(buckets.len(), 17);
+    assert_eq!(buckets[0], (0.0001, 2));
+    // 3ms falls in the bucket up to 5ms.
+    assert_eq!(buckets[4], (0.0025, 2));
+    assert_eq!(buckets[5], (0.005, 3));
+    assert_eq!(buckets[15], (10.0, 3));
+    assert!(buckets[16].0.is_infinite());
+    assert_eq!(buckets[16].1, 4);
+    assert_eq!(histogram.count(), 4);
+}
+
+#[test]
+fn requests_are_classified_by_endpoint() {
+    let cases = [
+        ("GET", "/drive/v3/files?q=trashed", Endpoint::FilesList),
+        ("POST", "/drive/v3/files", Endpoint::FilesCreate),
+        ("GET", "/drive/v3/files/abc?fields=size", Endpoint::FilesGet),
+        (
+            "GET",
+            "/drive/v3/files/abc?alt=media&x=1",
+            Endpoint::FilesDownload,
+        ),
+        ("PATCH", "/drive/v3/files/abc", Endpoint::FilesUpdate),
+        ("DELETE", "/drive/v3/files/abc", Endpoint::FilesDelete),
+        (
+            "GET",
+            "/drive/v3/files/abc/export?mimeType=text",
+            Endpoint::FilesExport,
+        ),
+        (
+            "PUT",
+            "/upload/drive/v3/files/abc?uploadType=resumable",
+            Endpoint::Upload,
+        ),
+        ("POST", "/batch/drive/v3", Endpoint::Batch),
+        (
+            "GET",
+            "/drive/v3/changes?pageToken=1",
+            Endpoint::ChangesList,
+        ),
+        (
+            "GET",
+            "/drive/v3/changes/startPageToken",
+            Endpoint::ChangesStartPageToken,
+        ),
+        ("POST", "/drive/v3/changes/watch", Endpoint::ChangesWatch),
+        ("POST", "/drive/v3/channels/stop", Endpoint::ChannelsStop),
+        ("GET", "/drive/v3/about?fields=user", Endpoint::About),
+        ("POST", "/o/oauth2/token", Endpoint::Token),
+        ("POST", "/token", Endpoint::Token),
+        ("GET", "/elsewhere", Endpoint::Other),
+    ];
+    for &(method, target, endpoint) in &cases {
+        assert_eq!(Endpoint::classify(method, target), endpoint, "{}", target);
+    }
+}
+
+#[test]
+fn metrics_are_rendered_in_prometheus_format() {
+    let metrics = Metrics::default();
+    metrics.record_op(FuseOp::Read, Duration::from_millis(20));
+    metrics.record_exchange(&Exchange {
+        endpoint: Endpoint::FilesDownload,
+        status: Some(503),
+        throttled: true,
+        retry: false,
+        sent: 100,
+        received: 50,
+        duration: Duration::from_millis(1),
+    });
+    metrics.record_exchange(&Exchange {
+        endpoint: Endpoint::FilesDownload,
+        status: Some(206),
+        throttled: false,
+        retry: true,
+        sent: 100,
+        received: 1000,
+        duration: Duration::from_millis(1),
+    });
+    metrics.add_pending_write_bytes(4096);
+    metrics.add_pending_write_bytes(-1024);
+    metrics.add_upload_progress(10_000, 0);
+    metrics.add_upload_progress(0, 4096);
+    let now = SystemTime::now();
+    metrics.record_sync(now - Duration::from_secs(5));
+
+    let text = metrics.render(now, 123, None);
+    let lines: Vec<&str> = text.lines().collect();
+    for expected in &[
+        "# TYPE gcsf_fuse_op_duration_seconds histogram",
+        "gcsf_fuse_op_duration_seconds_bucket{op=\"read\",le=\"0.01\"} 0",
+        "gcsf_fuse_op_duration_seconds_bucket{op=\"read\",le=\"0.025\"} 1",
+        "gcsf_fuse_op_duration_seconds_bucket{op=\"read\",le=\"+Inf\"} 1",
+        "gcsf_fuse_op_duration_seconds_sum{op=\"read\"} 0.02",
+        "gcsf_fuse_op_duration_seconds_count{op=\"read\"} 1",
+        "gcsf_fuse_op_duration_seconds_count{op=\"lookup\"} 0",
+        "gcsf_drive_requests_total{endpoint=\"files.download\"} 2",
+        "gcsf_drive_errors_total{endpoint=\"files.download\"} 1",
+        "gcsf_drive_retries_total{endpoint=\"files.download\"} 1",
+        "gcsf_drive_throttled_total{endpoint=\"files.download\"} 1",
+        "gcsf_drive_requests_total{endpoint=\"files.list\"} 0",
+        "gcsf_drive_sent_bytes_total 200",
+        "gcsf_drive_received_bytes_total 1050",
+        "gcsf_cache_resident_bytes{cache=\"memory\"} 123",
+        "gcsf_pending_write_bytes 3072",
+        "gcsf_upload_bytes 10000",
+        "gcsf_upload_acknowledged_bytes 4096",
+        "gcsf_sync_lag_seconds 5",
+    ] {
+        assert!(
+            lines.contains(expected),
+            "missing {:?} in\n{}",
+            expected,
+            text
+        );
+    }
+    // Without lookups there is no ratio, and without a disk cache no disk residency.
+    assert!(!text.contains("gcsf_cache_hit_ratio"));
+    assert!(!text.contains("cache=\"disk\""));
+}
+
+#[test]
+fn directory_handles_hold_their_listing() {
+    let mut handles = FileHandles::new();
+    let entry = |inode: u64, name: &str| DirEntry {
+        inode,
+        kind: FileType::RegularFile,
+        name: name.to_string(),
+    };
+
+    let file = handles.open(7, 4);
+    let first = handles.open_dir(1, vec![entry(7, "a"), entry(8, "b")]);
+    let second = handles.open_dir(1, vec![entry(7, "a")]);
+    assert_ne!(file, first);
+    assert_ne!(first, second);
+
+    assert_eq!(handles.dir_entries(first, 1).unwrap().len(), 2);
+    assert_eq!(
+        handles.dir_entries(second, 1).unwrap(),
+        &[entry(7, "a")][..]
+    );
+    assert!(handles.dir_entries(first, 2).is_none());
+    assert!(handles.dir_entries(file, 7).is_none());
+
+    handles.release_dir(first);
+    assert!(handles.dir_entries(first, 1).is_none());
+    assert!(handles.dir_entries(second, 1).is_some());
+}
+
+#[test]
+fn file_manager_loads_directories_lazily() {
+    let mut drive = SyntheticDrive::new();
+    let root = drive.root().to_string();
+    let folder = drive.add_folder("folder", &root);
+    let other = drive.add_folder("other", &root);
+    let file = drive.add_file("a.txt", &folder, b"hello".to_vec());
+    drive.add_file("b.txt", &other, Vec::new());
+
+    let mut manager = manager_with(drive, true);
+    // Only the root, "Shared with me" and "Trash" exist until something is looked into.
+    assert_eq!(manager.files.len(), 3);
+
+    manager.load_children(1).unwrap();
+    let folder_inode = manager.get_inode(&FileId::DriveId(folder.clone())).unwrap();
+    let other_inode = manager.get_inode(&FileId::DriveId(other.clone())).unwrap();
+    assert_eq!(manager.files.len(), 5);
+    assert!(!manager.contains(&FileId::DriveId(file.clone())));
+
+    manager.load_children(folder_inode).unwrap();
+    manager.load_children(folder_inode).unwrap();
+    assert!(manager.contains(&FileId::DriveId(file.clone())));
+    assert_eq!(manager.files.len(), 6);
+
+    // A file moved into a directory which has not been listed leaves the tree, and comes back
+    // when that directory is listed.
+    manager
+        .df
+        .change_file(&file, |f| f.parents = Some(vec![other.clone()]))
+        .unwrap();
+    manager.sync().unwrap();
+    assert!(!manager.contains(&FileId::DriveId(file.clone())));
+
+    manager.load_children(other_inode).unwrap();
+    let moved = manager.get_inode(&FileId::DriveId(file)).unwrap();
+    assert_eq!(manager.files.parent(moved), Some(other_inode));
+    assert_eq!(
+        manager
+            .get_children(&FileId::Inode(other_inode))
+            .unwrap()
+            .count(),
+        2
+    );
+}